@@ -0,0 +1,100 @@
+// Main-thread cost of decoding MQTT telemetry in process vs. on the ingest worker (ingestWorker.js).
+// Messages arrive as slices of a larger socket read, as mqtt.js delivers them. Main-thread time is
+// the event loop's active time (performance.eventLoopUtilization) until every reply is handled;
+// in-process decoding is synchronous, so there it is the elapsed time.
+//   npm run bench:ingest [-- <messages>]
+const path = require('path');
+const { Worker } = require('worker_threads');
+const { performance } = require('perf_hooks');
+const { decodeMqttMessage } = require('../portEvents');
+
+const MESSAGES = parseInt(process.argv[2], 10) || 20000;
+const STATION_STATUS_TOPIC = /^station\/([^/]+)\/status$/;
+const BACKFILL_PREFIX = 'charger/backfill/';
+const SOCKET_CHUNK_BYTES = 64 * 1024;
+
+function inSocketChunk(bytes) {
+    const chunk = Buffer.alloc(Math.max(SOCKET_CHUNK_BYTES, bytes.length + 100));
+    bytes.copy(chunk, 100);
+    return chunk.subarray(100, 100 + bytes.length);
+}
+
+function usageMessage(i) {
+    return inSocketChunk(Buffer.from(JSON.stringify({ port_number: 1 + (i % 4), consumption: 0.85, charger_state: 'ON', timestamp: Date.now(), seq: i })));
+}
+
+function backfillMessage(i) {
+    const readings = Array.from({ length: 1000 }, (_, j) => ({ timestamp: Date.now() - j * 10000, consumption: 0.5 + (j % 7) / 10, charger_state: 'ON', seq: i * 1000 + j }));
+    return inSocketChunk(Buffer.from(JSON.stringify({ port_number: 2, boot: 'b1', readings })));
+}
+
+function startWorker() {
+    const counters = new Int32Array(new SharedArrayBuffer(5 * 4));
+    return new Worker(path.join(__dirname, '..', 'ingestWorker.js'), {
+        workerData: {
+            poolOptions: { max: 1 }, // never connects; decode only
+            stationStatusTopic: STATION_STATUS_TOPIC,
+            backfillTopicPrefix: BACKFILL_PREFIX,
+            counters: counters.buffer,
+            counterIndex: { DECODED: 0, DECODE_ERRORS: 1, EVENTS_WRITTEN: 2, BATCH_FAILURES: 3, BATCHES_IN_FLIGHT: 4 }
+        }
+    });
+}
+
+// prepare(message) -> { message, transferList } for one worker request
+function runWorker(worker, topic, messages, prepare) {
+    return new Promise((resolve) => {
+        let replies = 0;
+        const onMessage = () => {
+            if (++replies === messages.length) {
+                worker.off('message', onMessage);
+                resolve();
+            }
+        };
+        worker.on('message', onMessage);
+        messages.forEach((message, id) => {
+            const { payload, transferList } = prepare(message);
+            worker.postMessage({ id, type: 'decode', topic, message: payload }, transferList);
+        });
+    });
+}
+
+async function measure(work) {
+    const before = performance.eventLoopUtilization();
+    const started = performance.now();
+    const pending = work();
+    const syncMs = performance.now() - started;
+    await pending;
+    const elu = performance.eventLoopUtilization(before);
+    return { mainMs: Math.max(elu.active, syncMs), wallMs: performance.now() - started };
+}
+
+const strategies = {
+    'in-process': null,
+    'worker, Buffer view': (message) => ({ payload: message, transferList: [] }),
+    'worker, compact transfer': (message) => {
+        const bytes = new Uint8Array(message); // copies just the message bytes
+        return { payload: bytes, transferList: [bytes.buffer] };
+    }
+};
+
+(async () => {
+    const worker = startWorker();
+    const cases = [
+        { name: 'usage', topic: 'charger/usage/DEV', count: MESSAGES, make: usageMessage },
+        { name: 'backfill x1000', topic: `${BACKFILL_PREFIX}DEV`, count: Math.max(10, Math.floor(MESSAGES / 200)), make: backfillMessage }
+    ];
+    for (const { name, topic, count, make } of cases) {
+        const messages = Array.from({ length: count }, (_, i) => make(i));
+        console.log(`${name}: ${count} messages of ${messages[0].length} bytes`);
+        for (const [label, prepare] of Object.entries(strategies)) {
+            const work = prepare
+                ? () => runWorker(worker, topic, messages, prepare)
+                : () => messages.forEach(message => decodeMqttMessage(topic, message, STATION_STATUS_TOPIC, BACKFILL_PREFIX));
+            await measure(work); // warm up
+            const { mainMs, wallMs } = await measure(work);
+            console.log(`  ${label.padEnd(26)} main thread ${mainMs.toFixed(1).padStart(8)} ms  (${(mainMs * 1000 / count).toFixed(1)} us/msg)  wall ${wallMs.toFixed(1)} ms`);
+        }
+    }
+    await worker.terminate();
+})();
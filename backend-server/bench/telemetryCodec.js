@@ -0,0 +1,102 @@
+// Compares the native and pure-JS telemetry codecs on charger/backfill-sized batches:
+// decode (Buffer -> usage frame) plus validation/energy integration, as normalizeBackfillReadings runs them.
+// Also checks that both paths produce identical frames and totals.
+//   npm run build:native && npm run bench:telemetry [-- <batches> <readingsPerBatch>]
+const { implementations } = require('../telemetryCodec');
+const { NOMINAL_CHARGING_VOLTAGE_DC, USAGE_REPORT_INTERVAL_SECONDS } = require('../portEvents');
+
+const BATCHES = parseInt(process.argv[2], 10) || 200;
+const READINGS_PER_BATCH = parseInt(process.argv[3], 10) || 1000;
+const ROUNDS = 5;
+
+function makeBatch(seed, now) {
+    const readings = [];
+    for (let i = 0; i < READINGS_PER_BATCH; i++) {
+        const reading = {
+            timestamp: now - (READINGS_PER_BATCH - i) * 10000,
+            consumption: Math.round(((seed * 7919 + i * 104729) % 25000) / 10) / 1000, // 0 - 2.5 A
+            charger_state: i % 50 === 0 ? 'OFF' : 'ON',
+            seq: seed * READINGS_PER_BATCH + i
+        };
+        if (i % 2 === 0) reading.port_number = 1 + (i % 4); // the rest use the batch default
+        if (i % 97 === 0) reading.timestamp = null; // null fields must decode the same on both paths
+        if (i % 89 === 0) reading.consumption = null;
+        if (i % 83 === 0) reading.port_number = null;
+        if (i % 79 === 0) reading.seq = null;
+        readings.push(reading);
+    }
+    return Buffer.from(JSON.stringify({ port_number: 2, boot: `b${seed}`, readings }));
+}
+
+function limitsAt(now) {
+    return {
+        oldestMs: now - 72 * 3600 * 1000,
+        newestMs: now + 60 * 1000,
+        maxWatts: 10000,
+        voltage: NOMINAL_CHARGING_VOLTAGE_DC,
+        intervalSeconds: USAGE_REPORT_INTERVAL_SECONDS
+    };
+}
+
+function run(codec, batches, limits) {
+    let totalKwh = 0;
+    let accepted = 0;
+    const started = process.hrtime.bigint();
+    for (const buffer of batches) {
+        const frame = codec.decodeUsageFrame(buffer);
+        const result = codec.integrateUsage(frame.portNumber, frame.timestamp, frame.consumption, limits);
+        totalKwh += result.totalKwh;
+        accepted += result.acceptedCount;
+    }
+    const seconds = Number(process.hrtime.bigint() - started) / 1e9;
+    return { seconds, totalKwh, accepted };
+}
+
+function sameColumns(a, b) {
+    for (const column of ['portNumber', 'timestamp', 'consumption', 'seq', 'chargerState']) {
+        if (a[column].length !== b[column].length) return false;
+        for (let i = 0; i < a[column].length; i++) {
+            if (!Object.is(a[column][i], b[column][i])) return false;
+        }
+    }
+    return a.count === b.count && a.boot === b.boot;
+}
+
+const now = Date.now();
+const limits = limitsAt(now);
+const batches = Array.from({ length: BATCHES }, (_, seed) => makeBatch(seed, now));
+// Edge cases checked for equality only
+const edgeCases = [
+    { readings: [{ port_number: 1, timestamp: null, consumption: null }] },
+    { port_number: null, readings: [{ timestamp: now, consumption: 0.5, seq: null }] },
+    { readings: [{ port_number: 2, timestamp: now, consumption: 0.5, charger_state: null }, {}] }
+].map(body => Buffer.from(JSON.stringify(body)));
+const megabytes = batches.reduce((sum, buffer) => sum + buffer.length, 0) / (1024 * 1024);
+console.log(`${BATCHES} batches x ${READINGS_PER_BATCH} readings (${megabytes.toFixed(1)} MB of JSON), best of ${ROUNDS} rounds`);
+
+const paths = Object.entries(implementations).filter(([, codec]) => codec);
+if (!implementations.native) {
+    console.log('Native codec not built (npm run build:native); measuring the JS path only.');
+}
+
+const results = {};
+for (const [name, codec] of paths) {
+    run(codec, batches.slice(0, 10), limits); // warm up
+    let best = null;
+    for (let round = 0; round < ROUNDS; round++) {
+        const result = run(codec, batches, limits);
+        if (!best || result.seconds < best.seconds) best = result;
+    }
+    results[name] = best;
+    const readingsPerSecond = (BATCHES * READINGS_PER_BATCH) / best.seconds;
+    console.log(`${name.padEnd(6)} ${(best.seconds * 1000).toFixed(1).padStart(8)} ms  ${(readingsPerSecond / 1e6).toFixed(2)} M readings/s  ${(megabytes / best.seconds).toFixed(0)} MB/s  accepted ${best.accepted}  kWh ${best.totalKwh.toFixed(6)}`);
+}
+
+if (results.native) {
+    console.log(`native speedup: ${(results.js.seconds / results.native.seconds).toFixed(1)}x`);
+    const identical = batches.concat(edgeCases).every(buffer =>
+        sameColumns(implementations.js.decodeUsageFrame(buffer), implementations.native.decodeUsageFrame(buffer)));
+    const sameTotals = results.js.accepted === results.native.accepted && results.js.totalKwh === results.native.totalKwh;
+    console.log(`frames identical: ${identical}, totals identical: ${sameTotals}`);
+    if (!identical || !sameTotals) process.exitCode = 1;
+}
@@ -296,4 +296,198 @@ ADD COLUMN IF NOT EXISTS last_borrow_date date;
 UPDATE user_subscription 
 SET borrowed_mah_today = 0.0, 
     borrowed_mah_pending = 0.0 
-WHERE borrowed_mah_today IS NULL OR borrowed_mah_pending IS NULL;
\ No newline at end of file
+WHERE borrowed_mah_today IS NULL OR borrowed_mah_pending IS NULL;
+-- Phone telemetry is flushed from memory with batched UPSERTs keyed on the device identity
+UPDATE user_devices SET device_name = 'Unknown Device' WHERE device_name IS NULL;
+-- Heartbeats used to insert a new row per report (NULL names never matched); keep the newest row per identity
+DELETE FROM user_devices ud
+USING (
+  SELECT device_id,
+         ROW_NUMBER() OVER (PARTITION BY user_id, device_type, device_name
+                            ORDER BY last_updated DESC NULLS LAST, created_at DESC NULLS LAST, device_id) AS rn
+  FROM user_devices
+) ranked
+WHERE ud.device_id = ranked.device_id AND ranked.rn > 1;
+CREATE UNIQUE INDEX IF NOT EXISTS user_devices_user_type_name_key
+ON user_devices (user_id, device_type, device_name);
+
+-- Append-only port event log: every charger usage/status fact is written here once.
+-- consumption_data and device_status_logs become views over it; current_device_status
+-- and charging_session energy totals are projections maintained by the backend.
+CREATE TABLE IF NOT EXISTS public.port_events (
+  event_id bigserial NOT NULL,
+  event_type character varying NOT NULL,
+  device_id character varying NOT NULL,
+  port_number integer,
+  port_id uuid,
+  session_id uuid,
+  occurred_at timestamp with time zone NOT NULL DEFAULT now(),
+  recorded_at timestamp with time zone NOT NULL DEFAULT now(),
+  status_message character varying,
+  charger_state character varying,
+  consumption_watts real,
+  payload jsonb,
+  CONSTRAINT port_events_pkey PRIMARY KEY (event_id)
+);
+CREATE INDEX IF NOT EXISTS port_events_session_idx ON port_events (session_id, occurred_at) WHERE session_id IS NOT NULL;
+CREATE INDEX IF NOT EXISTS port_events_port_idx ON port_events (port_id, event_type, occurred_at DESC);
+CREATE INDEX IF NOT EXISTS port_events_device_idx ON port_events (device_id, occurred_at DESC);
+
+-- The old tables become *_legacy and their rows are copied into port_events once, in time order.
+-- Guarded so a re-run neither fails nor copies the history again (replay would double session totals).
+DO $$
+DECLARE
+  sources text[] := '{}';
+BEGIN
+  IF to_regclass('public.consumption_data_legacy') IS NULL
+     AND EXISTS (SELECT 1 FROM pg_class WHERE oid = to_regclass('public.consumption_data') AND relkind = 'r') THEN
+    ALTER TABLE consumption_data RENAME TO consumption_data_legacy;
+    sources := sources || $q$
+      SELECT 'usage', cd.device_id, cd.port_number, cp.port_id, cd.session_id, cd.timestamp, cd.timestamp, NULL, cd.charger_state, cd.consumption_watts
+      FROM consumption_data_legacy cd
+      LEFT JOIN charging_port cp ON cp.device_mqtt_id = cd.device_id AND cp.port_number_in_device = cd.port_number$q$;
+  END IF;
+  IF to_regclass('public.device_status_logs_legacy') IS NULL
+     AND EXISTS (SELECT 1 FROM pg_class WHERE oid = to_regclass('public.device_status_logs') AND relkind = 'r') THEN
+    ALTER TABLE device_status_logs RENAME TO device_status_logs_legacy;
+    sources := sources || $q$
+      SELECT 'status', dsl.device_id, cp.port_number_in_device, dsl.port_id, NULL::uuid, dsl.timestamp, dsl.timestamp, dsl.status_message, dsl.charger_state, NULL::real
+      FROM device_status_logs_legacy dsl
+      LEFT JOIN charging_port cp ON cp.port_id = dsl.port_id$q$;
+  END IF;
+  IF cardinality(sources) > 0 THEN
+    EXECUTE 'INSERT INTO port_events (event_type, device_id, port_number, port_id, session_id, occurred_at, recorded_at, status_message, charger_state, consumption_watts) '
+      || array_to_string(sources, ' UNION ALL ') || ' ORDER BY 6';
+  END IF;
+END $$;
+
+CREATE OR REPLACE VIEW public.consumption_data AS
+SELECT event_id AS id, session_id, device_id, consumption_watts, occurred_at AS timestamp, charger_state, port_number
+FROM port_events
+WHERE event_type = 'usage';
+
+CREATE OR REPLACE VIEW public.device_status_logs AS
+SELECT event_id AS id, device_id, status_message, charger_state, occurred_at AS timestamp, port_id
+FROM port_events
+WHERE event_type = 'status';
+
+-- Transactional outbox for MQTT control commands: rows are inserted with the session change
+-- and drained by the backend publisher (newest pending command per port wins).
+CREATE TABLE IF NOT EXISTS public.command_outbox (
+  command_id bigserial NOT NULL,
+  device_id character varying NOT NULL,
+  port_number integer NOT NULL,
+  command character varying NOT NULL,
+  session_id uuid,
+  source character varying,
+  status character varying NOT NULL DEFAULT 'pending',
+  attempts integer NOT NULL DEFAULT 0,
+  next_attempt_at timestamp with time zone NOT NULL DEFAULT now(),
+  last_error text,
+  created_at timestamp with time zone NOT NULL DEFAULT now(),
+  sent_at timestamp with time zone,
+  CONSTRAINT command_outbox_pkey PRIMARY KEY (command_id)
+);
+CREATE INDEX IF NOT EXISTS command_outbox_pending_idx ON command_outbox (command_id) WHERE status = 'pending';
+
+-- port_events rows carry the local telemetry journal position so replay after a crash is idempotent
+ALTER TABLE port_events
+ADD COLUMN IF NOT EXISTS journal_id uuid,
+ADD COLUMN IF NOT EXISTS journal_lsn bigint;
+CREATE UNIQUE INDEX IF NOT EXISTS port_events_journal_key
+ON port_events (journal_id, journal_lsn) WHERE journal_lsn IS NOT NULL;
+
+-- Reference data edited outside the admin API (plans have no admin route) still reaches the backend caches
+CREATE OR REPLACE FUNCTION public.notify_reference_data_changed() RETURNS trigger AS $$
+BEGIN
+  PERFORM pg_notify('reference_data_changed', 'db:' || TG_ARGV[0]);
+  RETURN NULL;
+END;
+$$ LANGUAGE plpgsql;
+DROP TRIGGER IF EXISTS subscription_plans_reference_data ON public.subscription_plans;
+CREATE TRIGGER subscription_plans_reference_data
+AFTER INSERT OR UPDATE OR DELETE ON public.subscription_plans
+FOR EACH STATEMENT EXECUTE FUNCTION public.notify_reference_data_changed('plans');
+DROP TRIGGER IF EXISTS quota_extension_pricing_reference_data ON public.quota_extension_pricing;
+CREATE TRIGGER quota_extension_pricing_reference_data
+AFTER INSERT OR UPDATE OR DELETE ON public.quota_extension_pricing
+FOR EACH STATEMENT EXECUTE FUNCTION public.notify_reference_data_changed('quotaPricing');
+
+-- Time-of-use tariffs: windows override the station's flat price_per_mah (server local time;
+-- end_time <= start_time runs past midnight; days_of_week 0 = Sunday, NULL = every day)
+CREATE TABLE IF NOT EXISTS public.station_tariff_windows (
+  tariff_id uuid NOT NULL DEFAULT gen_random_uuid(),
+  station_id uuid NOT NULL,
+  days_of_week smallint[],
+  start_time time NOT NULL,
+  end_time time NOT NULL,
+  price_per_mah numeric NOT NULL CHECK (price_per_mah >= 0),
+  created_at timestamp with time zone NOT NULL DEFAULT now(),
+  CONSTRAINT station_tariff_windows_pkey PRIMARY KEY (tariff_id),
+  CONSTRAINT station_tariff_windows_station_id_fkey FOREIGN KEY (station_id) REFERENCES public.charging_station(station_id) ON DELETE CASCADE
+);
+CREATE INDEX IF NOT EXISTS station_tariff_windows_station_idx ON station_tariff_windows (station_id);
+
+-- Cost accrued per usage reading (priced when logged) and its running total per session;
+-- NULL accrued_cost means part of the session was logged unpriced and is priced at finalization
+ALTER TABLE port_events ADD COLUMN IF NOT EXISTS cost_increment double precision;
+ALTER TABLE charging_session ADD COLUMN IF NOT EXISTS accrued_cost numeric;
+
+-- Station telemetry (station/<station>/status): one aggregate row per station per minute, partitioned
+-- by month. The backend creates this and next month's partitions; the default partition catches the rest.
+CREATE TABLE IF NOT EXISTS public.station_telemetry (
+  station_id uuid NOT NULL,
+  bucket_start timestamp with time zone NOT NULL,
+  samples integer NOT NULL,
+  battery_soc_avg real,
+  battery_soc_min real,
+  battery_soc_max real,
+  solar_watts_avg real,
+  solar_watts_max real,
+  temperature_c_avg real,
+  temperature_c_max real,
+  CONSTRAINT station_telemetry_pkey PRIMARY KEY (station_id, bucket_start)
+) PARTITION BY RANGE (bucket_start);
+CREATE TABLE IF NOT EXISTS public.station_telemetry_default PARTITION OF public.station_telemetry DEFAULT;
+
+-- Port occupancy rollup: seconds each port spent occupied (reserved through finalizing), idle (available)
+-- or offline (offline/fault) per hour, added to incrementally by the backend
+CREATE TABLE IF NOT EXISTS public.port_occupancy_hourly (
+  port_id uuid NOT NULL,
+  station_id uuid NOT NULL,
+  hour_start timestamp with time zone NOT NULL,
+  occupied_seconds double precision NOT NULL DEFAULT 0,
+  idle_seconds double precision NOT NULL DEFAULT 0,
+  offline_seconds double precision NOT NULL DEFAULT 0,
+  CONSTRAINT port_occupancy_hourly_pkey PRIMARY KEY (port_id, hour_start),
+  CONSTRAINT port_occupancy_hourly_port_id_fkey FOREIGN KEY (port_id) REFERENCES public.charging_port(port_id) ON DELETE CASCADE
+);
+CREATE INDEX IF NOT EXISTS port_occupancy_hourly_station_idx ON port_occupancy_hourly (station_id, hour_start);
+
+-- Per-user daily rollup: energy is added as readings are logged (daily_energy projection), session
+-- counts/minutes/cost are recomputed for the start day whenever a session completes
+ALTER TABLE daily_energy_usage ADD COLUMN IF NOT EXISTS total_energy_kwh numeric DEFAULT 0.0;
+ALTER TABLE daily_energy_usage ADD COLUMN IF NOT EXISTS completed_sessions integer DEFAULT 0;
+ALTER TABLE daily_energy_usage ADD COLUMN IF NOT EXISTS charging_minutes numeric DEFAULT 0.0;
+ALTER TABLE daily_energy_usage ADD COLUMN IF NOT EXISTS total_cost numeric DEFAULT 0.0;
+CREATE UNIQUE INDEX IF NOT EXISTS daily_energy_usage_user_date_key ON daily_energy_usage (user_id, usage_date);
+CREATE INDEX IF NOT EXISTS charging_session_user_start_idx ON charging_session (user_id, start_time);
+-- Seed from existing sessions (energy on the start day); rows already written by the backend are kept.
+-- Days are calendar days in the backend's STATION_TIME_ZONE: pass it as
+-- PGOPTIONS="-c solarcharge.station_time_zone=Asia/Manila", else the session's TimeZone is used.
+INSERT INTO daily_energy_usage (user_id, usage_date, total_energy_used_mah, total_energy_kwh, completed_sessions, charging_minutes, total_cost)
+SELECT user_id, (start_time AT TIME ZONE COALESCE(NULLIF(current_setting('solarcharge.station_time_zone', true), ''), current_setting('TimeZone')))::date,
+       COALESCE(SUM(energy_consumed_mah), 0),
+       COALESCE(SUM(energy_consumed_kwh), 0),
+       COUNT(*) FILTER (WHERE session_status = 'completed'),
+       COALESCE(SUM(EXTRACT(EPOCH FROM (end_time - start_time)) / 60) FILTER (WHERE session_status = 'completed'), 0),
+       COALESCE(SUM(cost) FILTER (WHERE session_status = 'completed'), 0)
+FROM charging_session
+WHERE user_id IS NOT NULL
+GROUP BY 1, 2
+ON CONFLICT (user_id, usage_date) DO NOTHING;
+
+-- Station power budget: a session's scheduling priority and, while the budget holds its relay off,
+-- when it was paused. Restored on startup so queued/paused sessions are not resumed as running.
+ALTER TABLE charging_session ADD COLUMN IF NOT EXISTS power_priority smallint;
+ALTER TABLE charging_session ADD COLUMN IF NOT EXISTS power_paused_at timestamp with time zone;
@@ -0,0 +1,60 @@
+// Ingestion worker: decodes backfill batches and writes port_events batches (with their
+// projections) on its own thread. Usage and status messages are decoded on the API thread, where
+// a JSON.parse is cheaper than the round trip; validation and energy integration of backfill
+// readings also stay there. See bench/ingestDecode.js for the main-thread cost of each path.
+// Started by setupIngestWorker() in server.js; requests arrive as { id, type, ... } on the
+// parent port and every request gets exactly one { id, result } or { id, error } reply.
+const { parentPort, workerData } = require('worker_threads');
+const { Pool } = require('pg');
+const { decodeMqttMessage, writePortEventBatch } = require('./portEvents');
+
+const pool = new Pool(workerData.poolOptions);
+pool.on('error', (err) => console.error('IngestWorker: Idle database client error:', err.message));
+
+// Shared with the API thread, which reads them with Atomics.load (layout: INGEST_COUNTERS in server.js)
+const counters = new Int32Array(workerData.counters);
+const COUNTER = workerData.counterIndex;
+
+const handlers = {
+    decode({ topic, message }) {
+        const bytes = Buffer.from(message.buffer, message.byteOffset, message.byteLength); // a view of the transferred bytes
+        try {
+            const payload = decodeMqttMessage(topic, bytes, workerData.stationStatusTopic, workerData.backfillTopicPrefix);
+            Atomics.add(counters, COUNTER.DECODED, 1);
+            return { payload };
+        } catch (error) {
+            Atomics.add(counters, COUNTER.DECODE_ERRORS, 1);
+            return { error: error.message };
+        }
+    },
+
+    async writeBatch({ batch }) {
+        Atomics.add(counters, COUNTER.BATCHES_IN_FLIGHT, 1);
+        try {
+            const inserted = await writePortEventBatch(pool, batch);
+            Atomics.add(counters, COUNTER.EVENTS_WRITTEN, inserted);
+            return inserted;
+        } catch (error) {
+            Atomics.add(counters, COUNTER.BATCH_FAILURES, 1);
+            throw error;
+        } finally {
+            Atomics.sub(counters, COUNTER.BATCHES_IN_FLIGHT, 1);
+        }
+    },
+
+    async shutdown() {
+        await pool.end();
+        return true;
+    }
+};
+
+parentPort.on('message', async (request) => {
+    const handler = handlers[request.type];
+    try {
+        if (!handler) throw new Error(`Unknown ingest worker request: ${request.type}`);
+        const result = await handler(request);
+        parentPort.postMessage({ id: request.id, result });
+    } catch (error) {
+        parentPort.postMessage({ id: request.id, error: error.message, code: error.code });
+    }
+});
@@ -0,0 +1,10 @@
+{
+  "targets": [
+    {
+      "target_name": "telemetry_codec",
+      "sources": ["telemetry_codec.cc"],
+      "cflags_cc": ["-O3", "-std=c++17"],
+      "xcode_settings": { "OTHER_CPLUSPLUSFLAGS": ["-O3", "-std=c++17"] }
+    }
+  ]
+}
@@ -0,0 +1,511 @@
+// Native telemetry codec: decodes charger/backfill batches straight out of the MQTT Buffer into
+// columnar typed arrays, and validates/integrates usage readings over those columns.
+// Loaded by telemetryCodec.js when built (npm run build:native); results must match the JS path
+// there exactly, so anything this decoder does not model makes it return undefined instead.
+#include <node_api.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+#define NAPI_CALL(env, call)                                        \
+    do {                                                            \
+        if ((call) != napi_ok) {                                    \
+            napi_throw_error((env), nullptr, "N-API call failed");  \
+            return nullptr;                                         \
+        }                                                           \
+    } while (0)
+
+constexpr double kMissing = NAN;
+
+enum ChargerStateCode : uint8_t { kStateNone = 0, kStateOn = 1, kStateOff = 2 };
+
+// One reading's fields as decoded; NaN marks "absent or null"
+struct Reading {
+    double port_number = kMissing;
+    double timestamp = kMissing;
+    double consumption = kMissing;
+    double seq = kMissing;
+    uint8_t charger_state = kStateNone;
+};
+
+enum class BootKind { kNone, kString, kNumber };
+
+struct Frame {
+    std::vector<Reading> readings;
+    double default_port = kMissing;
+    BootKind boot_kind = BootKind::kNone;
+    const char* boot_text = nullptr;
+    size_t boot_length = 0;
+    double boot_number = 0;
+};
+
+// Minimal JSON reader over the raw bytes. Fails (ok = false) on malformed input and on
+// shapes the columnar frame cannot represent; the caller then falls back to JSON.parse.
+class Reader {
+  public:
+    Reader(const char* data, size_t length) : p_(data), end_(data + length) {}
+
+    bool ok() const { return ok_; }
+    bool AtEnd() {
+        SkipSpace();
+        return p_ == end_;
+    }
+
+    bool ParseFrame(Frame* frame) {
+        SkipSpace();
+        if (!Consume('{')) return Fail();
+        SkipSpace();
+        if (Consume('}')) return true;
+        do {
+            const char* key;
+            size_t key_length;
+            SkipSpace();
+            if (!ParseRawString(&key, &key_length) || !Expect(':')) return Fail();
+            SkipSpace();
+            if (KeyIs(key, key_length, "readings")) {
+                frame->readings.clear();  // duplicate keys: the last one wins, as with JSON.parse
+                if (Peek() == '[') {
+                    if (!ParseReadings(&frame->readings)) return Fail();
+                } else if (!SkipValue()) {
+                    return Fail();
+                }
+            } else if (KeyIs(key, key_length, "port_number")) {
+                if (!ParseNumberOrNull(&frame->default_port)) return Fail();
+            } else if (KeyIs(key, key_length, "boot")) {
+                if (!ParseBoot(frame)) return Fail();
+            } else if (!SkipValue()) {
+                return Fail();
+            }
+            SkipSpace();
+        } while (Consume(','));
+        return Expect('}');
+    }
+
+  private:
+    bool Fail() {
+        ok_ = false;
+        return false;
+    }
+
+    char Peek() const { return p_ < end_ ? *p_ : '\0'; }
+
+    bool Consume(char c) {
+        if (p_ < end_ && *p_ == c) {
+            ++p_;
+            return true;
+        }
+        return false;
+    }
+
+    bool Expect(char c) {
+        SkipSpace();
+        return Consume(c) || Fail();
+    }
+
+    void SkipSpace() {
+        while (p_ < end_ && (*p_ == ' ' || *p_ == '\t' || *p_ == '\n' || *p_ == '\r')) ++p_;
+    }
+
+    static bool KeyIs(const char* key, size_t length, const char* expected) {
+        return length == std::strlen(expected) && std::memcmp(key, expected, length) == 0;
+    }
+
+    // Strings with escapes are only skipped, never decoded; a key or value that needs decoding fails
+    bool ParseRawString(const char** text, size_t* length) {
+        if (!Consume('"')) return false;
+        const char* start = p_;
+        while (p_ < end_ && *p_ != '"') {
+            if (*p_ == '\\' || static_cast<unsigned char>(*p_) < 0x20) return false;
+            ++p_;
+        }
+        if (p_ == end_) return false;
+        *text = start;
+        *length = static_cast<size_t>(p_ - start);
+        ++p_;
+        return true;
+    }
+
+    bool SkipString() {
+        if (!Consume('"')) return false;
+        while (p_ < end_) {
+            const char c = *p_++;
+            if (c == '"') return true;
+            if (static_cast<unsigned char>(c) < 0x20) return false;
+            if (c == '\\') {
+                if (p_ == end_) return false;
+                ++p_;
+            }
+        }
+        return false;
+    }
+
+    bool ParseLiteral(const char* literal) {
+        const size_t length = std::strlen(literal);
+        if (static_cast<size_t>(end_ - p_) < length || std::memcmp(p_, literal, length) != 0) return false;
+        p_ += length;
+        return true;
+    }
+
+    bool ParseNumber(double* value) {
+        static const double kPowersOfTen[] = {
+            1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+            1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+        };
+        const char* start = p_;
+        const bool negative = p_ < end_ && *p_ == '-';
+        if (negative) ++p_;
+        if (p_ == end_ || !(*p_ >= '0' && *p_ <= '9')) return false;
+        uint64_t mantissa = 0;
+        int digits = 0;
+        int fraction_digits = 0;
+        if (*p_ == '0') {
+            ++p_;
+        } else {
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+                mantissa = mantissa * 10 + static_cast<uint64_t>(*p_++ - '0');
+                ++digits;
+            }
+        }
+        if (p_ < end_ && *p_ == '.') {
+            ++p_;
+            if (p_ == end_ || !(*p_ >= '0' && *p_ <= '9')) return false;
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') {
+                mantissa = mantissa * 10 + static_cast<uint64_t>(*p_++ - '0');
+                ++digits;
+                ++fraction_digits;
+            }
+        }
+        bool has_exponent = false;
+        if (p_ < end_ && (*p_ == 'e' || *p_ == 'E')) {
+            has_exponent = true;
+            ++p_;
+            if (p_ < end_ && (*p_ == '+' || *p_ == '-')) ++p_;
+            if (p_ == end_ || !(*p_ >= '0' && *p_ <= '9')) return false;
+            while (p_ < end_ && *p_ >= '0' && *p_ <= '9') ++p_;
+        }
+        // Exact fast path: the digits fit a double's mantissa and the divisor is an exact power of
+        // ten, so one correctly rounded division gives the same double as JSON.parse
+        if (!has_exponent && digits <= 15 && fraction_digits <= 22) {
+            const double magnitude = static_cast<double>(mantissa) / kPowersOfTen[fraction_digits];
+            *value = negative ? -magnitude : magnitude;
+            return true;
+        }
+        // The Buffer is not NUL-terminated; strtod needs a terminated copy
+        char token[64];
+        const size_t length = static_cast<size_t>(p_ - start);
+        if (length >= sizeof(token)) return false;
+        std::memcpy(token, start, length);
+        token[length] = '\0';
+        *value = std::strtod(token, nullptr);
+        return true;
+    }
+
+    bool ParseNumberOrNull(double* value) {
+        if (Peek() == 'n') {
+            *value = kMissing;
+            return ParseLiteral("null");
+        }
+        return ParseNumber(value);
+    }
+
+    bool ParseBoot(Frame* frame) {
+        const char c = Peek();
+        if (c == 'n') {
+            frame->boot_kind = BootKind::kNone;
+            return ParseLiteral("null");
+        }
+        if (c == '"') {
+            frame->boot_kind = BootKind::kString;
+            return ParseRawString(&frame->boot_text, &frame->boot_length);
+        }
+        frame->boot_kind = BootKind::kNumber;
+        return ParseNumber(&frame->boot_number);
+    }
+
+    bool ParseChargerState(uint8_t* state) {
+        if (Peek() == 'n') {
+            *state = kStateNone;
+            return ParseLiteral("null");
+        }
+        const char* text;
+        size_t length;
+        if (!ParseRawString(&text, &length)) return false;
+        if (length == 0) {
+            *state = kStateNone;  // "" is falsy, stored as null
+        } else if (KeyIs(text, length, "ON")) {
+            *state = kStateOn;
+        } else if (KeyIs(text, length, "OFF")) {
+            *state = kStateOff;
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    bool ParseReading(Reading* reading) {
+        if (Peek() != '{') return SkipValue();  // non-object entries become all-missing (rejected) rows
+        ++p_;
+        SkipSpace();
+        if (Consume('}')) return true;
+        do {
+            const char* key;
+            size_t key_length;
+            SkipSpace();
+            if (!ParseRawString(&key, &key_length) || !Expect(':')) return false;
+            SkipSpace();
+            bool parsed;
+            if (KeyIs(key, key_length, "port_number")) {
+                parsed = ParseNumberOrNull(&reading->port_number);
+            } else if (KeyIs(key, key_length, "timestamp")) {
+                parsed = ParseNumberOrNull(&reading->timestamp);
+            } else if (KeyIs(key, key_length, "consumption")) {
+                parsed = ParseNumberOrNull(&reading->consumption);
+            } else if (KeyIs(key, key_length, "seq")) {
+                parsed = ParseNumberOrNull(&reading->seq);
+            } else if (KeyIs(key, key_length, "charger_state")) {
+                parsed = ParseChargerState(&reading->charger_state);
+            } else if (KeyIs(key, key_length, "boot")) {
+                parsed = ParseLiteral("null");  // per-reading boot ids are left to the JS decoder
+            } else {
+                parsed = SkipValue();
+            }
+            if (!parsed) return false;
+            SkipSpace();
+        } while (Consume(','));
+        return Expect('}');
+    }
+
+    bool ParseReadings(std::vector<Reading>* readings) {
+        ++p_;  // '['
+        readings->reserve(static_cast<size_t>(end_ - p_) / 48);  // rough bytes per reading
+        SkipSpace();
+        if (Consume(']')) return true;
+        do {
+            SkipSpace();
+            readings->emplace_back();
+            if (!ParseReading(&readings->back())) return false;
+            SkipSpace();
+        } while (Consume(','));
+        return Expect(']');
+    }
+
+    bool SkipValue(int depth = 0) {
+        if (depth > 64) return false;
+        SkipSpace();
+        const char c = Peek();
+        if (c == '"') return SkipString();
+        if (c == 't') return ParseLiteral("true");
+        if (c == 'f') return ParseLiteral("false");
+        if (c == 'n') return ParseLiteral("null");
+        if (c == '{' || c == '[') {
+            const char close = c == '{' ? '}' : ']';
+            ++p_;
+            SkipSpace();
+            if (Consume(close)) return true;
+            do {
+                SkipSpace();
+                if (c == '{') {
+                    if (!SkipString() || !Expect(':')) return false;
+                }
+                if (!SkipValue(depth + 1)) return false;
+                SkipSpace();
+            } while (Consume(','));
+            return Expect(close);
+        }
+        double ignored;
+        return ParseNumber(&ignored);
+    }
+
+    const char* p_;
+    const char* end_;
+    bool ok_ = true;
+};
+
+napi_value NewFloat64Array(napi_env env, size_t length, double** data) {
+    napi_value buffer, array;
+    void* raw;
+    NAPI_CALL(env, napi_create_arraybuffer(env, length * sizeof(double), &raw, &buffer));
+    NAPI_CALL(env, napi_create_typedarray(env, napi_float64_array, length, buffer, 0, &array));
+    *data = static_cast<double*>(raw);
+    return array;
+}
+
+napi_value NewUint8Array(napi_env env, size_t length, uint8_t** data) {
+    napi_value buffer, array;
+    void* raw;
+    NAPI_CALL(env, napi_create_arraybuffer(env, length, &raw, &buffer));
+    NAPI_CALL(env, napi_create_typedarray(env, napi_uint8_array, length, buffer, 0, &array));
+    *data = static_cast<uint8_t*>(raw);
+    return array;
+}
+
+bool SetNamed(napi_env env, napi_value object, const char* name, napi_value value) {
+    return value != nullptr && napi_set_named_property(env, object, name, value) == napi_ok;
+}
+
+bool SetNumber(napi_env env, napi_value object, const char* name, double number) {
+    napi_value value;
+    return napi_create_double(env, number, &value) == napi_ok && SetNamed(env, object, name, value);
+}
+
+// decodeUsageFrame(buffer) -> { count, portNumber, timestamp, consumption, seq, chargerState, boot } | undefined
+napi_value DecodeUsageFrame(napi_env env, napi_callback_info info) {
+    size_t argc = 1;
+    napi_value argv[1];
+    NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, nullptr, nullptr));
+
+    bool is_buffer = false;
+    if (argc < 1 || napi_is_buffer(env, argv[0], &is_buffer) != napi_ok || !is_buffer) {
+        napi_throw_type_error(env, nullptr, "decodeUsageFrame expects a Buffer");
+        return nullptr;
+    }
+    void* data;
+    size_t length;
+    NAPI_CALL(env, napi_get_buffer_info(env, argv[0], &data, &length));
+
+    Frame frame;
+    Reader reader(static_cast<const char*>(data), length);
+    napi_value undefined;
+    NAPI_CALL(env, napi_get_undefined(env, &undefined));
+    if (!reader.ParseFrame(&frame) || !reader.AtEnd()) return undefined;
+
+    const size_t count = frame.readings.size();
+    double *port_number, *timestamp, *consumption, *seq;
+    uint8_t* charger_state;
+    napi_value result;
+    NAPI_CALL(env, napi_create_object(env, &result));
+    if (!SetNamed(env, result, "portNumber", NewFloat64Array(env, count, &port_number)) ||
+        !SetNamed(env, result, "timestamp", NewFloat64Array(env, count, &timestamp)) ||
+        !SetNamed(env, result, "consumption", NewFloat64Array(env, count, &consumption)) ||
+        !SetNamed(env, result, "seq", NewFloat64Array(env, count, &seq)) ||
+        !SetNamed(env, result, "chargerState", NewUint8Array(env, count, &charger_state)) ||
+        !SetNumber(env, result, "count", static_cast<double>(count))) {
+        return nullptr;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        const Reading& reading = frame.readings[i];
+        port_number[i] = std::isnan(reading.port_number) ? frame.default_port : reading.port_number;
+        timestamp[i] = reading.timestamp;
+        consumption[i] = reading.consumption;
+        seq[i] = reading.seq;
+        charger_state[i] = reading.charger_state;
+    }
+
+    napi_value boot;
+    if (frame.boot_kind == BootKind::kString) {
+        NAPI_CALL(env, napi_create_string_utf8(env, frame.boot_text, frame.boot_length, &boot));
+    } else if (frame.boot_kind == BootKind::kNumber) {
+        NAPI_CALL(env, napi_create_double(env, frame.boot_number, &boot));
+    } else {
+        NAPI_CALL(env, napi_get_null(env, &boot));
+    }
+    if (!SetNamed(env, result, "boot", boot)) return nullptr;
+    return result;
+}
+
+bool GetFloat64Array(napi_env env, napi_value value, const double** data, size_t* length) {
+    napi_typedarray_type type;
+    void* raw;
+    napi_value buffer;
+    size_t offset;
+    if (napi_get_typedarray_info(env, value, &type, length, &raw, &buffer, &offset) != napi_ok ||
+        type != napi_float64_array) {
+        return false;
+    }
+    *data = static_cast<const double*>(raw);
+    return true;
+}
+
+double GetNumberProperty(napi_env env, napi_value object, const char* name) {
+    napi_value value;
+    double number = NAN;
+    if (napi_get_named_property(env, object, name, &value) == napi_ok) napi_get_value_double(env, value, &number);
+    return number;
+}
+
+// integrateUsage(portNumber, timestamp, consumption, limits) -> { accepted, watts, kwh, mah, acceptedCount, totalKwh, totalMah }
+napi_value IntegrateUsage(napi_env env, napi_callback_info info) {
+    size_t argc = 4;
+    napi_value argv[4];
+    NAPI_CALL(env, napi_get_cb_info(env, info, &argc, argv, nullptr, nullptr));
+
+    const double *port_number, *timestamp, *consumption;
+    size_t count, timestamp_count, consumption_count;
+    if (argc < 4 ||
+        !GetFloat64Array(env, argv[0], &port_number, &count) ||
+        !GetFloat64Array(env, argv[1], &timestamp, &timestamp_count) ||
+        !GetFloat64Array(env, argv[2], &consumption, &consumption_count) ||
+        timestamp_count != count || consumption_count != count) {
+        napi_throw_type_error(env, nullptr, "integrateUsage expects three Float64Arrays of equal length and a limits object");
+        return nullptr;
+    }
+
+    const double oldest_ms = GetNumberProperty(env, argv[3], "oldestMs");
+    const double newest_ms = GetNumberProperty(env, argv[3], "newestMs");
+    const double max_watts = GetNumberProperty(env, argv[3], "maxWatts");
+    const double voltage = GetNumberProperty(env, argv[3], "voltage");
+    const double interval_seconds = GetNumberProperty(env, argv[3], "intervalSeconds");
+
+    uint8_t* accepted;
+    double *watts, *kwh, *mah;
+    napi_value result;
+    NAPI_CALL(env, napi_create_object(env, &result));
+    if (!SetNamed(env, result, "accepted", NewUint8Array(env, count, &accepted)) ||
+        !SetNamed(env, result, "watts", NewFloat64Array(env, count, &watts)) ||
+        !SetNamed(env, result, "kwh", NewFloat64Array(env, count, &kwh)) ||
+        !SetNamed(env, result, "mah", NewFloat64Array(env, count, &mah))) {
+        return nullptr;
+    }
+
+    // Same arithmetic, in the same order, as usageEnergyIncrement and validateConsumption
+    size_t accepted_count = 0;
+    double total_kwh = 0;
+    double total_mah = 0;
+    for (size_t i = 0; i < count; ++i) {
+        double w = consumption[i] * voltage;
+        if (std::isnan(w) || w < 0) w = 0;
+        if (w > max_watts) w = max_watts;
+        const double port = port_number[i];
+        const double ts = timestamp[i];
+        const bool ok = std::isfinite(port) && port == std::trunc(port) && port >= 1 &&
+                        std::isfinite(ts) && ts >= oldest_ms && ts <= newest_ms && w > 0;
+        accepted[i] = ok ? 1 : 0;
+        watts[i] = w;
+        if (!ok) {
+            kwh[i] = 0;
+            mah[i] = 0;
+            continue;
+        }
+        kwh[i] = (w * interval_seconds) / (1000 * 3600);
+        mah[i] = ((w / voltage) * 1000) * (interval_seconds / 3600);
+        total_kwh += kwh[i];
+        total_mah += mah[i];
+        ++accepted_count;
+    }
+
+    if (!SetNumber(env, result, "acceptedCount", static_cast<double>(accepted_count)) ||
+        !SetNumber(env, result, "totalKwh", total_kwh) ||
+        !SetNumber(env, result, "totalMah", total_mah)) {
+        return nullptr;
+    }
+    return result;
+}
+
+napi_value Init(napi_env env, napi_value exports) {
+    napi_property_descriptor properties[] = {
+        { "decodeUsageFrame", nullptr, DecodeUsageFrame, nullptr, nullptr, nullptr, napi_default, nullptr },
+        { "integrateUsage", nullptr, IntegrateUsage, nullptr, nullptr, nullptr, napi_default, nullptr },
+    };
+    NAPI_CALL(env, napi_define_properties(env, exports, sizeof(properties) / sizeof(properties[0]), properties));
+    return exports;
+}
+
+}  // namespace
+
+NAPI_MODULE(NODE_GYP_MODULE_NAME, Init)
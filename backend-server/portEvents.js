@@ -0,0 +1,288 @@
+// Port event log helpers shared by server.js and the ingestion worker (ingestWorker.js).
+// Everything here is pure or takes the pg client/pool it should use, so both threads
+// decode telemetry and advance projections exactly the same way.
+
+const { decodeUsageFrame } = require('./telemetryCodec');
+
+const NOMINAL_CHARGING_VOLTAGE_DC = 12; // Volts DC. Adjust this based on your battery system.
+const USAGE_REPORT_INTERVAL_SECONDS = 10; // ESP32 publishes usage every 10 seconds
+const DAILY_ENERGY_BUCKET_MS = 15 * 60 * 1000; // finest time-zone offset granularity
+// Station wall clock: tariff windows, the solar model and the calendar days of daily_energy_usage (the server's zone when unset)
+const STATION_TIME_ZONE = process.env.STATION_TIME_ZONE || Intl.DateTimeFormat().resolvedOptions().timeZone;
+
+// Named statements fail behind a transaction-mode pooler (Supabase's on port 6543, or a URL marked
+// pgbouncer=true), so there they default to off; PG_PREPARED_STATEMENTS=on|off overrides.
+function preparedStatementsDefault(databaseUrl = process.env.DATABASE_URL) {
+    if (process.env.PG_PREPARED_STATEMENTS) return process.env.PG_PREPARED_STATEMENTS !== 'off';
+    try {
+        const url = new URL(databaseUrl);
+        return url.port !== '6543' && url.searchParams.get('pgbouncer') !== 'true';
+    } catch (error) {
+        return true; // No or unparsable URL: pg reads the PG* variables, a direct connection
+    }
+}
+
+// Named so node-postgres prepares them once per connection (server.js's preparedStatement uses the same switch)
+const PREPARED_STATEMENTS_ENABLED = preparedStatementsDefault();
+function statement(name, text, values) {
+    return PREPARED_STATEMENTS_ENABLED ? { name, text, values } : { text, values };
+}
+
+// Every usage/status fact from a charger is appended once to port_events; the tables below are projections of it
+const PORT_EVENT_TYPES = {
+    USAGE: 'usage',   // consumption reading (read through the consumption_data view)
+    STATUS: 'status'  // status/charger_state report (read through the device_status_logs view)
+};
+
+// Turns a raw MQTT message into a payload object. The station's plain-string LWT ("offline")
+// on its status topic becomes the JSON shape the handler expects, and backfill batches become
+// columnar usage frames (telemetryCodec.js). Throws on malformed JSON.
+function decodeMqttMessage(topic, message, stationStatusTopic, backfillTopicPrefix) {
+    if (backfillTopicPrefix && topic.startsWith(backfillTopicPrefix)) {
+        return decodeUsageFrame(message);
+    }
+    const messageString = message.toString();
+    if (topic === stationStatusTopic && messageString === 'offline') {
+        console.warn(`MQTT: Converted plain "offline" LWT to JSON for ${topic}`);
+        return {
+            status: "offline",
+            charger_state: 'UNKNOWN',
+            timestamp: Date.now(),
+            port_number: -1 // Special indicator for station-level offline message (will be ignored by port-specific logic)
+        };
+    }
+    return JSON.parse(messageString);
+}
+
+// Energy a single usage reading adds to its session (shared by live projection and replay)
+function usageEnergyIncrement(consumptionWatts) {
+    const kwh = (consumptionWatts * USAGE_REPORT_INTERVAL_SECONDS) / (1000 * 3600); // Watts * seconds / (1000W/kW * 3600s/hr)
+    const currentAmps = consumptionWatts / NOMINAL_CHARGING_VOLTAGE_DC; // Amps = Watts / Volts
+    const mah = (currentAmps * 1000) * (USAGE_REPORT_INTERVAL_SECONDS / 3600); // mAh = Amps * 1000 * (seconds / 3600)
+    return { kwh, mah };
+}
+
+// Cost of an energy increment at a per-mAh price (the tariff in force when the reading was taken).
+// Matches the billing convention of calculateSessionCost: mAh = kWh / nominal voltage.
+function usageCostIncrement(kwh, pricePerMah) {
+    return (kwh / NOMINAL_CHARGING_VOLTAGE_DC) * pricePerMah;
+}
+
+// Projections fold a batch of events (in log order) into one write each.
+// `reduce` must be pure so that live flushes and replay produce the same rows.
+const PORT_EVENT_PROJECTIONS = {
+    current_device_status: {
+        reduce(events) {
+            const latestByPort = new Map();
+            for (const event of events) {
+                if (event.event_type !== PORT_EVENT_TYPES.STATUS || !event.port_id) continue;
+                const previous = latestByPort.get(event.port_id);
+                if (!previous || new Date(previous.occurred_at) <= new Date(event.occurred_at)) {
+                    latestByPort.set(event.port_id, event);
+                }
+            }
+            return Array.from(latestByPort.values());
+        },
+        async write(client, rows) {
+            if (rows.length === 0) return;
+            await client.query(statement('projectCurrentDeviceStatus',
+                `INSERT INTO current_device_status (device_id, port_id, status_message, charger_state, last_update)
+                 SELECT * FROM UNNEST($1::varchar[], $2::uuid[], $3::varchar[], $4::varchar[], $5::timestamptz[])
+                 ON CONFLICT (device_id, port_id) DO UPDATE SET
+                    status_message = EXCLUDED.status_message,
+                    charger_state = EXCLUDED.charger_state,
+                    last_update = EXCLUDED.last_update
+                 WHERE current_device_status.last_update <= EXCLUDED.last_update`,
+                [
+                    rows.map(row => row.device_id),
+                    rows.map(row => row.port_id),
+                    rows.map(row => row.status_message),
+                    rows.map(row => row.charger_state),
+                    rows.map(row => row.occurred_at)
+                ]
+            ));
+        }
+    },
+    session_energy: {
+        reduce(events) {
+            const totals = new Map();
+            for (const event of events) {
+                if (event.event_type !== PORT_EVENT_TYPES.USAGE || !event.session_id) continue;
+                const { kwh, mah } = usageEnergyIncrement(Number(event.consumption_watts) || 0);
+                const total = totals.get(event.session_id) || { session_id: event.session_id, kwh: 0, mah: 0, cost: 0, last_update: event.occurred_at };
+                total.kwh += kwh;
+                total.mah += mah;
+                // Readings logged before cost accrual carry no price; the session is then priced at finalization
+                const costIncrement = event.cost_increment === null || event.cost_increment === undefined ? null : Number(event.cost_increment);
+                total.cost = total.cost === null || costIncrement === null ? null : total.cost + costIncrement;
+                if (new Date(total.last_update) < new Date(event.occurred_at)) total.last_update = event.occurred_at;
+                totals.set(event.session_id, total);
+            }
+            return Array.from(totals.values());
+        },
+        async write(client, rows) {
+            if (rows.length === 0) return;
+            await client.query(statement('projectSessionEnergy',
+                `UPDATE charging_session AS cs
+                 SET energy_consumed_kwh = COALESCE(cs.energy_consumed_kwh, 0) + u.kwh,
+                     energy_consumed_mah = COALESCE(cs.energy_consumed_mah, 0) + u.mah,
+                     total_mah_consumed = COALESCE(cs.total_mah_consumed, 0) + u.mah,
+                     -- NULL once any of the session's energy is unpriced (including sessions that predate accrual)
+                     accrued_cost = CASE
+                        WHEN u.cost IS NULL THEN NULL
+                        WHEN cs.accrued_cost IS NULL AND COALESCE(cs.energy_consumed_kwh, 0) > 0 THEN NULL
+                        ELSE COALESCE(cs.accrued_cost, 0) + u.cost
+                     END,
+                     last_status_update = GREATEST(COALESCE(cs.last_status_update, u.last_update), u.last_update)
+                 FROM UNNEST($1::uuid[], $2::float8[], $3::float8[], $4::timestamptz[], $5::float8[])
+                    AS u(session_id, kwh, mah, last_update, cost)
+                 WHERE cs.session_id = u.session_id`,
+                [
+                    rows.map(row => row.session_id),
+                    rows.map(row => row.kwh),
+                    rows.map(row => row.mah),
+                    rows.map(row => row.last_update),
+                    rows.map(row => row.cost)
+                ]
+            ));
+        },
+        // Replay recomputes totals from scratch for every session that has usage in the log
+        async reset(client, maxEventId) {
+            await client.query(
+                `UPDATE charging_session
+                 SET energy_consumed_kwh = 0, energy_consumed_mah = 0, total_mah_consumed = 0, accrued_cost = NULL
+                 WHERE session_id IN (
+                    SELECT DISTINCT session_id FROM port_events
+                    WHERE event_type = $1 AND session_id IS NOT NULL AND event_id <= $2
+                 )`,
+                [PORT_EVENT_TYPES.USAGE, maxEventId]
+            );
+        }
+    },
+    // Per-user, per-day energy (daily_energy_usage). Days are calendar days in STATION_TIME_ZONE, not the
+    // database session's zone; readings are folded into 15-minute buckets, which never straddle a
+    // midnight in a whole- or quarter-hour zone.
+    daily_energy: {
+        reduce(events) {
+            const totals = new Map();
+            for (const event of events) {
+                if (event.event_type !== PORT_EVENT_TYPES.USAGE || !event.session_id) continue;
+                const bucketMs = Math.floor(new Date(event.occurred_at).getTime() / DAILY_ENERGY_BUCKET_MS) * DAILY_ENERGY_BUCKET_MS;
+                const key = `${event.session_id}|${bucketMs}`;
+                const { kwh, mah } = usageEnergyIncrement(Number(event.consumption_watts) || 0);
+                const total = totals.get(key) || { session_id: event.session_id, bucket_start: new Date(bucketMs), kwh: 0, mah: 0 };
+                total.kwh += kwh;
+                total.mah += mah;
+                totals.set(key, total);
+            }
+            return Array.from(totals.values());
+        },
+        async write(client, rows) {
+            if (rows.length === 0) return;
+            await client.query(statement('projectDailyEnergy',
+                `INSERT INTO daily_energy_usage AS d (user_id, usage_date, total_energy_used_mah, total_energy_kwh, subscription_reference)
+                 SELECT cs.user_id, (u.bucket_start AT TIME ZONE $5)::date, SUM(u.mah), SUM(u.kwh),
+                        (SELECT us.user_subscription_id FROM user_subscription us WHERE us.user_id = cs.user_id AND us.is_active = true LIMIT 1)
+                 FROM UNNEST($1::uuid[], $2::timestamptz[], $3::float8[], $4::float8[]) AS u(session_id, bucket_start, mah, kwh)
+                 JOIN charging_session cs ON cs.session_id = u.session_id
+                 WHERE cs.user_id IS NOT NULL
+                 GROUP BY cs.user_id, (u.bucket_start AT TIME ZONE $5)::date
+                 ON CONFLICT (user_id, usage_date) DO UPDATE SET
+                    total_energy_used_mah = COALESCE(d.total_energy_used_mah, 0) + EXCLUDED.total_energy_used_mah,
+                    total_energy_kwh = COALESCE(d.total_energy_kwh, 0) + EXCLUDED.total_energy_kwh,
+                    updated_at = NOW()`,
+                [
+                    rows.map(row => row.session_id),
+                    rows.map(row => row.bucket_start),
+                    rows.map(row => row.mah),
+                    rows.map(row => row.kwh),
+                    STATION_TIME_ZONE
+                ]
+            ));
+        },
+        // Replay rebuilds the energy of every user-day that has usage in the log; session counts,
+        // minutes and cost are written at finalization and left alone
+        async reset(client, maxEventId) {
+            await client.query(
+                `UPDATE daily_energy_usage d
+                 SET total_energy_used_mah = 0, total_energy_kwh = 0, updated_at = NOW()
+                 FROM (
+                    SELECT DISTINCT cs.user_id, (pe.occurred_at AT TIME ZONE $3)::date AS usage_date
+                    FROM port_events pe
+                    JOIN charging_session cs ON cs.session_id = pe.session_id
+                    WHERE pe.event_type = $1 AND pe.event_id <= $2
+                 ) t
+                 WHERE d.user_id = t.user_id AND d.usage_date = t.usage_date`,
+                [PORT_EVENT_TYPES.USAGE, maxEventId, STATION_TIME_ZONE]
+            );
+        }
+    }
+};
+
+async function applyPortEventProjections(client, events, projectionNames = Object.keys(PORT_EVENT_PROJECTIONS)) {
+    for (const name of projectionNames) {
+        const projection = PORT_EVENT_PROJECTIONS[name];
+        await projection.write(client, projection.reduce(events));
+    }
+}
+
+
+// Appends one batch to port_events and advances every projection in the same transaction.
+// Returns the journal LSNs that were actually inserted; (journal_id, journal_lsn) makes a retry
+// of a batch that was already committed before a crash a no-op.
+async function writePortEventBatch(pgPool, batch) {
+    let client = null;
+    try {
+        client = await pgPool.connect();
+        await client.query('BEGIN');
+        const { rows } = await client.query(statement('insertPortEvents',
+            `INSERT INTO port_events
+                (event_type, device_id, port_number, port_id, session_id, occurred_at,
+                 status_message, charger_state, consumption_watts, payload, journal_id, journal_lsn, cost_increment)
+             SELECT * FROM UNNEST(
+                $1::varchar[], $2::varchar[], $3::int[], $4::uuid[], $5::uuid[], $6::timestamptz[],
+                $7::varchar[], $8::varchar[], $9::real[], $10::jsonb[], $11::uuid[], $12::bigint[], $13::float8[])
+             ON CONFLICT (journal_id, journal_lsn) WHERE journal_lsn IS NOT NULL DO NOTHING
+             RETURNING journal_lsn`,
+            [
+                batch.map(event => event.event_type),
+                batch.map(event => event.device_id),
+                batch.map(event => event.port_number),
+                batch.map(event => event.port_id),
+                batch.map(event => event.session_id),
+                batch.map(event => event.occurred_at),
+                batch.map(event => event.status_message),
+                batch.map(event => event.charger_state),
+                batch.map(event => event.consumption_watts),
+                batch.map(event => (event.payload ? JSON.stringify(event.payload) : null)),
+                batch.map(event => event.journal_id || null),
+                batch.map(event => event.journal_lsn || null),
+                batch.map(event => event.cost_increment ?? null)
+            ]
+        ));
+        // Only events that were not already applied before a crash advance the projections
+        const insertedLsns = new Set(rows.map(row => String(row.journal_lsn)));
+        await applyPortEventProjections(client, batch.filter(event => !event.journal_lsn || insertedLsns.has(String(event.journal_lsn))));
+        await client.query('COMMIT');
+        return rows.length;
+    } catch (error) {
+        if (client) await client.query('ROLLBACK').catch(() => {});
+        throw error;
+    } finally {
+        if (client) client.release();
+    }
+}
+
+module.exports = {
+    NOMINAL_CHARGING_VOLTAGE_DC,
+    USAGE_REPORT_INTERVAL_SECONDS,
+    STATION_TIME_ZONE,
+    PREPARED_STATEMENTS_ENABLED,
+    PORT_EVENT_TYPES,
+    PORT_EVENT_PROJECTIONS,
+    decodeMqttMessage,
+    usageEnergyIncrement,
+    usageCostIncrement,
+    applyPortEventProjections,
+    writePortEventBatch
+};
@@ -1,20 +1,55 @@
 const express = require('express');
 const cors = require('cors');
-const { Pool } = require('pg');
+const { Pool, Client } = require('pg');
 const mqtt = require('mqtt');
 require('dotenv').config(); // Load environment variables from .env file
 const jwt = require('jsonwebtoken'); // For JWT decode/verify
+const fs = require('fs');
+const path = require('path');
+const crypto = require('crypto');
+const { monitorEventLoopDelay } = require('perf_hooks');
+const { Worker } = require('worker_threads');
+const cluster = require('cluster');
+const os = require('os');
+const http = require('http');
+const net = require('net');
+const { EventEmitter } = require('events');
+const {
+    NOMINAL_CHARGING_VOLTAGE_DC,
+    USAGE_REPORT_INTERVAL_SECONDS,
+    STATION_TIME_ZONE,
+    PREPARED_STATEMENTS_ENABLED,
+    PORT_EVENT_TYPES,
+    PORT_EVENT_PROJECTIONS,
+    decodeMqttMessage,
+    usageEnergyIncrement,
+    usageCostIncrement,
+    applyPortEventProjections,
+    writePortEventBatch
+} = require('./portEvents');
+const telemetryCodec = require('./telemetryCodec');
 
 const app = express();
 const PORT = process.env.PORT || 3001;
 
 // --- Global state for active sessions and timers ---
-// activeChargerSessions: Maps `${deviceId}_${portNumberInDevice}` -> session_id
-const activeChargerSessions = {};
-// activePortTimers: Maps `${deviceId}_${portNumberInDevice}` -> { timerId: setTimeout_ID, lastConsumptionTime: Date.now() }
-const activePortTimers = {};
-// fullChargeNotificationState: Maps session_id -> { userId, portId, portNumber, fullSentAt, disconnectSent }
-const fullChargeNotificationState = new Map();
+// portStateMachines: Maps `${deviceId}_${portNumberInDevice}` -> port state entry (see "Per-port state machine")
+// Each entry owns the port's lifecycle state, active session, inactivity timer and full-charge notification state.
+const portStateMachines = new Map();
+// portStateMachinesById: Maps charging_port.port_id -> the same entry
+const portStateMachinesById = new Map();
+// pendingPortStatusWrites: entries whose charging_port row is behind their in-memory state (write-behind)
+const pendingPortStatusWrites = new Set();
+// pendingPortEvents: port_events rows (the telemetry system of record) waiting for the next batched INSERT
+const pendingPortEvents = [];
+// userDeviceTelemetry: Maps user_id -> Map(`${device_type}|${device_name}` -> latest user_devices record)
+const userDeviceTelemetry = new Map();
+// pendingUserDeviceRecords: user_devices records (from userDeviceTelemetry) waiting for the next batched UPSERT
+const pendingUserDeviceRecords = new Set();
+// stationTelemetry: Maps station_id -> { ring, latest, bucket, persistedLevel } (see "Station telemetry")
+const stationTelemetry = new Map();
+// pendingStationBuckets: closed one-minute station_telemetry rows waiting for the next batched INSERT
+const pendingStationBuckets = [];
 
 // --- Session locking mechanism to prevent race conditions ---
 const sessionLocks = new Map(); // Maps sessionKey -> lock status
@@ -38,8 +73,18 @@ async function acquireSessionLock(sessionKey, timeoutMs = 5000) {
 const INACTIVITY_TIMEOUT_SECONDS = 300; // 5 minutes for inactivity timeout
 const DEVICE_STATUS_STALE_THRESHOLD_SECONDS = 45; // when device stops reporting
 const USER_DEVICE_ONLINE_THRESHOLD_SECONDS = 120; // consider mobile device online if updated within last 2 minutes
-const NOMINAL_CHARGING_VOLTAGE_DC = 12; // Volts DC. Adjust this based on your battery system.
+const USER_DEVICE_FLUSH_INTERVAL_MS = 5000; // batched UPSERT of changed phone telemetry into user_devices
+const USER_DEVICE_HEARTBEAT_PERSIST_SECONDS = 300; // unchanged heartbeats only refresh user_devices.last_updated this often
+const USER_DEVICE_CACHE_TTL_SECONDS = 60 * 60; // drop cached phone telemetry after 1 hour without heartbeats
+const USER_DEVICE_MAX_BATCH_UPDATES = 50; // max telemetry samples accepted in one POST /api/user/devices
 const MAX_REASONABLE_CONSUMPTION = 10000; // 10kW in watts, for consumption validation
+const STATION_TELEMETRY_RING_SIZE = 360; // latest readings kept per station for live reads (1 hour at 10 s)
+const STATION_TELEMETRY_BUCKET_SECONDS = 60; // readings are persisted as one aggregate row per station per minute
+const STATION_TELEMETRY_FLUSH_INTERVAL_MS = 15000;
+const STATION_TELEMETRY_FRESH_SECONDS = 120; // newer readings override the station's stored battery level and solar estimate
+const STATION_TELEMETRY_MAX_SOLAR_WATTS = 20000;
+const STATION_TELEMETRY_TEMPERATURE_RANGE_C = [-40, 125];
+const STATION_TELEMETRY_PARTITION_CHECK_MS = 24 * 60 * 60 * 1000; // keep this and next month's partitions in place
 
 // Premium user slot limits - easily configurable
 // To change the slot limit, simply modify the value below:
@@ -52,10 +97,7 @@ const PREMIUM_USER_MAX_ACTIVE_SLOTS = 1; // Maximum number of active charging sl
 // --- Helper function to check user's active session count ---
 async function checkUserActiveSessions(user_id) {
     try {
-        const result = await pool.query(
-            'SELECT COUNT(*) as active_count FROM charging_session WHERE user_id = $1 AND session_status = $2',
-            [user_id, SESSION_STATUS.ACTIVE]
-        );
+        const result = await controlPool.query(preparedStatement('countUserActiveSessions', [user_id, SESSION_STATUS.ACTIVE]));
         return parseInt(result.rows[0].active_count) || 0;
     } catch (error) {
         console.error('Error checking user active sessions:', error);
@@ -72,6 +114,7 @@ const MQTT_TOPICS = {
     USAGE: 'charger/usage/',
     STATUS: 'charger/status/',
     CONTROL: 'charger/control/',
+    BACKFILL: 'charger/backfill/', // buffered usage readings replayed by a station after an outage
     STATION_GENERIC_STATUS: 'station/+/status' // For broader station status topics
 };
 
@@ -111,6 +154,368 @@ const LOG_SOURCES = {
     API: 'api'
 };
 
+// --- Per-port state machine ---
+// available -> reserved -> charging -> full_ready -> finalizing -> available, with offline/fault reachable
+// from any live state. MQTT, API and timer events are the only way to move a port between states.
+const PORT_FSM_STATES = {
+    AVAILABLE: 'available',
+    RESERVED: 'reserved',     // session created via API, device has not confirmed ON yet
+    CHARGING: 'charging',
+    FULL_READY: 'full_ready', // device reported full charge, auto-disconnect pending
+    FINALIZING: 'finalizing', // session is being closed in the DB
+    OFFLINE: 'offline',
+    FAULT: 'fault'
+};
+
+const PORT_FSM_EVENTS = {
+    SESSION_STARTED: 'session_started',
+    DEVICE_ON: 'device_on',
+    DEVICE_OFF: 'device_off',
+    FULL_READY: 'full_ready',
+    FINALIZE: 'finalize',
+    FINALIZE_FAILED: 'finalize_failed',
+    SESSION_ENDED: 'session_ended',
+    DEVICE_OFFLINE: 'device_offline',
+    DEVICE_ONLINE: 'device_online',
+    FAULT_DETECTED: 'fault_detected',
+    FAULT_CLEARED: 'fault_cleared'
+};
+
+// Next state per (state, event). Functions resolve states that depend on whether a session is attached.
+const resumeStateForEntry = (entry) => (entry.sessionId ? PORT_FSM_STATES.CHARGING : PORT_FSM_STATES.AVAILABLE);
+const PORT_FSM_TRANSITIONS = {
+    [PORT_FSM_STATES.AVAILABLE]: {
+        [PORT_FSM_EVENTS.SESSION_STARTED]: PORT_FSM_STATES.RESERVED,
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.RESERVED]: {
+        [PORT_FSM_EVENTS.SESSION_STARTED]: PORT_FSM_STATES.RESERVED,
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.RESERVED,
+        [PORT_FSM_EVENTS.FULL_READY]: PORT_FSM_STATES.FULL_READY,
+        [PORT_FSM_EVENTS.FINALIZE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.CHARGING]: {
+        [PORT_FSM_EVENTS.SESSION_STARTED]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.FULL_READY]: PORT_FSM_STATES.FULL_READY,
+        [PORT_FSM_EVENTS.FINALIZE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.FULL_READY]: {
+        [PORT_FSM_EVENTS.SESSION_STARTED]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.FULL_READY,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.FULL_READY,
+        [PORT_FSM_EVENTS.FULL_READY]: PORT_FSM_STATES.FULL_READY,
+        [PORT_FSM_EVENTS.FINALIZE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.FINALIZING]: {
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.FINALIZE_FAILED]: (entry) => entry.previousState || PORT_FSM_STATES.CHARGING,
+        // A port that was offline/faulted when finalization began stays that way once it is released
+        [PORT_FSM_EVENTS.SESSION_ENDED]: (entry) => (
+            entry.previousState === PORT_FSM_STATES.OFFLINE || entry.previousState === PORT_FSM_STATES.FAULT
+                ? entry.previousState
+                : PORT_FSM_STATES.AVAILABLE
+        ),
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.OFFLINE]: {
+        [PORT_FSM_EVENTS.SESSION_STARTED]: PORT_FSM_STATES.RESERVED,
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.CHARGING,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.AVAILABLE,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: resumeStateForEntry,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FINALIZE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.OFFLINE,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT
+    },
+    [PORT_FSM_STATES.FAULT]: {
+        // New sessions are refused while faulted; existing ones can still be closed out
+        [PORT_FSM_EVENTS.DEVICE_ON]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.DEVICE_OFF]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.DEVICE_ONLINE]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.DEVICE_OFFLINE]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.FAULT_DETECTED]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.FINALIZE]: PORT_FSM_STATES.FINALIZING,
+        [PORT_FSM_EVENTS.SESSION_ENDED]: PORT_FSM_STATES.FAULT,
+        [PORT_FSM_EVENTS.FAULT_CLEARED]: resumeStateForEntry
+    }
+};
+
+const PORT_STATE_FLUSH_INTERVAL_MS = 2000; // write-behind interval for charging_port status
+
+// --- Port occupancy ---
+// Time in each state is accrued into per-port, per-hour occupied/idle/offline seconds as transitions
+// happen, and added to port_occupancy_hourly once a minute, so utilization never scans the logs.
+const OCCUPANCY_FLUSH_INTERVAL_MS = 60000;
+const OCCUPANCY_MAX_DAYS = 90; // longest window the occupancy API aggregates
+const OCCUPANCY = {
+    OCCUPIED: 'occupied',
+    IDLE: 'idle',
+    OFFLINE: 'offline'
+};
+
+// --- Port event log ---
+// PORT_EVENT_TYPES, the projections and the batch writer live in portEvents.js (shared with the ingestion worker)
+const PORT_EVENT_FLUSH_INTERVAL_MS = 1000; // batched INSERT of port_events + projection updates
+const PORT_EVENT_MAX_BATCH = 1000; // max events written per flush transaction
+const PORT_EVENT_REPLAY_PAGE_SIZE = 5000; // events read per page when rebuilding projections
+
+// --- Telemetry journal (local write-ahead log for port_events) ---
+// Every event is appended to a segmented journal on disk before it is written to Postgres,
+// so a database outage or a crash between the two does not lose telemetry.
+const TELEMETRY_JOURNAL_DIR = process.env.TELEMETRY_JOURNAL_DIR || path.join(__dirname, 'journal');
+const JOURNAL_SEGMENT_MAX_BYTES = 16 * 1024 * 1024; // rotate to a new segment file past 16 MB
+const JOURNAL_FSYNC_INTERVAL_MS = 200; // appends are batched into one write + fdatasync per interval
+const JOURNAL_MEMORY_MAX_EVENTS = 20000; // beyond this many unapplied events, the rest stay on disk until the DB catches up
+const JOURNAL_RECORD_HEADER_BYTES = 8; // u32 length + u32 CRC32, both big-endian
+
+// --- Telemetry sequence numbers ---
+// Usage payloads carry a per-port `seq` (and optionally a `boot` id that changes on firmware restart).
+// QoS 1 redeliveries reuse the seq and are dropped before they reach the energy accounting.
+const TELEMETRY_SEQ_WINDOW_SIZE = 256; // recent sequence numbers remembered per port (multiple of 32)
+const TELEMETRY_SEQ_GAP_LOG_THRESHOLD = 6; // gaps of this many samples (1 minute of usage) go to system_logs
+const SEQUENCE_RESULT = {
+    ACCEPTED: 'accepted',
+    DUPLICATE: 'duplicate',
+    STALE: 'stale', // older than the window; cannot tell whether it was already counted
+    UNSEQUENCED: 'unsequenced' // firmware without `seq`; accepted as before
+};
+
+// --- Consumption anomaly detection ---
+// Each port runs an O(1) detector over its positive usage samples (one charging run at a time):
+// an EWMA mean/variance for spikes, a run length for a sensor stuck on one value, and a count of
+// readings past MAX_REASONABLE_CONSUMPTION. Spikes and out-of-range readings fault the port and
+// alert admins. A flat line only flags the port for review: firmware that reports rounded amps
+// holds one value for a whole constant-current phase, which a stuck sensor cannot be told apart from.
+const ANOMALY_EWMA_ALPHA = 0.1; // weight of the newest sample in the running mean/variance
+const ANOMALY_WARMUP_SAMPLES = 12; // samples (2 minutes) before spikes are judged
+const ANOMALY_SPIKE_Z = 6; // deviation in standard deviations that counts as a spike...
+const ANOMALY_SPIKE_MIN_RATIO = 0.5; // ...and only if it is also at least this fraction of the mean
+const ANOMALY_SPIKE_DECAY = 0.9; // per-sample decay of the spike score
+const ANOMALY_SPIKE_SCORE_FAULT = 3; // roughly 4 spikes within ~10 samples
+const ANOMALY_LEVEL_SHIFT_SAMPLES = 3; // this many outliers in a row is a new load level, not spikes
+const ANOMALY_FLATLINE_SAMPLES = 360; // unchanged non-zero readings (1 hour) before a port is flagged for review
+const ANOMALY_SENSOR_RESOLUTION_AMPS = 0.001; // firmware reports amps to 3 decimals; closer readings are the same value
+const ANOMALY_KINDS = {
+    SPIKES: 'spikes',
+    FLATLINE: 'flatline',
+    OUT_OF_RANGE: 'out_of_range'
+};
+
+// --- Server-side full-charge detection ---
+// Phones charge at a roughly constant current, then taper once the battery reaches its
+// constant-voltage phase and settle on a small trickle when full. Spotting that shape in the
+// usage stream ends the session without waiting for the device's PORT_FULL_READY or the
+// inactivity timeout. Samples arrive about every 10 s.
+const FULL_CHARGE_EWMA_ALPHA = 0.3; // smoothing for the current the peak is taken from
+const FULL_CHARGE_MIN_SAMPLES = 18; // readings (3 minutes) before a session can be judged full
+const FULL_CHARGE_MIN_PEAK_AMPS = 0.3; // smoothed peak a real bulk charge reaches
+const FULL_CHARGE_TAPER_RATIO = 0.6; // below this fraction of the peak the charge is tapering...
+const FULL_CHARGE_MIN_TAPER_SAMPLES = 3; // ...for at least this many falling readings right before the trickle
+const FULL_CHARGE_TRICKLE_RATIO = 0.2; // below this fraction of the peak is trickle
+const FULL_CHARGE_TRICKLE_MAX_AMPS = 0.15; // and never more than this
+const FULL_CHARGE_PLATEAU_SAMPLES = 6; // trickle readings (1 minute) in a row...
+const FULL_CHARGE_PLATEAU_TOLERANCE_AMPS = 0.05; // ...within this band of each other
+const FULL_CHARGE_ZERO_AMPS = 0.005; // a plateau at or below this is no current at all, which an unplug also gives...
+const FULL_CHARGE_ZERO_MIN_TAPER_SAMPLES = 6; // ...so it needs a longer taper...
+const FULL_CHARGE_ZERO_MIN_DECLINE_RATIO = 0.2; // ...that fell by at least this fraction of the peak
+const FULL_CHARGE_DISCONNECT_GRACE_SECONDS = 60; // matches "We'll disconnect in about a minute"
+
+// --- Station power budget ---
+// A station can only feed as many ports as its battery and panel sustain. Each station's budget is
+// its usable stored energy spread over POWER_BUDGET_RUNTIME_HOURS plus the panel's expected output;
+// ports are admitted, queued or rotated by plan priority to stay inside it. Stations without
+// battery_capacity_mah/current_battery_level are not managed.
+const POWER_BUDGET_TICK_MS = 15000;
+const POWER_BUDGET_RUNTIME_HOURS = 4; // stored energy should last this long at the budgeted draw
+const POWER_BUDGET_RESERVE_PERCENT = 20; // battery below this level is kept for the station itself
+const POWER_BUDGET_HEADROOM = 0.9; // schedule against 90% of the budget
+const POWER_BUDGET_ROTATION_SECONDS = 300; // a running port keeps its slot this long before it can be rotated out
+const POWER_BUDGET_PORT_ESTIMATE_WATTS = 10; // expected draw of a port with no readings yet (phone fast charge)
+const POWER_BUDGET_DRAW_FRESH_SECONDS = 30; // readings older than this no longer describe the live draw
+const POWER_BUDGET_MAX_QUEUED_MINUTES = 60; // a session kept paused this long in one stretch is ended
+const SOLAR_DAY_START_HOUR = 6; // panel output is modelled as a half sine between these solar hours
+const SOLAR_DAY_END_HOUR = 18;
+const SOLAR_DERATE = 0.75; // panel output at solar noon relative to its rated wattage
+const POWER_PRIORITY = {
+    STANDARD: 0,
+    PREMIUM_PORT: 1,
+    PRIORITY_PLAN: 2 // subscription_plans.priority_access
+};
+
+// --- Command outbox ---
+// Control commands are inserted into command_outbox in the same transaction as the session change
+// and published by a background drainer, so the DB and the relays cannot disagree for long.
+const COMMAND_OUTBOX_STATUS = {
+    PENDING: 'pending',
+    SENT: 'sent',
+    SUPERSEDED: 'superseded', // a newer command for the same port was queued before this one went out
+    FAILED: 'failed'          // gave up after COMMAND_OUTBOX_MAX_ATTEMPTS
+};
+const COMMAND_OUTBOX_POLL_INTERVAL_MS = 1000; // retry/backstop poll; new commands trigger an immediate drain
+const COMMAND_OUTBOX_BATCH_SIZE = 200; // pending rows examined per drain
+const COMMAND_OUTBOX_MAX_ATTEMPTS = 8;
+const COMMAND_OUTBOX_BACKOFF_BASE_SECONDS = 2; // retry after 2s, 4s, 8s ... capped below
+const COMMAND_OUTBOX_BACKOFF_MAX_SECONDS = 120;
+const COMMAND_PUBLISH_TIMEOUT_MS = 10000; // no PUBACK within this window counts as a failed attempt
+
+// --- Store-and-forward backfill ---
+const BACKFILL_MAX_READINGS = 1000; // per MQTT message / HTTP request; devices send larger buffers in chunks
+const BACKFILL_MAX_AGE_HOURS = 72; // older buffered readings are rejected
+const BACKFILL_SESSION_EXTENSION_HOURS = 12; // how far past a session's recorded end an ON reading may extend it
+
+// --- Circuit breakers and admission control ---
+const CIRCUIT_STATES = {
+    CLOSED: 'closed',
+    OPEN: 'open',           // failing fast until resetTimeoutMs has passed
+    HALF_OPEN: 'half_open'  // one trial call decides whether to close again
+};
+const DB_CIRCUIT_OPTIONS = { failureThreshold: 5, resetTimeoutMs: 10000 };
+const MQTT_CIRCUIT_OPTIONS = { failureThreshold: 3, resetTimeoutMs: 5000 };
+const REQUEST_PRIORITY = {
+    CRITICAL: 'critical', // start/stop charging, ingestion, health; never shed
+    NORMAL: 'normal',
+    LOW: 'low'            // admin reports and polling reads; shed first
+};
+const ADMISSION_LAG_SAMPLE_INTERVAL_MS = 500;
+const ADMISSION_SHED_LOW_LAG_MS = 100; // p99 event-loop delay above which LOW requests get 503
+const ADMISSION_SHED_NORMAL_LAG_MS = 300; // ... and NORMAL requests too
+const ADMISSION_SHED_LOW_POOL_WAITING = 5; // requests queued for a pg connection above which LOW requests get 503
+const ADMISSION_RETRY_AFTER_SECONDS = 2;
+
+// --- Traffic classes ---
+const PG_POOL_SIZES = {
+    control: 4,   // start/stop charging; never waits behind reports or ingestion
+    ingest: 3,
+    reporting: 2, // admin analytics queue here instead of starving everything else
+    general: 6,
+    replica: 4
+};
+const MQTT_PRIORITY = {
+    HIGH: 0,   // status messages that end sessions or take ports offline (OFF, offline, device events)
+    NORMAL: 1, // other status and station messages
+    LOW: 2     // usage samples and backfill batches
+};
+const MQTT_PROCESSING_CONCURRENCY = 4; // messages handled at once; ports with higher-priority work are served first
+const MQTT_QUEUE_LIMIT = 5000;          // queued messages at which we stop reading from the broker (backpressure)
+const MQTT_QUEUE_RESUME = 4000;         // reading resumes once the queue is back under this
+const MQTT_QUEUE_URGENT_HEADROOM = 1000; // status messages still arriving past limit + headroom are dropped; usage and backfill never are
+
+// --- Request coalescing ---
+const SINGLE_FLIGHT_TTL_MS = 300; // identical reads within this window share one DB execution
+const STATION_RECONCILE_TTL_MS = 2000; // sync polls reconcile a station at most this often
+
+// --- Reference data cache ---
+// Stations, subscription plans and quota pricing are held in memory and reloaded when an admin
+// route changes them; other processes and replicas hear about it on this Postgres channel.
+const REFERENCE_DATA_CHANNEL = 'reference_data_changed';
+const REFERENCE_DATA_REFRESH_INTERVAL_MS = 5 * 60 * 1000; // full reload, covers notifications missed while disconnected
+const REFERENCE_DATA_LISTEN_RETRY_MS = 5000;
+
+// --- Conditional GET ---
+// Polling endpoints answer If-None-Match from in-memory version counters without touching the DB.
+// ETags also roll over on this interval, so a change that no counter saw is picked up within it.
+const RESOURCE_ETAG_MAX_AGE_MS = 30000;
+
+// --- Cluster mode ---
+// CLUSTER_WORKERS=auto (one per core) or a number forks that many HTTP workers. The primary becomes the
+// ingest process: it owns MQTT, the port state machines and the background jobs, serves the routes in
+// LIVE_STATE_OWNER_ROUTES on a loopback port, and pushes port snapshots to the workers. Unset/0 keeps
+// everything in a single process.
+const CLUSTER_WORKERS = process.env.CLUSTER_WORKERS === 'auto'
+    ? (os.availableParallelism ? os.availableParallelism() : os.cpus().length)
+    : parseInt(process.env.CLUSTER_WORKERS || '0', 10) || 0;
+const PROCESS_ROLES = {
+    STANDALONE: 'standalone',
+    INGEST: 'ingest', // cluster primary
+    HTTP: 'http'      // cluster worker
+};
+const PROCESS_ROLE = CLUSTER_WORKERS > 0
+    ? (cluster.isPrimary ? PROCESS_ROLES.INGEST : PROCESS_ROLES.HTTP)
+    : PROCESS_ROLES.STANDALONE;
+const OWNS_LIVE_STATE = PROCESS_ROLE !== PROCESS_ROLES.HTTP;
+const CLUSTER_OWNER_PORT = parseInt(process.env.CLUSTER_OWNER_PORT || '0', 10) || Number(PORT) + 1000; // loopback only
+const CLUSTER_STICKY = process.env.CLUSTER_STICKY === 'ip'; // pin each client IP to one worker (only useful without a proxy in front)
+const CLUSTER_WORKER_RESTART_DELAY_MS = 1000;
+const LIVE_STATE_BROADCAST_INTERVAL_MS = 250; // snapshots are only sent when a port changed
+const PG_POOL_SIZES_HTTP_WORKER = { // per worker; control/ingest traffic is forwarded to the ingest process
+    control: 1,
+    ingest: 1,
+    reporting: 1,
+    general: 3,
+    replica: 2
+};
+
+// --- Read replica ---
+// With DATABASE_REPLICA_URL set, read-only report and public queries tagged with readPool() go to the
+// replica while it is reachable and caught up; everything else (and every write) stays on the primary.
+const REPLICA_LAG_CHECK_INTERVAL_MS = 5000;
+const REPLICA_MAX_LAG_SECONDS = 10; // further behind than this and all reads go to the primary
+const READ_YOUR_WRITES_WINDOW_MS = (REPLICA_MAX_LAG_SECONDS + 5) * 1000; // a user's reads stay on the primary this long after they write
+
+// --- Ingestion worker ---
+const INGEST_WORKER_ENABLED = process.env.INGEST_WORKER !== 'off'; // 'off' decodes and writes telemetry on the main thread
+const INGEST_WORKER_RESTART_DELAY_MS = 5000;
+// While the worker runs it writes the port_events batches, so it takes most of the ingest connections;
+// ingestPool keeps the rest for write-behind flushes and backfill. The two never exceed PG_POOL_SIZES.ingest.
+const INGEST_WORKER_POOL_SIZE = Math.max(1, PG_POOL_SIZES.ingest - 1);
+const INGEST_MAIN_POOL_SIZE_WITH_WORKER = Math.max(1, PG_POOL_SIZES.ingest - INGEST_WORKER_POOL_SIZE);
+const INGEST_COUNTERS = { // slots in the SharedArrayBuffer the worker updates
+    DECODED: 0,
+    DECODE_ERRORS: 1,
+    EVENTS_WRITTEN: 2,
+    BATCH_FAILURES: 3,
+    BATCHES_IN_FLIGHT: 4
+};
+
+// Request priorities for admission control (first match wins; anything else is NORMAL)
+const REQUEST_PRIORITY_RULES = [
+    { priority: REQUEST_PRIORITY.CRITICAL, method: 'POST', pattern: /^\/api\/devices\/[^/]+\/\d+\/control$/ },
+    { priority: REQUEST_PRIORITY.CRITICAL, method: 'POST', pattern: /^\/api\/devices\/[^/]+\/backfill$/ },
+    { priority: REQUEST_PRIORITY.CRITICAL, method: 'GET', pattern: /^\/api\/health$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/admin\// },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/devices\/status$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/stations\/[^/]+\/(sync|consumption)$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/devices\/.+\/consumption$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/user\/notifications\/unread-count$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'GET', pattern: /^\/api\/user\/usage(\/debug)?$/ },
+    { priority: REQUEST_PRIORITY.LOW, method: 'POST', pattern: /^\/api\/user\/devices$/ }
+];
+
+// Routes that read or change state only the ingest process holds; cluster HTTP workers forward them there
+const LIVE_STATE_OWNER_ROUTES = [
+    { method: 'POST', pattern: /^\/api\/devices\/[^/]+\/\d+\/control$/ },
+    { method: 'POST', pattern: /^\/api\/devices\/[^/]+\/backfill$/ },
+    { method: 'POST', pattern: /^\/api\/esp32\/command$/ },
+    { method: 'DELETE', pattern: /^\/api\/admin\/stations\/[^/]+$/ },
+    { method: 'POST', pattern: /^\/api\/admin\/port-events\/replay$/ },
+    { method: '*', pattern: /^\/api\/admin\/telemetry\// },
+    { method: 'GET', pattern: /^\/api\/admin\/power-budget$/ },
+    { method: 'GET', pattern: /^\/api\/admin\/stations\/[^/]+\/telemetry$/ },
+    { method: '*', pattern: /^\/api\/user\/devices$/ } // phone telemetry cache
+];
+
 // Middleware
 const allowedOrigins = [
     'http://localhost:3000', // Your local frontend development server
@@ -147,25 +552,525 @@ app.use(cors({
     },
     credentials: true // Important if you're sending cookies or authorization headers
 }));
+app.use(admissionControl); // Sheds low-priority requests under load (see "Admission control")
+app.use(liveStateRouter); // Cluster workers forward live-state routes before the body is parsed
 app.use(express.json()); // Parses incoming JSON requests
 
-// --- Supabase PostgreSQL connection Pool ---
-const pool = new Pool({
-    connectionString: process.env.DATABASE_URL,
-    ssl: {
-        // rejectUnauthorized: true for production for security if providing CA
-        rejectUnauthorized: process.env.NODE_ENV === 'production' && !!process.env.DB_CA_CERT,
-        ca: process.env.DB_CA_CERT // Provide the CA certificate content
+// --- Supabase PostgreSQL connection Pools ---
+// One pool per traffic class, so a heavy report or an ingest burst cannot take the connections
+// that start/stop charging needs. `pool` serves the regular API handlers.
+function pgPoolOptions(max, connectionString = process.env.DATABASE_URL) {
+    return {
+        connectionString,
+        ssl: {
+            // rejectUnauthorized: true for production for security if providing CA
+            rejectUnauthorized: process.env.NODE_ENV === 'production' && !!process.env.DB_CA_CERT,
+            ca: process.env.DB_CA_CERT // Provide the CA certificate content
+        },
+        max,
+        connectionTimeoutMillis: 5000, // waiting longer than this for a connection counts as a failure (circuit breaker)
+        query_timeout: 15000
+    };
+}
+function createPgPool(max) {
+    return new Pool(pgPoolOptions(max));
+}
+const poolSizes = PROCESS_ROLE === PROCESS_ROLES.HTTP ? PG_POOL_SIZES_HTTP_WORKER : PG_POOL_SIZES;
+const pool = createPgPool(poolSizes.general);
+const controlPool = createPgPool(poolSizes.control); // sessions, quota checks, command outbox
+const ingestPool = createPgPool(poolSizes.ingest); // port_events batches, write-behind flushes, backfill
+const reportingPool = createPgPool(poolSizes.reporting); // admin analytics and history reads
+const replicaPool = process.env.DATABASE_REPLICA_URL
+    ? new Pool(pgPoolOptions(poolSizes.replica, process.env.DATABASE_REPLICA_URL))
+    : null;
+const allPools = [pool, controlPool, ingestPool, reportingPool];
+
+// --- Circuit breakers ---
+// A breaker opens after `failureThreshold` consecutive infrastructure failures and then fails fast
+// with err.code === 'CIRCUIT_OPEN' until `resetTimeoutMs` has passed and a trial call succeeds.
+function createCircuitBreaker(name, { failureThreshold, resetTimeoutMs }, isFailure = () => true) {
+    const breaker = {
+        name,
+        state: CIRCUIT_STATES.CLOSED,
+        consecutiveFailures: 0,
+        openedAt: null,
+        trialInFlight: false,
+        rejected: 0,
+        opened: 0,
+
+        canPass() {
+            if (breaker.state === CIRCUIT_STATES.OPEN && Date.now() - breaker.openedAt >= resetTimeoutMs) {
+                breaker.state = CIRCUIT_STATES.HALF_OPEN;
+            }
+            if (breaker.state === CIRCUIT_STATES.CLOSED) return true;
+            if (breaker.state === CIRCUIT_STATES.HALF_OPEN && !breaker.trialInFlight) {
+                breaker.trialInFlight = true;
+                return true;
+            }
+            return false;
+        },
+
+        // True while exec() would reject. Unlike canPass(), this does not claim the half-open trial.
+        isRejecting() {
+            if (breaker.state === CIRCUIT_STATES.OPEN) return Date.now() - breaker.openedAt < resetTimeoutMs;
+            return breaker.state === CIRCUIT_STATES.HALF_OPEN && breaker.trialInFlight;
+        },
+
+        onSuccess() {
+            if (breaker.state !== CIRCUIT_STATES.CLOSED) {
+                console.log(`Circuit ${name}: closed`);
+            }
+            breaker.state = CIRCUIT_STATES.CLOSED;
+            breaker.consecutiveFailures = 0;
+            breaker.trialInFlight = false;
+        },
+
+        onFailure(error) {
+            breaker.trialInFlight = false;
+            if (!isFailure(error)) {
+                breaker.consecutiveFailures = 0; // The dependency answered; the request itself was bad
+                if (breaker.state === CIRCUIT_STATES.HALF_OPEN) breaker.state = CIRCUIT_STATES.CLOSED;
+                return;
+            }
+            breaker.consecutiveFailures++;
+            if (breaker.state === CIRCUIT_STATES.HALF_OPEN || breaker.consecutiveFailures >= failureThreshold) {
+                if (breaker.state !== CIRCUIT_STATES.OPEN) {
+                    breaker.opened++;
+                    console.error(`Circuit ${name}: open after ${breaker.consecutiveFailures} failures (${error.message})`);
+                }
+                breaker.state = CIRCUIT_STATES.OPEN;
+                breaker.openedAt = Date.now();
+            }
+        },
+
+        async exec(operation) {
+            if (!breaker.canPass()) {
+                breaker.rejected++;
+                const error = new Error(`${name} circuit is open`);
+                error.code = 'CIRCUIT_OPEN';
+                throw error;
+            }
+            try {
+                const result = await operation();
+                breaker.onSuccess();
+                return result;
+            } catch (error) {
+                breaker.onFailure(error);
+                throw error;
+            }
+        },
+
+        snapshot() {
+            return { state: breaker.state, consecutive_failures: breaker.consecutiveFailures, opened: breaker.opened, rejected: breaker.rejected };
+        }
+    };
+    return breaker;
+}
+
+// SQL errors (constraint violations, bad input) mean Postgres is healthy; only connection-level
+// problems, resource exhaustion and timeouts count against the breaker.
+function isDatabaseInfrastructureError(error) {
+    const code = error?.code;
+    if (!code) return true; // socket errors, pool/connection/query timeouts
+    return /^(08|53|57P|58)/.test(code) || /^E[A-Z]+$/.test(code);
+}
+
+const dbCircuit = createCircuitBreaker('postgres', DB_CIRCUIT_OPTIONS, isDatabaseInfrastructureError);
+const mqttCircuit = createCircuitBreaker('mqtt-publish', MQTT_CIRCUIT_OPTIONS);
+
+// Route every query / connect through the breaker so callers fail fast while Postgres is down
+function guardPoolWithCircuit(pgPool, circuit = dbCircuit) {
+    const rawQuery = pgPool.query.bind(pgPool);
+    const rawConnect = pgPool.connect.bind(pgPool);
+    pgPool.query = (...args) => {
+        const callback = typeof args[args.length - 1] === 'function' ? args.pop() : null;
+        const promise = circuit.exec(() => rawQuery(...args));
+        if (!callback) return promise;
+        promise.then(result => callback(null, result), error => callback(error));
+        return undefined;
+    };
+    // pg-pool's own query() checks out its client with connect(callback), so keep that form working
+    pgPool.connect = (callback) => {
+        const promise = circuit.exec(() => rawConnect());
+        if (!callback) return promise;
+        promise.then(client => callback(null, client, client.release), error => callback(error));
+        return undefined;
+    };
+}
+allPools.forEach(pgPool => guardPoolWithCircuit(pgPool));
+
+function isCircuitOpenError(error) {
+    return error?.code === 'CIRCUIT_OPEN';
+}
+
+// --- Read replica routing ---
+// The replica has its own breaker, so a replica outage only moves reads back to the primary.
+const replicaCircuit = createCircuitBreaker('postgres-replica', DB_CIRCUIT_OPTIONS, isDatabaseInfrastructureError);
+if (replicaPool) guardPoolWithCircuit(replicaPool, replicaCircuit);
+const replicaState = { lagSeconds: null, healthy: false, checkedAt: null, routed: 0, fallbacks: 0 };
+const recentUserWrites = new Map(); // user_id -> ms timestamp of their last state-changing request
+
+// Lag is zero while the replica is streaming and has replayed everything it received; otherwise it is
+// the age of the last replayed commit. A replica whose WAL receiver is down (or not visible to this role)
+// has replayed all it received while falling behind, so only the replay age bounds its lag there.
+async function checkReplicaLag() {
+    if (!replicaPool) return;
+    try {
+        const { rows } = await replicaPool.query(
+            `SELECT CASE
+                WHEN NOT pg_is_in_recovery() THEN 0
+                WHEN (SELECT status FROM pg_stat_wal_receiver LIMIT 1) IS DISTINCT FROM 'streaming'
+                    THEN EXTRACT(EPOCH FROM (now() - pg_last_xact_replay_timestamp()))
+                WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0
+                ELSE COALESCE(EXTRACT(EPOCH FROM (now() - pg_last_xact_replay_timestamp())), 0)
+             END AS lag_seconds`
+        );
+        const lag = rows[0].lag_seconds;
+        replicaState.lagSeconds = lag === null ? null : Number(lag); // null: not streaming and nothing replayed yet
+        replicaState.healthy = replicaState.lagSeconds !== null && replicaState.lagSeconds <= REPLICA_MAX_LAG_SECONDS;
+    } catch (error) {
+        replicaState.healthy = false;
+        console.error('Replica: Lag check failed:', error.message);
+    }
+    replicaState.checkedAt = new Date();
+
+    const cutoff = Date.now() - READ_YOUR_WRITES_WINDOW_MS;
+    for (const [userId, writtenAt] of recentUserWrites) {
+        if (writtenAt < cutoff) recentUserWrites.delete(userId);
     }
-});
+}
+
+// Call after a user's request changes state they will read back (e.g. a control command)
+function noteUserWrite(userId) {
+    if (!userId) return;
+    const writtenAt = Date.now();
+    recentUserWrites.set(userId, writtenAt);
+    if (PROCESS_ROLE === PROCESS_ROLES.INGEST) {
+        clusterWorkerSlots.forEach(worker => worker && worker.isConnected() && worker.send({ type: 'user-write', userId, writtenAt }));
+    }
+}
+
+// Query router for read-only statements: returns the replica when it is healthy, caught up and
+// the user has no recent write to read back, otherwise `primary`. Replica failures retry on `primary`.
+function readPool(primary, { userId = null } = {}) {
+    if (!replicaPool || !replicaState.healthy || replicaCircuit.state === CIRCUIT_STATES.OPEN) return primary;
+    const writtenAt = userId ? recentUserWrites.get(userId) : undefined;
+    if (writtenAt && Date.now() - writtenAt < READ_YOUR_WRITES_WINDOW_MS) return primary;
+    return {
+        query: async (...args) => {
+            replicaState.routed++;
+            try {
+                return await replicaPool.query(...args);
+            } catch (error) {
+                if (!isCircuitOpenError(error) && !isDatabaseInfrastructureError(error)) throw error;
+                replicaState.fallbacks++;
+                return primary.query(...args);
+            }
+        }
+    };
+}
+
+function getReplicaMetrics() {
+    return {
+        configured: !!replicaPool,
+        healthy: replicaState.healthy,
+        lag_seconds: replicaState.lagSeconds,
+        checked_at: replicaState.checkedAt,
+        routed_queries: replicaState.routed,
+        fallbacks: replicaState.fallbacks,
+        circuit: replicaCircuit.snapshot()
+    };
+}
+
+// --- Admission control ---
+// Sheds LOW (and, under heavier lag, NORMAL) requests with 503 based on event-loop delay and
+// pg pool queueing, so control commands and ingestion keep their latency under load.
+const eventLoopDelay = monitorEventLoopDelay({ resolution: 20 });
+eventLoopDelay.enable();
+const admissionState = { lagMs: 0, shed: { low: 0, normal: 0 } };
+
+function sampleEventLoopLag() {
+    admissionState.lagMs = eventLoopDelay.percentile(99) / 1e6;
+    eventLoopDelay.reset();
+}
+
+function requestPriority(req) {
+    const urlPath = req.path || req.url;
+    const rule = REQUEST_PRIORITY_RULES.find(candidate => candidate.method === req.method && candidate.pattern.test(urlPath));
+    return rule ? rule.priority : REQUEST_PRIORITY.NORMAL;
+}
+
+function admissionControl(req, res, next) {
+    const priority = requestPriority(req);
+    if (priority === REQUEST_PRIORITY.CRITICAL || req.method === 'OPTIONS') {
+        return next();
+    }
+
+    const lagMs = admissionState.lagMs;
+    const shed = priority === REQUEST_PRIORITY.LOW
+        ? lagMs > ADMISSION_SHED_LOW_LAG_MS
+            || pool.waitingCount > ADMISSION_SHED_LOW_POOL_WAITING
+            || reportingPool.waitingCount > ADMISSION_SHED_LOW_POOL_WAITING
+            || dbCircuit.state === CIRCUIT_STATES.OPEN
+        : lagMs > ADMISSION_SHED_NORMAL_LAG_MS;
+    if (!shed) {
+        return next();
+    }
+
+    admissionState.shed[priority]++;
+    res.set('Retry-After', String(ADMISSION_RETRY_AFTER_SECONDS));
+    return res.status(503).json({ error: 'Server is busy. Please try again shortly.' });
+}
+
+// --- Prepared statement registry ---
+// Hot-path statements are sent under a stable name: node-postgres prepares each one once per
+// connection and Postgres reuses its parse/plan instead of redoing them on every call. Every
+// value is a bound parameter. PG_PREPARED_STATEMENTS=off sends them unnamed (for poolers in
+// transaction mode that cannot keep per-connection statements); that is the default when
+// DATABASE_URL points at one (PREPARED_STATEMENTS_ENABLED, portEvents.js).
+const SQL_STATEMENTS = {
+    insertSystemLog: 'INSERT INTO system_logs (log_type, source, message, user_id) VALUES ($1, $2, $3, $4)',
+    countUserActiveSessions: 'SELECT COUNT(*) as active_count FROM charging_session WHERE user_id = $1 AND session_status = $2',
+    getPortByDevice: `
+        SELECT port_id, station_id, device_mqtt_id, port_number_in_device, is_premium, current_status
+        FROM charging_port
+        WHERE device_mqtt_id = $1 AND port_number_in_device = $2`,
+    flushPortStatus: `
+        UPDATE charging_port AS cp
+        SET current_status = u.current_status::port_status,
+            is_occupied = u.is_occupied,
+            last_status_update = u.changed_at
+        FROM UNNEST($1::uuid[], $2::text[], $3::boolean[], $4::timestamptz[])
+           AS u(port_id, current_status, is_occupied, changed_at)
+        WHERE cp.port_id = u.port_id`,
+    enqueueControlCommand: `
+        INSERT INTO command_outbox (device_id, port_number, command, session_id, source)
+        VALUES ($1, $2, $3, $4, $5)
+        RETURNING command_id`,
+    // Due commands, plus backed-off ones that a newer due command for the same port will supersede.
+    // Other backed-off rows stay out, so they cannot fill the batch and starve due commands.
+    selectPendingCommands: `
+        SELECT co.command_id, co.device_id, co.port_number, co.command, co.session_id, co.attempts, co.next_attempt_at <= NOW() AS is_due
+        FROM command_outbox co
+        WHERE co.status = $1
+          AND (co.next_attempt_at <= NOW() OR EXISTS (
+                SELECT 1 FROM command_outbox newer
+                WHERE newer.status = $1
+                  AND newer.device_id = co.device_id AND newer.port_number = co.port_number
+                  AND newer.command_id > co.command_id
+                  AND newer.next_attempt_at <= NOW()))
+        ORDER BY co.command_id
+        LIMIT $2`,
+    supersedeCommands: 'UPDATE command_outbox SET status = $1 WHERE command_id = ANY($2::bigint[]) AND status = $3',
+    markCommandsSent: `
+        UPDATE command_outbox
+        SET status = $1, sent_at = NOW(), attempts = attempts + 1, last_error = NULL
+        WHERE command_id = ANY($2::bigint[])`,
+    markCommandsFailed: `
+        UPDATE command_outbox AS co
+        SET attempts = co.attempts + 1,
+            last_error = f.last_error,
+            status = CASE WHEN co.attempts + 1 >= $2 THEN $3 ELSE co.status END,
+            next_attempt_at = NOW() + make_interval(secs => LEAST($4::float8, $5::float8 * power(2, co.attempts)))
+        FROM UNNEST($1::bigint[], $6::text[]) AS f(command_id, last_error)
+        WHERE co.command_id = f.command_id`,
+    getSessionStation: 'SELECT station_id FROM charging_session WHERE session_id = $1',
+    insertNotification: `
+        INSERT INTO notification (user_id, notification_type, notification_context, notification_content)
+        VALUES ($1, $2::notification_type, $3, $4)`,
+    getActiveSessionForPort: `
+        SELECT session_id, user_id, station_id
+        FROM charging_session
+        WHERE port_id = $1 AND session_status = $2
+        ORDER BY start_time DESC
+        LIMIT 1`,
+    upsertUserDevices: `
+        INSERT INTO user_devices
+           (user_id, device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging, last_updated, updated_at)
+        SELECT u.user_id, u.device_type, u.device_name, u.device_model, u.battery_capacity_mah,
+               u.current_battery_level, u.is_charging, u.last_updated, NOW()
+        FROM UNNEST($1::uuid[], $2::text[], $3::text[], $4::text[], $5::numeric[], $6::numeric[], $7::boolean[], $8::timestamptz[])
+           AS u(user_id, device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging, last_updated)
+        ON CONFLICT (user_id, device_type, device_name) DO UPDATE SET
+           device_model = EXCLUDED.device_model,
+           battery_capacity_mah = EXCLUDED.battery_capacity_mah,
+           current_battery_level = EXCLUDED.current_battery_level,
+           is_charging = EXCLUDED.is_charging,
+           last_updated = GREATEST(user_devices.last_updated, EXCLUDED.last_updated),
+           updated_at = NOW()
+        RETURNING device_id, user_id, device_type, device_name`,
+    portEventExists: 'SELECT 1 FROM port_events WHERE port_id = $1 AND event_type = $2 AND occurred_at = $3 LIMIT 1',
+    setSessionPowerPaused: 'UPDATE charging_session SET power_paused_at = $3 WHERE session_id = $1 AND session_status = $2',
+    getActiveSessionEnergy: 'SELECT energy_consumed_kwh, energy_consumed_mah, accrued_cost FROM charging_session WHERE session_id = $1 AND session_status = $2',
+    getUserQuota: `
+        SELECT
+            us.current_daily_mah_consumed,
+            us.borrowed_mah_today,
+            us.last_quota_reset,
+            us.plan_id
+        FROM user_subscription us
+        WHERE us.user_id = $1 AND us.is_active = true
+        ORDER BY us.created_at DESC LIMIT 1`,
+    getSessionEnergy: 'SELECT energy_consumed_kwh, energy_consumed_mah, accrued_cost FROM charging_session WHERE session_id = $1',
+    countUnreadNotifications: `
+        SELECT COUNT(*) as unread_count
+        FROM notification
+        WHERE user_id = $1 AND is_read = false`,
+    getUserActiveSessions: `
+        SELECT
+            cs.session_id,
+            cs.start_time,
+            cs.total_mah_consumed,
+            cs.energy_consumed_kwh,
+            cs.accrued_cost,
+            cp.port_number_in_device,
+            cp.device_mqtt_id,
+            s.station_name,
+            s.station_id
+        FROM charging_session cs
+        JOIN charging_port cp ON cs.port_id = cp.port_id
+        JOIN charging_station s ON cs.station_id = s.station_id
+        WHERE cs.user_id = $1 AND cs.session_status = $2
+        ORDER BY cs.start_time DESC`,
+    getUserIsAdmin: 'SELECT is_admin FROM users WHERE user_id = $1',
+    listAdminUserIds: 'SELECT user_id FROM users WHERE is_admin = true',
+    // Recomputes the session counts, minutes and cost of the user-day a session started on (energy is added live by the daily_energy projection).
+    // Days are calendar days in STATION_TIME_ZONE ($3), like the projection's.
+    refreshDailySessionTotals: `
+        WITH day AS (
+            SELECT user_id, (start_time AT TIME ZONE $3)::date AS usage_date FROM charging_session WHERE session_id = $1 AND user_id IS NOT NULL
+        )
+        INSERT INTO daily_energy_usage AS d (user_id, usage_date, completed_sessions, charging_minutes, total_cost, subscription_reference)
+        SELECT day.user_id, day.usage_date,
+               COUNT(cs.session_id),
+               COALESCE(SUM(EXTRACT(EPOCH FROM (cs.end_time - cs.start_time)) / 60), 0),
+               COALESCE(SUM(cs.cost), 0),
+               (SELECT us.user_subscription_id FROM user_subscription us WHERE us.user_id = day.user_id AND us.is_active = true LIMIT 1)
+        FROM day
+        LEFT JOIN charging_session cs
+               ON cs.user_id = day.user_id
+              AND cs.start_time >= day.usage_date::timestamp AT TIME ZONE $3
+              AND cs.start_time < (day.usage_date + 1)::timestamp AT TIME ZONE $3
+              AND cs.session_status = $2
+        GROUP BY day.user_id, day.usage_date
+        ON CONFLICT (user_id, usage_date) DO UPDATE SET
+           completed_sessions = EXCLUDED.completed_sessions,
+           charging_minutes = EXCLUDED.charging_minutes,
+           total_cost = EXCLUDED.total_cost,
+           updated_at = NOW()`,
+    // This month's rollup plus the user's open sessions (which are not in the rollup's counts yet); the month is STATION_TIME_ZONE's ($3)
+    getUserMonthlyUsage: `
+        SELECT
+            COALESCE(SUM(d.completed_sessions), 0) + a.active_sessions AS total_sessions,
+            COALESCE(SUM(d.charging_minutes), 0) + a.active_minutes AS total_duration_minutes,
+            COALESCE(SUM(d.total_energy_kwh), 0) AS total_energy_kwh,
+            COALESCE(SUM(d.total_energy_used_mah), 0) AS total_energy_mah,
+            COALESCE(SUM(d.total_cost), 0) AS total_cost
+        FROM (
+            SELECT COUNT(*) AS active_sessions,
+                   COALESCE(SUM(EXTRACT(EPOCH FROM (NOW() - start_time)) / 60), 0) AS active_minutes
+            FROM charging_session
+            WHERE user_id = $1 AND session_status = $2 AND start_time >= date_trunc('month', NOW() AT TIME ZONE $3) AT TIME ZONE $3
+        ) a
+        LEFT JOIN daily_energy_usage d
+               ON d.user_id = $1 AND d.usage_date >= date_trunc('month', NOW() AT TIME ZONE $3)::date
+        GROUP BY a.active_sessions, a.active_minutes`,
+    listUserDailyUsage: `
+        SELECT to_char(day, 'YYYY-MM-DD') AS usage_date,
+               COALESCE(d.total_energy_used_mah, 0) AS energy_mah,
+               COALESCE(d.total_energy_kwh, 0) AS energy_kwh,
+               COALESCE(d.completed_sessions, 0) AS sessions,
+               COALESCE(d.charging_minutes, 0) AS duration_minutes,
+               COALESCE(d.total_cost, 0) AS cost
+        FROM generate_series((NOW() AT TIME ZONE $3)::date - ($2::int - 1), (NOW() AT TIME ZONE $3)::date, INTERVAL '1 day') AS day
+        LEFT JOIN daily_energy_usage d ON d.user_id = $1 AND d.usage_date = day::date
+        ORDER BY day`,
+    addPortOccupancy: `
+        INSERT INTO port_occupancy_hourly AS o (port_id, station_id, hour_start, occupied_seconds, idle_seconds, offline_seconds)
+        SELECT * FROM UNNEST($1::uuid[], $2::uuid[], $3::timestamptz[], $4::float8[], $5::float8[], $6::float8[])
+        ON CONFLICT (port_id, hour_start) DO UPDATE SET
+           occupied_seconds = o.occupied_seconds + EXCLUDED.occupied_seconds,
+           idle_seconds = o.idle_seconds + EXCLUDED.idle_seconds,
+           offline_seconds = o.offline_seconds + EXCLUDED.offline_seconds`,
+    listPortOccupancyByHour: `
+        SELECT o.port_id, o.station_id, s.station_name, cp.port_number_in_device AS port_number, cp.is_premium,
+               EXTRACT(HOUR FROM o.hour_start AT TIME ZONE $3)::int AS hour_of_day,
+               SUM(o.occupied_seconds) AS occupied_seconds,
+               SUM(o.idle_seconds) AS idle_seconds,
+               SUM(o.offline_seconds) AS offline_seconds
+        FROM port_occupancy_hourly o
+        JOIN charging_port cp ON cp.port_id = o.port_id
+        JOIN charging_station s ON s.station_id = o.station_id
+        WHERE o.hour_start >= NOW() - $1::interval
+          AND ($2::uuid IS NULL OR o.station_id = $2)
+        GROUP BY o.port_id, o.station_id, s.station_name, cp.port_number_in_device, cp.is_premium, hour_of_day
+        ORDER BY s.station_name, cp.port_number_in_device, hour_of_day`,
+    insertStationTelemetry: `
+        INSERT INTO station_telemetry
+           (station_id, bucket_start, samples, battery_soc_avg, battery_soc_min, battery_soc_max,
+            solar_watts_avg, solar_watts_max, temperature_c_avg, temperature_c_max)
+        SELECT * FROM UNNEST($1::uuid[], $2::timestamptz[], $3::int[], $4::real[], $5::real[], $6::real[],
+                             $7::real[], $8::real[], $9::real[], $10::real[])
+        ON CONFLICT (station_id, bucket_start) DO NOTHING`,
+    updateStationBatteryLevels: `
+        UPDATE charging_station AS s
+        SET current_battery_level = u.level, updated_at = NOW()
+        FROM UNNEST($1::uuid[], $2::numeric[]) AS u(station_id, level)
+        WHERE s.station_id = u.station_id AND s.current_battery_level IS DISTINCT FROM u.level`,
+    listStationTelemetry: `
+        SELECT bucket_start, samples, battery_soc_avg, battery_soc_min, battery_soc_max,
+               solar_watts_avg, solar_watts_max, temperature_c_avg, temperature_c_max
+        FROM station_telemetry
+        WHERE station_id = $1 AND bucket_start >= NOW() - $2::interval
+        ORDER BY bucket_start`,
+    listAdminSessions: `
+        SELECT
+            cs.session_id as id,
+            CONCAT(u.fname, ' ', u.lname) as user_name,
+            s.station_name,
+            cp.port_number_in_device as port,
+            cs.start_time,
+            cs.end_time,
+            EXTRACT(EPOCH FROM (COALESCE(cs.end_time, NOW()) - cs.start_time))/60 as duration,
+            cs.energy_consumed_kwh as energy,
+            cs.energy_consumed_mah as energy_mah,
+            cs.cost,
+            cs.session_status as status
+        FROM charging_session cs
+        JOIN users u ON cs.user_id = u.user_id
+        JOIN charging_station s ON cs.station_id = s.station_id
+        JOIN charging_port cp ON cs.port_id = cp.port_id
+        WHERE cs.start_time > CURRENT_DATE - $1::interval
+          AND ($2::uuid IS NULL OR cs.station_id = $2::uuid)
+          AND ($3::text IS NULL OR cs.session_status::text = $3)
+        ORDER BY cs.start_time DESC`,
+    listAdminLogs: `
+        SELECT
+            log_id,
+            timestamp,
+            log_type,
+            source,
+            message,
+            user_id,
+            (SELECT email FROM users WHERE user_id = system_logs.user_id) as user_email
+        FROM system_logs
+        WHERE timestamp > NOW() - $1::interval
+          AND ($2::text IS NULL OR log_type::text = $2)
+          AND ($3::text IS NULL OR source::text = $3)
+        ORDER BY timestamp DESC
+        LIMIT 500 -- Limit logs to prevent massive responses`
+};
+
+function preparedStatement(name, values = []) {
+    const text = SQL_STATEMENTS[name];
+    if (text === undefined) throw new Error(`Unknown SQL statement: ${name}`);
+    return PREPARED_STATEMENTS_ENABLED ? { name, text, values } : { text, values };
+}
 
 // Helper for system logging
 async function logSystemEvent(logType, source, message, userId = null) {
     try {
-        await pool.query(
-            'INSERT INTO system_logs (log_type, source, message, user_id) VALUES ($1, $2, $3, $4)',
-            [logType, source, message, userId]
-        );
+        await pool.query(preparedStatement('insertSystemLog', [logType, source, message, userId]));
     } catch (logErr) {
         console.error('Failed to write to system_logs table:', logErr);
     }
@@ -189,44 +1094,1851 @@ const MQTT_USERNAME = process.env.EMQX_USERNAME;
 const MQTT_PASSWORD = process.env.EMQX_PASSWORD;
 const EMQX_CA_CERT = process.env.EMQX_CA_CERT; // CA certificate content from .env
 
-// The unique ID for the single ESP32 that manages the entire station (multiple ports)
-const ESP32_STATION_CLIENT_ID = "ESP32_CHARGER_STATION_001"; // <--- IMPORTANT: Must match ESP32 firmware's mqttClientId
+// The unique ID for the single ESP32 that manages the entire station (multiple ports)
+const ESP32_STATION_CLIENT_ID = "ESP32_CHARGER_STATION_001"; // <--- IMPORTANT: Must match ESP32 firmware's mqttClientId
+
+// MQTT Client Options
+const mqttOptions = {
+    clientId: `backend_server_${Math.random().toString(16).substring(2, 10)}`, // Unique ID for backend
+    username: MQTT_USERNAME,
+    password: MQTT_PASSWORD,
+    clean: true, // Clean session (no persistent session for backend)
+    rejectUnauthorized: process.env.NODE_ENV === 'production' && !!EMQX_CA_CERT, // Ensure server cert is valid in production
+    ca: EMQX_CA_CERT, // Provide the CA certificate
+    keepalive: 60,
+    reconnectPeriod: 5000,
+    connectTimeout: 30000,
+};
+
+// Stand-in for cluster HTTP workers: only the ingest process talks to the broker
+function createDetachedMqttClient() {
+    const client = new EventEmitter();
+    client.connected = false;
+    client.subscribe = () => {};
+    client.publish = (topic, message, options, callback) => {
+        if (typeof callback === 'function') callback(new Error('MQTT is owned by the ingest process'));
+    };
+    client.end = (...args) => {
+        const callback = args.find(arg => typeof arg === 'function');
+        if (callback) callback();
+    };
+    return client;
+}
+
+// Create MQTT client instance
+const mqttClient = OWNS_LIVE_STATE
+    ? mqtt.connect(`mqtts://${MQTT_BROKER_HOST}:${MQTT_PORT}`, mqttOptions)
+    : createDetachedMqttClient();
+
+// --- Per-port state machine helpers ---
+function portStateKey(deviceId, portNumberInDevice) {
+    return `${deviceId}_${portNumberInDevice}`;
+}
+
+function getPortEntry(deviceId, portNumberInDevice) {
+    return portStateMachines.get(portStateKey(deviceId, portNumberInDevice)) || null;
+}
+
+function getPortEntryById(portId) {
+    return portStateMachinesById.get(portId) || null;
+}
+
+// Creates (or refreshes the static fields of) the in-memory entry for a charging_port row
+function registerPortEntry(row) {
+    const key = portStateKey(row.device_mqtt_id, row.port_number_in_device);
+    let entry = portStateMachines.get(key);
+
+    if (!entry) {
+        entry = {
+            key,
+            deviceId: row.device_mqtt_id,
+            portNumber: row.port_number_in_device,
+            portId: row.port_id,
+            stationId: row.station_id,
+            isPremium: !!row.is_premium,
+            state: PORT_FSM_STATES.AVAILABLE,
+            previousState: null,
+            stateSince: new Date(),
+            sessionId: null,
+            userId: null,
+            lastActivityAt: null,   // last consumption / session start, drives the inactivity timeout
+            lastStatusAt: null,     // last charger/status message from the device
+            inactivityTimerId: null,
+            fullChargeDisconnectTimerId: null, // grace timer before a detected full charge is switched off
+            fullCharge: null,       // { fullSentAt, fallbackUsed, disconnectSent } for the current session
+            usageSequence: createSequenceWindow(), // dedupe window over the usage stream's `seq` numbers
+            anomaly: createAnomalyDetector(),       // streaming sensor-health detector over usage samples
+            taper: createTaperDetector(),           // full-charge detector over the current session's readings
+            budget: createPowerBudgetState(),       // station power budget slot (paused/running) and latest draw
+            persistedStatus: row.current_status || null,
+            occupancyAccruedAt: new Date() // time in the current state is counted from here
+        };
+        portStateMachines.set(key, entry);
+        liveStateVersion++;
+        bumpPortResources(entry);
+    } else if (entry.portId !== row.port_id) {
+        portStateMachinesById.delete(entry.portId);
+        entry.portId = row.port_id;
+    }
+
+    entry.stationId = row.station_id;
+    entry.isPremium = !!row.is_premium;
+    portStateMachinesById.set(entry.portId, entry);
+    return entry;
+}
+
+// Bumped whenever a port's session or state changes; cluster workers get a new snapshot when it moves
+let liveStateVersion = 0;
+
+// Resolves once loadPortStateMachines has run, so early MQTT/API events see restored sessions
+let portStateReady = Promise.resolve();
+
+// Memory lookup with a single DB fallback for ports created after boot
+async function ensurePortEntry(deviceId, portNumberInDevice) {
+    await portStateReady;
+    const existing = getPortEntry(deviceId, portNumberInDevice);
+    if (existing) return existing;
+
+    const { rows } = await controlPool.query(preparedStatement('getPortByDevice', [deviceId, portNumberInDevice]));
+    return rows[0] ? registerPortEntry(rows[0]) : null;
+}
+
+function forgetStationPorts(stationId) {
+    for (const entry of portStateMachines.values()) {
+        if (entry.stationId === stationId) {
+            clearPortInactivityTimer(entry);
+            clearFullChargeDisconnectTimer(entry);
+            pendingPortStatusWrites.delete(entry);
+            portStateMachines.delete(entry.key);
+            portStateMachinesById.delete(entry.portId);
+            liveStateVersion++;
+            bumpPortResources(entry);
+        }
+    }
+}
+
+// charging_port.current_status projection of a port's state
+function portDbStatusForEntry(entry) {
+    switch (entry.state) {
+        case PORT_FSM_STATES.RESERVED:
+            return PORT_STATUS.OCCUPIED;
+        case PORT_FSM_STATES.CHARGING:
+        case PORT_FSM_STATES.FULL_READY:
+        case PORT_FSM_STATES.FINALIZING:
+            return entry.isPremium ? PORT_STATUS.CHARGING_PREMIUM : PORT_STATUS.CHARGING_FREE;
+        case PORT_FSM_STATES.OFFLINE:
+            return PORT_STATUS.OFFLINE;
+        case PORT_FSM_STATES.FAULT:
+            return PORT_STATUS.MAINTENANCE; // port_status enum may not include 'fault'
+        default:
+            return PORT_STATUS.AVAILABLE;
+    }
+}
+
+function portStatusIsOccupied(status) {
+    return status === PORT_STATUS.CHARGING_FREE || status === PORT_STATUS.CHARGING_PREMIUM || status === PORT_STATUS.OCCUPIED;
+}
+
+// Applies an event to a port. Returns false (and leaves the port untouched) for events its state does not accept.
+function transitionPortState(entry, event, details = {}) {
+    const resolver = PORT_FSM_TRANSITIONS[entry.state]?.[event];
+    if (resolver === undefined) {
+        console.warn(`PortFSM: Ignoring event '${event}' for ${entry.key} in state '${entry.state}'`);
+        logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.BACKEND, `Port ${entry.key} ignored event '${event}' in state '${entry.state}'`);
+        return false;
+    }
+
+    const previousUserId = entry.userId;
+    if (event === PORT_FSM_EVENTS.SESSION_STARTED) {
+        if (entry.sessionId !== details.sessionId) {
+            clearFullChargeDisconnectTimer(entry);
+            entry.fullCharge = null;
+            entry.taper = createTaperDetector();
+            entry.budget = createPowerBudgetState(entry.budget);
+        }
+        entry.sessionId = details.sessionId;
+        entry.userId = details.userId;
+    } else if (event === PORT_FSM_EVENTS.SESSION_ENDED) {
+        clearPortInactivityTimer(entry);
+        clearFullChargeDisconnectTimer(entry);
+        entry.sessionId = null;
+        entry.userId = null;
+        entry.fullCharge = null;
+        entry.taper = createTaperDetector();
+        entry.budget = createPowerBudgetState(entry.budget);
+        entry.lastActivityAt = null;
+    }
+
+    const nextState = typeof resolver === 'function' ? resolver(entry) : resolver;
+    if (nextState !== entry.state) {
+        accruePortOccupancy(entry);
+        console.log(`PortFSM: ${entry.key} ${entry.state} -> ${nextState} (${event})`);
+        entry.previousState = entry.state;
+        entry.state = nextState;
+        entry.stateSince = new Date();
+    }
+
+    if (portDbStatusForEntry(entry) !== entry.persistedStatus) {
+        pendingPortStatusWrites.add(entry);
+    }
+    liveStateVersion++;
+    bumpPortResources(entry);
+    if (previousUserId && previousUserId !== entry.userId) bumpResource(`user:${previousUserId}`);
+    return true;
+}
+
+function clearPortInactivityTimer(entry) {
+    if (entry.inactivityTimerId) {
+        clearTimeout(entry.inactivityTimerId);
+        entry.inactivityTimerId = null;
+    }
+}
+
+function clearFullChargeDisconnectTimer(entry) {
+    if (entry.fullChargeDisconnectTimerId) {
+        clearTimeout(entry.fullChargeDisconnectTimerId);
+        entry.fullChargeDisconnectTimerId = null;
+    }
+}
+
+// (Re)arms the inactivity timeout for the port's current session, measured from lastActivityAt
+function resetPortInactivityTimer(entry, lastActivityAt = new Date()) {
+    clearPortInactivityTimer(entry);
+    if (!entry.sessionId) return;
+
+    entry.lastActivityAt = lastActivityAt;
+    const sessionId = entry.sessionId;
+    const delayMs = Math.max(0, INACTIVITY_TIMEOUT_SECONDS * 1000 - (Date.now() - lastActivityAt.getTime()));
+    entry.inactivityTimerId = setTimeout(
+        () => handleInactivityTurnOff(entry.deviceId, entry.portNumber, entry.portId, sessionId),
+        delayMs
+    );
+}
+
+// --- Port occupancy: incremental per-hour rollup ---
+// pendingOccupancy: Maps `${port_id}|${hour start ms}` -> seconds per OCCUPANCY category not yet in Postgres
+const pendingOccupancy = new Map();
+
+function occupancyForState(state) {
+    switch (state) {
+        case PORT_FSM_STATES.AVAILABLE:
+            return OCCUPANCY.IDLE;
+        case PORT_FSM_STATES.OFFLINE:
+        case PORT_FSM_STATES.FAULT:
+            return OCCUPANCY.OFFLINE;
+        default:
+            return OCCUPANCY.OCCUPIED; // reserved, charging, full_ready, finalizing
+    }
+}
+
+// Credits the time since the last accrual to the port's current state, split at hour boundaries
+function accruePortOccupancy(entry, until = new Date()) {
+    const category = occupancyForState(entry.state);
+    const hourMs = 60 * 60 * 1000;
+    let from = entry.occupancyAccruedAt.getTime();
+    const to = until.getTime();
+    while (from < to) {
+        const hourStart = Math.floor(from / hourMs) * hourMs;
+        const sliceEnd = Math.min(to, hourStart + hourMs);
+        const key = `${entry.portId}|${hourStart}`;
+        let bucket = pendingOccupancy.get(key);
+        if (!bucket) {
+            bucket = { port_id: entry.portId, station_id: entry.stationId, hour_start: new Date(hourStart), occupied: 0, idle: 0, offline: 0 };
+            pendingOccupancy.set(key, bucket);
+        }
+        bucket[category] += (sliceEnd - from) / 1000;
+        from = sliceEnd;
+    }
+    if (to > entry.occupancyAccruedAt.getTime()) entry.occupancyAccruedAt = until;
+}
+
+let occupancyFlushInProgress = false;
+
+// Brings every port up to now, then adds the accrued seconds to port_occupancy_hourly in one statement
+async function flushPortOccupancy() {
+    if (occupancyFlushInProgress) return;
+    occupancyFlushInProgress = true;
+
+    const now = new Date();
+    for (const entry of portStateMachines.values()) {
+        accruePortOccupancy(entry, now);
+    }
+    const batch = Array.from(pendingOccupancy.values());
+    pendingOccupancy.clear();
+
+    try {
+        if (batch.length === 0) return;
+        await ingestPool.query(preparedStatement('addPortOccupancy', [
+            batch.map(bucket => bucket.port_id),
+            batch.map(bucket => bucket.station_id),
+            batch.map(bucket => bucket.hour_start),
+            batch.map(bucket => bucket.occupied),
+            batch.map(bucket => bucket.idle),
+            batch.map(bucket => bucket.offline)
+        ]));
+    } catch (error) {
+        // Merge back so the next interval retries them
+        for (const bucket of batch) {
+            const key = `${bucket.port_id}|${bucket.hour_start.getTime()}`;
+            const pending = pendingOccupancy.get(key);
+            if (pending) {
+                pending.occupied += bucket.occupied;
+                pending.idle += bucket.idle;
+                pending.offline += bucket.offline;
+            } else {
+                pendingOccupancy.set(key, bucket);
+            }
+        }
+        console.error('Failed to flush port occupancy:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to flush ${batch.length} port occupancy buckets: ${error.message}`);
+    } finally {
+        occupancyFlushInProgress = false;
+    }
+}
+
+let portStateFlushInProgress = false;
+
+// Write-behind of charging_port status for every port whose state changed since the last flush
+async function flushPortStateWrites() {
+    if (portStateFlushInProgress || pendingPortStatusWrites.size === 0) {
+        return;
+    }
+
+    portStateFlushInProgress = true;
+    const batch = Array.from(pendingPortStatusWrites, entry => ({
+        entry,
+        status: portDbStatusForEntry(entry),
+        changedAt: entry.stateSince
+    }));
+    pendingPortStatusWrites.clear();
+
+    try {
+        await ingestPool.query(preparedStatement('flushPortStatus', [
+            batch.map(item => item.entry.portId),
+            batch.map(item => item.status),
+            batch.map(item => portStatusIsOccupied(item.status)),
+            batch.map(item => item.changedAt)
+        ]));
+        batch.forEach(item => {
+            item.entry.persistedStatus = item.status;
+            if (portDbStatusForEntry(item.entry) !== item.status) {
+                pendingPortStatusWrites.add(item.entry); // Changed again while the write was in flight
+            }
+        });
+    } catch (error) {
+        batch.forEach(item => pendingPortStatusWrites.add(item.entry));
+        console.error('Failed to persist port states:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to persist ${batch.length} port states: ${error.message}`);
+    } finally {
+        portStateFlushInProgress = false;
+    }
+}
+
+// Builds every port's state machine from charging_port, current_device_status and active sessions
+async function loadPortStateMachines() {
+    const { rows } = await ingestPool.query(
+        `SELECT
+            cp.port_id,
+            cp.station_id,
+            cp.device_mqtt_id,
+            cp.port_number_in_device,
+            cp.is_premium,
+            cp.current_status,
+            cds.last_update AS status_last_update,
+            cs.session_id,
+            cs.user_id,
+            cs.last_status_update AS session_last_update,
+            cs.power_paused_at,
+            cs.power_priority
+        FROM charging_port cp
+        LEFT JOIN current_device_status cds ON cp.port_id = cds.port_id
+        LEFT JOIN charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $1
+        WHERE cp.device_mqtt_id IS NOT NULL AND cp.port_number_in_device IS NOT NULL
+        ORDER BY cs.start_time ASC NULLS FIRST`,
+        [SESSION_STATUS.ACTIVE]
+    );
+
+    for (const row of rows) {
+        const entry = registerPortEntry(row);
+        entry.lastStatusAt = row.status_last_update ? new Date(row.status_last_update) : null;
+
+        if (row.current_status === PORT_STATUS.OFFLINE) {
+            entry.state = PORT_FSM_STATES.OFFLINE;
+        } else if (row.current_status === PORT_STATUS.MAINTENANCE || row.current_status === PORT_STATUS.FAULT) {
+            entry.state = PORT_FSM_STATES.FAULT;
+        } else if (row.session_id || portStatusIsOccupied(row.current_status)) {
+            entry.state = PORT_FSM_STATES.CHARGING;
+        } else {
+            entry.state = PORT_FSM_STATES.AVAILABLE;
+        }
+
+        if (row.session_id) {
+            entry.sessionId = row.session_id;
+            entry.userId = row.user_id;
+            entry.budget.priority = row.power_priority ?? POWER_PRIORITY.STANDARD;
+            if (row.power_paused_at) {
+                markPortPaused(entry, new Date(row.power_paused_at)); // Relay is off; the power budget resumes it
+            } else {
+                resetPortInactivityTimer(entry, row.session_last_update ? new Date(row.session_last_update) : new Date());
+            }
+        }
+    }
+
+    console.log(`PortFSM: Loaded ${portStateMachines.size} ports (${rows.filter(row => row.session_id).length} with active sessions)`);
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Loaded state machines for ${portStateMachines.size} ports`);
+}
+
+// --- Telemetry journal: append + fsync batching, checkpoint, replay ---
+const telemetryJournal = {
+    enabled: false,
+    dir: TELEMETRY_JOURNAL_DIR,
+    journalId: null,        // identifies this journal in port_events (journal_id, journal_lsn)
+    nextLsn: 1,
+    appliedLsn: 0,          // highest LSN committed to Postgres (persisted in journal.json)
+    lastQueuedLsn: 0,       // highest LSN handed to the in-memory queue
+    spilled: false,         // newer events live only on disk; the replayer pages them back in
+    segments: [],           // [{ name, firstLsn, lastLsn, bytes }] oldest first; the last one is open for appends
+    handle: null,
+    writeBuffer: [],        // [{ event, record }] not yet written + fsynced
+    writeChain: Promise.resolve(),
+    fsyncs: 0,
+    corruptRecords: 0,
+    lastError: null
+};
+
+const CRC32_TABLE = (() => {
+    const table = new Int32Array(256);
+    for (let n = 0; n < 256; n++) {
+        let c = n;
+        for (let k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >>> 1) : c >>> 1;
+        table[n] = c;
+    }
+    return table;
+})();
+
+function crc32(buffer) {
+    let crc = -1;
+    for (let i = 0; i < buffer.length; i++) crc = CRC32_TABLE[(crc ^ buffer[i]) & 0xFF] ^ (crc >>> 8);
+    return (crc ^ -1) >>> 0;
+}
+
+function encodeJournalRecord(event) {
+    const body = Buffer.from(JSON.stringify(event));
+    const record = Buffer.allocUnsafe(JOURNAL_RECORD_HEADER_BYTES + body.length);
+    record.writeUInt32BE(body.length, 0);
+    record.writeUInt32BE(crc32(body), 4);
+    body.copy(record, JOURNAL_RECORD_HEADER_BYTES);
+    return record;
+}
+
+// Decodes a segment; stops at the first torn or corrupt record and reports how many bytes were valid
+function decodeJournalSegment(buffer) {
+    const events = [];
+    let offset = 0;
+    while (offset + JOURNAL_RECORD_HEADER_BYTES <= buffer.length) {
+        const length = buffer.readUInt32BE(offset);
+        const end = offset + JOURNAL_RECORD_HEADER_BYTES + length;
+        if (end > buffer.length) break;
+        const body = buffer.subarray(offset + JOURNAL_RECORD_HEADER_BYTES, end);
+        if (crc32(body) !== buffer.readUInt32BE(offset + 4)) break;
+        events.push(JSON.parse(body.toString()));
+        offset = end;
+    }
+    return { events, validBytes: offset, corrupt: offset < buffer.length };
+}
+
+function journalSegmentName(firstLsn) {
+    return `segment-${String(firstLsn).padStart(16, '0')}.log`;
+}
+
+function readJournalSegment(segment) {
+    return decodeJournalSegment(fs.readFileSync(path.join(telemetryJournal.dir, segment.name))).events;
+}
+
+// journal.json must survive a crash: losing it starts a new journal_id, and replayed events would
+// no longer collide with their (journal_id, journal_lsn) rows. Temp file + fsync, rename, then
+// fsync the directory so the rename itself is durable. Throws if any step fails.
+function persistJournalMeta(appliedLsn = telemetryJournal.appliedLsn) {
+    const dir = telemetryJournal.dir;
+    const metaPath = path.join(dir, 'journal.json');
+    const fd = fs.openSync(`${metaPath}.tmp`, 'w');
+    try {
+        fs.writeSync(fd, JSON.stringify({ journal_id: telemetryJournal.journalId, applied_lsn: appliedLsn }));
+        fs.fsyncSync(fd);
+    } finally {
+        fs.closeSync(fd);
+    }
+    fs.renameSync(`${metaPath}.tmp`, metaPath);
+    if (process.platform !== 'win32') { // Directories cannot be opened for fsync there
+        const dirFd = fs.openSync(dir, 'r');
+        try {
+            fs.fsyncSync(dirFd);
+        } finally {
+            fs.closeSync(dirFd);
+        }
+    }
+}
+
+// Opens (or creates) the journal at startup and returns events not yet applied to Postgres.
+// Synchronous on purpose: it must finish before the first MQTT message is handled.
+function openTelemetryJournal() {
+    const dir = telemetryJournal.dir;
+    fs.mkdirSync(dir, { recursive: true });
+
+    const metaPath = path.join(dir, 'journal.json');
+    const meta = fs.existsSync(metaPath) ? JSON.parse(fs.readFileSync(metaPath, 'utf8')) : {};
+    telemetryJournal.journalId = meta.journal_id || crypto.randomUUID();
+    telemetryJournal.appliedLsn = Number(meta.applied_lsn) || 0;
+
+    const unapplied = [];
+    let maxLsn = telemetryJournal.appliedLsn;
+    const names = fs.readdirSync(dir).filter(name => /^segment-\d+\.log$/.test(name)).sort();
+    for (const name of names) {
+        const filePath = path.join(dir, name);
+        const { events, validBytes, corrupt } = decodeJournalSegment(fs.readFileSync(filePath));
+        if (corrupt) {
+            // A torn tail from a crash mid-write; everything before it was fsynced intact
+            telemetryJournal.corruptRecords++;
+            fs.truncateSync(filePath, validBytes);
+            console.warn(`Journal: Truncated torn tail of ${name} at ${validBytes} bytes.`);
+        }
+        if (events.length === 0) {
+            fs.unlinkSync(filePath);
+            continue;
+        }
+        const segment = { name, firstLsn: events[0].journal_lsn, lastLsn: events[events.length - 1].journal_lsn, bytes: validBytes };
+        telemetryJournal.segments.push(segment);
+        maxLsn = Math.max(maxLsn, segment.lastLsn);
+        for (const event of events) {
+            if (event.journal_lsn > telemetryJournal.appliedLsn) unapplied.push(event);
+        }
+    }
+
+    telemetryJournal.nextLsn = maxLsn + 1;
+    const segment = { name: journalSegmentName(telemetryJournal.nextLsn), firstLsn: telemetryJournal.nextLsn, lastLsn: maxLsn, bytes: 0 };
+    telemetryJournal.segments.push(segment);
+    telemetryJournal.handle = fs.openSync(path.join(dir, segment.name), 'a');
+    persistJournalMeta();
+    telemetryJournal.enabled = true;
+    pruneAppliedJournalSegments();
+    return unapplied;
+}
+
+// Assigns the next LSN and buffers the record; flushTelemetryJournal() makes it durable
+function journalAppend(event) {
+    if (!telemetryJournal.enabled) return;
+    event.journal_id = telemetryJournal.journalId;
+    event.journal_lsn = telemetryJournal.nextLsn++;
+    event.journaled_at = new Date();
+    telemetryJournal.writeBuffer.push({ event, record: encodeJournalRecord(event) });
+}
+
+async function writeTelemetryJournalBuffer() {
+    const pending = telemetryJournal.writeBuffer;
+    if (!telemetryJournal.enabled || pending.length === 0) return;
+    telemetryJournal.writeBuffer = [];
+
+    const buffer = Buffer.concat(pending.map(item => item.record));
+    const segment = telemetryJournal.segments[telemetryJournal.segments.length - 1];
+    try {
+        await new Promise((resolve, reject) => fs.write(telemetryJournal.handle, buffer, 0, buffer.length, null, (err, written) => {
+            if (err) reject(err);
+            else if (written !== buffer.length) reject(new Error(`Short journal write (${written}/${buffer.length} bytes)`));
+            else resolve();
+        }));
+        await new Promise((resolve, reject) => fs.fdatasync(telemetryJournal.handle, err => (err ? reject(err) : resolve())));
+        telemetryJournal.fsyncs++;
+        segment.bytes += buffer.length;
+        segment.lastLsn = pending[pending.length - 1].event.journal_lsn;
+    } catch (error) {
+        telemetryJournal.writeBuffer = pending.concat(telemetryJournal.writeBuffer);
+        telemetryJournal.lastError = error.message;
+        throw error;
+    }
+
+    if (segment.bytes >= JOURNAL_SEGMENT_MAX_BYTES) {
+        fs.closeSync(telemetryJournal.handle);
+        const next = { name: journalSegmentName(telemetryJournal.nextLsn), firstLsn: telemetryJournal.nextLsn, lastLsn: telemetryJournal.nextLsn - 1, bytes: 0 };
+        telemetryJournal.segments.push(next);
+        telemetryJournal.handle = fs.openSync(path.join(telemetryJournal.dir, next.name), 'a');
+    }
+}
+
+// Serialized so writes land in LSN order; resolves once every record appended so far is on disk
+function flushTelemetryJournal() {
+    telemetryJournal.writeChain = telemetryJournal.writeChain
+        .catch(() => {})
+        .then(writeTelemetryJournalBuffer);
+    return telemetryJournal.writeChain;
+}
+
+// Called after a port_events batch commits: advance the checkpoint and delete fully applied segments
+function commitJournalCheckpoint(lsn) {
+    if (!telemetryJournal.enabled || !(lsn > telemetryJournal.appliedLsn)) return;
+    try {
+        persistJournalMeta(lsn);
+        telemetryJournal.appliedLsn = lsn; // Only once it is durable; the next commit retries otherwise
+        pruneAppliedJournalSegments();
+    } catch (error) {
+        telemetryJournal.lastError = error.message;
+        console.error('Journal: Failed to persist checkpoint:', error);
+    }
+}
+
+function pruneAppliedJournalSegments() {
+    while (telemetryJournal.segments.length > 1 && telemetryJournal.segments[0].lastLsn <= telemetryJournal.appliedLsn) {
+        const segment = telemetryJournal.segments.shift();
+        fs.unlinkSync(path.join(telemetryJournal.dir, segment.name));
+    }
+}
+
+// Replayer: once the in-memory queue has drained, pages spilled events back in from disk in LSN order
+async function refillFromTelemetryJournal() {
+    if (!telemetryJournal.spilled || pendingPortEvents.length > 0) return;
+    await flushTelemetryJournal();
+
+    for (const segment of telemetryJournal.segments) {
+        if (segment.lastLsn <= telemetryJournal.lastQueuedLsn) continue;
+        for (const event of readJournalSegment(segment)) {
+            if (event.journal_lsn <= telemetryJournal.lastQueuedLsn) continue;
+            pendingPortEvents.push(event);
+            telemetryJournal.lastQueuedLsn = event.journal_lsn;
+            if (pendingPortEvents.length >= JOURNAL_MEMORY_MAX_EVENTS) return;
+        }
+    }
+
+    // Caught up with the disk; hand over anything appended since the flush above and resume in-memory queueing
+    for (const { event } of telemetryJournal.writeBuffer) {
+        pendingPortEvents.push(event);
+        telemetryJournal.lastQueuedLsn = event.journal_lsn;
+    }
+    telemetryJournal.spilled = false;
+    console.log(`Journal: Replayer caught up at LSN ${telemetryJournal.lastQueuedLsn}.`);
+}
+
+function getTelemetryJournalMetrics() {
+    const lastLsn = telemetryJournal.nextLsn - 1;
+    const oldest = pendingPortEvents.find(event => event.journaled_at);
+    return {
+        enabled: telemetryJournal.enabled,
+        journal_id: telemetryJournal.journalId,
+        segments: telemetryJournal.segments.length,
+        size_bytes: telemetryJournal.segments.reduce((total, segment) => total + segment.bytes, 0),
+        last_lsn: lastLsn,
+        applied_lsn: telemetryJournal.appliedLsn,
+        lag_records: Math.max(0, lastLsn - telemetryJournal.appliedLsn),
+        lag_seconds: oldest ? Math.max(0, (Date.now() - new Date(oldest.journaled_at).getTime()) / 1000) : 0,
+        spilled_to_disk: telemetryJournal.spilled,
+        queued_in_memory: pendingPortEvents.length,
+        fsyncs: telemetryJournal.fsyncs,
+        corrupt_records: telemetryJournal.corruptRecords,
+        last_error: telemetryJournal.lastError
+    };
+}
+
+// --- Telemetry sequence dedupe (sliding-window bitmap per port) ---
+const telemetrySequenceMetrics = {
+    accepted: 0,
+    duplicates: 0,
+    stale: 0,
+    unsequenced: 0,
+    missing: 0,    // samples skipped over by a jump in seq (may still arrive late)
+    recovered: 0,  // late samples that filled a previously counted gap
+    restarts: 0    // window resets caused by a new boot id or a seq far behind the window
+};
+
+function createSequenceWindow() {
+    return {
+        boot: null,
+        highest: -1,
+        bits: new Uint32Array(TELEMETRY_SEQ_WINDOW_SIZE / 32),
+        missing: 0,
+        duplicates: 0,
+        lastGapAt: null
+    };
+}
+
+function sequenceBit(window, seq, value) {
+    const slot = seq % TELEMETRY_SEQ_WINDOW_SIZE;
+    const word = slot >>> 5;
+    const mask = 1 << (slot & 31);
+    if (value === undefined) return (window.bits[word] & mask) !== 0;
+    if (value) window.bits[word] |= mask;
+    else window.bits[word] &= ~mask;
+    return value;
+}
+
+function resetSequenceWindow(window, seq, boot) {
+    window.bits.fill(0);
+    window.highest = seq;
+    window.boot = boot;
+    sequenceBit(window, seq, true);
+}
+
+// Classifies one sequence number against the port's window and records it.
+// Returns { result, gap } where gap is the number of samples newly found missing.
+function acceptSequence(window, rawSeq, rawBoot) {
+    const seq = Number(rawSeq);
+    if (rawSeq === undefined || rawSeq === null || !Number.isSafeInteger(seq) || seq < 0) {
+        telemetrySequenceMetrics.unsequenced++;
+        return { result: SEQUENCE_RESULT.UNSEQUENCED, gap: 0 };
+    }
+    const boot = rawBoot === undefined ? null : String(rawBoot);
+
+    if (window.highest < 0 || (boot !== null && boot !== window.boot)) {
+        if (window.highest >= 0) telemetrySequenceMetrics.restarts++;
+        resetSequenceWindow(window, seq, boot);
+        telemetrySequenceMetrics.accepted++;
+        return { result: SEQUENCE_RESULT.ACCEPTED, gap: 0 };
+    }
+
+    if (seq > window.highest) {
+        const advance = seq - window.highest;
+        if (advance >= TELEMETRY_SEQ_WINDOW_SIZE) {
+            window.bits.fill(0);
+        } else {
+            for (let cleared = window.highest + 1; cleared < seq; cleared++) {
+                sequenceBit(window, cleared, false);
+            }
+        }
+        sequenceBit(window, seq, true);
+        window.highest = seq;
+        const gap = advance - 1;
+        window.missing += gap;
+        telemetrySequenceMetrics.missing += gap;
+        telemetrySequenceMetrics.accepted++;
+        return { result: SEQUENCE_RESULT.ACCEPTED, gap };
+    }
+
+    const behind = window.highest - seq;
+    if (behind >= TELEMETRY_SEQ_WINDOW_SIZE) {
+        // Far behind: a counter reset without a boot id. Start over rather than drop all future samples.
+        if (behind > TELEMETRY_SEQ_WINDOW_SIZE * 4 || seq < TELEMETRY_SEQ_WINDOW_SIZE) {
+            telemetrySequenceMetrics.restarts++;
+            resetSequenceWindow(window, seq, boot);
+            telemetrySequenceMetrics.accepted++;
+            return { result: SEQUENCE_RESULT.ACCEPTED, gap: 0 };
+        }
+        telemetrySequenceMetrics.stale++;
+        return { result: SEQUENCE_RESULT.STALE, gap: 0 };
+    }
+
+    if (sequenceBit(window, seq)) {
+        window.duplicates++;
+        telemetrySequenceMetrics.duplicates++;
+        return { result: SEQUENCE_RESULT.DUPLICATE, gap: 0 };
+    }
+
+    // Late arrival inside the window: fills a gap counted earlier
+    sequenceBit(window, seq, true);
+    if (window.missing > 0) window.missing--;
+    telemetrySequenceMetrics.recovered++;
+    telemetrySequenceMetrics.accepted++;
+    return { result: SEQUENCE_RESULT.ACCEPTED, gap: 0 };
+}
+
+// --- Consumption anomaly detection (streaming, per port) ---
+const consumptionAnomalyMetrics = {
+    samples: 0,
+    spikes: 0,
+    out_of_range: 0,
+    flatlines: 0,
+    faults: 0,
+    cleared: 0
+};
+
+function createAnomalyDetector() {
+    return {
+        samples: 0,
+        mean: 0,
+        variance: 0,
+        lastWatts: null,
+        flatRun: 0,
+        spikeScore: 0,
+        spikeRun: 0,
+        spikes: 0,
+        outOfRange: 0,
+        fault: null, // { kind, detail, at } once the port was faulted for an anomaly
+        review: null // { kind, detail, at } once a flat line flagged the port for an admin to look at
+    };
+}
+
+// A zero reading ends the charging run; the next one learns its own baseline
+function resetAnomalyBaseline(detector) {
+    detector.samples = 0;
+    detector.mean = 0;
+    detector.variance = 0;
+    detector.lastWatts = null;
+    detector.flatRun = 0;
+    detector.spikeScore = 0;
+    detector.spikeRun = 0;
+}
+
+// Feeds one usage sample (raw watts, before clamping). Returns { kind, detail } when the port
+// should be faulted, otherwise null.
+function observeConsumptionSample(detector, rawWatts) {
+    if (!Number.isFinite(rawWatts) || rawWatts <= 0) {
+        resetAnomalyBaseline(detector);
+        return null;
+    }
+    consumptionAnomalyMetrics.samples++;
+    detector.spikeScore *= ANOMALY_SPIKE_DECAY;
+
+    if (rawWatts > MAX_REASONABLE_CONSUMPTION) {
+        detector.outOfRange++;
+        consumptionAnomalyMetrics.out_of_range++;
+        detector.spikeScore += 1;
+        if (detector.spikeScore >= ANOMALY_SPIKE_SCORE_FAULT) {
+            return { kind: ANOMALY_KINDS.OUT_OF_RANGE, detail: `${rawWatts.toFixed(1)}W exceeds ${MAX_REASONABLE_CONSUMPTION}W repeatedly` };
+        }
+        return null; // Clamped readings would poison the baseline
+    }
+
+    const flatToleranceWatts = (ANOMALY_SENSOR_RESOLUTION_AMPS / 2) * NOMINAL_CHARGING_VOLTAGE_DC;
+    detector.flatRun = detector.lastWatts !== null && Math.abs(rawWatts - detector.lastWatts) < flatToleranceWatts
+        ? detector.flatRun + 1
+        : 1;
+    detector.lastWatts = rawWatts;
+    if (detector.flatRun === ANOMALY_FLATLINE_SAMPLES) { // once per run
+        consumptionAnomalyMetrics.flatlines++;
+        return { kind: ANOMALY_KINDS.FLATLINE, detail: `${detector.flatRun} identical readings of ${rawWatts.toFixed(3)}W`, review: true };
+    }
+
+    if (detector.samples === 0) {
+        detector.mean = rawWatts;
+    } else {
+        const deviation = rawWatts - detector.mean;
+        if (detector.samples >= ANOMALY_WARMUP_SAMPLES) {
+            const std = Math.sqrt(detector.variance);
+            if (Math.abs(deviation) > ANOMALY_SPIKE_Z * std && Math.abs(deviation) > ANOMALY_SPIKE_MIN_RATIO * detector.mean) {
+                // Outliers stay out of the baseline. A run of them is the load settling at a new
+                // level (phone switching charge mode), so relearn from here instead of faulting.
+                if (++detector.spikeRun >= ANOMALY_LEVEL_SHIFT_SAMPLES) {
+                    detector.mean = rawWatts;
+                    detector.variance = 0;
+                    detector.samples = 1;
+                    detector.spikeRun = 0;
+                }
+                return null;
+            }
+            if (detector.spikeRun > 0) {
+                detector.spikes += detector.spikeRun;
+                consumptionAnomalyMetrics.spikes += detector.spikeRun;
+                detector.spikeScore += detector.spikeRun;
+                detector.spikeRun = 0;
+            }
+        }
+        // West's incremental EWMA variance
+        const increment = ANOMALY_EWMA_ALPHA * deviation;
+        detector.mean += increment;
+        detector.variance = (1 - ANOMALY_EWMA_ALPHA) * (detector.variance + deviation * increment);
+    }
+    detector.samples++;
+
+    if (detector.spikeScore >= ANOMALY_SPIKE_SCORE_FAULT) {
+        return { kind: ANOMALY_KINDS.SPIKES, detail: `${detector.spikes} spikes around a mean of ${detector.mean.toFixed(2)}W` };
+    }
+    return null;
+}
+
+// Flags the port for an admin to check; the port stays in service and the session keeps charging
+async function flagConsumptionAnomalyForReview(entry, anomaly) {
+    entry.anomaly.review = { kind: anomaly.kind, detail: anomaly.detail, at: new Date() };
+    console.warn(`Anomaly: ${entry.key} flagged for review (${anomaly.kind}): ${anomaly.detail}`);
+    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Port ${entry.key} flagged for review (${anomaly.kind}): ${anomaly.detail}`);
+
+    try {
+        const { rows: admins } = await controlPool.query(preparedStatement('listAdminUserIds', []));
+        await Promise.all(admins.map(admin => createUserNotification({
+            userId: admin.user_id,
+            type: 'warning',
+            content: `Port ${entry.portNumber} on device ${entry.deviceId} may have a stuck sensor: ${anomaly.detail}. It is still in service.`,
+            context: `Anomaly review: ${anomaly.kind} • Station ${entry.stationId}`
+        })));
+    } catch (error) {
+        console.error(`Anomaly: Failed to notify admins about ${entry.key}:`, error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to flag consumption anomaly on ${entry.key}: ${error.message}`);
+    }
+}
+
+// Faults the port, closes any session on it (so a bad sensor stops billing) and alerts admins
+async function handleConsumptionAnomaly(entry, anomaly) {
+    const sessionKey = entry.key;
+    const sessionId = entry.sessionId;
+    const userId = entry.userId;
+    entry.anomaly.fault = { ...anomaly, at: new Date() };
+    consumptionAnomalyMetrics.faults++;
+    transitionPortState(entry, PORT_FSM_EVENTS.FAULT_DETECTED);
+    console.warn(`Anomaly: ${sessionKey} faulted (${anomaly.kind}): ${anomaly.detail}`);
+    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Port ${sessionKey} faulted for consumption anomaly (${anomaly.kind}): ${anomaly.detail}`);
+
+    try {
+        if (sessionId) {
+            const finalized = await finalizeSessionFromDeviceEvent({
+                deviceId: entry.deviceId,
+                portNumberInDevice: entry.portNumber,
+                actualPortId: entry.portId,
+                endReason: `consumption anomaly (${anomaly.kind})`,
+                source: LOG_SOURCES.BACKEND,
+                sendOffCommand: true
+            });
+            if (finalized) {
+                await createUserNotification({
+                    userId,
+                    type: 'warning',
+                    content: `Charging on Port ${entry.portNumber} was stopped because the port reported abnormal readings. Please use another port.`,
+                    context: `Anomaly: ${anomaly.kind}`
+                });
+            }
+        }
+
+        const { rows: admins } = await controlPool.query(preparedStatement('listAdminUserIds', []));
+        await Promise.all(admins.map(admin => createUserNotification({
+            userId: admin.user_id,
+            type: 'error',
+            content: `Port ${entry.portNumber} on device ${entry.deviceId} was taken out of service: ${anomaly.detail}.`,
+            context: `Anomaly: ${anomaly.kind} • Station ${entry.stationId}`
+        })));
+    } catch (error) {
+        console.error(`Anomaly: Failed to handle fault on ${sessionKey}:`, error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to handle consumption anomaly on ${sessionKey}: ${error.message}`);
+    }
+}
+
+// --- Full-charge taper detection (streaming, per port) ---
+const fullChargeDetectionMetrics = {
+    detected: 0,
+    disconnected: 0
+};
+
+// Detector state for one charging session
+function createTaperDetector() {
+    return {
+        samples: 0,
+        smoothedAmps: null,
+        peakAmps: 0,
+        taperSamples: 0, // current run of non-rising readings in the taper band
+        taperStartAmps: 0,
+        taperLastAmps: 0,
+        plateauRun: 0,
+        plateauMin: 0,
+        plateauMax: 0,
+        detectedAt: null
+    };
+}
+
+// Feeds one usage reading (amps, zero included) of the port's active session. Returns true once,
+// on the reading that completes bulk -> taper -> flat trickle.
+function observeChargeCurrent(detector, amps) {
+    if (!Number.isFinite(amps) || amps < 0 || detector.detectedAt) {
+        return false;
+    }
+    detector.samples++;
+    detector.smoothedAmps = detector.smoothedAmps === null
+        ? amps
+        : detector.smoothedAmps + FULL_CHARGE_EWMA_ALPHA * (amps - detector.smoothedAmps);
+    detector.peakAmps = Math.max(detector.peakAmps, detector.smoothedAmps);
+    if (detector.peakAmps < FULL_CHARGE_MIN_PEAK_AMPS) {
+        return false;
+    }
+
+    const trickleAmps = Math.min(FULL_CHARGE_TRICKLE_RATIO * detector.peakAmps, FULL_CHARGE_TRICKLE_MAX_AMPS);
+    if (amps > trickleAmps) {
+        detector.plateauRun = 0;
+        if (amps >= FULL_CHARGE_TAPER_RATIO * detector.peakAmps) {
+            detector.taperSamples = 0; // Back to bulk current: an earlier dip was a load change, not the taper
+        } else if (detector.taperSamples === 0 || amps > detector.taperLastAmps + FULL_CHARGE_PLATEAU_TOLERANCE_AMPS) {
+            detector.taperSamples = 1; // A taper only falls; a rise starts the run again
+            detector.taperStartAmps = amps;
+            detector.taperLastAmps = amps;
+        } else {
+            detector.taperSamples++;
+            detector.taperLastAmps = amps;
+        }
+        return false;
+    }
+
+    const plateauMin = Math.min(detector.plateauMin, amps);
+    const plateauMax = Math.max(detector.plateauMax, amps);
+    if (detector.plateauRun > 0 && plateauMax - plateauMin <= FULL_CHARGE_PLATEAU_TOLERANCE_AMPS) {
+        detector.plateauRun++;
+        detector.plateauMin = plateauMin;
+        detector.plateauMax = plateauMax;
+    } else {
+        detector.plateauRun = 1;
+        detector.plateauMin = amps;
+        detector.plateauMax = amps;
+    }
+
+    // Zero current after a short or level dip is what an unplug looks like; only a real, falling
+    // taper makes it a full battery
+    const tricklesAboveZero = detector.plateauMax > FULL_CHARGE_ZERO_AMPS;
+    const taperFell = detector.taperSamples >= FULL_CHARGE_ZERO_MIN_TAPER_SAMPLES &&
+        detector.taperStartAmps - detector.taperLastAmps >= FULL_CHARGE_ZERO_MIN_DECLINE_RATIO * detector.peakAmps;
+    if (detector.plateauRun >= FULL_CHARGE_PLATEAU_SAMPLES &&
+        detector.taperSamples >= FULL_CHARGE_MIN_TAPER_SAMPLES &&
+        (tricklesAboveZero || taperFell) &&
+        detector.samples >= FULL_CHARGE_MIN_SAMPLES) {
+        detector.detectedAt = new Date();
+        return true;
+    }
+    return false;
+}
+
+// The taper was recognised: run the device's full-ready flow, then switch the port off after the
+// grace period unless the device (or the user) ends the session first
+async function handleDetectedFullCharge(entry) {
+    const sessionId = entry.sessionId;
+    const detector = entry.taper;
+    if (entry.fullCharge?.fullSentAt) {
+        return; // The device reported it first and will switch itself off
+    }
+    fullChargeDetectionMetrics.detected++;
+    const reason = `current tapered from ${detector.peakAmps.toFixed(2)}A to ${detector.smoothedAmps.toFixed(2)}A`;
+    console.log(`FullCharge: ${entry.key} session ${sessionId} looks full (${reason}).`);
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Full charge detected on ${entry.key} for session ${sessionId}: ${reason}`);
+
+    await handleFullChargeReadyEvent({
+        deviceId: entry.deviceId,
+        actualPortId: entry.portId,
+        portNumber: entry.portNumber,
+        reason: 'SERVER_TAPER_DETECTED'
+    });
+    clearFullChargeDisconnectTimer(entry);
+    entry.fullChargeDisconnectTimerId = setTimeout(() => {
+        entry.fullChargeDisconnectTimerId = null;
+        disconnectDetectedFullCharge(entry, sessionId);
+    }, FULL_CHARGE_DISCONNECT_GRACE_SECONDS * 1000);
+    entry.fullChargeDisconnectTimerId.unref();
+}
+
+async function disconnectDetectedFullCharge(entry, sessionId) {
+    if (entry.sessionId !== sessionId || entry.state !== PORT_FSM_STATES.FULL_READY) {
+        return; // Already ended by the device's own auto-off or by the user
+    }
+    try {
+        await handleFullChargeDisconnectEvent({
+            actualPortId: entry.portId,
+            portNumber: entry.portNumber,
+            reason: 'SERVER_TAPER_DETECTED'
+        });
+        const finalized = await finalizeSessionFromDeviceEvent({
+            deviceId: entry.deviceId,
+            portNumberInDevice: entry.portNumber,
+            actualPortId: entry.portId,
+            endReason: 'full_charge_detected',
+            source: LOG_SOURCES.BACKEND,
+            sendOffCommand: true
+        });
+        if (finalized) fullChargeDetectionMetrics.disconnected++;
+    } catch (error) {
+        console.error(`FullCharge: Failed to disconnect ${entry.key}:`, error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to disconnect fully charged session ${sessionId} on ${entry.key}: ${error.message}`);
+    }
+}
+
+// --- Station power budget scheduler ---
+const powerBudgetMetrics = {
+    ticks: 0,
+    admitted: 0,
+    queued: 0,
+    paused: 0,
+    resumed: 0,
+    expired: 0
+};
+
+// Per-session scheduling state on the port entry; lastWatts/lastReadingAt describe the port's
+// latest usage reading and survive across sessions
+function createPowerBudgetState(previous = null) {
+    return {
+        paused: false,
+        pausedAt: null,
+        runningSince: null,
+        priority: POWER_PRIORITY.STANDARD,
+        expectedWatts: null, // last positive draw of this session
+        notified: false,
+        lastWatts: previous?.lastWatts ?? null,
+        lastReadingAt: previous?.lastReadingAt ?? null
+    };
+}
+
+const stationHourFormat = new Intl.DateTimeFormat('en-US', { timeZone: STATION_TIME_ZONE, weekday: 'short', hour: 'numeric', minute: 'numeric', hourCycle: 'h23' });
+const WEEKDAY_INDEX = { Sun: 0, Mon: 1, Tue: 2, Wed: 3, Thu: 4, Fri: 5, Sat: 6 };
+
+// Day of week (0 = Sunday) and minute of the day on STATION_TIME_ZONE's clock
+function stationClock(at = new Date()) {
+    const parts = Object.fromEntries(stationHourFormat.formatToParts(at).map(part => [part.type, part.value]));
+    return { day: WEEKDAY_INDEX[parts.weekday], minute: Number(parts.hour) * 60 + Number(parts.minute) };
+}
+
+// Hour of the day at the station: mean solar time from its longitude, else STATION_TIME_ZONE's clock
+function stationSolarHour(station, at = new Date()) {
+    const longitude = station?.longitude;
+    if (Number.isFinite(longitude)) {
+        const utcHour = at.getUTCHours() + at.getUTCMinutes() / 60;
+        return (((utcHour + longitude / 15) % 24) + 24) % 24;
+    }
+    return stationClock(at).minute / 60;
+}
+
+function estimatedSolarWatts(station, at = new Date()) {
+    const rated = Number(station?.solar_panel_wattage) || 0;
+    const hour = stationSolarHour(station, at);
+    if (rated <= 0 || hour <= SOLAR_DAY_START_HOUR || hour >= SOLAR_DAY_END_HOUR) return 0;
+    return rated * SOLAR_DERATE * Math.sin(Math.PI * (hour - SOLAR_DAY_START_HOUR) / (SOLAR_DAY_END_HOUR - SOLAR_DAY_START_HOUR));
+}
+
+// Watts the station can supply right now, or null when it is not budget-managed. Live station
+// telemetry, when fresh, replaces the stored battery level and the modelled solar output.
+function stationPowerBudgetWatts(station, at = new Date()) {
+    const live = station ? freshStationTelemetry(station.station_id, at.getTime()) : null;
+    const capacityMah = Number(station?.battery_capacity_mah);
+    const storedLevel = station?.current_battery_level === null ? NaN : Number(station?.current_battery_level);
+    const levelPercent = live?.battery_soc ?? storedLevel;
+    if (!(capacityMah > 0) || !Number.isFinite(levelPercent)) return null;
+
+    const usablePercent = Math.max(0, levelPercent - POWER_BUDGET_RESERVE_PERCENT);
+    const storedWh = capacityMah * (usablePercent / 100) / 1000 * NOMINAL_CHARGING_VOLTAGE_DC;
+    return storedWh / POWER_BUDGET_RUNTIME_HOURS + (live?.solar_watts ?? estimatedSolarWatts(station, at));
+}
+
+function readingIsFresh(budget, now = Date.now()) {
+    return budget.lastReadingAt !== null && now - budget.lastReadingAt.getTime() <= POWER_BUDGET_DRAW_FRESH_SECONDS * 1000;
+}
+
+// What a port will draw once its relay is on: its live reading, else what it drew earlier in the session
+function expectedPortWatts(entry, now = Date.now()) {
+    const budget = entry.budget;
+    if (!budget.paused && readingIsFresh(budget, now)) return budget.lastWatts;
+    return budget.expectedWatts ?? POWER_BUDGET_PORT_ESTIMATE_WATTS;
+}
+
+// Called for every usage reading (zero included)
+function recordPortDraw(entry, watts, at) {
+    entry.budget.lastWatts = watts;
+    entry.budget.lastReadingAt = at;
+    if (watts > 0 && entry.sessionId) entry.budget.expectedWatts = watts;
+}
+
+function budgetedSessionsAt(stationId) {
+    return Array.from(portStateMachines.values()).filter(entry =>
+        entry.stationId === stationId && entry.sessionId &&
+        (entry.state === PORT_FSM_STATES.RESERVED || entry.state === PORT_FSM_STATES.CHARGING || entry.state === PORT_FSM_STATES.FULL_READY));
+}
+
+function powerPriorityFor(entry, quotaCheck) {
+    if (quotaCheck?.priorityAccess) return POWER_PRIORITY.PRIORITY_PLAN;
+    return entry.isPremium ? POWER_PRIORITY.PREMIUM_PORT : POWER_PRIORITY.STANDARD;
+}
+
+// Whether a new session on this port fits next to the ports already running at its station.
+// A tight budget queues it; the next tick may still rotate a lower-priority port out for it.
+async function admitToPowerBudget(entry) {
+    const station = await getStationConfig(entry.stationId);
+    const budgetWatts = stationPowerBudgetWatts(station);
+    if (budgetWatts === null) return true;
+
+    const now = Date.now();
+    const runningWatts = budgetedSessionsAt(entry.stationId)
+        .filter(other => other !== entry && !other.budget.paused)
+        .reduce((sum, other) => sum + expectedPortWatts(other, now), 0);
+    return runningWatts + expectedPortWatts(entry, now) <= budgetWatts * POWER_BUDGET_HEADROOM;
+}
+
+function markPortPaused(entry, now = new Date()) {
+    entry.budget.paused = true;
+    entry.budget.pausedAt = now;
+    entry.budget.runningSince = null;
+    clearPortInactivityTimer(entry); // A paused port draws nothing on purpose
+}
+
+function markPortRunning(entry, now = new Date()) {
+    entry.budget.paused = false;
+    entry.budget.pausedAt = null;
+    entry.budget.runningSince = now;
+}
+
+// Decides which sessions at a station run. Higher priority first; within a priority, ports still
+// inside their rotation slot keep running, then the longest-waiting paused ports, then ports
+// that have had their slot. First fit against the budget.
+function planStationPower(sessions, budgetWatts, now = Date.now()) {
+    const rotationMs = POWER_BUDGET_ROTATION_SECONDS * 1000;
+    const rank = (entry) => {
+        const budget = entry.budget;
+        if (budget.paused) return { group: 1, order: budget.pausedAt?.getTime() ?? 0 };
+        const since = budget.runningSince?.getTime() ?? now;
+        return now - since < rotationMs ? { group: 0, order: 0 } : { group: 2, order: -since };
+    };
+    const ordered = sessions
+        .map(entry => ({ entry, rank: rank(entry), watts: expectedPortWatts(entry, now) }))
+        .sort((a, b) => b.entry.budget.priority - a.entry.budget.priority ||
+            a.rank.group - b.rank.group || a.rank.order - b.rank.order);
+
+    const limit = budgetWatts * POWER_BUDGET_HEADROOM;
+    let used = 0;
+    const run = new Set();
+    for (const { entry, watts } of ordered) {
+        if (used + watts <= limit) {
+            used += watts;
+            run.add(entry);
+        }
+    }
+    return { run, plannedWatts: used };
+}
+
+// Queues one planned switch under the port's session lock. The session may have ended (API OFF,
+// device finalize) while the plan was made, so it is re-checked in memory and its row is updated
+// (power_paused_at, restored at boot), which orders this against a finalize transaction. The port
+// is only marked paused/running once the command is committed. Returns whether the command was queued.
+async function applyPowerBudgetCommand({ entry, sessionId, command }, now) {
+    let unlock;
+    try {
+        unlock = await acquireSessionLock(entry.key);
+    } catch (lockError) {
+        return false; // Port busy with a user command; the next tick re-plans it
+    }
+    try {
+        const stillBudgeted = entry.sessionId === sessionId && budgetedSessionsAt(entry.stationId).includes(entry);
+        if (!stillBudgeted || entry.budget.paused !== (command === CHARGER_STATES.ON)) return false;
+
+        const queued = await runInTransaction(async (client) => {
+            const pausedAt = command === CHARGER_STATES.ON ? null : now;
+            const { rowCount } = await client.query(preparedStatement('setSessionPowerPaused', [sessionId, SESSION_STATUS.ACTIVE, pausedAt]));
+            if (rowCount === 0) return false;
+            await enqueueControlCommand(client, {
+                deviceId: entry.deviceId,
+                portNumber: entry.portNumber,
+                command,
+                sessionId,
+                source: LOG_SOURCES.BACKEND
+            });
+            return true;
+        });
+        if (!queued) return false;
+
+        if (command === CHARGER_STATES.ON) {
+            markPortRunning(entry, now);
+            resetPortInactivityTimer(entry);
+            powerBudgetMetrics.resumed++;
+        } else {
+            markPortPaused(entry, now);
+            powerBudgetMetrics.paused++;
+        }
+        return true;
+    } finally {
+        unlock();
+    }
+}
+
+async function rebalanceStationPower(stationId) {
+    const sessions = budgetedSessionsAt(stationId);
+    if (sessions.length === 0) return;
+
+    const station = await getStationConfig(stationId);
+    const budgetWatts = stationPowerBudgetWatts(station);
+    const { run } = budgetWatts === null
+        ? { run: new Set(sessions) } // No longer managed: everyone runs
+        : planStationPower(sessions, budgetWatts);
+
+    const now = new Date();
+    const planned = [];
+    for (const entry of sessions) {
+        if (!entry.budget.paused && !entry.budget.runningSince) entry.budget.runningSince = now; // restored at boot
+        const shouldRun = run.has(entry);
+        if (shouldRun && entry.budget.paused) {
+            planned.push({ entry, sessionId: entry.sessionId, command: CHARGER_STATES.ON });
+        } else if (!shouldRun && !entry.budget.paused) {
+            planned.push({ entry, sessionId: entry.sessionId, command: CHARGER_STATES.OFF });
+        }
+    }
+
+    const commands = [];
+    for (const switchCommand of planned) {
+        if (await applyPowerBudgetCommand(switchCommand, now)) commands.push(switchCommand);
+    }
+    if (commands.length === 0) return;
+    scheduleCommandOutboxDrain();
+
+    const summary = commands.map(({ entry, command }) => `${entry.key} ${command}`).join(', ');
+    console.log(`PowerBudget: Station ${stationId} (${budgetWatts === null ? 'unmanaged' : `${budgetWatts.toFixed(1)}W`}): ${summary}`);
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Power budget for station ${stationId} switched ${summary}`);
+
+    for (const { entry, command } of commands) {
+        if (command !== CHARGER_STATES.OFF || entry.budget.notified) continue;
+        entry.budget.notified = true;
+        await createUserNotification({
+            userId: entry.userId,
+            type: 'info',
+            content: `Charging on Port ${entry.portNumber} is paused to share the station's stored power. It resumes automatically.`,
+            context: 'Station power budget'
+        });
+    }
+}
+
+// Paused sessions are skipped by the inactivity timer and the stale checker, so one whose station
+// cannot power it (budget below the port's draw) would hold the port and the user's slot forever.
+// After POWER_BUDGET_MAX_QUEUED_MINUTES paused in one stretch it is ended like an inactive session.
+async function expireQueuedSessions(stationId, now = Date.now()) {
+    const maxQueuedMs = POWER_BUDGET_MAX_QUEUED_MINUTES * 60 * 1000;
+    const expired = budgetedSessionsAt(stationId).filter(entry =>
+        entry.budget.paused && entry.budget.pausedAt && now - entry.budget.pausedAt.getTime() >= maxQueuedMs);
+
+    for (const entry of expired) {
+        let unlock;
+        try {
+            unlock = await acquireSessionLock(entry.key);
+        } catch (lockError) {
+            continue; // Port busy with a user command; checked again next tick
+        }
+        try {
+            const { sessionId, userId } = entry;
+            if (!entry.budget.paused || !sessionId) continue;
+            const finalized = await finalizeSessionFromDeviceEvent({
+                deviceId: entry.deviceId,
+                portNumberInDevice: entry.portNumber,
+                actualPortId: entry.portId,
+                endReason: `waited for station power over ${POWER_BUDGET_MAX_QUEUED_MINUTES} minutes`,
+                source: LOG_SOURCES.BACKEND,
+                sendOffCommand: true
+            });
+            if (!finalized) continue;
+            powerBudgetMetrics.expired++;
+            logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Power budget ended session ${sessionId} on ${entry.key} after ${POWER_BUDGET_MAX_QUEUED_MINUTES} minutes waiting for power`);
+            if (userId) {
+                await createUserNotification({
+                    userId,
+                    type: 'info',
+                    content: `Your session on Port ${entry.portNumber} was ended because the station could not supply power for ${POWER_BUDGET_MAX_QUEUED_MINUTES} minutes. Please try again later or at another station.`,
+                    context: 'Station power budget'
+                });
+            }
+        } finally {
+            unlock();
+        }
+    }
+}
+
+async function runPowerBudgetScheduler() {
+    powerBudgetMetrics.ticks++;
+    const stationIds = new Set();
+    for (const entry of portStateMachines.values()) {
+        if (entry.sessionId && entry.stationId) stationIds.add(entry.stationId);
+    }
+    for (const stationId of stationIds) {
+        try {
+            await expireQueuedSessions(stationId);
+            await rebalanceStationPower(stationId);
+        } catch (error) {
+            console.error(`PowerBudget: Failed to rebalance station ${stationId}:`, error);
+            logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to rebalance power budget for station ${stationId}: ${error.message}`);
+        }
+    }
+}
+
+// Per-station view for the admin API: budget, live draw and every session's slot
+async function getStationPowerSnapshot(stationId) {
+    const station = await getStationConfig(stationId);
+    const now = Date.now();
+    const ports = Array.from(portStateMachines.values()).filter(entry => entry.stationId === stationId);
+    const liveDrawWatts = ports
+        .filter(entry => readingIsFresh(entry.budget, now))
+        .reduce((sum, entry) => sum + (entry.budget.lastWatts || 0), 0);
+    return {
+        station_id: stationId,
+        station_name: station?.station_name ?? null,
+        budget_watts: stationPowerBudgetWatts(station),
+        solar_watts: freshStationTelemetry(stationId)?.solar_watts ?? estimatedSolarWatts(station),
+        battery_level: freshStationTelemetry(stationId)?.battery_soc ?? station?.current_battery_level ?? null,
+        live_draw_watts: liveDrawWatts,
+        sessions: budgetedSessionsAt(stationId).map(entry => ({
+            device_id: entry.deviceId,
+            port_number: entry.portNumber,
+            session_id: entry.sessionId,
+            priority: entry.budget.priority,
+            paused: entry.budget.paused,
+            paused_at: entry.budget.pausedAt,
+            running_since: entry.budget.runningSince,
+            expected_watts: expectedPortWatts(entry, now)
+        }))
+    };
+}
+
+// --- Port event log: append, project, replay ---
+
+// Extra usage fields kept in port_events.payload
+function usageEventDetails(payload, deviceTimestampMs) {
+    const details = {};
+    if (deviceTimestampMs !== null) details.device_timestamp = deviceTimestampMs;
+    if (payload.seq !== undefined) details.seq = payload.seq;
+    if (payload.boot !== undefined) details.boot = payload.boot;
+    return Object.keys(details).length > 0 ? details : null;
+}
+
+// Queues one fact for the port_events log. Projections are applied when the batch is written.
+function appendPortEvent(portEntry, eventType, fields = {}) {
+    const event = {
+        event_type: eventType,
+        device_id: portEntry.deviceId,
+        port_number: portEntry.portNumber,
+        port_id: portEntry.portId,
+        session_id: fields.sessionId || null,
+        occurred_at: fields.occurredAt || new Date(),
+        status_message: fields.statusMessage ?? null,
+        charger_state: fields.chargerState ?? null,
+        consumption_watts: fields.consumptionWatts ?? null,
+        cost_increment: fields.costIncrement ?? null,
+        payload: fields.payload || null
+    };
+    journalAppend(event);
+
+    // While the DB is behind by more than the memory budget, events stay on disk until the replayer reads them back
+    if (telemetryJournal.spilled) return event;
+    if (telemetryJournal.enabled && pendingPortEvents.length >= JOURNAL_MEMORY_MAX_EVENTS) {
+        telemetryJournal.spilled = true;
+        console.warn(`Journal: ${pendingPortEvents.length} events waiting for the database; spilling new events to disk only.`);
+        return event;
+    }
+    pendingPortEvents.push(event);
+    if (event.journal_lsn) telemetryJournal.lastQueuedLsn = event.journal_lsn;
+    return event;
+}
+
+// Appends queued events and advances every projection in one transaction, so a fact and
+// its effects are either both visible or both retried. Events are made durable in the local
+// journal first; (journal_id, journal_lsn) makes a retry after a crash idempotent.
+// The batch itself is written by the ingestion worker when it is running.
+async function writePendingPortEvents() {
+    try {
+        await flushTelemetryJournal();
+    } catch (error) {
+        console.error('Journal: Failed to write telemetry journal:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Telemetry journal write failed: ${error.message}`);
+    }
+    await refillFromTelemetryJournal();
+
+    while (pendingPortEvents.length > 0) {
+        const batch = pendingPortEvents.splice(0, PORT_EVENT_MAX_BATCH);
+        try {
+            await writePortEventBatchOffThread(batch);
+            commitJournalCheckpoint(batch.reduce((max, event) => Math.max(max, event.journal_lsn || 0), 0));
+            new Set(batch.map(event => event.port_id)).forEach(portId => {
+                const entry = getPortEntryById(portId);
+                if (entry) bumpPortResources(entry);
+            });
+        } catch (error) {
+            pendingPortEvents.unshift(...batch); // Keep log order for the retry
+            console.error('Failed to write port events:', error);
+            logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to write ${batch.length} port events: ${error.message}`);
+            return;
+        }
+
+        if (pendingPortEvents.length === 0) {
+            await refillFromTelemetryJournal();
+        }
+    }
+}
+
+// Serializes flushes; callers that need projections to be current (e.g. before billing a session) await this
+let portEventFlushChain = Promise.resolve();
+function flushPortEvents() {
+    portEventFlushChain = portEventFlushChain.catch(() => {}).then(writePendingPortEvents);
+    return portEventFlushChain;
+}
+
+// Rebuilds projections by replaying port_events in log order. Events appended while the
+// replay runs are past its snapshot and reach the projections through the live flush instead.
+async function replayPortEvents(projectionNames = Object.keys(PORT_EVENT_PROJECTIONS)) {
+    await flushPortEvents();
+    const client = await reportingPool.connect();
+    let replayed = 0;
+    try {
+        await client.query('BEGIN');
+        const { rows: [{ max_event_id: maxEventId }] } = await client.query(
+            'SELECT COALESCE(MAX(event_id), 0) AS max_event_id FROM port_events'
+        );
+
+        for (const name of projectionNames) {
+            const projection = PORT_EVENT_PROJECTIONS[name];
+            if (projection.reset) await projection.reset(client, maxEventId);
+        }
+
+        let lastEventId = 0;
+        for (;;) {
+            const { rows: events } = await client.query(
+                `SELECT * FROM port_events
+                 WHERE event_id > $1 AND event_id <= $2
+                 ORDER BY event_id
+                 LIMIT $3`,
+                [lastEventId, maxEventId, PORT_EVENT_REPLAY_PAGE_SIZE]
+            );
+            if (events.length === 0) break;
+            await applyPortEventProjections(client, events, projectionNames);
+            replayed += events.length;
+            lastEventId = events[events.length - 1].event_id;
+        }
+
+        await client.query('COMMIT');
+        return { replayed, maxEventId: Number(maxEventId), projections: projectionNames };
+    } catch (error) {
+        await client.query('ROLLBACK').catch(() => {});
+        throw error;
+    } finally {
+        client.release();
+    }
+}
+
+// --- Command outbox: enqueue in the caller's transaction, drain in batches ---
+
+// Runs `work(client)` inside BEGIN/COMMIT on a dedicated connection (control pool unless told otherwise)
+async function runInTransaction(work, db = controlPool) {
+    const client = await db.connect();
+    try {
+        await client.query('BEGIN');
+        const result = await work(client);
+        await client.query('COMMIT');
+        return result;
+    } catch (error) {
+        await client.query('ROLLBACK').catch(() => {});
+        throw error;
+    } finally {
+        client.release();
+    }
+}
+
+// Queues a control command. Pass the transaction's client so the command commits with the state change.
+async function enqueueControlCommand(db, { deviceId, portNumber, command, sessionId = null, source = LOG_SOURCES.API }) {
+    const { rows } = await db.query(preparedStatement('enqueueControlCommand', [deviceId, portNumber, command, sessionId, source]));
+    return rows[0].command_id;
+}
+
+function publishMqttMessage(topic, message, options = { qos: 1 }) {
+    return mqttCircuit.exec(() => new Promise((resolve, reject) => {
+        const timer = setTimeout(() => reject(new Error('Publish timed out waiting for PUBACK')), COMMAND_PUBLISH_TIMEOUT_MS);
+        mqttClient.publish(topic, message, options, (err) => {
+            clearTimeout(timer);
+            if (err) reject(err);
+            else resolve();
+        });
+    }));
+}
+
+let commandOutboxDrainInProgress = false;
+let commandOutboxDrainRequested = false;
+
+// Publishes due commands. Only the newest pending command per port is sent; older ones are
+// marked superseded, so a burst of ON/OFF toggles (or a bulk OFF) costs one publish per port.
+async function drainCommandOutbox() {
+    if (commandOutboxDrainInProgress) {
+        commandOutboxDrainRequested = true;
+        return;
+    }
+    if (!mqttClient.connected || mqttCircuit.isRejecting()) {
+        return; // Retried on reconnect and by the poll
+    }
+
+    commandOutboxDrainInProgress = true;
+    try {
+        const { rows } = await controlPool.query(preparedStatement('selectPendingCommands', [COMMAND_OUTBOX_STATUS.PENDING, COMMAND_OUTBOX_BATCH_SIZE]));
+        if (rows.length === 0) return;
+
+        const latestByPort = new Map();
+        const supersededIds = [];
+        for (const row of rows) {
+            const key = portStateKey(row.device_id, row.port_number);
+            const previous = latestByPort.get(key);
+            if (previous) supersededIds.push(previous.command_id);
+            latestByPort.set(key, row);
+        }
+        if (supersededIds.length > 0) {
+            await controlPool.query(preparedStatement('supersedeCommands', [COMMAND_OUTBOX_STATUS.SUPERSEDED, supersededIds, COMMAND_OUTBOX_STATUS.PENDING]));
+        }
+
+        let due = Array.from(latestByPort.values()).filter(row => row.is_due);
+        // A breaker that is not closed lets one trial publish through; the rest wait for its outcome
+        const trial = mqttCircuit.state !== CIRCUIT_STATES.CLOSED;
+        if (trial && due.length > 1) due = due.slice(0, 1);
+        const results = await Promise.allSettled(due.map(row => publishMqttMessage(
+            `${MQTT_TOPICS.CONTROL}${row.device_id}`,
+            JSON.stringify({ command: row.command, port_number: row.port_number })
+        )));
+
+        const sentIds = [];
+        const failed = [];
+        let deferred = 0; // Rejected by the breaker without a publish attempt; not counted against the command
+        results.forEach((result, index) => {
+            if (result.status === 'fulfilled') sentIds.push(due[index].command_id);
+            else if (isCircuitOpenError(result.reason)) deferred++;
+            else failed.push({ row: due[index], error: result.reason });
+        });
+        if (trial && sentIds.length > 0) commandOutboxDrainRequested = true; // Trial passed: send the rest now
+        if (deferred > 0) console.warn(`Outbox: ${deferred} control commands held back by the open MQTT circuit.`);
+
+        if (sentIds.length > 0) {
+            await controlPool.query(preparedStatement('markCommandsSent', [COMMAND_OUTBOX_STATUS.SENT, sentIds]));
+            console.log(`Outbox: Published ${sentIds.length} control commands (${supersededIds.length} superseded).`);
+        }
+
+        if (failed.length > 0) {
+            await controlPool.query(preparedStatement('markCommandsFailed', [
+                failed.map(item => item.row.command_id),
+                COMMAND_OUTBOX_MAX_ATTEMPTS,
+                COMMAND_OUTBOX_STATUS.FAILED,
+                COMMAND_OUTBOX_BACKOFF_MAX_SECONDS,
+                COMMAND_OUTBOX_BACKOFF_BASE_SECONDS,
+                failed.map(item => item.error?.message || String(item.error))
+            ]));
+            failed.forEach(({ row, error }) => {
+                const gaveUp = row.attempts + 1 >= COMMAND_OUTBOX_MAX_ATTEMPTS;
+                console.error(`Outbox: Failed to publish '${row.command}' to ${row.device_id} Port ${row.port_number} (attempt ${row.attempts + 1}):`, error);
+                logSystemEvent(
+                    gaveUp ? LOG_TYPES.ERROR : LOG_TYPES.WARN,
+                    LOG_SOURCES.MQTT,
+                    `${gaveUp ? 'Gave up on' : 'Will retry'} control command ${row.command_id} '${row.command}' for ${portStateKey(row.device_id, row.port_number)}: ${error?.message || error}`
+                );
+            });
+        }
+    } catch (error) {
+        console.error('Outbox: Error draining command outbox:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Error draining command outbox: ${error.message}`);
+    } finally {
+        commandOutboxDrainInProgress = false;
+        if (commandOutboxDrainRequested) {
+            commandOutboxDrainRequested = false;
+            setImmediate(drainCommandOutbox);
+        }
+    }
+}
+
+// Called after a transaction that enqueued commands has committed
+function scheduleCommandOutboxDrain() {
+    setImmediate(drainCommandOutbox);
+}
+
+// --- Reference data cache ---
+// Stations, plans and quota pricing change only through admin routes, so hot paths read them
+// from memory. Rows are typed once on load (numeric columns arrive from pg as strings) and
+// frozen, since every caller shares them. Admin writes call invalidateReferenceData(), which
+// reloads locally and NOTIFYs every other process; a periodic full reload backs that up.
+const REFERENCE_DATA_SOURCES = {
+    stations: {
+        text: `SELECT station_id, station_name, device_mqtt_id, is_active, price_per_mah, price_per_kwh,
+                      num_free_ports, num_premium_ports, solar_panel_wattage, battery_capacity_mah, current_battery_level, longitude
+               FROM charging_station`,
+        key: 'station_id',
+        numeric: ['price_per_mah', 'price_per_kwh', 'num_free_ports', 'num_premium_ports', 'solar_panel_wattage', 'battery_capacity_mah', 'current_battery_level', 'longitude']
+    },
+    plans: {
+        text: 'SELECT * FROM subscription_plans',
+        key: 'plan_id',
+        numeric: ['price', 'daily_mah_limit', 'max_session_duration_hours', 'cooldown_percentage', 'cooldown_time_hour', 'duration_value']
+    },
+    quotaPricing: {
+        text: 'SELECT * FROM quota_extension_pricing',
+        key: 'extension_type',
+        numeric: ['price_per_mah', 'base_fee', 'penalty_percentage', 'min_purchase_mah', 'max_purchase_mah',
+                  'extension_amount_mah', 'price_per_transaction']
+    },
+    tariffs: {
+        text: `SELECT tariff_id, station_id, days_of_week, start_time::text AS start_time, end_time::text AS end_time, price_per_mah
+               FROM station_tariff_windows
+               ORDER BY station_id, start_time`,
+        key: 'station_id',
+        group: true, // station_id -> its windows
+        numeric: ['price_per_mah'],
+        prepare: row => ({ ...row, start_minute: minuteOfDay(row.start_time), end_minute: minuteOfDay(row.end_time) })
+    }
+};
+
+const referenceData = {
+    stations: new Map(),
+    plans: new Map(),
+    quotaPricing: new Map(),
+    tariffs: new Map()
+};
+const referenceDataState = { loadedAt: {}, reloads: 0, notificationsReceived: 0, listening: false };
+const referenceDataInstanceId = crypto.randomBytes(6).toString('hex'); // skips our own NOTIFYs
+
+function typeReferenceRow(row, source) {
+    const typed = source.prepare ? source.prepare(row) : { ...row };
+    for (const column of source.numeric) {
+        if (typed[column] !== undefined && typed[column] !== null) typed[column] = Number(typed[column]);
+    }
+    return Object.freeze(typed);
+}
+
+async function loadReferenceData(kind) {
+    const source = REFERENCE_DATA_SOURCES[kind];
+    const { rows } = await controlPool.query(source.text);
+    const entries = new Map();
+    for (const row of rows) {
+        const typed = typeReferenceRow(row, source);
+        if (!source.group) {
+            entries.set(row[source.key], typed);
+        } else if (entries.has(row[source.key])) {
+            entries.get(row[source.key]).push(typed);
+        } else {
+            entries.set(row[source.key], [typed]);
+        }
+    }
+    if (source.group) entries.forEach(Object.freeze);
+    referenceData[kind] = entries;
+    referenceDataState.loadedAt[kind] = new Date();
+    referenceDataState.reloads++;
+    return referenceData[kind];
+}
+
+// Concurrent misses and notifications for the same kind share one reload
+function reloadReferenceData(kind) {
+    return singleFlight(`reference:${kind}`, () => loadReferenceData(kind), 0);
+}
+
+async function loadAllReferenceData() {
+    await Promise.all(Object.keys(REFERENCE_DATA_SOURCES).map(reloadReferenceData));
+}
+
+// Called by admin routes after their write has committed
+async function invalidateReferenceData(kind) {
+    try {
+        await reloadReferenceData(kind);
+        await controlPool.query('SELECT pg_notify($1, $2)', [REFERENCE_DATA_CHANNEL, `${referenceDataInstanceId}:${kind}`]);
+    } catch (error) {
+        console.error(`ReferenceData: Failed to refresh ${kind}:`, error.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Reference data refresh for ${kind} failed: ${error.message}`);
+    }
+}
+
+async function getReferenceRow(kind, key) {
+    const cached = referenceData[kind].get(key);
+    if (cached || key === undefined || key === null) return cached || null;
+    // Unknown key: created since the last load (or before the cache warmed up)
+    return (await reloadReferenceData(kind)).get(key) || null;
+}
+
+const getStationConfig = (stationId) => getReferenceRow('stations', stationId);
+const getStationTariffs = (stationId) => referenceData.tariffs.get(stationId) || [];
+const getSubscriptionPlan = (planId) => getReferenceRow('plans', planId);
+const getQuotaPricing = (extensionType) => getReferenceRow('quotaPricing', extensionType);
+
+// Dedicated connection for LISTEN; pooled clients are handed back and would drop the subscription
+async function listenForReferenceDataChanges() {
+    const client = new Client(pgPoolOptions(1));
+    let retrying = false;
+    const retry = () => {
+        if (retrying) return;
+        retrying = true;
+        referenceDataState.listening = false;
+        client.removeAllListeners();
+        client.end().catch(() => {});
+        setTimeout(listenForReferenceDataChanges, REFERENCE_DATA_LISTEN_RETRY_MS);
+    };
+
+    client.on('notification', ({ channel, payload }) => {
+        if (channel !== REFERENCE_DATA_CHANNEL) return;
+        const [origin, kind] = String(payload).split(':');
+        if (origin === referenceDataInstanceId || !REFERENCE_DATA_SOURCES[kind]) return;
+        referenceDataState.notificationsReceived++;
+        reloadReferenceData(kind).catch(error => {
+            console.error(`ReferenceData: Reload of ${kind} after notification failed:`, error.message);
+        });
+    });
+    client.on('error', (error) => {
+        console.error('ReferenceData: LISTEN connection error:', error.message);
+        retry();
+    });
+
+    try {
+        await client.connect();
+        await client.query(`LISTEN ${REFERENCE_DATA_CHANNEL}`);
+        referenceDataState.listening = true;
+        // Anything changed while we were not listening
+        if (referenceDataState.reloads > 0) await loadAllReferenceData();
+    } catch (error) {
+        console.error('ReferenceData: Failed to LISTEN for changes:', error.message);
+        retry();
+    }
+}
+
+function getReferenceDataMetrics() {
+    return {
+        stations: referenceData.stations.size,
+        plans: referenceData.plans.size,
+        quota_pricing: referenceData.quotaPricing.size,
+        tariff_stations: referenceData.tariffs.size,
+        listening: referenceDataState.listening,
+        reloads: referenceDataState.reloads,
+        notifications_received: referenceDataState.notificationsReceived
+    };
+}
+
+function setupReferenceDataCache() {
+    loadAllReferenceData().catch(error => {
+        console.error('ReferenceData: Initial load failed; entries load on first use:', error.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Reference data initial load failed: ${error.message}`);
+    });
+    listenForReferenceDataChanges();
+    setInterval(() => {
+        loadAllReferenceData().catch(error => console.error('ReferenceData: Periodic reload failed:', error.message));
+    }, REFERENCE_DATA_REFRESH_INTERVAL_MS);
+    console.log(`Reference data cache set up (LISTEN ${REFERENCE_DATA_CHANNEL}, full reload every ${REFERENCE_DATA_REFRESH_INTERVAL_MS / 60000} minutes).`);
+}
+
+// --- Time-of-use tariffs ---
+// A station's windows (station_tariff_windows) override its flat price_per_mah for the minutes
+// they cover, in server local time like the daily quota reset. A window whose end is not after
+// its start runs past midnight; days_of_week (0 = Sunday) NULL means every day; the first
+// matching window wins. Everything comes from the reference data cache, so pricing a reading is free.
+function minuteOfDay(timeText) {
+    const [hours, minutes] = String(timeText).split(':').map(Number);
+    return hours * 60 + minutes;
+}
+
+function tariffAppliesOn(tariff, day) {
+    return !tariff.days_of_week || tariff.days_of_week.includes(day);
+}
 
-// MQTT Client Options
-const mqttOptions = {
-    clientId: `backend_server_${Math.random().toString(16).substring(2, 10)}`, // Unique ID for backend
-    username: MQTT_USERNAME,
-    password: MQTT_PASSWORD,
-    clean: true, // Clean session (no persistent session for backend)
-    rejectUnauthorized: process.env.NODE_ENV === 'production' && !!EMQX_CA_CERT, // Ensure server cert is valid in production
-    ca: EMQX_CA_CERT, // Provide the CA certificate
-    keepalive: 60,
-    reconnectPeriod: 5000,
-    connectTimeout: 30000,
-};
+function tariffCovers(tariff, day, minute) {
+    if (tariff.start_minute < tariff.end_minute) {
+        return tariffAppliesOn(tariff, day) && minute >= tariff.start_minute && minute < tariff.end_minute;
+    }
+    // Overnight: the part after midnight belongs to the day the window opened
+    if (minute >= tariff.start_minute) return tariffAppliesOn(tariff, day);
+    return minute < tariff.end_minute && tariffAppliesOn(tariff, (day + 6) % 7);
+}
 
-// Create MQTT client instance
-const mqttClient = mqtt.connect(`mqtts://${MQTT_BROKER_HOST}:${MQTT_PORT}`, mqttOptions);
+// Tariff windows are wall-clock times in STATION_TIME_ZONE, not the server's zone
+function stationPricePerMahAt(stationId, at = new Date()) {
+    const { day, minute } = stationClock(at);
+    const tariff = getStationTariffs(stationId).find(candidate => tariffCovers(candidate, day, minute));
+    if (tariff) return tariff.price_per_mah;
+    return referenceData.stations.get(stationId)?.price_per_mah || DEFAULT_PRICE_PER_MAH;
+}
+
+// Priced when the reading is logged; the session_energy projection sums these into accrued_cost
+function usageReadingCost(stationId, consumptionWatts, at) {
+    const { kwh } = usageEnergyIncrement(consumptionWatts);
+    return usageCostIncrement(kwh, stationPricePerMahAt(stationId, at));
+}
+
+// Final cost from a session's totals row: its accrued cost, or the flat-price calculation when
+// some of its energy was logged unpriced (sessions that predate accrual)
+async function finalSessionCost(sessionId, totals, stationId) {
+    if (totals.accrued_cost !== null && totals.accrued_cost !== undefined) return Number(totals.accrued_cost);
+    return calculateSessionCost(sessionId, parseFloat(totals.energy_consumed_kwh) || 0, stationId);
+}
 
 // --- Helper function to calculate cost ---
-async function calculateSessionCost(sessionId, energyKWH) {
+// stationId saves the session lookup when the caller already knows it
+async function calculateSessionCost(sessionId, energyKWH, stationId = null) {
     try {
-        const sessionResult = await pool.query(
-            "SELECT station_id FROM charging_session WHERE session_id = $1",
-            [sessionId]
-        );
+        if (!stationId) {
+            const sessionResult = await controlPool.query(preparedStatement('getSessionStation', [sessionId]));
+            stationId = sessionResult.rows[0]?.station_id;
+        }
 
-        if (sessionResult.rows.length > 0) {
-            const stationId = sessionResult.rows[0].station_id;
-            const stationPricing = await pool.query(
-                "SELECT price_per_mah FROM charging_station WHERE station_id = $1",
-                [stationId]
-            );
-            const pricePerMAH = stationPricing.rows[0]?.price_per_mah || DEFAULT_PRICE_PER_MAH;
-            // Convert kWh to mAh for pricing calculation
-            // Assuming 12V nominal voltage: mAh = kWh * 1000 / (12 * 1000) = kWh / 12
-            const energyMAH = energyKWH / 12;
-            return energyMAH * pricePerMAH;
+        if (stationId) {
+            const station = await getStationConfig(stationId);
+            const pricePerMAH = station?.price_per_mah || DEFAULT_PRICE_PER_MAH;
+            return usageCostIncrement(energyKWH, pricePerMAH);
         }
     } catch (error) {
         console.error(`Error calculating session cost for session ${sessionId}:`, error);
@@ -244,11 +2956,8 @@ async function createUserNotification({ userId, type = 'info', content, context
     const normalizedType = allowedTypes.includes(type) ? type : 'info';
 
     try {
-        await pool.query(
-            `INSERT INTO notification (user_id, notification_type, notification_context, notification_content)
-             VALUES ($1, $2::notification_type, $3, $4)`,
-            [userId, normalizedType, context || null, content]
-        );
+        await pool.query(preparedStatement('insertNotification', [userId, normalizedType, context || null, content]));
+        bumpResource(`notifications:${userId}`);
         logSystemEvent(
             LOG_TYPES.INFO,
             LOG_SOURCES.BACKEND,
@@ -268,15 +2977,17 @@ async function createUserNotification({ userId, type = 'info', content, context
 
 async function getActiveSessionForPort(portId) {
     if (!portId) return null;
+
+    // The port's state machine owns its active session; only unknown ports need the DB
+    const entry = getPortEntryById(portId);
+    if (entry) {
+        return entry.sessionId
+            ? { session_id: entry.sessionId, user_id: entry.userId, station_id: entry.stationId }
+            : null;
+    }
+
     try {
-        const { rows } = await pool.query(
-            `SELECT session_id, user_id, station_id
-             FROM charging_session
-             WHERE port_id = $1 AND session_status = $2
-             ORDER BY start_time DESC
-             LIMIT 1`,
-            [portId, SESSION_STATUS.ACTIVE]
-        );
+        const { rows } = await controlPool.query(preparedStatement('getActiveSessionForPort', [portId, SESSION_STATUS.ACTIVE]));
         return rows[0] || null;
     } catch (error) {
         console.error('Failed to fetch active session for port:', error);
@@ -285,18 +2996,195 @@ async function getActiveSessionForPort(portId) {
     }
 }
 
+function userDeviceKey(deviceType, deviceName) {
+    return `${deviceType}|${deviceName}`;
+}
+
+// Normalizes one telemetry sample from POST /api/user/devices. Returns null when device_type is missing.
+function normalizeUserDeviceUpdate(raw) {
+    if (!raw || typeof raw !== 'object' || !raw.device_type) {
+        return null;
+    }
+
+    const numberOrNull = (value) => {
+        if (value === null || value === undefined || value === '') return null;
+        const parsed = Number(value);
+        return Number.isFinite(parsed) ? parsed : null;
+    };
+
+    // Client timestamps are trusted for ordering only; never let them run ahead of server time
+    const now = Date.now();
+    const recordedMs = raw.recorded_at !== undefined ? new Date(raw.recorded_at).getTime() : NaN;
+    const recordedAt = new Date(Number.isFinite(recordedMs) ? Math.min(recordedMs, now) : now);
+
+    return {
+        device_type: String(raw.device_type),
+        device_name: raw.device_name ? String(raw.device_name) : 'Unknown Device',
+        device_model: raw.device_model ?? null,
+        battery_capacity_mah: numberOrNull(raw.battery_capacity_mah),
+        current_battery_level: numberOrNull(raw.current_battery_level),
+        is_charging: Boolean(raw.is_charging),
+        recorded_at: recordedAt
+    };
+}
+
+// Applies a telemetry sample to the in-memory latest-state cache and queues it for the next
+// batched UPSERT when something changed (or when the persisted heartbeat is getting old).
+function ingestUserDeviceTelemetry(userId, update) {
+    let devices = userDeviceTelemetry.get(userId);
+    if (!devices) {
+        devices = new Map();
+        userDeviceTelemetry.set(userId, devices);
+    }
+
+    const key = userDeviceKey(update.device_type, update.device_name);
+    let record = devices.get(key);
+
+    if (record && update.recorded_at < record.last_updated) {
+        return record; // Older sample from a batch; the cache already has newer state
+    }
+
+    const changed = !record ||
+        record.device_model !== update.device_model ||
+        record.battery_capacity_mah !== update.battery_capacity_mah ||
+        record.current_battery_level !== update.current_battery_level ||
+        record.is_charging !== update.is_charging;
+
+    if (!record) {
+        record = { device_id: null, user_id: userId, created_at: update.recorded_at, persisted_at: null };
+        devices.set(key, record);
+    }
+
+    Object.assign(record, {
+        device_type: update.device_type,
+        device_name: update.device_name,
+        device_model: update.device_model,
+        battery_capacity_mah: update.battery_capacity_mah,
+        current_battery_level: update.current_battery_level,
+        is_charging: update.is_charging,
+        last_updated: update.recorded_at
+    });
+
+    const heartbeatDue = !record.persisted_at ||
+        (record.last_updated.getTime() - record.persisted_at.getTime()) / 1000 >= USER_DEVICE_HEARTBEAT_PERSIST_SECONDS;
+    if (changed || heartbeatDue) {
+        pendingUserDeviceRecords.add(record);
+    }
+
+    return record;
+}
+
+function formatUserDeviceRecord(record) {
+    return {
+        device_id: record.device_id,
+        device_type: record.device_type,
+        device_name: record.device_name,
+        device_model: record.device_model,
+        battery_capacity_mah: record.battery_capacity_mah,
+        current_battery_level: record.current_battery_level,
+        is_charging: record.is_charging,
+        last_updated: record.last_updated,
+        created_at: record.created_at
+    };
+}
+
+let userDeviceFlushInProgress = false;
+
+// Writes every queued user_devices record in a single multi-row UPSERT
+async function flushUserDeviceTelemetry() {
+    if (userDeviceFlushInProgress || pendingUserDeviceRecords.size === 0) {
+        return;
+    }
+
+    userDeviceFlushInProgress = true;
+    const batch = Array.from(pendingUserDeviceRecords);
+    pendingUserDeviceRecords.clear();
+    const snapshotTimes = batch.map(record => record.last_updated);
+
+    try {
+        const { rows } = await ingestPool.query(preparedStatement('upsertUserDevices', [
+            batch.map(record => record.user_id),
+            batch.map(record => record.device_type),
+            batch.map(record => record.device_name),
+            batch.map(record => record.device_model),
+            batch.map(record => record.battery_capacity_mah),
+            batch.map(record => record.current_battery_level),
+            batch.map(record => record.is_charging),
+            snapshotTimes
+        ]));
+
+        const deviceIds = new Map(rows.map(row => [`${row.user_id}|${userDeviceKey(row.device_type, row.device_name)}`, row.device_id]));
+        batch.forEach((record, index) => {
+            record.device_id = deviceIds.get(`${record.user_id}|${userDeviceKey(record.device_type, record.device_name)}`) || record.device_id;
+            record.persisted_at = snapshotTimes[index];
+        });
+    } catch (error) {
+        // Keep the records queued so the next interval retries them
+        batch.forEach(record => pendingUserDeviceRecords.add(record));
+        console.error('Failed to flush user device telemetry:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to flush ${batch.length} user device records: ${error.message}`);
+    } finally {
+        userDeviceFlushInProgress = false;
+    }
+}
+
+function evictStaleUserDeviceTelemetry() {
+    const cutoff = Date.now() - USER_DEVICE_CACHE_TTL_SECONDS * 1000;
+    for (const [userId, devices] of userDeviceTelemetry) {
+        for (const [key, record] of devices) {
+            if (record.last_updated.getTime() < cutoff && !pendingUserDeviceRecords.has(record)) {
+                devices.delete(key);
+            }
+        }
+        if (devices.size === 0) {
+            userDeviceTelemetry.delete(userId);
+        }
+    }
+}
+
+// Latest phone telemetry for a user, served from memory; falls back to user_devices after a restart
 async function getLatestUserDeviceTelemetry(userId) {
     if (!userId) return null;
+
+    const cachedDevices = userDeviceTelemetry.get(userId);
+    if (cachedDevices && cachedDevices.size > 0) {
+        let latest = null;
+        for (const record of cachedDevices.values()) {
+            if (!latest || record.last_updated > latest.last_updated) {
+                latest = record;
+            }
+        }
+        return formatUserDeviceRecord(latest);
+    }
+
     try {
         const { rows } = await pool.query(
-            `SELECT device_id, device_name, device_model, current_battery_level, is_charging, last_updated
+            `SELECT device_id, device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging, last_updated, created_at
              FROM user_devices
              WHERE user_id = $1
              ORDER BY last_updated DESC
              LIMIT 1`,
             [userId]
         );
-        return rows[0] || null;
+        const row = rows[0];
+        if (!row) return null;
+
+        // Seed the cache so later full-charge checks for this user stay in memory
+        if (row.device_type && row.last_updated && !userDeviceTelemetry.has(userId)) {
+            const lastUpdated = new Date(row.last_updated);
+            userDeviceTelemetry.set(userId, new Map([[
+                userDeviceKey(row.device_type, row.device_name),
+                {
+                    ...row,
+                    user_id: userId,
+                    battery_capacity_mah: row.battery_capacity_mah === null ? null : Number(row.battery_capacity_mah),
+                    current_battery_level: row.current_battery_level === null ? null : Number(row.current_battery_level),
+                    last_updated: lastUpdated,
+                    persisted_at: lastUpdated
+                }
+            ]]));
+        }
+        return row;
     } catch (error) {
         console.error('Failed to fetch user device telemetry:', error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Fetch device telemetry failed for ${userId}: ${error.message}`, userId);
@@ -342,19 +3230,23 @@ function buildDeviceNotificationContext({ telemetry, fallbackUsed, extraParts =
 
 async function handleFullChargeReadyEvent({ deviceId, actualPortId, portNumber, reason }) {
     try {
-        const session = await getActiveSessionForPort(actualPortId);
-        if (!session) {
+        const entry = getPortEntryById(actualPortId);
+        if (!entry?.sessionId) {
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Full-charge ready event without active session for port ${actualPortId}`);
             return;
         }
 
-        const sessionId = session.session_id;
-        const currentState = fullChargeNotificationState.get(sessionId);
-        if (currentState?.fullSentAt) {
+        if (entry.fullCharge?.fullSentAt) {
             return;
         }
 
-        const telemetry = await getLatestUserDeviceTelemetry(session.user_id);
+        const sessionId = entry.sessionId;
+        const userId = entry.userId;
+        transitionPortState(entry, PORT_FSM_EVENTS.FULL_READY);
+        // Claim the notification before awaiting so a duplicate event cannot send it twice
+        entry.fullCharge = { fullSentAt: new Date(), fallbackUsed: false, disconnectSent: false };
+
+        const telemetry = await getLatestUserDeviceTelemetry(userId);
         const telemetryFresh = deviceTelemetryIsFresh(telemetry);
         const meetsStrictConditions = telemetryFresh && telemetry?.is_charging;
         const resolvedPortNumber = portNumber ?? 'unknown';
@@ -370,21 +3262,15 @@ async function handleFullChargeReadyEvent({ deviceId, actualPortId, portNumber,
         });
 
         await createUserNotification({
-            userId: session.user_id,
+            userId,
             type: 'success',
             content,
             context
         });
 
-        fullChargeNotificationState.set(sessionId, {
-            userId: session.user_id,
-            portId: actualPortId,
-            portNumber,
-            deviceId,
-            fullSentAt: new Date(),
-            fallbackUsed: !meetsStrictConditions,
-            disconnectSent: false
-        });
+        if (entry.sessionId === sessionId && entry.fullCharge) {
+            entry.fullCharge.fallbackUsed = !meetsStrictConditions;
+        }
     } catch (error) {
         console.error('handleFullChargeReadyEvent error:', error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to process full-charge ready event: ${error.message}`);
@@ -393,18 +3279,17 @@ async function handleFullChargeReadyEvent({ deviceId, actualPortId, portNumber,
 
 async function handleFullChargeDisconnectEvent({ actualPortId, portNumber, reason }) {
     try {
-        const session = await getActiveSessionForPort(actualPortId);
-        if (!session) {
+        const entry = getPortEntryById(actualPortId);
+        if (!entry?.sessionId) {
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Full-charge disconnect event without active session for port ${actualPortId}`);
             return;
         }
 
-        const sessionId = session.session_id;
-        const currentState = fullChargeNotificationState.get(sessionId) || {};
-
+        const currentState = entry.fullCharge || {};
         if (currentState.disconnectSent) {
             return;
         }
+        entry.fullCharge = { ...currentState, disconnectSent: true };
 
         const resolvedPortNumber = portNumber ?? 'unknown';
         const elapsedSeconds = currentState.fullSentAt
@@ -423,221 +3308,936 @@ async function handleFullChargeDisconnectEvent({ actualPortId, portNumber, reaso
         }
 
         await createUserNotification({
-            userId: session.user_id,
+            userId: entry.userId,
             type: 'info',
             content: `Charging session on Port ${resolvedPortNumber} has been disconnected automatically.`,
             context: contextParts.length ? contextParts.join(' • ') : null
         });
-
-        fullChargeNotificationState.set(sessionId, {
-            ...currentState,
-            disconnectSent: true
-        });
     } catch (error) {
         console.error('handleFullChargeDisconnectEvent error:', error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to process full-charge disconnect event: ${error.message}`);
     }
 }
 
-// --- Helper function to handle automatic port turn-off due to inactivity ---
-async function handleInactivityTurnOff(deviceId, internalPortNumber, actualPortId, sessionId) {
-    const sessionKey = `${deviceId}_${internalPortNumber}`;
-    console.log(`Timer expired for ${sessionKey}. Checking for inactivity.`);
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Inactivity check for session ${sessionId} on ${sessionKey}`);
+// --- Helper function to handle automatic port turn-off due to inactivity ---
+async function handleInactivityTurnOff(deviceId, internalPortNumber, actualPortId, sessionId) {
+    const sessionKey = portStateKey(deviceId, internalPortNumber);
+    const entry = getPortEntry(deviceId, internalPortNumber);
+    console.log(`Timer expired for ${sessionKey}. Checking for inactivity.`);
+
+    if (!entry || entry.sessionId !== sessionId) {
+        console.log(`Session ${sessionId} for ${sessionKey} was already inactive or not found. No auto turn-off needed.`);
+        return;
+    }
+    entry.inactivityTimerId = null;
+    if (entry.budget.paused) {
+        return; // Switched off by the power budget; the timer restarts when the port resumes
+    }
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Inactivity check for session ${sessionId} on ${sessionKey}`);
+
+    try {
+        const secondsSinceLastActivity = entry.lastActivityAt
+            ? Math.floor((Date.now() - entry.lastActivityAt.getTime()) / 1000)
+            : INACTIVITY_TIMEOUT_SECONDS + 1; // No recorded activity, assume it's inactive
+        console.log(`${sessionKey}: ${secondsSinceLastActivity} seconds since last activity.`);
+
+        // Only deactivate if truly inactive for the timeout period
+        if (secondsSinceLastActivity < INACTIVITY_TIMEOUT_SECONDS) {
+            resetPortInactivityTimer(entry, entry.lastActivityAt);
+            console.log(`Inactivity: Session ${sessionId} for ${sessionKey} is still active. Timer re-armed.`);
+            return;
+        }
+
+        // Close the session and queue the OFF command to ESP32 in one transaction
+        const finalized = await finalizeSessionFromDeviceEvent({
+            deviceId,
+            portNumberInDevice: internalPortNumber,
+            actualPortId,
+            endReason: `inactivity (${secondsSinceLastActivity}s)`,
+            source: LOG_SOURCES.BACKEND,
+            sendOffCommand: true
+        });
+        if (finalized) {
+            console.log(`Automatically queued OFF command for ${deviceId} Port ${internalPortNumber} due to inactivity (${secondsSinceLastActivity}s).`);
+            logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Queued auto OFF command for ${sessionKey} (session ${sessionId}) due to inactivity`);
+        }
+    } catch (error) {
+        console.error(`Error during inactivity turn-off for ${sessionKey}:`, error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Error during inactivity turn-off for ${sessionKey}: ${error.message}`);
+    }
+}
+
+async function finalizeSessionFromDeviceEvent({
+    deviceId,
+    portNumberInDevice,
+    actualPortId,
+    endReason = 'device_event',
+    source = LOG_SOURCES.MQTT,
+    sendOffCommand = false // queue an OFF for the relay (backend-initiated endings; device-reported OFFs need none)
+}) {
+    if (!deviceId || !portNumberInDevice || !actualPortId) {
+        return false;
+    }
+
+    const sessionKey = portStateKey(deviceId, portNumberInDevice);
+    const entry = await ensurePortEntry(deviceId, portNumberInDevice);
+    if (!entry?.sessionId || entry.state === PORT_FSM_STATES.FINALIZING) {
+        return false; // No session, or another event is already closing it
+    }
+
+    const sessionId = entry.sessionId;
+    const userId = entry.userId;
+    transitionPortState(entry, PORT_FSM_EVENTS.FINALIZE);
+
+    try {
+        await flushPortEvents(); // Bill against every usage event received so far
+        const { rows } = await controlPool.query(preparedStatement('getActiveSessionEnergy', [sessionId, SESSION_STATUS.ACTIVE]));
+
+        if (rows.length === 0) {
+            // Closed elsewhere (API, stale checker); just release the port
+            transitionPortState(entry, PORT_FSM_EVENTS.SESSION_ENDED);
+            return false;
+        }
+
+        const mAhConsumed = parseFloat(rows[0].energy_consumed_mah) || 0;
+        const sessionCost = await finalSessionCost(sessionId, rows[0], entry.stationId);
+
+        const completed = await runInTransaction(async (client) => {
+            const updateResult = await client.query(
+                "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3 AND session_status = $4",
+                [SESSION_STATUS.COMPLETED, sessionCost, sessionId, SESSION_STATUS.ACTIVE]
+            );
+            if (updateResult.rowCount === 0) {
+                return false;
+            }
+            await client.query(preparedStatement('refreshDailySessionTotals', [sessionId, SESSION_STATUS.COMPLETED, STATION_TIME_ZONE]));
+
+            if (userId) {
+                await client.query(
+                    "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
+                    [mAhConsumed, userId]
+                );
+            }
+            if (sendOffCommand) {
+                await enqueueControlCommand(client, {
+                    deviceId,
+                    portNumber: portNumberInDevice,
+                    command: CHARGER_STATES.OFF,
+                    sessionId,
+                    source
+                });
+            }
+            return true;
+        });
+
+        transitionPortState(entry, PORT_FSM_EVENTS.SESSION_ENDED);
+        if (!completed) {
+            return false;
+        }
+        if (sendOffCommand) {
+            scheduleCommandOutboxDrain();
+        }
+
+        logSystemEvent(
+            LOG_TYPES.INFO,
+            source,
+            `Auto-completed session ${sessionId} for ${sessionKey}. Reason: ${endReason}. Cost: $${sessionCost.toFixed(2)}`
+        );
+
+        return true;
+    } catch (error) {
+        if (entry.sessionId === sessionId) {
+            transitionPortState(entry, PORT_FSM_EVENTS.FINALIZE_FAILED);
+        }
+        throw error;
+    }
+}
+
+
+// --- Store-and-forward backfill ingestion ---
+
+// Validates and sorts a device's buffered readings. Accepts the usage frame decoded from a
+// charger/backfill message, or a parsed { port_number?, boot?, readings: [...] } body (HTTP route).
+// Validation and energy (validateConsumption, usageEnergyIncrement) run over the frame's columns.
+function normalizeBackfillReadings(bodyOrFrame) {
+    const frame = telemetryCodec.isUsageFrame(bodyOrFrame) ? bodyOrFrame : telemetryCodec.usageFrameFromBody(bodyOrFrame);
+    const now = Date.now();
+    const integrated = telemetryCodec.integrateUsage(frame, {
+        oldestMs: now - BACKFILL_MAX_AGE_HOURS * 3600 * 1000,
+        newestMs: now + 60 * 1000,
+        maxWatts: MAX_REASONABLE_CONSUMPTION,
+        voltage: NOMINAL_CHARGING_VOLTAGE_DC,
+        intervalSeconds: USAGE_REPORT_INTERVAL_SECONDS,
+        maxReadings: BACKFILL_MAX_READINGS
+    });
+
+    const accepted = [];
+    for (let i = 0; i < integrated.accepted.length; i++) {
+        if (!integrated.accepted[i]) continue;
+        const seq = frame.seq[i];
+        accepted.push({
+            portNumber: frame.portNumber[i],
+            occurredAt: new Date(frame.timestamp[i]),
+            consumptionWatts: integrated.watts[i],
+            kwh: integrated.kwh[i],
+            chargerState: telemetryCodec.chargerStateAt(frame, i),
+            seq: Number.isSafeInteger(seq) && seq >= 0 ? seq : null,
+            boot: telemetryCodec.bootAt(frame, i)
+        });
+    }
+
+    const rejected = frame.count - integrated.acceptedCount;
+    accepted.sort((a, b) => a.occurredAt - b.occurredAt);
+    return { readings: accepted, rejected };
+}
+
+// Merges buffered readings into the usage log in one statement, then recomputes the totals of every
+// session they touch. Sessions closed during the outage are extended, or reopened if still charging.
+async function ingestTelemetryBackfill(deviceId, body, source = LOG_SOURCES.MQTT) {
+    const { readings, rejected } = normalizeBackfillReadings(body);
+    const summary = { received: readings.length + rejected, inserted: 0, duplicates: 0, rejected, sessionsAdjusted: 0, sessionsReopened: 0 };
+
+    const rows = [];
+    for (const reading of readings) {
+        const entry = await ensurePortEntry(deviceId, reading.portNumber);
+        if (entry) rows.push({ ...reading, entry });
+        else summary.rejected++;
+    }
+    if (rows.length === 0) return summary;
+
+    await flushPortEvents(); // Live events must be in the log before dedupe and recomputation
+
+    const { inserted, sessions } = await runInTransaction(async (client) => {
+        const insertResult = await client.query(
+            `WITH incoming AS (
+                SELECT * FROM UNNEST($1::uuid[], $2::int[], $3::timestamptz[], $4::real[], $5::varchar[], $6::bigint[], $7::varchar[], $13::float8[])
+                    AS r(port_id, port_number, occurred_at, consumption_watts, charger_state, seq, boot, cost_increment)
+             ),
+             fresh AS (
+                SELECT DISTINCT ON (r.port_id, COALESCE(r.seq::text || '|' || COALESCE(r.boot, ''), r.occurred_at::text)) r.*
+                FROM incoming r
+                WHERE NOT EXISTS (
+                    SELECT 1 FROM port_events pe
+                    WHERE pe.port_id = r.port_id
+                      AND pe.event_type = $8::varchar
+                      AND pe.occurred_at > r.occurred_at - make_interval(hours => $9::int)
+                      AND ((r.seq IS NOT NULL AND pe.payload->>'seq' = r.seq::text AND COALESCE(pe.payload->>'boot', '') = COALESCE(r.boot, ''))
+                        OR (r.seq IS NULL AND (pe.occurred_at = r.occurred_at -- earlier backfill: occurred_at is device time
+                            OR round((pe.payload->>'device_timestamp')::numeric) = round(EXTRACT(EPOCH FROM r.occurred_at)::numeric * 1000)))) -- live: receive time
+                )
+                ORDER BY r.port_id, COALESCE(r.seq::text || '|' || COALESCE(r.boot, ''), r.occurred_at::text), r.occurred_at
+             )
+             INSERT INTO port_events (event_type, device_id, port_number, port_id, session_id, occurred_at, charger_state, consumption_watts, payload, cost_increment)
+             SELECT $8::varchar, $10::varchar, f.port_number, f.port_id, s.session_id, f.occurred_at, f.charger_state, f.consumption_watts,
+                    jsonb_strip_nulls(jsonb_build_object('seq', f.seq, 'boot', f.boot, 'backfill', true)), f.cost_increment
+             FROM fresh f
+             LEFT JOIN LATERAL (
+                SELECT cs.session_id, cs.end_time
+                FROM charging_session cs
+                WHERE cs.port_id = f.port_id AND cs.start_time <= f.occurred_at
+                ORDER BY cs.start_time DESC
+                LIMIT 1
+             ) s ON s.end_time IS NULL
+                 OR s.end_time >= f.occurred_at
+                 OR (f.charger_state = $11 AND f.occurred_at <= s.end_time + make_interval(hours => $12::int))
+             ORDER BY f.occurred_at
+             RETURNING event_type, session_id, occurred_at, consumption_watts`,
+            [
+                rows.map(row => row.entry.portId),
+                rows.map(row => row.portNumber),
+                rows.map(row => row.occurredAt),
+                rows.map(row => row.consumptionWatts),
+                rows.map(row => row.chargerState),
+                rows.map(row => row.seq),
+                rows.map(row => (row.boot === null ? null : String(row.boot))),
+                PORT_EVENT_TYPES.USAGE,
+                BACKFILL_MAX_AGE_HOURS,
+                deviceId,
+                CHARGER_STATES.ON,
+                BACKFILL_SESSION_EXTENSION_HOURS,
+                rows.map(row => usageCostIncrement(row.kwh, stationPricePerMahAt(row.entry.stationId, row.occurredAt)))
+            ]
+        );
+
+        // Merged readings bypass the live flush, so add their energy to the per-user daily totals here
+        await applyPortEventProjections(client, insertResult.rows, ['daily_energy']);
+
+        const sessionIds = [...new Set(insertResult.rows.map(row => row.session_id).filter(Boolean))];
+        if (sessionIds.length === 0) {
+            return { inserted: insertResult.rowCount, sessions: [] };
+        }
+
+        // Lock the sessions, then recompute their totals from the full log in one pass
+        const { rows: affected } = await client.query(
+            `SELECT cs.session_id, cs.session_status, cs.end_time, cs.user_id, cs.port_id, cs.station_id,
+                    COALESCE(cs.energy_consumed_mah, 0) AS old_mah,
+                    t.watts_sum, t.last_reading_at, t.last_charger_state,
+                    CASE WHEN t.fully_priced THEN t.cost_sum END AS accrued_cost
+             FROM charging_session cs
+             JOIN (
+                SELECT session_id,
+                       SUM(consumption_watts) AS watts_sum,
+                       SUM(cost_increment) AS cost_sum,
+                       BOOL_AND(cost_increment IS NOT NULL) AS fully_priced,
+                       MAX(occurred_at) AS last_reading_at,
+                       (ARRAY_AGG(charger_state ORDER BY occurred_at DESC))[1] AS last_charger_state
+                FROM port_events
+                WHERE event_type = $2 AND session_id = ANY($1::uuid[])
+                GROUP BY session_id
+             ) t ON t.session_id = cs.session_id
+             WHERE cs.session_id = ANY($1::uuid[])
+             FOR UPDATE OF cs`,
+            [sessionIds, PORT_EVENT_TYPES.USAGE]
+        );
+
+        const results = [];
+        for (const session of affected) {
+            const { kwh, mah } = usageEnergyIncrement(Number(session.watts_sum) || 0);
+            const oldMah = Number(session.old_mah) || 0;
+            const lastReadingAt = new Date(session.last_reading_at);
+            const entry = getPortEntryById(session.port_id);
+            const wasCompleted = session.session_status === SESSION_STATUS.COMPLETED;
+            const stillCharging = session.last_charger_state === CHARGER_STATES.ON &&
+                (Date.now() - lastReadingAt.getTime()) / 1000 < INACTIVITY_TIMEOUT_SECONDS;
+            const reopen = wasCompleted && stillCharging && entry && !entry.sessionId &&
+                entry.state !== PORT_FSM_STATES.FAULT;
+
+            if (reopen) {
+                await client.query(
+                    `UPDATE charging_session
+                     SET session_status = $1, end_time = NULL, cost = NULL,
+                         energy_consumed_kwh = $2, energy_consumed_mah = $3, total_mah_consumed = $3, last_status_update = $4,
+                         accrued_cost = $6
+                     WHERE session_id = $5`,
+                    [SESSION_STATUS.ACTIVE, kwh, mah, lastReadingAt, session.session_id, session.accrued_cost]
+                );
+                // The daily quota is charged again when the session closes for good
+                await client.query(
+                    "UPDATE user_subscription SET current_daily_mah_consumed = GREATEST(COALESCE(current_daily_mah_consumed, 0) - $1, 0) WHERE user_id = $2 AND is_active = true",
+                    [oldMah, session.user_id]
+                );
+                await client.query(preparedStatement('refreshDailySessionTotals', [session.session_id, SESSION_STATUS.COMPLETED, STATION_TIME_ZONE]));
+            } else if (wasCompleted) {
+                const cost = await finalSessionCost(session.session_id, { energy_consumed_kwh: kwh, accrued_cost: session.accrued_cost }, session.station_id);
+                await client.query(
+                    `UPDATE charging_session
+                     SET energy_consumed_kwh = $1, energy_consumed_mah = $2, total_mah_consumed = $2, cost = $3,
+                         end_time = GREATEST(end_time, $4), last_status_update = GREATEST(last_status_update, $4),
+                         accrued_cost = $6
+                     WHERE session_id = $5`,
+                    [kwh, mah, cost, lastReadingAt, session.session_id, session.accrued_cost]
+                );
+                await client.query(
+                    "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
+                    [mah - oldMah, session.user_id]
+                );
+                await client.query(preparedStatement('refreshDailySessionTotals', [session.session_id, SESSION_STATUS.COMPLETED, STATION_TIME_ZONE]));
+            } else {
+                await client.query(
+                    `UPDATE charging_session
+                     SET energy_consumed_kwh = $1, energy_consumed_mah = $2, total_mah_consumed = $2,
+                         last_status_update = GREATEST(last_status_update, $3), accrued_cost = $5
+                     WHERE session_id = $4`,
+                    [kwh, mah, lastReadingAt, session.session_id, session.accrued_cost]
+                );
+            }
+            results.push({ ...session, reopen, lastReadingAt, entry });
+        }
+        return { inserted: insertResult.rowCount, sessions: results };
+    }, ingestPool);
+
+    summary.inserted = inserted;
+    summary.duplicates = rows.length - inserted;
+
+    // Bring the port state machines in line with the committed sessions
+    for (const session of sessions) {
+        const entry = session.entry;
+        if (session.reopen) {
+            transitionPortState(entry, PORT_FSM_EVENTS.SESSION_STARTED, { sessionId: session.session_id, userId: session.user_id });
+            transitionPortState(entry, PORT_FSM_EVENTS.DEVICE_ON);
+            resetPortInactivityTimer(entry, session.lastReadingAt);
+            summary.sessionsReopened++;
+        } else {
+            if (entry && entry.sessionId === session.session_id &&
+                (!entry.lastActivityAt || entry.lastActivityAt < session.lastReadingAt)) {
+                resetPortInactivityTimer(entry, session.lastReadingAt);
+            }
+            summary.sessionsAdjusted++;
+        }
+    }
+
+    console.log(`Backfill: ${deviceId} ${JSON.stringify(summary)}`);
+    logSystemEvent(
+        LOG_TYPES.INFO,
+        source,
+        `Backfill from ${deviceId}: ${summary.inserted} readings merged, ${summary.duplicates} duplicates, ${summary.rejected} rejected, ` +
+        `${summary.sessionsAdjusted} sessions adjusted, ${summary.sessionsReopened} reopened`
+    );
+    return summary;
+}
+
+// --- MQTT Event Handlers ---
+mqttClient.on('connect', () => {
+    console.log('Backend connected to EMQX Cloud MQTT broker');
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, 'Backend connected to EMQX Cloud MQTT broker');
+    // Subscribe to topics for the single station device ID
+    mqttClient.subscribe(`${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}`, { qos: 1 }, (err) => {
+        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}`);
+        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}: ${err.message}`);
+    });
+    mqttClient.subscribe(`${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}`, { qos: 1 }, (err) => {
+        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}`);
+        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}: ${err.message}`);
+    });
+    mqttClient.subscribe(`${MQTT_TOPICS.BACKFILL}${ESP32_STATION_CLIENT_ID}`, { qos: 1 }, (err) => {
+        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.BACKFILL}${ESP32_STATION_CLIENT_ID}`);
+        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.BACKFILL}${ESP32_STATION_CLIENT_ID}: ${err.message}`);
+    });
+    // Existing station topics (if any, adjust topic string as needed)
+    mqttClient.subscribe(MQTT_TOPICS.STATION_GENERIC_STATUS, { qos: 1 }, (err) => {
+        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.STATION_GENERIC_STATUS}`);
+        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.STATION_GENERIC_STATUS}: ${err.message}`);
+    });
+    // Deliver commands queued while the broker was unreachable
+    scheduleCommandOutboxDrain();
+});
+// --- Station telemetry ---
+// station/<station>/status carries the station's own battery state of charge, solar input and
+// temperature. Readings go to a per-station ring buffer for live reads, are folded into one
+// station_telemetry row per minute, and move charging_station.current_battery_level only when the
+// whole-percent level changes. <station> is the station_id or the station's device_mqtt_id.
+const stationTelemetryMetrics = {
+    received: 0,
+    invalid: 0,
+    unknown_station: 0,
+    buckets_written: 0,
+    level_updates: 0
+};
+const unknownTelemetryStations = new Set(); // logged once each
+
+function numberInRange(value, min, max) {
+    if (value === undefined || value === null || value === '') return null;
+    const number = Number(value);
+    return Number.isFinite(number) && number >= min && number <= max ? number : null;
+}
+
+// Schema: { battery_soc | battery_level: 0-100, solar_watts: >= 0, temperature_c | temperature: °C, status? }.
+// Returns null when the message carries none of the three readings.
+function normalizeStationTelemetry(raw) {
+    if (!raw || typeof raw !== 'object') return null;
+    const reading = {
+        battery_soc: numberInRange(raw.battery_soc ?? raw.battery_level, 0, 100),
+        solar_watts: numberInRange(raw.solar_watts, 0, STATION_TELEMETRY_MAX_SOLAR_WATTS),
+        temperature_c: numberInRange(raw.temperature_c ?? raw.temperature, ...STATION_TELEMETRY_TEMPERATURE_RANGE_C),
+        status: typeof raw.status === 'string' ? raw.status : null,
+        recorded_at: new Date() // Server time, as for port usage
+    };
+    if (reading.battery_soc === null && reading.solar_watts === null && reading.temperature_c === null) {
+        return null;
+    }
+    return reading;
+}
+
+function resolveTelemetryStation(stationKey) {
+    const byId = referenceData.stations.get(stationKey);
+    if (byId) return byId;
+    for (const station of referenceData.stations.values()) {
+        if (station.device_mqtt_id === stationKey) return station;
+    }
+    return null;
+}
+
+function createStationBucket(start) {
+    return {
+        start,
+        samples: 0,
+        soc: { sum: 0, count: 0, min: null, max: null },
+        solar: { sum: 0, count: 0, max: null },
+        temperature: { sum: 0, count: 0, max: null }
+    };
+}
+
+function addToAggregate(aggregate, value) {
+    if (value === null) return;
+    aggregate.sum += value;
+    aggregate.count++;
+    if (aggregate.max === null || value > aggregate.max) aggregate.max = value;
+    if ('min' in aggregate && (aggregate.min === null || value < aggregate.min)) aggregate.min = value;
+}
+
+function closeStationBucket(stationId, state) {
+    const bucket = state.bucket;
+    state.bucket = null;
+    if (!bucket || bucket.samples === 0) return;
+    const average = (aggregate) => (aggregate.count > 0 ? aggregate.sum / aggregate.count : null);
+    pendingStationBuckets.push({
+        station_id: stationId,
+        bucket_start: bucket.start,
+        samples: bucket.samples,
+        battery_soc_avg: average(bucket.soc),
+        battery_soc_min: bucket.soc.min,
+        battery_soc_max: bucket.soc.max,
+        solar_watts_avg: average(bucket.solar),
+        solar_watts_max: bucket.solar.max,
+        temperature_c_avg: average(bucket.temperature),
+        temperature_c_max: bucket.temperature.max
+    });
+}
+
+function ingestStationTelemetry(stationKey, payload) {
+    const station = resolveTelemetryStation(stationKey);
+    if (!station) {
+        stationTelemetryMetrics.unknown_station++;
+        if (!unknownTelemetryStations.has(stationKey)) {
+            unknownTelemetryStations.add(stationKey);
+            logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Station telemetry for unknown station '${stationKey}'`);
+        }
+        return null;
+    }
+    const reading = normalizeStationTelemetry(payload);
+    if (!reading) {
+        stationTelemetryMetrics.invalid++;
+        console.warn(`MQTT: Station telemetry for ${station.station_id} has no valid readings: ${JSON.stringify(payload)}`);
+        return null;
+    }
+    stationTelemetryMetrics.received++;
+
+    let state = stationTelemetry.get(station.station_id);
+    if (!state) {
+        state = {
+            ring: new Array(STATION_TELEMETRY_RING_SIZE),
+            next: 0,
+            size: 0,
+            latest: null,
+            bucket: null,
+            persistedLevel: station.current_battery_level === null ? null : Math.round(station.current_battery_level),
+            pendingLevel: null
+        };
+        stationTelemetry.set(station.station_id, state);
+    }
+
+    state.ring[state.next] = reading;
+    state.next = (state.next + 1) % STATION_TELEMETRY_RING_SIZE;
+    state.size = Math.min(state.size + 1, STATION_TELEMETRY_RING_SIZE);
+    state.latest = reading;
+
+    const bucketMs = STATION_TELEMETRY_BUCKET_SECONDS * 1000;
+    const bucketStart = new Date(Math.floor(reading.recorded_at.getTime() / bucketMs) * bucketMs);
+    if (state.bucket && state.bucket.start.getTime() !== bucketStart.getTime()) {
+        closeStationBucket(station.station_id, state);
+    }
+    if (!state.bucket) state.bucket = createStationBucket(bucketStart);
+    state.bucket.samples++;
+    addToAggregate(state.bucket.soc, reading.battery_soc);
+    addToAggregate(state.bucket.solar, reading.solar_watts);
+    addToAggregate(state.bucket.temperature, reading.temperature_c);
+
+    // Change-only: a steady battery costs no charging_station writes
+    if (reading.battery_soc !== null) {
+        const level = Math.round(reading.battery_soc);
+        state.pendingLevel = level !== state.persistedLevel ? level : null;
+    }
+    return reading;
+}
+
+// Latest station reading when recent enough to stand in for charging_station's stored values
+function freshStationTelemetry(stationId, now = Date.now()) {
+    const latest = stationTelemetry.get(stationId)?.latest;
+    return latest && now - latest.recorded_at.getTime() <= STATION_TELEMETRY_FRESH_SECONDS * 1000 ? latest : null;
+}
 
-    try {
-        // Check if the session is still active in the DB (important if backend restarted)
-        const sessionCheck = await pool.query(
-            "SELECT session_id, session_status, last_status_update, energy_consumed_kwh, energy_consumed_mah FROM charging_session WHERE session_id = $1",
-            [sessionId]
-        );
+// Ring buffer contents, oldest first
+function stationTelemetryReadings(stationId) {
+    const state = stationTelemetry.get(stationId);
+    if (!state) return [];
+    const start = (state.next - state.size + STATION_TELEMETRY_RING_SIZE) % STATION_TELEMETRY_RING_SIZE;
+    return Array.from({ length: state.size }, (_, index) => state.ring[(start + index) % STATION_TELEMETRY_RING_SIZE]);
+}
 
-        if (sessionCheck.rows.length > 0 && sessionCheck.rows[0].session_status === SESSION_STATUS.ACTIVE) {
-            const lastUpdate = sessionCheck.rows[0].last_status_update;
-                            const energyConsumed = parseFloat(sessionCheck.rows[0].energy_consumed_kwh) || 0;
-                const mAhConsumed = parseFloat(sessionCheck.rows[0].energy_consumed_mah) || 0;
-            const now = new Date();
-            
-            // Calculate seconds since last activity
-            const secondsSinceLastActivity = lastUpdate ? 
-                Math.floor((now - new Date(lastUpdate)) / 1000) : 
-                INACTIVITY_TIMEOUT_SECONDS + 1; // If no last_status_update, assume it's inactive
-            
-            console.log(`${sessionKey}: ${secondsSinceLastActivity} seconds since last activity.`);
-            
-            // Only deactivate if truly inactive for the timeout period
-            if (secondsSinceLastActivity >= INACTIVITY_TIMEOUT_SECONDS) {
-                // Send OFF command to ESP32
-                const controlTopic = `${MQTT_TOPICS.CONTROL}${deviceId}`;
-                const mqttPayload = JSON.stringify({ command: CHARGER_STATES.OFF, port_number: internalPortNumber });
-                mqttClient.publish(controlTopic, mqttPayload, { qos: 1 }, (err) => {
-                    if (err) {
-                        console.error(`Failed to publish automatic OFF command to ${controlTopic}:`, err);
-                        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed auto OFF command for ${sessionKey}: ${err.message}`);
-                    } else {
-                        console.log(`Automatically sent OFF command to ${deviceId} Port ${internalPortNumber} due to inactivity (${secondsSinceLastActivity}s).`);
-                        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Sent auto OFF command for ${sessionKey} (session ${sessionId}) due to inactivity`);
-                    }
-                });
+let stationTelemetryFlushInProgress = false;
 
-                // Calculate final cost
-                const sessionCost = await calculateSessionCost(sessionId, energyConsumed);
+// Closes finished minute buckets (also for stations that went quiet), then writes buckets and changed levels
+async function flushStationTelemetry() {
+    if (stationTelemetryFlushInProgress) return;
+    stationTelemetryFlushInProgress = true;
 
-                // Mark session as auto_completed in DB
-                await pool.query(
-                    "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3",
-                    [SESSION_STATUS.COMPLETED, sessionCost, sessionId] // sessionId instead of session.session_id
-                )
-                console.log(`Marked session ${sessionId} as '${SESSION_STATUS.COMPLETED}' due to inactivity. Final Cost: $${sessionCost.toFixed(2)}`);
-                logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Session ${sessionId} auto-completed due to inactivity. Cost: $${sessionCost.toFixed(2)}`);
+    const bucketMs = STATION_TELEMETRY_BUCKET_SECONDS * 1000;
+    const now = Date.now();
+    const levels = [];
+    for (const [stationId, state] of stationTelemetry) {
+        if (state.bucket && state.bucket.start.getTime() + bucketMs <= now) {
+            closeStationBucket(stationId, state);
+        }
+        if (state.pendingLevel !== null) {
+            levels.push({ stationId, state, level: state.pendingLevel });
+        }
+    }
 
-                // Update user's daily consumption
-                const userResult = await pool.query(
-                    "SELECT user_id FROM charging_session WHERE session_id = $1",
-                    [sessionId]
-                );
-                if (userResult.rows.length > 0) {
-                    const userId = userResult.rows[0].user_id;
-                    await pool.query(
-                        "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
-                        [mAhConsumed, userId]
-                    );
-                    console.log(`Inactivity: Updated daily consumption for user ${userId} by ${mAhConsumed.toFixed(0)} mAh`);
-                }
+    try {
+        if (pendingStationBuckets.length > 0) {
+            const batch = pendingStationBuckets.splice(0);
+            try {
+                await ingestPool.query(preparedStatement('insertStationTelemetry', [
+                    batch.map(row => row.station_id),
+                    batch.map(row => row.bucket_start),
+                    batch.map(row => row.samples),
+                    batch.map(row => row.battery_soc_avg),
+                    batch.map(row => row.battery_soc_min),
+                    batch.map(row => row.battery_soc_max),
+                    batch.map(row => row.solar_watts_avg),
+                    batch.map(row => row.solar_watts_max),
+                    batch.map(row => row.temperature_c_avg),
+                    batch.map(row => row.temperature_c_max)
+                ]));
+                stationTelemetryMetrics.buckets_written += batch.length;
+            } catch (error) {
+                pendingStationBuckets.unshift(...batch); // Retried next interval; ON CONFLICT keeps it idempotent
+                throw error;
+            }
+        }
 
-                // Clear from in-memory tracking
-                delete activeChargerSessions[sessionKey];
-                delete activePortTimers[sessionKey];
-                console.log(`Inactivity: Removed session ${sessionId} from tracking maps for ${sessionKey}`);
-                fullChargeNotificationState.delete(sessionId);
-            } else {
-                // If still active but timer expired, reset the timer
-                console.log(`Session ${sessionId} for ${sessionKey} is still active. Resetting inactivity timer.`);
-                activePortTimers[sessionKey] = {
-                    timerId: setTimeout(
-                        () => handleInactivityTurnOff(deviceId, internalPortNumber, actualPortId, sessionId),
-                        INACTIVITY_TIMEOUT_SECONDS * 1000
-                    ),
-                    lastConsumptionTime: Date.now()
-                };
-                console.log(`Inactivity: Reset timer for ${sessionKey} for another ${INACTIVITY_TIMEOUT_SECONDS} seconds`);
+        if (levels.length > 0) {
+            await ingestPool.query(preparedStatement('updateStationBatteryLevels', [
+                levels.map(item => item.stationId),
+                levels.map(item => item.level)
+            ]));
+            for (const { state, level } of levels) {
+                state.persistedLevel = level;
+                if (state.pendingLevel === level) state.pendingLevel = null;
             }
-        } else {
-            console.log(`Session ${sessionId} for ${sessionKey} was already inactive or not found. No auto turn-off needed.`);
-            delete activeChargerSessions[sessionKey]; // Clean up if session was manually ended but timer persisted
-            delete activePortTimers[sessionKey];
-            console.log(`Inactivity: Cleaned up tracking maps for ${sessionKey} (session was already inactive)`);
+            stationTelemetryMetrics.level_updates += levels.length;
         }
     } catch (error) {
-        console.error(`Error during inactivity turn-off for ${sessionKey}:`, error);
-        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Error during inactivity turn-off for ${sessionKey}: ${error.message}`);
+        console.error('Failed to flush station telemetry:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to flush station telemetry: ${error.message}`);
+    } finally {
+        stationTelemetryFlushInProgress = false;
     }
 }
 
-async function finalizeSessionFromDeviceEvent({
-    deviceId,
-    portNumberInDevice,
-    actualPortId,
-    endReason = 'device_event',
-    source = LOG_SOURCES.MQTT
-}) {
-    if (!deviceId || !portNumberInDevice || !actualPortId) {
-        return false;
+// station_telemetry is partitioned by month; make sure this month's and next month's partitions exist
+// before rows for them arrive (anything else lands in the default partition)
+async function ensureStationTelemetryPartitions(now = new Date()) {
+    for (const offset of [0, 1]) {
+        const from = new Date(Date.UTC(now.getUTCFullYear(), now.getUTCMonth() + offset, 1));
+        const to = new Date(Date.UTC(from.getUTCFullYear(), from.getUTCMonth() + 1, 1));
+        const name = `station_telemetry_${from.getUTCFullYear()}_${String(from.getUTCMonth() + 1).padStart(2, '0')}`;
+        try {
+            await pool.query(
+                `CREATE TABLE IF NOT EXISTS public.${name} PARTITION OF public.station_telemetry
+                 FOR VALUES FROM ('${from.toISOString()}') TO ('${to.toISOString()}')`
+            );
+        } catch (error) {
+            console.error(`Failed to create partition ${name}:`, error.message);
+            logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Failed to create station telemetry partition ${name}: ${error.message}`);
+        }
     }
+}
 
-    const sessionKey = `${deviceId}_${portNumberInDevice}`;
-    let sessionRow;
-    let sessionId = activeChargerSessions[sessionKey];
+// --- Ingestion worker: MQTT decoding and port_events batch writes off the API thread ---
+// The port state machines stay here because the control endpoint reads and transitions them
+// synchronously; the worker gets the CPU- and I/O-heavy stateless parts. Anything sent to a
+// worker that dies is redone in-process, so telemetry is never dropped by a crash.
+const STATION_STATUS_TOPIC = `${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}`;
+const ingestWorkerState = {
+    worker: null,
+    nextRequestId: 1,
+    pending: new Map(), // request id -> { resolve, reject, fallback }
+    counters: new Int32Array(new SharedArrayBuffer(Object.keys(INGEST_COUNTERS).length * Int32Array.BYTES_PER_ELEMENT)),
+    restarts: 0,
+    stopping: false
+};
 
-    if (sessionId) {
-        const { rows } = await pool.query(
-            "SELECT session_id, user_id, energy_consumed_kwh, energy_consumed_mah FROM charging_session WHERE session_id = $1 AND session_status = $2",
-            [sessionId, SESSION_STATUS.ACTIVE]
-        );
-        if (rows.length > 0) {
-            sessionRow = rows[0];
+function startIngestWorker() {
+    let worker;
+    try {
+        worker = new Worker(path.join(__dirname, 'ingestWorker.js'), {
+            workerData: {
+                poolOptions: pgPoolOptions(INGEST_WORKER_POOL_SIZE),
+                stationStatusTopic: STATION_STATUS_TOPIC,
+                backfillTopicPrefix: MQTT_TOPICS.BACKFILL,
+                counters: ingestWorkerState.counters.buffer,
+                counterIndex: INGEST_COUNTERS
+            }
+        });
+    } catch (error) {
+        console.error('IngestWorker: Failed to start, processing telemetry in-process:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Ingest worker failed to start: ${error.message}`);
+        return;
+    }
+
+    worker.on('message', ({ id, result, error, code }) => {
+        const request = ingestWorkerState.pending.get(id);
+        if (!request) return;
+        ingestWorkerState.pending.delete(id);
+        if (error === undefined) {
+            request.resolve(result);
         } else {
-            sessionId = null;
+            const err = new Error(error);
+            if (code) err.code = code;
+            request.reject(err);
+        }
+    });
+    worker.on('error', (error) => {
+        console.error('IngestWorker: Uncaught error:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Ingest worker crashed: ${error.message}`);
+    });
+    worker.on('exit', (exitCode) => {
+        if (ingestWorkerState.worker === worker) ingestWorkerState.worker = null;
+        ingestPool.options.max = PG_POOL_SIZES.ingest; // Batches are written here until a worker is back
+        // Redo whatever the worker had not answered yet on this thread
+        for (const request of ingestWorkerState.pending.values()) {
+            Promise.resolve().then(request.fallback).then(request.resolve, request.reject);
         }
+        ingestWorkerState.pending.clear();
+        if (ingestWorkerState.stopping) return;
+        console.warn(`IngestWorker: Exited with code ${exitCode}; restarting in ${INGEST_WORKER_RESTART_DELAY_MS}ms.`);
+        ingestWorkerState.restarts++;
+        setTimeout(startIngestWorker, INGEST_WORKER_RESTART_DELAY_MS).unref();
+    });
+    ingestWorkerState.worker = worker;
+    ingestPool.options.max = INGEST_MAIN_POOL_SIZE_WITH_WORKER; // pg-pool reads max on every checkout; extra idle clients time out
+}
+
+// Sends a request to the worker; `fallback` produces the same result in-process when there is no worker.
+// `transferList` buffers move to the worker and are unusable here afterwards.
+function requestIngestWorker(request, fallback, transferList) {
+    const worker = ingestWorkerState.worker;
+    if (!worker) return Promise.resolve().then(fallback);
+    return new Promise((resolve, reject) => {
+        const id = ingestWorkerState.nextRequestId++;
+        ingestWorkerState.pending.set(id, { resolve, reject, fallback });
+        worker.postMessage({ ...request, id }, transferList);
+    });
+}
+
+function decodeMqttMessageInProcess(topic, message) {
+    try {
+        return { payload: decodeMqttMessage(topic, message, STATION_STATUS_TOPIC, MQTT_TOPICS.BACKFILL) };
+    } catch (error) {
+        return { error: error.message };
     }
+}
 
-    if (!sessionId) {
-        const result = await pool.query(
-            "SELECT session_id, user_id, energy_consumed_kwh, energy_consumed_mah FROM charging_session WHERE port_id = $1 AND session_status = $2 ORDER BY start_time DESC LIMIT 1",
-            [actualPortId, SESSION_STATUS.ACTIVE]
-        );
+// Only backfill batches go to the worker: a round trip costs the main thread ~10us, several times
+// a JSON.parse of a usage or status message, but a fraction of decoding 1000 readings
+// (npm run bench:ingest). The worker gets a copy of just the message bytes, transferred rather
+// than cloned: the Buffer mqtt.js hands us is a view into a whole socket read, and posting it
+// would copy that entire chunk. Decodes still resolve in arrival order: in-process results wait
+// for the worker decode in flight, whose replies come back in request order.
+let pendingWorkerDecode = null;
+
+function decodeMqttMessageOffThread(topic, message) {
+    if (ingestWorkerState.worker && topic.startsWith(MQTT_TOPICS.BACKFILL)) {
+        const bytes = new Uint8Array(message);
+        const decoding = requestIngestWorker({ type: 'decode', topic, message: bytes }, () => decodeMqttMessageInProcess(topic, message), [bytes.buffer]);
+        pendingWorkerDecode = decoding;
+        const settled = () => { if (pendingWorkerDecode === decoding) pendingWorkerDecode = null; };
+        decoding.then(settled, settled);
+        return decoding;
+    }
+    const decoded = decodeMqttMessageInProcess(topic, message);
+    return pendingWorkerDecode ? pendingWorkerDecode.then(() => decoded, () => decoded) : Promise.resolve(decoded);
+}
 
-        if (result.rows.length === 0) {
-            return false;
-        }
+function writePortEventBatchOffThread(batch) {
+    const inProcess = () => writePortEventBatch(ingestPool, batch); // ingestPool is already behind the breaker
+    if (!ingestWorkerState.worker) return inProcess();
+    return dbCircuit.exec(() => requestIngestWorker({ type: 'writeBatch', batch }, () => rewriteBatchAfterWorkerExit(batch)));
+}
 
-        sessionRow = result.rows[0];
-        sessionId = sessionRow.session_id;
+// A worker that died mid-request may have committed the batch already. Journaled events are
+// skipped by ON CONFLICT (journal_id, journal_lsn); events without an LSN are not, so look for the
+// batch's last unjournaled event first. The batch is one transaction: if it is there, all of it is.
+async function rewriteBatchAfterWorkerExit(batch) {
+    const probe = batch.findLast(event => !event.journal_lsn);
+    if (probe) {
+        const { rowCount } = await ingestPool.query(preparedStatement('portEventExists', [probe.port_id, probe.event_type, probe.occurred_at]));
+        if (rowCount > 0) {
+            console.warn(`IngestWorker: Batch of ${batch.length} port events was committed before the worker exited; not rewriting it.`);
+            return 0;
+        }
     }
+    return writePortEventBatch(ingestPool, batch);
+}
 
-    const energyConsumed = parseFloat(sessionRow.energy_consumed_kwh) || 0;
-    const mAhConsumed = parseFloat(sessionRow.energy_consumed_mah) || 0;
-    const sessionCost = await calculateSessionCost(sessionId, energyConsumed);
+async function stopIngestWorker() {
+    ingestWorkerState.stopping = true;
+    const worker = ingestWorkerState.worker;
+    if (!worker) return;
+    await requestIngestWorker({ type: 'shutdown' }, () => true).catch(() => {});
+    await worker.terminate();
+}
 
-    const updateResult = await pool.query(
-        "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3 AND session_status = $4",
-        [SESSION_STATUS.COMPLETED, sessionCost, sessionId, SESSION_STATUS.ACTIVE]
-    );
+// Read straight from shared memory; no round trip to the worker
+function getIngestWorkerMetrics() {
+    const counters = ingestWorkerState.counters;
+    return {
+        running: ingestWorkerState.worker !== null,
+        restarts: ingestWorkerState.restarts,
+        pending_requests: ingestWorkerState.pending.size,
+        decoded: Atomics.load(counters, INGEST_COUNTERS.DECODED),
+        decode_errors: Atomics.load(counters, INGEST_COUNTERS.DECODE_ERRORS),
+        events_written: Atomics.load(counters, INGEST_COUNTERS.EVENTS_WRITTEN),
+        batch_failures: Atomics.load(counters, INGEST_COUNTERS.BATCH_FAILURES),
+        batches_in_flight: Atomics.load(counters, INGEST_COUNTERS.BATCHES_IN_FLIGHT)
+    };
+}
 
-    if (updateResult.rowCount === 0) {
-        return false;
+function setupIngestWorker() {
+    if (!INGEST_WORKER_ENABLED) {
+        console.log('IngestWorker: Disabled (INGEST_WORKER=off); decoding telemetry on the main thread.');
+        return;
     }
+    startIngestWorker();
+    console.log('IngestWorker: Started telemetry ingestion worker thread.');
+}
 
-    if (sessionRow.user_id) {
-        await pool.query(
-            "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
-            [mAhConsumed, sessionRow.user_id]
-        );
+// --- MQTT priority scheduler ---
+// Session-ending status messages must not wait behind a burst of usage samples for other ports.
+// Each device port has its own FIFO, so a port's messages always run in arrival order (an OFF never
+// overtakes that port's earlier usage samples) and never concurrently. Priority only decides which
+// port is served next: the one whose queue holds the most urgent message.
+const mqttKeyQueues = new Map(); // key -> { items: [], counts: [high, normal, low] }
+const mqttReadyKeys = [new Set(), new Set(), new Set()]; // idle keys with queued work, by their most urgent message
+const mqttBusyKeys = new Set();
+const mqttSchedulerStats = { processed: 0, active: 0, dropped: 0, queued: [0, 0, 0], lastDropLogAt: 0, pauses: 0 };
+let mqttDeliveryPaused = null; // mqtt.js callback held back while the queue is full
+
+// `payload` is undefined when the message could not be decoded; the handler reports it
+function classifyMqttMessage(topic, payload) {
+    const deviceId = topic.split('/')[2];
+    if (topic.startsWith(MQTT_TOPICS.USAGE)) {
+        return { priority: MQTT_PRIORITY.LOW, key: `${deviceId}:${payload?.port_number}` };
     }
+    if (topic.startsWith(MQTT_TOPICS.BACKFILL)) {
+        return { priority: MQTT_PRIORITY.LOW, key: `${deviceId}:backfill` };
+    }
+    if (topic.startsWith(MQTT_TOPICS.STATUS)) {
+        if (!payload) return { priority: MQTT_PRIORITY.NORMAL, key: `${deviceId}:unparsed` };
+        const urgent = payload.charger_state === CHARGER_STATES.OFF || payload.status === 'offline' || !!payload.event_type;
+        return { priority: urgent ? MQTT_PRIORITY.HIGH : MQTT_PRIORITY.NORMAL, key: `${deviceId}:${payload.port_number}` };
+    }
+    return { priority: MQTT_PRIORITY.NORMAL, key: topic };
+}
+
+function mqttQueuedTotal() {
+    return mqttSchedulerStats.queued.reduce((sum, count) => sum + count, 0);
+}
+
+function mostUrgentPriority(queue) {
+    return queue.counts.findIndex(count => count > 0);
+}
+
+// Files an idle key with queued work under its most urgent message (at the back of that level)
+function markMqttKeyReady(key, queue) {
+    for (const ready of mqttReadyKeys) ready.delete(key);
+    if (queue.items.length > 0) mqttReadyKeys[mostUrgentPriority(queue)].add(key);
+}
+
+// mqtt.js reads the next packet, and sends a QoS 1 message's PUBACK, only after this callback runs.
+// Holding it while the queue is full makes the broker keep undelivered messages instead of us
+// dropping billed readings that were already acknowledged.
+function handleMqttDelivery(packet, callback) {
+    if (mqttQueuedTotal() < MQTT_QUEUE_LIMIT) return callback();
+    mqttSchedulerStats.pauses++;
+    console.warn(`MQTT: Queue full (${mqttQueuedTotal()} messages); pausing delivery from the broker.`);
+    mqttDeliveryPaused = callback;
+}
+
+function resumeMqttDelivery() {
+    if (!mqttDeliveryPaused || mqttQueuedTotal() >= MQTT_QUEUE_RESUME) return;
+    const callback = mqttDeliveryPaused;
+    mqttDeliveryPaused = null;
+    console.log(`MQTT: Queue down to ${mqttQueuedTotal()} messages; resuming delivery.`);
+    callback();
+}
 
-    delete activeChargerSessions[sessionKey];
-    if (activePortTimers[sessionKey]) {
-        clearTimeout(activePortTimers[sessionKey].timerId);
-        delete activePortTimers[sessionKey];
+function scheduleMqttMessage(topic, message, decoded) {
+    const { priority, key } = classifyMqttMessage(topic, decoded.payload);
+    // Delivery pauses at MQTT_QUEUE_LIMIT, so only messages already in flight can get this far
+    if (priority !== MQTT_PRIORITY.LOW && mqttQueuedTotal() >= MQTT_QUEUE_LIMIT + MQTT_QUEUE_URGENT_HEADROOM) {
+        mqttSchedulerStats.dropped++;
+        if (Date.now() - mqttSchedulerStats.lastDropLogAt > 60000) {
+            mqttSchedulerStats.lastDropLogAt = Date.now();
+            console.warn(`MQTT: Queue full (${mqttQueuedTotal()} messages); dropping ${topic} (${mqttSchedulerStats.dropped} status messages dropped so far)`);
+            logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `MQTT queue full; ${mqttSchedulerStats.dropped} status messages dropped so far`);
+        }
+        return;
     }
-    fullChargeNotificationState.delete(sessionId);
 
-    await pool.query(
-        "UPDATE charging_port SET current_status = $1, is_occupied = false, last_status_update = NOW() WHERE port_id = $2",
-        [PORT_STATUS.AVAILABLE, actualPortId]
-    );
+    let queue = mqttKeyQueues.get(key);
+    if (!queue) {
+        queue = { items: [], counts: [0, 0, 0] };
+        mqttKeyQueues.set(key, queue);
+    }
+    const before = mostUrgentPriority(queue);
+    queue.items.push({ topic, message, decoded, priority });
+    queue.counts[priority]++;
+    mqttSchedulerStats.queued[priority]++;
+    if (!mqttBusyKeys.has(key) && (before === -1 || priority < before)) markMqttKeyReady(key, queue);
+    pumpMqttQueues();
+}
 
-    logSystemEvent(
-        LOG_TYPES.INFO,
-        source,
-        `Auto-completed session ${sessionId} for ${sessionKey}. Reason: ${endReason}`
-    );
+// Takes the next message of the idle port with the most urgent queued work
+function takeNextMqttMessage() {
+    for (const ready of mqttReadyKeys) {
+        for (const key of ready) {
+            ready.delete(key);
+            const queue = mqttKeyQueues.get(key);
+            const item = queue.items.shift();
+            queue.counts[item.priority]--;
+            mqttSchedulerStats.queued[item.priority]--;
+            return { key, item };
+        }
+    }
+    return null;
+}
 
-    return true;
+function pumpMqttQueues() {
+    while (mqttSchedulerStats.active < MQTT_PROCESSING_CONCURRENCY) {
+        const next = takeNextMqttMessage();
+        if (!next) return;
+        const { key, item } = next;
+        mqttBusyKeys.add(key);
+        mqttSchedulerStats.active++;
+        processMqttMessage(item.topic, item.message, item.decoded).finally(() => {
+            mqttBusyKeys.delete(key);
+            mqttSchedulerStats.active--;
+            mqttSchedulerStats.processed++;
+            const queue = mqttKeyQueues.get(key);
+            if (queue.items.length === 0) {
+                mqttKeyQueues.delete(key);
+            } else {
+                markMqttKeyReady(key, queue);
+            }
+            resumeMqttDelivery();
+            pumpMqttQueues();
+        });
+    }
 }
 
+function getMqttSchedulerMetrics() {
+    const queued = mqttSchedulerStats.queued;
+    return {
+        queued: { high: queued[MQTT_PRIORITY.HIGH], normal: queued[MQTT_PRIORITY.NORMAL], low: queued[MQTT_PRIORITY.LOW] },
+        queued_ports: mqttKeyQueues.size,
+        limit: MQTT_QUEUE_LIMIT,
+        delivery_paused: mqttDeliveryPaused !== null,
+        pauses: mqttSchedulerStats.pauses,
+        dropped: mqttSchedulerStats.dropped,
+        active: mqttSchedulerStats.active,
+        processed: mqttSchedulerStats.processed
+    };
+}
 
-// --- MQTT Event Handlers ---
-mqttClient.on('connect', () => {
-    console.log('Backend connected to EMQX Cloud MQTT broker');
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, 'Backend connected to EMQX Cloud MQTT broker');
-    // Subscribe to topics for the single station device ID
-    mqttClient.subscribe(`${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}`, { qos: 1 }, (err) => {
-        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}`);
-        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.USAGE}${ESP32_STATION_CLIENT_ID}: ${err.message}`);
-    });
-    mqttClient.subscribe(`${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}`, { qos: 1 }, (err) => {
-        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}`);
-        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}: ${err.message}`);
-    });
-    // Existing station topics (if any, adjust topic string as needed)
-    mqttClient.subscribe(MQTT_TOPICS.STATION_GENERIC_STATUS, { qos: 1 }, (err) => {
-        if (!err) console.log(`Subscribed to ${MQTT_TOPICS.STATION_GENERIC_STATUS}`);
-        else logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to subscribe to ${MQTT_TOPICS.STATION_GENERIC_STATUS}: ${err.message}`);
-    });
-});
 // --- Main MQTT Message Processing Handler ---
-mqttClient.on('message', async (topic, message) => {
+mqttClient.handleMessage = handleMqttDelivery;
+mqttClient.on('message', (topic, message) => {
+    decodeMqttMessageOffThread(topic, message).then(decoded => scheduleMqttMessage(topic, message, decoded));
+});
+
+async function processMqttMessage(topic, message, decoded) {
     console.log(`Received message on ${topic}: ${message.toString()}`);
     let payload;
     const messageString = message.toString();
@@ -648,25 +4248,27 @@ mqttClient.on('message', async (topic, message) => {
     // --- END DEBUGGING ---
     
     try {
-        // Handle specific plain string LWT from ESP32, converting it to JSON structure
-        if (topic === `${MQTT_TOPICS.STATUS}${ESP32_STATION_CLIENT_ID}` && messageString === 'offline') {
-            payload = {
-                status: "offline",
-                charger_state: CHARGER_STATES.UNKNOWN,
-                timestamp: Date.now(),
-                port_number: -1 // Special indicator for station-level offline message (will be ignored by port-specific logic)
-            };
-            console.warn(`MQTT: Converted plain "offline" LWT to JSON for ${topic}`);
-        } else {
-            // Attempt to parse as JSON for all other messages
-            payload = JSON.parse(messageString);
-        }
+        // Parsed (and the plain-string LWT converted) by decodeMqttMessage, normally on the ingestion worker
+        if (decoded.error !== undefined) throw new Error(decoded.error);
+        payload = decoded.payload;
 
         console.log(`MQTT: Parsed payload for ${topic}:`, JSON.stringify(payload, null, 2));
 
         // Extract the deviceId (which is the station's MQTT Client ID)
         const deviceId = topic.split('/')[2]; // e.g., ESP32_CHARGER_STATION_001
 
+        // --- Handle charger/backfill topic (buffered readings for many ports in one message) ---
+        if (topic.startsWith(MQTT_TOPICS.BACKFILL)) {
+            await ingestTelemetryBackfill(deviceId, payload, LOG_SOURCES.MQTT);
+            return;
+        }
+
+        // --- Handle station/<station>/status (station battery, solar input and temperature) ---
+        if (topic.startsWith('station/')) {
+            ingestStationTelemetry(topic.split('/')[1], payload);
+            return;
+        }
+
         // Extract port_number from payload (will be undefined for generic station-level status)
         const portNumberInDevice = payload.port_number;
 
@@ -684,26 +4286,20 @@ mqttClient.on('message', async (topic, message) => {
             return; // Exit here for invalid portNumber messages
         }
 
-        // --- Find the actual port_id (UUID) from charging_port table ---
-        // This query links the ESP32's ID and its internal port number to a unique DB port_id.
-        const portIdResult = await pool.query(
-            'SELECT port_id, is_premium FROM charging_port WHERE device_mqtt_id = $1 AND port_number_in_device = $2', // Fetch is_premium
-            [deviceId, portNumberInDevice]
-        );
-        const actualPortId = portIdResult.rows[0]?.port_id; // Get the port_id UUID
-        const isPremiumPort = portIdResult.rows[0]?.is_premium; // Get is_premium
+        // --- Resolve the port's state machine (memory; DB only for ports added since boot) ---
+        const portEntry = await ensurePortEntry(deviceId, portNumberInDevice);
 
-        if (!actualPortId) {
+        if (!portEntry) {
             console.warn(`MQTT: No charging_port found for device_id: ${deviceId} and port_number_in_device: ${portNumberInDevice}. Skipping message processing.`);
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `No charging_port found for device_id: ${deviceId}, port: ${portNumberInDevice}. Topic: ${topic}`);
             return; // Cannot process if a specific port mapping is not found in DB
         }
 
-        // Determine unique key for session tracking using deviceId and internal port number
-        const sessionKey = `${deviceId}_${portNumberInDevice}`;
-        const currentSessionId = activeChargerSessions[sessionKey]; // Get session_id from in-memory map
+        const actualPortId = portEntry.portId;
+        const sessionKey = portEntry.key;
+        const currentSessionId = portEntry.sessionId;
 
-        console.log(`MQTT: Session tracking for ${sessionKey}: Session ID = ${currentSessionId}, Active sessions:`, Object.keys(activeChargerSessions));
+        console.log(`MQTT: Session tracking for ${sessionKey}: Session ID = ${currentSessionId}, Port state = ${portEntry.state}`);
 
         // --- Handle charger/usage topic (for consumption data and session management) ---
         if (topic.startsWith(MQTT_TOPICS.USAGE)) {
@@ -714,8 +4310,29 @@ mqttClient.on('message', async (topic, message) => {
             const hasDeviceTimestamp = Number.isFinite(deviceTimestampMs);
             const charger_state = payload.charger_state;
 
+            // QoS 1 may redeliver: drop samples whose seq this port has already seen
+            const sequence = acceptSequence(portEntry.usageSequence, payload.seq, payload.boot);
+            if (sequence.result === SEQUENCE_RESULT.DUPLICATE || sequence.result === SEQUENCE_RESULT.STALE) {
+                console.log(`MQTT: Dropped ${sequence.result} usage seq ${payload.seq} for ${sessionKey}.`);
+                return;
+            }
+            if (sequence.gap > 0) {
+                portEntry.usageSequence.lastGapAt = serverTimestamp;
+                console.warn(`MQTT: ${sequence.gap} usage samples missing before seq ${payload.seq} for ${sessionKey}.`);
+                if (sequence.gap >= TELEMETRY_SEQ_GAP_LOG_THRESHOLD) {
+                    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Telemetry gap on ${sessionKey}: ${sequence.gap} usage samples missing before seq ${payload.seq}`);
+                }
+            }
+
             const consumptionWatts = consumptionAmps * NOMINAL_CHARGING_VOLTAGE_DC;
             const validatedConsumption = validateConsumption(consumptionWatts);
+            // Sensor health is judged on the raw reading; a faulted port waits for an admin to clear it
+            const anomaly = portEntry.state === PORT_FSM_STATES.FAULT ? null : observeConsumptionSample(portEntry.anomaly, consumptionWatts);
+            const fault = anomaly && !anomaly.review ? anomaly : null;
+            // Zero readings count too: a full phone often drops to nothing rather than a trickle
+            const fullChargeDetected = !fault && currentSessionId && portEntry.state === PORT_FSM_STATES.CHARGING &&
+                !portEntry.budget.paused && observeChargeCurrent(portEntry.taper, consumptionAmps);
+            recordPortDraw(portEntry, validatedConsumption, serverTimestamp);
 
             console.log(
                 `MQTT: Processing usage message for ${sessionKey}. Charger state: ${charger_state}, ` +
@@ -726,56 +4343,34 @@ mqttClient.on('message', async (topic, message) => {
                 `(device timestamp: ${hasDeviceTimestamp ? deviceTimestampMs : 'n/a'})`
             );
 
-            // ALWAYS store consumption data regardless of session state
+            // ALWAYS record consumption regardless of session state
             
             if (validatedConsumption > 0) {
-                // Store consumption data with port_number for easier querying
-                await pool.query(
-                    'INSERT INTO consumption_data (session_id, device_id, port_number, consumption_watts, timestamp, charger_state) VALUES ($1, $2, $3, $4, $5, $6)',
-                    [currentSessionId, deviceId, portNumberInDevice, validatedConsumption, serverTimestamp, charger_state]
-                );
+                // One port_events row; consumption_data and the session's energy totals are projections of it
+                appendPortEvent(portEntry, PORT_EVENT_TYPES.USAGE, {
+                    sessionId: currentSessionId,
+                    occurredAt: serverTimestamp,
+                    chargerState: charger_state,
+                    consumptionWatts: validatedConsumption,
+                    costIncrement: usageReadingCost(portEntry.stationId, validatedConsumption, serverTimestamp),
+                    payload: usageEventDetails(payload, hasDeviceTimestamp ? deviceTimestampMs : null)
+                });
                 console.log(
-                    `MQTT: Stored consumption for ${deviceId} Port ${portNumberInDevice}: ` +
+                    `MQTT: Recorded consumption for ${deviceId} Port ${portNumberInDevice}: ` +
                     `${validatedConsumption}W at ${serverTimestamp.toISOString()}`
                 );
 
-                // If we have an active session, update session totals
+                // If we have an active session, its totals follow from the event
                 if (currentSessionId) {
-                    const intervalSeconds = 10; // ESP32 publishes every 10 seconds
-                    const kwhIncrement = (validatedConsumption * intervalSeconds) / (1000 * 3600); // Watts * seconds / (1000W/kW * 3600s/hr)
-
-                    // Calculate mAh Increment (assuming a nominal charging voltage, e.g., 12V for the battery)
-                    const currentAmps = validatedConsumption / NOMINAL_CHARGING_VOLTAGE_DC; // Amps = Watts / Volts
-                    const mAhIncrement = (currentAmps * 1000) * (intervalSeconds / 3600); // mAh = Amps * 1000 * (seconds / 3600)
-
-                    console.log(`MQTT: Energy increment for ${sessionKey}: ${kwhIncrement.toFixed(6)} kWh, ${mAhIncrement.toFixed(2)} mAh`);
+                    const { kwh: kwhIncrement, mah: mAhIncrement } = usageEnergyIncrement(validatedConsumption);
+                    console.log(`MQTT: Energy increment for ${sessionKey}: ${kwhIncrement.toFixed(6)} kWh, ${mAhIncrement.toFixed(2)} mAh (price ${stationPricePerMahAt(portEntry.stationId, serverTimestamp)}/mAh)`);
 
-                    await pool.query(
-                        'UPDATE charging_session SET energy_consumed_kwh = COALESCE(energy_consumed_kwh, 0) + $1, energy_consumed_mah = COALESCE(energy_consumed_mah, 0) + $2, total_mah_consumed = COALESCE(total_mah_consumed, 0) + $3, last_status_update = $4 WHERE session_id = $5',
-                        [kwhIncrement, mAhIncrement, mAhIncrement, serverTimestamp, currentSessionId]
-                    );
-
-                    // Reset inactivity timer on new consumption data
-                    if (activePortTimers[sessionKey]) {
-                        clearTimeout(activePortTimers[sessionKey].timerId);
-                        activePortTimers[sessionKey].lastConsumptionTime = Date.now();
-                        activePortTimers[sessionKey].timerId = setTimeout(
-                            () => handleInactivityTurnOff(deviceId, portNumberInDevice, actualPortId, currentSessionId),
-                            INACTIVITY_TIMEOUT_SECONDS * 1000
-                        );
-                        console.log(`MQTT: Timer reset for ${sessionKey} due to new consumption. Timer set for ${INACTIVITY_TIMEOUT_SECONDS} seconds.`);
-                    } else {
-                        console.warn(`MQTT: No active timer found for ${sessionKey} when consumption received. This might indicate a session tracking issue.`);
-                        // Try to reinitialize the timer if it's missing but we have a valid session
-                        activePortTimers[sessionKey] = {
-                            timerId: setTimeout(
-                                () => handleInactivityTurnOff(deviceId, portNumberInDevice, actualPortId, currentSessionId),
-                                INACTIVITY_TIMEOUT_SECONDS * 1000
-                            ),
-                            lastConsumptionTime: Date.now()
-                        };
-                        console.log(`MQTT: Reinitialized timer for ${sessionKey} due to missing timer.`);
+                    // Consumption proves the relay is on; reset inactivity timer on new consumption data
+                    if (portEntry.state === PORT_FSM_STATES.RESERVED) {
+                        transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_ON);
                     }
+                    resetPortInactivityTimer(portEntry);
+                    console.log(`MQTT: Timer reset for ${sessionKey} due to new consumption. Timer set for ${INACTIVITY_TIMEOUT_SECONDS} seconds.`);
                 } else {
                     console.log(`MQTT: Consumption stored for ${deviceId} Port ${portNumberInDevice} but no active session. Data preserved for later linking.`);
                 }
@@ -783,25 +4378,28 @@ mqttClient.on('message', async (topic, message) => {
                 console.warn(`MQTT: Ignoring invalid consumption value (${consumptionAmps}A) for ${deviceId} Port ${portNumberInDevice}`);
                 logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.MQTT, `Invalid consumption value (${consumptionAmps}A) for ${sessionKey}`);
             }
+
+            if (fault) {
+                await handleConsumptionAnomaly(portEntry, fault);
+            } else if (fullChargeDetected) {
+                await handleDetectedFullCharge(portEntry);
+            }
+            if (anomaly?.review) {
+                await flagConsumptionAnomalyForReview(portEntry, anomaly);
+            }
         }
 
         // --- Handle charger/status topic (for overall device/port status updates) ---
         else if (topic.startsWith(MQTT_TOPICS.STATUS)) {
-            // Pass the payload and newly fetched isPremiumPort to the dedicated handler
-            await handleMqttStatusMessage(payload, deviceId, actualPortId, isPremiumPort);
-        }
-
-        // --- Handle other existing station topics (if any) ---
-        else if (topic.startsWith('station/')) {
-            console.log(`MQTT: Processing generic station data: ${JSON.stringify(payload)}`);
-            logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Generic station data: ${JSON.stringify(payload)}`);
+            await handleMqttStatusMessage(payload, deviceId, portEntry);
         }
 
     } catch (error) {
         console.error('MQTT: Error processing MQTT message:', error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Error processing message on topic "${topic}" with payload "${messageString}": ${error.message}`);
     }
-});
+}
+
 mqttClient.on('error', (err) => {
     console.error('MQTT error:', err);
     logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `MQTT client error: ${err.message}`);
@@ -839,9 +4437,132 @@ app.get('/api/subscription/plans', supabaseAuthMiddleware, requireAdmin, async (
 });
 
 //Public endpoint to get all stations for the home page/map
+// The last good list is kept so the map still renders (marked stale) while Postgres is unavailable
+// --- Resource versions for conditional GET ---
+// Counters per polled resource ('devices', 'station:<id>', 'user:<id>', 'notifications:<userId>'),
+// bumped wherever the data behind them changes. The ETag hashes the key, its version, a per-boot
+// epoch and a time bucket, so a 304 costs a Map lookup and a restart or missed bump cannot pin a
+// stale body. In cluster mode the ingest process owns the counters: workers forward their bumps
+// and answer without validators for that key until the owner's next update reaches them.
+let resourceEpoch = crypto.randomBytes(6).toString('hex');
+const resourceVersions = new Map(); // key -> version
+const changedResourceKeys = new Set(); // owner: keys to push to HTTP workers on the next broadcast
+const pendingResourceBumps = new Set(); // HTTP worker: bumped here, owner's version not seen yet
+const conditionalGetStats = { notModified: 0, full: 0 };
+
+function bumpResource(key) {
+    resourceVersions.set(key, (resourceVersions.get(key) || 0) + 1);
+    if (PROCESS_ROLE === PROCESS_ROLES.INGEST) {
+        changedResourceKeys.add(key);
+    } else if (PROCESS_ROLE === PROCESS_ROLES.HTTP) {
+        pendingResourceBumps.add(key);
+        process.send({ type: 'bump-resource', key });
+    }
+}
+
+// A port change shows up in the global device list, its station's views and its session owner's views
+function bumpPortResources(entry) {
+    bumpResource('devices');
+    if (entry.stationId) bumpResource(`station:${entry.stationId}`);
+    if (entry.userId) bumpResource(`user:${entry.userId}`);
+}
+
+function resourceEtag(key) {
+    if (pendingResourceBumps.has(key)) return null;
+    const bucket = Math.floor(Date.now() / RESOURCE_ETAG_MAX_AGE_MS);
+    const digest = crypto.createHash('sha1')
+        .update(`${resourceEpoch}:${key}:${resourceVersions.get(key) || 0}:${bucket}`)
+        .digest('base64url')
+        .slice(0, 20);
+    return `W/"${digest}"`;
+}
+
+// Sets the ETag for `key` and answers 304 when the client already holds it. The tag is taken
+// before the route reads anything, so a change racing the read produces a new tag next poll.
+function answeredNotModified(req, res, key) {
+    const etag = resourceEtag(key);
+    if (!etag) {
+        conditionalGetStats.full++;
+        return false;
+    }
+    res.set('ETag', etag);
+    res.set('Cache-Control', 'private, no-cache');
+    const ifNoneMatch = req.headers['if-none-match'];
+    if (ifNoneMatch && ifNoneMatch.split(',').some(tag => tag.trim() === etag)) {
+        conditionalGetStats.notModified++;
+        res.status(304).end();
+        return true;
+    }
+    conditionalGetStats.full++;
+    return false;
+}
+
+function resourceVersionsMessage(keys) {
+    return {
+        type: 'resource-versions',
+        epoch: resourceEpoch,
+        versions: Array.from(keys, key => [key, resourceVersions.get(key) || 0])
+    };
+}
+
+// Worker side: adopt the owner's epoch and versions; a key stays unvalidated until the owner has seen its bump
+function applyResourceVersions({ epoch, versions, full }) {
+    if (full) resourceVersions.clear();
+    resourceEpoch = epoch;
+    for (const [key, version] of versions) {
+        resourceVersions.set(key, version);
+        pendingResourceBumps.delete(key);
+    }
+}
+
+// --- Single-flight coalescing for hot polling reads ---
+// Concurrent identical requests share one in-flight execution, and its result is reused for
+// a short TTL, so DB load from a busy station scales with stations rather than viewers.
+// Results are shared between callers and must not be mutated.
+const singleFlights = new Map(); // key -> { promise, settled }
+const singleFlightStats = { executions: 0, shared: 0 };
+
+function singleFlight(key, work, ttlMs = SINGLE_FLIGHT_TTL_MS) {
+    const existing = singleFlights.get(key);
+    if (existing) {
+        singleFlightStats.shared++;
+        return existing.promise;
+    }
+
+    const flight = { promise: null };
+    const forget = () => {
+        if (singleFlights.get(key) === flight) singleFlights.delete(key);
+    };
+    flight.promise = Promise.resolve().then(work).then(
+        result => {
+            if (ttlMs > 0) setTimeout(forget, ttlMs).unref();
+            else forget();
+            return result;
+        },
+        error => {
+            forget(); // Never cache failures
+            throw error;
+        }
+    );
+    singleFlights.set(key, flight);
+    singleFlightStats.executions++;
+    return flight.promise;
+}
+
+// Sync polls ask for a reconcile; one runs per station per window, always in the process that owns live state
+function requestStationReconcile(stationId) {
+    if (!stationId) return Promise.resolve();
+    if (!OWNS_LIVE_STATE) {
+        process.send({ type: 'reconcile-station', stationId });
+        return Promise.resolve();
+    }
+    return singleFlight(`reconcile:${stationId}`, () => reconcileStationState(stationId), STATION_RECONCILE_TTL_MS);
+}
+
+let lastStationList = null;
 app.get('/api/stations', async (req, res) => {
     try {
-        const result = await pool.query(`
+        const result = await singleFlight('stations', () => readPool(pool).query(`
             SELECT 
                 s.station_id, 
                 s.station_name, 
@@ -857,10 +4578,15 @@ app.get('/api/stations', async (req, res) => {
             LEFT JOIN charging_port p ON s.station_id = p.station_id
             GROUP BY s.station_id
             ORDER BY s.station_name;
-        `);
+        `));
+        lastStationList = { rows: result.rows, fetchedAt: new Date() };
         res.json(result.rows);
     } catch (error) {
         console.error('Error fetching stations:', error.message);
+        if (lastStationList && (isCircuitOpenError(error) || isDatabaseInfrastructureError(error))) {
+            res.set('X-Data-Stale', lastStationList.fetchedAt.toISOString());
+            return res.json(lastStationList.rows);
+        }
         res.status(500).json({ error: 'Failed to fetch stations' });
     }
 });
@@ -869,7 +4595,7 @@ app.get('/api/stations', async (req, res) => {
 app.get('/api/stations/:stationId', async (req, res) => {
     const { stationId } = req.params;
     try {
-        const result = await pool.query(
+        const result = await readPool(pool).query(
             `SELECT * FROM charging_station WHERE station_id = $1`,
             [stationId]
         );
@@ -888,7 +4614,7 @@ app.get('/api/devices/:deviceId/:portNumber/consumption', async (req, res) => {
     const { deviceId, portNumber } = req.params;
     try {
         // First, find the actual port_id (UUID) from charging_port table
-        const portIdResult = await pool.query(
+        const portIdResult = await readPool(reportingPool).query(
             'SELECT port_id FROM charging_port WHERE device_mqtt_id = $1 AND port_number_in_device = $2',
             [deviceId, parseInt(portNumber)] // Ensure portNumber is integer
         );
@@ -900,7 +4626,7 @@ app.get('/api/devices/:deviceId/:portNumber/consumption', async (req, res) => {
         }
 
         // Fetch consumption data linked to sessions for this specific actualPortId
-        const result = await pool.query(
+        const result = await readPool(reportingPool).query(
             'SELECT consumption_watts, timestamp, charger_state FROM consumption_data WHERE device_id = $1 AND session_id IN (SELECT session_id FROM charging_session WHERE port_id = $2) ORDER BY timestamp DESC LIMIT 100',
             [deviceId, actualPortId]
         );
@@ -915,8 +4641,9 @@ app.get('/api/devices/:deviceId/:portNumber/consumption', async (req, res) => {
 // Get all current device/port statuses
 app.get('/api/devices/status', async (req, res) => {
     try {
+        if (answeredNotModified(req, res, 'devices')) return;
         // Use LEFT JOIN to include all charging ports, even if they don't have status data yet
-        const result = await pool.query(`
+        const result = await singleFlight('devices:status', () => pool.query(`
             SELECT
                 cp.device_mqtt_id as device_id,
                 cp.port_id,
@@ -926,6 +4653,7 @@ app.get('/api/devices/status', async (req, res) => {
                 cp.port_number_in_device,
                 cs.total_mah_consumed,
                 cs.energy_consumed_kwh,
+                cs.accrued_cost,
                 cs.session_id
             FROM
                 charging_port cp
@@ -935,7 +4663,7 @@ app.get('/api/devices/status', async (req, res) => {
                 charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $1
             ORDER BY
                 cp.device_mqtt_id, cp.port_number_in_device
-        `, [SESSION_STATUS.ACTIVE]);
+        `, [SESSION_STATUS.ACTIVE]));
         
         res.json(result.rows);
     } catch (error) {
@@ -949,7 +4677,7 @@ app.get('/api/devices/status', async (req, res) => {
 app.get('/api/devices/consumption', async (req, res) => {
     try {
         // Get consumption data for all devices and ports with current consumption calculation
-        const result = await pool.query(`
+        const result = await readPool(reportingPool).query(`
             SELECT
                 cp.device_mqtt_id as device_id,
                 cp.port_number_in_device as port_number,
@@ -998,81 +4726,13 @@ app.get('/api/devices/consumption', async (req, res) => {
         console.error('Error fetching device consumption:', error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Error fetching all device consumption: ${error.message}`);
         res.status(500).json({ error: 'Failed to fetch device consumption' });
-    }
-});
-
-app.get('/api/stations/:stationId/sync', async (req, res) => {
-    const { stationId } = req.params;
-    try {
-        await reconcileStationState(stationId);
-
-        const statusResult = await pool.query(`
-            SELECT
-                cp.device_mqtt_id as device_id,
-                cp.port_id,
-                COALESCE(cds.status_message, 'online') as status_message,
-                COALESCE(cds.charger_state, 'OFF') as charger_state,
-                COALESCE(cds.last_update, NOW()) as last_update,
-                cp.port_number_in_device,
-                cs.total_mah_consumed,
-                cs.energy_consumed_kwh,
-                cs.session_id
-            FROM charging_port cp
-            LEFT JOIN current_device_status cds ON cp.port_id = cds.port_id
-            LEFT JOIN charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $2
-            WHERE cp.station_id = $1
-            ORDER BY cp.device_mqtt_id, cp.port_number_in_device
-        `, [stationId, SESSION_STATUS.ACTIVE]);
-
-        const consumptionResult = await pool.query(`
-            SELECT
-                cp.device_mqtt_id as device_id,
-                cp.port_number_in_device as port_number,
-                COALESCE(cs.total_mah_consumed, 0) as total_mah_consumed,
-                COALESCE(cs.energy_consumed_kwh, 0) as energy_consumed_kwh,
-                COALESCE(cs.last_status_update, NOW()) as timestamp,
-                (SELECT AVG(sub.consumption_watts) 
-                 FROM (
-                     SELECT consumption_watts
-                     FROM consumption_data cd 
-                     WHERE cd.session_id = cs.session_id 
-                     AND cd.timestamp > NOW() - INTERVAL '1 minute'
-                     ORDER BY cd.timestamp DESC 
-                     LIMIT 6
-                 ) sub) as recent_consumption_watts
-            FROM charging_port cp
-            LEFT JOIN charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $2
-            WHERE cp.station_id = $1
-            ORDER BY cp.device_mqtt_id, cp.port_number_in_device
-        `, [stationId, SESSION_STATUS.ACTIVE]);
-
-        const consumptionData = consumptionResult.rows.map(row => {
-            const totalMah = Number(row.total_mah_consumed) || 0;
-            const recentWatts = Number(row.recent_consumption_watts) || 0;
-            const currentConsumption = recentWatts > 0 ? (recentWatts / NOMINAL_CHARGING_VOLTAGE_DC) * 1000 : 0;
-
-            return {
-                device_id: row.device_id,
-                port_number: row.port_number,
-                total_mah: totalMah,
-                current_consumption: currentConsumption,
-                energy_consumed_kwh: Number(row.energy_consumed_kwh) || 0,
-                timestamp: row.timestamp
-            };
-        });
-
-        const activeSessionsResult = await pool.query(
-            `SELECT session_id, user_id, port_id, station_id, start_time, energy_consumed_kwh, energy_consumed_mah
-             FROM charging_session
-             WHERE station_id = $1 AND session_status = $2`,
-            [stationId, SESSION_STATUS.ACTIVE]
-        );
+    }
+});
 
-        res.json({
-            status: statusResult.rows,
-            consumption: consumptionData,
-            activeSessions: activeSessionsResult.rows
-        });
+app.get('/api/stations/:stationId/sync', async (req, res) => {
+    const { stationId } = req.params;
+    try {
+        res.json(await singleFlight(`sync:${stationId}`, () => loadStationSync(stationId)));
     } catch (error) {
         console.error(`Error syncing station ${stationId}:`, error);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Error syncing station ${stationId}: ${error.message}`);
@@ -1080,21 +4740,81 @@ app.get('/api/stations/:stationId/sync', async (req, res) => {
     }
 });
 
+// Reconciles the station, then reads port status, live consumption and active sessions (in parallel)
+async function loadStationSync(stationId) {
+    await requestStationReconcile(stationId);
+
+    const [statusResult, consumptionResult, activeSessionsResult] = await Promise.all([pool.query(`
+        SELECT
+            cp.device_mqtt_id as device_id,
+            cp.port_id,
+            COALESCE(cds.status_message, 'online') as status_message,
+            COALESCE(cds.charger_state, 'OFF') as charger_state,
+            COALESCE(cds.last_update, NOW()) as last_update,
+            cp.port_number_in_device,
+            cs.total_mah_consumed,
+            cs.energy_consumed_kwh,
+            cs.accrued_cost,
+            cs.session_id
+        FROM charging_port cp
+        LEFT JOIN current_device_status cds ON cp.port_id = cds.port_id
+        LEFT JOIN charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $2
+        WHERE cp.station_id = $1
+        ORDER BY cp.device_mqtt_id, cp.port_number_in_device
+    `, [stationId, SESSION_STATUS.ACTIVE]), pool.query(`
+        SELECT
+            cp.device_mqtt_id as device_id,
+            cp.port_number_in_device as port_number,
+            COALESCE(cs.total_mah_consumed, 0) as total_mah_consumed,
+            COALESCE(cs.energy_consumed_kwh, 0) as energy_consumed_kwh,
+            COALESCE(cs.last_status_update, NOW()) as timestamp,
+            (SELECT AVG(sub.consumption_watts) 
+             FROM (
+                 SELECT consumption_watts
+                 FROM consumption_data cd 
+                 WHERE cd.session_id = cs.session_id 
+                 AND cd.timestamp > NOW() - INTERVAL '1 minute'
+                 ORDER BY cd.timestamp DESC 
+                 LIMIT 6
+             ) sub) as recent_consumption_watts
+        FROM charging_port cp
+        LEFT JOIN charging_session cs ON cp.port_id = cs.port_id AND cs.session_status = $2
+        WHERE cp.station_id = $1
+        ORDER BY cp.device_mqtt_id, cp.port_number_in_device
+    `, [stationId, SESSION_STATUS.ACTIVE]), pool.query(
+        `SELECT session_id, user_id, port_id, station_id, start_time, energy_consumed_kwh, energy_consumed_mah
+         FROM charging_session
+         WHERE station_id = $1 AND session_status = $2`,
+        [stationId, SESSION_STATUS.ACTIVE]
+    )]);
+
+    const consumptionData = consumptionResult.rows.map(row => {
+        const totalMah = Number(row.total_mah_consumed) || 0;
+        const recentWatts = Number(row.recent_consumption_watts) || 0;
+        const currentConsumption = recentWatts > 0 ? (recentWatts / NOMINAL_CHARGING_VOLTAGE_DC) * 1000 : 0;
+
+        return {
+            device_id: row.device_id,
+            port_number: row.port_number,
+            total_mah: totalMah,
+            current_consumption: currentConsumption,
+            energy_consumed_kwh: Number(row.energy_consumed_kwh) || 0,
+            timestamp: row.timestamp
+        };
+    });
+
+    return {
+        status: statusResult.rows,
+        consumption: consumptionData,
+        activeSessions: activeSessionsResult.rows
+    };
+}
+
 // --- Quota Validation Function ---
 async function checkUserQuota(user_id) {
     try {
         // Get user's active subscription and current usage
-        const { rows } = await pool.query(`
-            SELECT 
-                us.current_daily_mah_consumed,
-                us.borrowed_mah_today,
-                us.last_quota_reset,
-                sp.daily_mah_limit
-            FROM user_subscription us
-            JOIN subscription_plans sp ON us.plan_id = sp.plan_id
-            WHERE us.user_id = $1 AND us.is_active = true
-            ORDER BY us.created_at DESC LIMIT 1
-        `, [user_id]);
+        const { rows } = await controlPool.query(preparedStatement('getUserQuota', [user_id]));
 
         if (rows.length === 0) {
             return { 
@@ -1108,7 +4828,8 @@ async function checkUserQuota(user_id) {
         }
 
         const subscription = rows[0];
-        const dailyLimit = Number(subscription.daily_mah_limit) || 0;
+        const plan = await getSubscriptionPlan(subscription.plan_id);
+        const dailyLimit = plan?.daily_mah_limit || 0;
         const consumed = Number(subscription.current_daily_mah_consumed) || 0;
         const borrowedToday = Number(subscription.borrowed_mah_today) || 0;
         const lastQuotaReset = subscription.last_quota_reset;
@@ -1131,7 +4852,7 @@ async function checkUserQuota(user_id) {
 
         // Reset daily consumption if it's a new day
         if (isNewDay && consumed > 0) {
-            await pool.query(`
+            await controlPool.query(`
                 UPDATE user_subscription 
                 SET current_daily_mah_consumed = 0, 
                     last_quota_reset = NOW(),
@@ -1164,7 +4885,8 @@ async function checkUserQuota(user_id) {
                 availableQuota,
                 totalUsed: updatedConsumed,
                 dailyLimit,
-                borrowedToday
+                borrowedToday,
+                priorityAccess: !!plan?.priority_access
             };
         }
 
@@ -1190,7 +4912,8 @@ async function checkUserQuota(user_id) {
             availableQuota,
             totalUsed: consumed,
             dailyLimit,
-            borrowedToday
+            borrowedToday,
+            priorityAccess: !!plan?.priority_access
         };
     } catch (error) {
         console.error('Error checking user quota:', error);
@@ -1215,26 +4938,22 @@ app.post('/api/devices/:deviceId/:portNumber/control', async (req, res) => {
         return res.status(400).json({ error: `Invalid command. Must be "${CHARGER_STATES.ON}" or "${CHARGER_STATES.OFF}".` });
     }
 
-    const controlTopic = `${MQTT_TOPICS.CONTROL}${deviceId}`;
     const internalPortNumber = parseInt(portNumber);
 
     try {
-        // Find the actual port_id (UUID) and is_premium from charging_port table
-        const portIdResult = await pool.query(
-            'SELECT port_id, is_premium FROM charging_port WHERE device_mqtt_id = $1 AND port_number_in_device = $2',
-            [deviceId, internalPortNumber]
-        );
-        const actualPortId = portIdResult.rows[0]?.port_id;
-        const isPremiumPort = portIdResult.rows[0]?.is_premium;
+        // Resolve the port's state machine (port_id, is_premium, active session)
+        const portEntry = await ensurePortEntry(deviceId, internalPortNumber);
+        const actualPortId = portEntry?.portId;
+        const isPremiumPort = portEntry?.isPremium;
 
-        if (!actualPortId) {
+        if (!portEntry) {
             console.warn(`API: Port not found for deviceId ${deviceId} and portNumber ${internalPortNumber}.`);
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `Control command for non-existent port: Device ${deviceId}, Port ${internalPortNumber}`);
             return res.status(404).json({ error: `Port ${internalPortNumber} not found for device ${deviceId}.` });
         }
 
         // Session Management Logic with locking
-        const sessionKey = `${deviceId}_${internalPortNumber}`;
+        const sessionKey = portEntry.key;
         
         // Acquire lock before processing session management
         let unlock;
@@ -1249,16 +4968,12 @@ app.post('/api/devices/:deviceId/:portNumber/control', async (req, res) => {
             });
         }
         
+        let finalizingHere = false;
         try {
-            let currentSessionId = activeChargerSessions[sessionKey];
-
-            // Determine the port status to set in the DB
-            let newPortStatusForDb;
-            if (command === CHARGER_STATES.ON) {
-                newPortStatusForDb = isPremiumPort ? PORT_STATUS.CHARGING_PREMIUM : PORT_STATUS.CHARGING_FREE;
-            } else { // command === CHARGER_STATES.OFF
-                newPortStatusForDb = PORT_STATUS.AVAILABLE;
-            }
+            let currentSessionId = portEntry.sessionId;
+            let commandId = null;
+            let waitingForPower = false;
+            const commandFields = { deviceId, portNumber: internalPortNumber, command, source: LOG_SOURCES.API };
 
             if (command === CHARGER_STATES.ON) {
             if (!user_id || !station_id) {
@@ -1266,6 +4981,13 @@ app.post('/api/devices/:deviceId/:portNumber/control', async (req, res) => {
                 return res.status(400).json({ error: 'user_id and station_id are required to start a session.' });
             }
 
+            if (portEntry.state === PORT_FSM_STATES.FAULT || portEntry.state === PORT_FSM_STATES.FINALIZING) {
+                logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `User ${user_id} tried to start ${sessionKey} while port is '${portEntry.state}'`);
+                return res.status(409).json({ error: portEntry.state === PORT_FSM_STATES.FAULT
+                    ? 'This port is out of service. Please use another port.'
+                    : 'Port is finishing the previous session. Please try again in a moment.' });
+            }
+
             // Check user quota before allowing charging
             const quotaCheck = await checkUserQuota(user_id);
             if (!quotaCheck.canCharge) {
@@ -1296,139 +5018,145 @@ app.post('/api/devices/:deviceId/:portNumber/control', async (req, res) => {
                 });
             }
 
-            // Check if there's already an active session in DB for this port
-            const existingActiveSession = await pool.query(
-                "SELECT session_id, user_id FROM charging_session WHERE port_id = $1 AND session_status = $2",
-                [actualPortId, SESSION_STATUS.ACTIVE]
-            );
-
-            if (existingActiveSession.rows.length === 0) {
-                // No active session found in DB, create a new one
-                const sessionResult = await pool.query(
-                    'INSERT INTO charging_session (user_id, port_id, station_id, start_time, session_status, is_premium, energy_consumed_kwh, total_mah_consumed, last_status_update) VALUES ($1, $2, $3, NOW(), $4, $5, $6, $7, NOW()) RETURNING session_id',
-                    [user_id, actualPortId, station_id, SESSION_STATUS.ACTIVE, isPremiumPort, 0, 0]
-                );
-                currentSessionId = sessionResult.rows[0].session_id;
-                activeChargerSessions[sessionKey] = currentSessionId;
-                console.log(`API: Started new charging session ${currentSessionId} for port ${actualPortId} (User: ${user_id})`);
-                logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `New charging session ${currentSessionId} started for ${sessionKey} by user ${user_id}`);
+            // Check if the port's state machine already holds an active session
+            if (!portEntry.sessionId) {
+                // The station's power budget decides whether the relay goes on now or the session waits its turn
+                const admitted = await admitToPowerBudget(portEntry);
+
+                // No active session found in DB, create it together with its ON command
+                const powerPriority = powerPriorityFor(portEntry, quotaCheck);
+                await runInTransaction(async (client) => {
+                    const sessionResult = await client.query(
+                        'INSERT INTO charging_session (user_id, port_id, station_id, start_time, session_status, is_premium, energy_consumed_kwh, total_mah_consumed, accrued_cost, last_status_update, power_priority, power_paused_at) VALUES ($1, $2, $3, NOW(), $4, $5, $6, $7, $8, NOW(), $9, CASE WHEN $10::boolean THEN NULL ELSE NOW() END) RETURNING session_id',
+                        [user_id, actualPortId, station_id, SESSION_STATUS.ACTIVE, isPremiumPort, 0, 0, 0, powerPriority, admitted]
+                    );
+                    currentSessionId = sessionResult.rows[0].session_id;
+                    if (admitted) {
+                        commandId = await enqueueControlCommand(client, { ...commandFields, sessionId: currentSessionId });
+                    }
+                });
+                transitionPortState(portEntry, PORT_FSM_EVENTS.SESSION_STARTED, { sessionId: currentSessionId, userId: user_id });
+                portEntry.budget.priority = powerPriority;
+                if (admitted) {
+                    markPortRunning(portEntry);
+                    powerBudgetMetrics.admitted++;
+                } else {
+                    markPortPaused(portEntry);
+                    powerBudgetMetrics.queued++;
+                    setImmediate(() => rebalanceStationPower(portEntry.stationId).catch(error =>
+                        console.error(`PowerBudget: Failed to rebalance station ${portEntry.stationId}:`, error)));
+                }
+                console.log(`API: Started new charging session ${currentSessionId} for port ${actualPortId} (User: ${user_id})${admitted ? '' : ', queued for station power'}`);
+                logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `New charging session ${currentSessionId} started for ${sessionKey} by user ${user_id}${admitted ? '' : ' (queued by power budget)'}`);
             } else {
                 // Session already active
-                currentSessionId = existingActiveSession.rows[0].session_id;
+                currentSessionId = portEntry.sessionId;
                 
                 // If the existing session is by a *different* user, it's occupied!
-                if (existingActiveSession.rows[0].user_id !== user_id) {
-                    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `User ${user_id} tried to activate occupied port ${sessionKey}. Occupied by ${existingActiveSession.rows[0].user_id}.`);
+                if (portEntry.userId !== user_id) {
+                    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `User ${user_id} tried to activate occupied port ${sessionKey}. Occupied by ${portEntry.userId}.`);
                     return res.status(409).json({ error: 'Port is currently occupied by another user.' });
                 }
 
-                activeChargerSessions[sessionKey] = currentSessionId; // Ensure in-memory map is updated
+                transitionPortState(portEntry, PORT_FSM_EVENTS.SESSION_STARTED, { sessionId: currentSessionId, userId: user_id });
                 
-                // Update the last_status_update to reset inactivity timer
-                await pool.query(
-                    "UPDATE charging_session SET last_status_update = NOW() WHERE session_id = $1",
-                    [currentSessionId]
-                );
+                // Update the last_status_update to reset inactivity timer, and re-send ON
+                await runInTransaction(async (client) => {
+                    await client.query(
+                        "UPDATE charging_session SET last_status_update = NOW() WHERE session_id = $1",
+                        [currentSessionId]
+                    );
+                    if (!portEntry.budget.paused) { // A queued session's ON comes from the power budget
+                        commandId = await enqueueControlCommand(client, { ...commandFields, sessionId: currentSessionId });
+                    }
+                });
                 
                 console.log(`API: Resuming existing active session ${currentSessionId} for port ${actualPortId} (User: ${user_id})`);
                 logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Resuming active session ${currentSessionId} for ${sessionKey} by user ${user_id}`);
             }
 
-            // Start/Reset inactivity timer when charger is turned ON via API
-            if (activePortTimers[sessionKey]) {
-                clearTimeout(activePortTimers[sessionKey].timerId);
-                console.log(`API: Cleared existing timer for ${sessionKey}`);
+            // Start/Reset inactivity timer when charger is turned ON via API (a queued port starts it on resume)
+            waitingForPower = portEntry.budget.paused;
+            if (!waitingForPower) {
+                resetPortInactivityTimer(portEntry);
+                console.log(`API: Inactivity timer started for ${sessionKey}. Timer set for ${INACTIVITY_TIMEOUT_SECONDS} seconds. Session ID: ${currentSessionId}`);
             }
-            activePortTimers[sessionKey] = {
-                timerId: setTimeout(
-                    () => handleInactivityTurnOff(deviceId, internalPortNumber, actualPortId, currentSessionId),
-                    INACTIVITY_TIMEOUT_SECONDS * 1000
-                ),
-                lastConsumptionTime: Date.now()
-            };
-            console.log(`API: Inactivity timer started for ${sessionKey}. Timer set for ${INACTIVITY_TIMEOUT_SECONDS} seconds. Session ID: ${currentSessionId}`);
 
         } else if (command === CHARGER_STATES.OFF) {
-            // Check if the session is currently active by this user
-            const sessionCheck = await pool.query(
-                "SELECT session_id, user_id, energy_consumed_kwh, energy_consumed_mah FROM charging_session WHERE port_id = $1 AND session_status = $2",
-                [actualPortId, SESSION_STATUS.ACTIVE]
-            );
-
-            if (sessionCheck.rows.length > 0) {
-                const dbSession = sessionCheck.rows[0];
-                if (dbSession.user_id !== user_id) { // Ensure only the session owner can end it via API
-                    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `User ${user_id} tried to end session ${dbSession.session_id} not owned by them.`);
+            // Check if the port's session is owned by this user
+            if (portEntry.sessionId && portEntry.state !== PORT_FSM_STATES.FINALIZING) {
+                if (portEntry.userId !== user_id) { // Ensure only the session owner can end it via API
+                    logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `User ${user_id} tried to end session ${portEntry.sessionId} not owned by them.`);
                     return res.status(403).json({ error: 'You can only end your own active session on this port.' });
                 }
 
-                currentSessionId = dbSession.session_id; // Set currentSessionId from DB
+                currentSessionId = portEntry.sessionId;
+                finalizingHere = transitionPortState(portEntry, PORT_FSM_EVENTS.FINALIZE);
+                await flushPortEvents(); // Bill against every usage event received so far
+                const sessionResult = await controlPool.query(preparedStatement('getSessionEnergy', [currentSessionId]));
+                const dbSession = sessionResult.rows[0] || {};
                 const energyConsumed = parseFloat(dbSession.energy_consumed_kwh) || 0;
                 const mAhConsumed = parseFloat(dbSession.energy_consumed_mah) || 0;
                 
                 // Calculate final cost
-                const sessionCost = await calculateSessionCost(currentSessionId, energyConsumed);
+                const sessionCost = await finalSessionCost(currentSessionId, dbSession, portEntry.stationId);
 
-                // End the active session in DB
-                await pool.query(
-                    "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3 AND session_status = $4",
-                    [SESSION_STATUS.COMPLETED, sessionCost, currentSessionId, SESSION_STATUS.ACTIVE]
-                );
+                // End the active session, charge the user's daily quota and queue OFF atomically
+                await runInTransaction(async (client) => {
+                    await client.query(
+                        "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3 AND session_status = $4",
+                        [SESSION_STATUS.COMPLETED, sessionCost, currentSessionId, SESSION_STATUS.ACTIVE]
+                    );
+                    await client.query(preparedStatement('refreshDailySessionTotals', [currentSessionId, SESSION_STATUS.COMPLETED, STATION_TIME_ZONE]));
+                    await client.query(
+                        "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
+                        [mAhConsumed, user_id]
+                    );
+                    commandId = await enqueueControlCommand(client, { ...commandFields, sessionId: currentSessionId });
+                });
                 console.log(`API: Ended charging session ${currentSessionId} for port ${actualPortId}. Energy consumed: ${energyConsumed.toFixed(3)} kWh, ${mAhConsumed.toFixed(0)} mAh. Cost: $${sessionCost.toFixed(2)}`);
                 logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Session ${currentSessionId} ended for ${sessionKey}. Cost: $${sessionCost.toFixed(2)}`);
-                
-                // Update user's daily consumption
-                await pool.query(
-                    "UPDATE user_subscription SET current_daily_mah_consumed = COALESCE(current_daily_mah_consumed, 0) + $1 WHERE user_id = $2 AND is_active = true",
-                    [mAhConsumed, user_id]
-                );
                 console.log(`API: Updated daily consumption for user ${user_id} by ${mAhConsumed.toFixed(0)} mAh`);
                 
-                delete activeChargerSessions[sessionKey]; // Remove from tracking map
-                console.log(`API: Removed session ${currentSessionId} from tracking map for ${sessionKey}`);
-
-                // Clear inactivity timer when charger is turned OFF via API
-                if (activePortTimers[sessionKey]) {
-                    clearTimeout(activePortTimers[sessionKey].timerId);
-                    delete activePortTimers[sessionKey];
-                    console.log(`API: Inactivity timer cleared for ${sessionKey}.`);
-                }
+                // Releases the port and clears its inactivity timer
+                transitionPortState(portEntry, PORT_FSM_EVENTS.SESSION_ENDED);
+                finalizingHere = false;
+                console.log(`API: Released ${sessionKey} after ending session ${currentSessionId}`);
 
             } else {
                 console.log(`API: Received OFF command for ${deviceId} Port ${internalPortNumber}, but no active session found for user ${user_id}.`);
                 logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `OFF command for ${sessionKey} by user ${user_id} but no active session.`);
                 // If no session, still attempt to turn off the physical charger
+                commandId = await enqueueControlCommand(pool, commandFields);
+                if (!portEntry.sessionId) {
+                    transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_OFF);
+                }
             }
         }
 
-        // Update charging_port table for real-time status display in the main schema
-        await pool.query(
-            'UPDATE charging_port SET current_status = $1, is_occupied = $2, last_status_update = NOW() WHERE port_id = $3',
-            [newPortStatusForDb, (newPortStatusForDb === PORT_STATUS.CHARGING_FREE || newPortStatusForDb === PORT_STATUS.CHARGING_PREMIUM || newPortStatusForDb === PORT_STATUS.OCCUPIED), actualPortId]
-        );
-        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Port ${actualPortId} status set to '${newPortStatusForDb}' by API command '${command}'.`);
+        // charging_port follows the state machine write-behind
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Port ${actualPortId} is '${portEntry.state}' after API command '${command}'.`);
 
-        // Publish MQTT command (payload remains the same for ESP32)
-        const mqttPayload = JSON.stringify({ command: command, port_number: internalPortNumber });
+        // The outbox publisher delivers the command (payload remains the same for ESP32); no waiting on PUBACK here
+        scheduleCommandOutboxDrain();
+        console.log(`API: Queued MQTT command '${command}' (#${commandId}) for ${deviceId} Port ${internalPortNumber}.`);
+        noteUserWrite(user_id); // Their next session/usage reads must see this session change
 
-        mqttClient.publish(controlTopic, mqttPayload, { qos: 1 }, (err) => {
-            if (err) {
-                console.error(`Failed to publish control command to ${controlTopic}:`, err);
-                logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to publish control command '${command}' to ${controlTopic}: ${err.message}`);
-                return res.status(500).json({ error: 'Failed to send control command via MQTT' });
-            }
-            console.log(`API: Sent MQTT command '${command}' to ${deviceId} Port ${internalPortNumber}.`);
-            
-            res.json({ 
-                status: 'Command sent', 
-                deviceId, 
-                portNumber: internalPortNumber, 
-                command, 
-                sessionId: currentSessionId
-            });
+        res.json({ 
+            status: waitingForPower ? 'Waiting for station power' : 'Command queued', 
+            deviceId, 
+            portNumber: internalPortNumber, 
+            command, 
+            commandId,
+            sessionId: currentSessionId,
+            powerBudget: { queued: waitingForPower }
         });
 
         } finally {
+            // An OFF that failed mid-finalization hands the port back to its session
+            if (finalizingHere) {
+                transitionPortState(portEntry, PORT_FSM_EVENTS.FINALIZE_FAILED);
+            }
             // Always release the lock
             unlock();
         }
@@ -1440,13 +5168,33 @@ app.post('/api/devices/:deviceId/:portNumber/control', async (req, res) => {
     }
 });
 
+// Backfill buffered readings for a device (e.g. uploaded from a station's SD card after an outage)
+app.post('/api/devices/:deviceId/backfill', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const { deviceId } = req.params;
+    if (!Array.isArray(req.body?.readings) || req.body.readings.length === 0) {
+        return res.status(400).json({ error: 'readings must be a non-empty array' });
+    }
+    if (req.body.readings.length > BACKFILL_MAX_READINGS) {
+        return res.status(413).json({ error: `At most ${BACKFILL_MAX_READINGS} readings per request; send the buffer in chunks.` });
+    }
+
+    try {
+        const summary = await ingestTelemetryBackfill(deviceId, req.body, LOG_SOURCES.API);
+        res.json(summary);
+    } catch (error) {
+        console.error('Error ingesting backfill:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Backfill for ${deviceId} failed: ${error.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Failed to ingest backfill' });
+    }
+});
+
 // --- Admin API Routes ---
 
 // Admin Dashboard Stats
 app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
         // Get user stats
-        const userStats = await pool.query(`
+        const userStats = await readPool(reportingPool).query(`
             SELECT 
                 COUNT(*) as total,
                 COUNT(CASE WHEN last_login > NOW() - INTERVAL '30 days' THEN 1 END) as active
@@ -1454,7 +5202,7 @@ app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, asyn
         `);
         
         // Get station stats
-        const stationStats = await pool.query(`
+        const stationStats = await readPool(reportingPool).query(`
             SELECT 
                 COUNT(*) as total,
                 COUNT(CASE WHEN is_active = true THEN 1 END) as active
@@ -1462,7 +5210,7 @@ app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, asyn
         `);
         
         // Get port stats
-        const portStats = await pool.query(`
+        const portStats = await readPool(reportingPool).query(`
             SELECT 
                 COUNT(*) as total,
                 COUNT(CASE WHEN current_status = '${PORT_STATUS.AVAILABLE}' THEN 1 END) as available,
@@ -1471,7 +5219,7 @@ app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, asyn
         `);
         
         // Get session stats
-        const sessionStats = await pool.query(`
+        const sessionStats = await readPool(reportingPool).query(`
             SELECT 
                 COUNT(CASE WHEN start_time > CURRENT_DATE THEN 1 END) as today,
                 COUNT(CASE WHEN start_time > CURRENT_DATE - INTERVAL '7 days' THEN 1 END) as week,
@@ -1481,7 +5229,7 @@ app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, asyn
         
         // Get revenue stats
         // This query now relies on the 'cost' column being present in charging_session
-        const revenueStats = await pool.query(`
+        const revenueStats = await readPool(reportingPool).query(`
             SELECT 
                 COALESCE(SUM(CASE WHEN start_time > CURRENT_DATE THEN cost ELSE 0 END), 0) as today,
                 COALESCE(SUM(CASE WHEN start_time > CURRENT_DATE - INTERVAL '7 days' THEN cost ELSE 0 END), 0) as week,
@@ -1508,7 +5256,7 @@ app.get('/api/admin/dashboard/stats', supabaseAuthMiddleware, requireAdmin, asyn
 app.get('/api/admin/sessions/recent', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
         // This query now relies on the 'cost' column being present in charging_session
-        const result = await pool.query(`
+        const result = await readPool(reportingPool).query(`
             SELECT 
                 cs.session_id as id,
                 CONCAT(u.fname, ' ', u.lname) as user_name,
@@ -1581,7 +5329,7 @@ app.get('/api/admin/system/status', supabaseAuthMiddleware, requireAdmin, async
 // Station Battery Levels
 app.get('/api/admin/stations/battery', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
-        const result = await pool.query(`
+        const result = await readPool(reportingPool).query(`
             SELECT 
                 station_name,
                 current_battery_level as level,
@@ -1930,6 +5678,7 @@ app.post('/api/admin/stations', supabaseAuthMiddleware, requireAdmin, async (req
             }
             
             await client.query('COMMIT');
+            await invalidateReferenceData('stations');
             
             res.status(201).json({ station_id: stationId, message: 'Station created successfully' });
             logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `New station ${stationId} created by admin`, req.user.user_id);
@@ -1982,6 +5731,7 @@ app.put('/api/admin/stations/:stationId', supabaseAuthMiddleware, requireAdmin,
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `Attempt to update non-existent station ${stationId}`, req.user.user_id);
             return res.status(404).json({ error: 'Station not found' });
         }
+        await invalidateReferenceData('stations');
         
         res.json({ message: 'Station updated successfully' });
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Station ${stationId} updated by admin`, req.user.user_id);
@@ -1992,6 +5742,98 @@ app.put('/api/admin/stations/:stationId', supabaseAuthMiddleware, requireAdmin,
     }
 });
 
+// Station telemetry: the live ring buffer, plus persisted minute buckets with ?hours= (at most 31 days)
+app.get('/api/admin/stations/:stationId/telemetry', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const { stationId } = req.params;
+    const hours = req.query.hours === undefined ? null : parseInt(req.query.hours, 10);
+    if (hours !== null && !(hours > 0 && hours <= 31 * 24)) {
+        return res.status(400).json({ error: 'hours must be between 1 and 744' });
+    }
+
+    try {
+        const history = hours === null
+            ? null
+            : (await readPool(reportingPool).query(preparedStatement('listStationTelemetry', [stationId, `${hours} hours`]))).rows;
+        res.json({
+            station_id: stationId,
+            latest: stationTelemetry.get(stationId)?.latest ?? null,
+            readings: stationTelemetryReadings(stationId),
+            history,
+            totals: stationTelemetryMetrics
+        });
+    } catch (err) {
+        console.error('Station telemetry error:', err.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Station telemetry error for ${stationId}: ${err.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Server error' });
+    }
+});
+
+// Time-of-use tariff windows for a station
+app.get('/api/admin/stations/:stationId/tariffs', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const { stationId } = req.params;
+    try {
+        const { rows } = await pool.query(
+            `SELECT tariff_id, days_of_week, start_time::text AS start_time, end_time::text AS end_time, price_per_mah
+             FROM station_tariff_windows
+             WHERE station_id = $1
+             ORDER BY start_time`,
+            [stationId]
+        );
+        res.json(rows);
+    } catch (err) {
+        console.error('Fetch station tariffs error:', err.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Fetch tariffs error for station ${stationId}: ${err.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Server error' });
+    }
+});
+
+// Replaces the station's windows; readings from then on are priced with the new ones
+app.put('/api/admin/stations/:stationId/tariffs', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const { stationId } = req.params;
+    const windows = Array.isArray(req.body?.windows) ? req.body.windows : null;
+    const timePattern = /^([01]\d|2[0-3]):[0-5]\d$/;
+
+    if (!windows) {
+        return res.status(400).json({ error: 'windows must be an array' });
+    }
+    for (const window of windows) {
+        const days = window.days_of_week ?? null;
+        if (!timePattern.test(window.start_time) || !timePattern.test(window.end_time) || window.start_time === window.end_time ||
+            !(Number(window.price_per_mah) >= 0) ||
+            (days !== null && (!Array.isArray(days) || !days.every(day => Number.isInteger(day) && day >= 0 && day <= 6)))) {
+            return res.status(400).json({ error: 'Each window needs start_time and end_time (HH:MM, different), price_per_mah >= 0 and optional days_of_week (0-6).' });
+        }
+    }
+
+    try {
+        await runInTransaction(async (client) => {
+            await client.query('DELETE FROM station_tariff_windows WHERE station_id = $1', [stationId]);
+            if (windows.length > 0) {
+                await client.query(
+                    `INSERT INTO station_tariff_windows (station_id, days_of_week, start_time, end_time, price_per_mah)
+                     SELECT $1, CASE WHEN w.days = '' THEN NULL ELSE string_to_array(w.days, ',')::smallint[] END, w.start_time, w.end_time, w.price_per_mah
+                     FROM UNNEST($2::text[], $3::time[], $4::time[], $5::numeric[]) AS w(days, start_time, end_time, price_per_mah)`,
+                    [
+                        stationId,
+                        windows.map(window => (window.days_of_week ? window.days_of_week.join(',') : '')),
+                        windows.map(window => window.start_time),
+                        windows.map(window => window.end_time),
+                        windows.map(window => Number(window.price_per_mah))
+                    ]
+                );
+            }
+        }, pool);
+        await invalidateReferenceData('tariffs');
+
+        res.json({ message: 'Tariffs updated successfully', windows: windows.length });
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Tariffs for station ${stationId} replaced (${windows.length} windows) by admin`, req.user.user_id);
+    } catch (err) {
+        console.error('Update station tariffs error:', err.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Update tariffs error for station ${stationId}: ${err.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Server error' });
+    }
+});
+
 //Delete a station
 app.delete('/api/admin/stations/:stationId', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
@@ -2065,6 +5907,8 @@ app.delete('/api/admin/stations/:stationId', supabaseAuthMiddleware, requireAdmi
             `, [stationId]);
             
             await client.query('COMMIT');
+            forgetStationPorts(stationId);
+            await invalidateReferenceData('stations');
             
             res.json({ message: 'Station and all associated data deleted successfully' });
             logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Station ${stationId} and associated data deleted by admin`, req.user.user_id);
@@ -2082,59 +5926,24 @@ app.delete('/api/admin/stations/:stationId', supabaseAuthMiddleware, requireAdmi
 });
 
 // Admin Sessions & Reports
+const UUID_PATTERN = /^[0-9a-f]{8}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{4}-[0-9a-f]{12}$/i;
+
 app.get('/api/admin/sessions', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
         const { range = 'week', station = 'all', status = 'all' } = req.query;
         
-        let timeFilter;
-        switch (range) {
-            case 'day':
-                timeFilter = "start_time > CURRENT_DATE";
-                break;
-            case 'week':
-                timeFilter = "start_time > CURRENT_DATE - INTERVAL '7 days'";
-                break;
-            case 'month':
-                timeFilter = "start_time > CURRENT_DATE - INTERVAL '30 days'";
-                break;
-            case 'year':
-                timeFilter = "start_time > CURRENT_DATE - INTERVAL '365 days'";
-                break;
-            default:
-                timeFilter = "start_time > CURRENT_DATE - INTERVAL '7 days'";
-        }
-        
-        let stationFilter = station !== 'all' ? `AND cs.station_id = '${station}'` : '';
-        let statusFilter = status !== 'all' ? `AND cs.session_status = '${status}'` : '';
-        
-        const query = `
-            SELECT 
-                cs.session_id as id,
-                CONCAT(u.fname, ' ', u.lname) as user_name,
-                s.station_name,
-                cp.port_number_in_device as port,
-                cs.start_time,
-                cs.end_time,
-                EXTRACT(EPOCH FROM (COALESCE(cs.end_time, NOW()) - cs.start_time))/60 as duration,
-                cs.energy_consumed_kwh as energy,
-                cs.energy_consumed_mah as energy_mah,
-                cs.cost,
-                cs.session_status as status
-            FROM 
-                charging_session cs
-            JOIN 
-                users u ON cs.user_id = u.user_id
-            JOIN 
-                charging_station s ON cs.station_id = s.station_id
-            JOIN 
-                charging_port cp ON cs.port_id = cp.port_id
-            WHERE 
-                ${timeFilter} ${stationFilter} ${statusFilter}
-            ORDER BY 
-                cs.start_time DESC
-        `;
+        // start_time > CURRENT_DATE - interval; 'day' means since midnight
+        const rangeIntervals = { day: '0 days', week: '7 days', month: '30 days', year: '365 days' };
+        const interval = rangeIntervals[range] || rangeIntervals.week;
         
-        const result = await pool.query(query);
+        if (station !== 'all' && !UUID_PATTERN.test(String(station))) {
+            return res.json([]); // No station has that id
+        }
+        const result = await readPool(reportingPool).query(preparedStatement('listAdminSessions', [
+            interval,
+            station !== 'all' ? String(station) : null,
+            status !== 'all' ? String(status) : null
+        ]));
         res.json(result.rows);
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, 'Admin sessions list fetched successfully', req.user.user_id);
     } catch (err) {
@@ -2203,10 +6012,10 @@ app.get('/api/admin/revenue', supabaseAuthMiddleware, requireAdmin, async (req,
             FROM charging_session
         `;
         
-        const dailyResult = await pool.query(dailyQuery);
-        const weeklyResult = await pool.query(weeklyQuery);
-        const monthlyResult = await pool.query(monthlyQuery);
-        const totalResult = await pool.query(totalQuery);
+        const dailyResult = await readPool(reportingPool).query(dailyQuery);
+        const weeklyResult = await readPool(reportingPool).query(weeklyQuery);
+        const monthlyResult = await readPool(reportingPool).query(monthlyQuery);
+        const totalResult = await readPool(reportingPool).query(totalQuery);
         
         res.json({
             daily: dailyResult.rows,
@@ -2222,6 +6031,69 @@ app.get('/api/admin/revenue', supabaseAuthMiddleware, requireAdmin, async (req,
     }
 });
 
+// Get port occupancy by hour of day, from the rollup kept by flushPortOccupancy (up to a minute behind)
+app.get('/api/admin/occupancy', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const days = Math.min(Math.max(parseInt(req.query.days, 10) || 7, 1), OCCUPANCY_MAX_DAYS);
+    const stationId = req.query.station_id || null;
+    const timeZone = req.query.tz || Intl.DateTimeFormat().resolvedOptions().timeZone;
+    try {
+        new Intl.DateTimeFormat('en-US', { timeZone });
+    } catch (err) {
+        return res.status(400).json({ error: 'Invalid time zone' });
+    }
+
+    try {
+        const result = await readPool(reportingPool).query(
+            preparedStatement('listPortOccupancyByHour', [`${days} days`, stationId, timeZone])
+        );
+
+        const ports = new Map();
+        for (const row of result.rows) {
+            let port = ports.get(row.port_id);
+            if (!port) {
+                port = {
+                    port_id: row.port_id,
+                    station_id: row.station_id,
+                    station_name: row.station_name,
+                    port_number: row.port_number,
+                    is_premium: row.is_premium,
+                    occupied_seconds: 0,
+                    idle_seconds: 0,
+                    offline_seconds: 0,
+                    hours: Array.from({ length: 24 }, (_, hour) => ({ hour, occupied_seconds: 0, idle_seconds: 0, offline_seconds: 0 }))
+                };
+                ports.set(row.port_id, port);
+            }
+            const slot = port.hours[row.hour_of_day];
+            slot.occupied_seconds = Number(row.occupied_seconds);
+            slot.idle_seconds = Number(row.idle_seconds);
+            slot.offline_seconds = Number(row.offline_seconds);
+            port.occupied_seconds += slot.occupied_seconds;
+            port.idle_seconds += slot.idle_seconds;
+            port.offline_seconds += slot.offline_seconds;
+        }
+
+        // Utilization is occupied time over time the port was online
+        const withUtilization = Array.from(ports.values()).map(port => {
+            const online = port.occupied_seconds + port.idle_seconds;
+            return {
+                ...port,
+                utilization: online > 0 ? port.occupied_seconds / online : null,
+                hours: port.hours.map(slot => {
+                    const slotOnline = slot.occupied_seconds + slot.idle_seconds;
+                    return { ...slot, utilization: slotOnline > 0 ? slot.occupied_seconds / slotOnline : null };
+                })
+            };
+        });
+
+        res.json({ days, timeZone, ports: withUtilization });
+    } catch (err) {
+        console.error('Occupancy error:', err.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Occupancy error: ${err.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Server error' });
+    }
+});
+
 //Get usage reports
 app.get('/api/admin/usage', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
@@ -2277,9 +6149,9 @@ app.get('/api/admin/usage', supabaseAuthMiddleware, requireAdmin, async (req, re
                 EXTRACT(DOW FROM start_time)
         `;
         
-        const byStationResult = await pool.query(byStationQuery);
-        const byHourResult = await pool.query(byHourQuery);
-        const byDayResult = await pool.query(byDayQuery);
+        const byStationResult = await readPool(reportingPool).query(byStationQuery);
+        const byHourResult = await readPool(reportingPool).query(byHourQuery);
+        const byDayResult = await readPool(reportingPool).query(byDayQuery);
         
         res.json({
             byStation: byStationResult.rows,
@@ -2294,51 +6166,138 @@ app.get('/api/admin/usage', supabaseAuthMiddleware, requireAdmin, async (req, re
     }
 });
 
+// Admin: usage telemetry sequence metrics (duplicates dropped, gaps) overall and per port
+app.get('/api/admin/telemetry/sequence-metrics', supabaseAuthMiddleware, requireAdmin, (req, res) => {
+    const ports = Array.from(portStateMachines.values())
+        .filter(entry => entry.usageSequence.highest >= 0)
+        .map(entry => ({
+            device_id: entry.deviceId,
+            port_number: entry.portNumber,
+            station_id: entry.stationId,
+            boot: entry.usageSequence.boot,
+            highest_seq: entry.usageSequence.highest,
+            missing: entry.usageSequence.missing,
+            duplicates: entry.usageSequence.duplicates,
+            last_gap_at: entry.usageSequence.lastGapAt
+        }));
+    res.json({ window_size: TELEMETRY_SEQ_WINDOW_SIZE, totals: telemetrySequenceMetrics, ports });
+});
+
+// Admin: consumption anomaly counters overall and for every port with anomalies, an anomaly fault or a review flag
+app.get('/api/admin/telemetry/anomalies', supabaseAuthMiddleware, requireAdmin, (req, res) => {
+    const ports = Array.from(portStateMachines.values())
+        .filter(entry => entry.anomaly.fault || entry.anomaly.review || entry.anomaly.spikes > 0 || entry.anomaly.outOfRange > 0)
+        .map(entry => ({
+            device_id: entry.deviceId,
+            port_number: entry.portNumber,
+            station_id: entry.stationId,
+            state: entry.state,
+            fault: entry.anomaly.fault,
+            review: entry.anomaly.review,
+            spikes: entry.anomaly.spikes,
+            out_of_range: entry.anomaly.outOfRange,
+            mean_watts: entry.anomaly.mean,
+            std_watts: Math.sqrt(entry.anomaly.variance),
+            flat_run: entry.anomaly.flatRun
+        }));
+    res.json({ totals: consumptionAnomalyMetrics, ports });
+});
+
+// Admin: server-side full-charge detection counters and the detector state of every charging port
+app.get('/api/admin/telemetry/full-charge', supabaseAuthMiddleware, requireAdmin, (req, res) => {
+    const ports = Array.from(portStateMachines.values())
+        .filter(entry => entry.sessionId && entry.taper.samples > 0)
+        .map(entry => ({
+            device_id: entry.deviceId,
+            port_number: entry.portNumber,
+            station_id: entry.stationId,
+            session_id: entry.sessionId,
+            state: entry.state,
+            samples: entry.taper.samples,
+            peak_amps: entry.taper.peakAmps,
+            smoothed_amps: entry.taper.smoothedAmps,
+            taper_samples: entry.taper.taperSamples,
+            plateau_run: entry.taper.plateauRun,
+            detected_at: entry.taper.detectedAt
+        }));
+    res.json({ totals: fullChargeDetectionMetrics, ports });
+});
+
+// Admin: power budget, live draw and session slots per station (?station_id= for one station)
+app.get('/api/admin/power-budget', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    try {
+        const stationIds = req.query.station_id
+            ? [req.query.station_id]
+            : Array.from(new Set(Array.from(portStateMachines.values(), entry => entry.stationId).filter(Boolean)));
+        const stations = await Promise.all(stationIds.map(getStationPowerSnapshot));
+        res.json({ totals: powerBudgetMetrics, stations });
+    } catch (err) {
+        console.error('Power budget snapshot error:', err.message);
+        res.status(500).json({ error: 'Failed to load power budget' });
+    }
+});
+
+// Admin: return a port faulted by the anomaly detector to service (after the hardware was checked),
+// or dismiss a review flag on a port that is still in service
+app.post('/api/admin/telemetry/anomalies/clear', supabaseAuthMiddleware, requireAdmin, (req, res) => {
+    const { device_id: deviceId, port_number: portNumber } = req.body || {};
+    const entry = getPortEntry(deviceId, Number(portNumber));
+    if (!entry) {
+        return res.status(404).json({ error: 'Port not found' });
+    }
+    if (entry.state !== PORT_FSM_STATES.FAULT) {
+        if (!entry.anomaly.review) {
+            return res.status(409).json({ error: `Port is ${entry.state}, not faulted or flagged` });
+        }
+        entry.anomaly.review = null;
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Review flag on ${entry.key} dismissed by admin`, req.user.user_id);
+        return res.json({ message: 'Review flag dismissed', state: entry.state });
+    }
+
+    transitionPortState(entry, PORT_FSM_EVENTS.FAULT_CLEARED);
+    entry.anomaly = createAnomalyDetector();
+    consumptionAnomalyMetrics.cleared++;
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Fault on ${entry.key} cleared by admin`, req.user.user_id);
+    res.json({ message: 'Port returned to service', state: entry.state });
+});
+
+// Admin: local telemetry journal size and how far Postgres is behind it
+app.get('/api/admin/telemetry/journal', supabaseAuthMiddleware, requireAdmin, (req, res) => {
+    res.json(getTelemetryJournalMetrics());
+});
+
+// Admin: rebuild projections (current_device_status, session energy totals) from port_events
+app.post('/api/admin/port-events/replay', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
+    const requested = Array.isArray(req.body?.projections) ? req.body.projections : Object.keys(PORT_EVENT_PROJECTIONS);
+    const unknown = requested.filter(name => !PORT_EVENT_PROJECTIONS[name]);
+    if (unknown.length > 0) {
+        return res.status(400).json({ error: `Unknown projections: ${unknown.join(', ')}` });
+    }
+
+    try {
+        const result = await replayPortEvents(requested);
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Replayed ${result.replayed} port events into ${requested.join(', ')}`, req.user.user_id);
+        res.json(result);
+    } catch (err) {
+        console.error('Port event replay error:', err.message);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Port event replay failed: ${err.message}`, req.user.user_id);
+        res.status(500).json({ error: 'Failed to replay port events' });
+    }
+});
+
 // Admin Logs
 app.get('/api/admin/logs', supabaseAuthMiddleware, requireAdmin, async (req, res) => {
     try {
         const { range = '24h', type = 'all', source = 'all' } = req.query; // Added type and source filters
         
-        let timeFilter;
-        switch (range) {
-            case '1h':
-                timeFilter = "timestamp > NOW() - INTERVAL '1 hour'";
-                break;
-            case '24h':
-                timeFilter = "timestamp > NOW() - INTERVAL '24 hours'";
-                break;
-            case '7d':
-                timeFilter = "timestamp > NOW() - INTERVAL '7 days'";
-                break;
-            case '30d':
-                timeFilter = "timestamp > NOW() - INTERVAL '30 days'";
-                break;
-            default:
-                timeFilter = "timestamp > NOW() - INTERVAL '24 hours'";
-        }
-
-        let typeFilter = type !== 'all' ? `AND log_type = '${type}'` : '';
-        let sourceFilter = source !== 'all' ? `AND source = '${source}'` : '';
-        
-        const query = `
-            SELECT 
-                log_id,
-                timestamp,
-                log_type,
-                source,
-                message,
-                user_id,
-                (SELECT email FROM users WHERE user_id = system_logs.user_id) as user_email
-            FROM 
-                system_logs
-            WHERE 
-                ${timeFilter} ${typeFilter} ${sourceFilter}
-            ORDER BY 
-                timestamp DESC
-            LIMIT 500 -- Limit logs to prevent massive responses
-        `;
+        const rangeIntervals = { '1h': '1 hour', '24h': '24 hours', '7d': '7 days', '30d': '30 days' };
+        const interval = rangeIntervals[range] || rangeIntervals['24h'];
         
-        const result = await pool.query(query);
+        const result = await readPool(reportingPool).query(preparedStatement('listAdminLogs', [
+            interval,
+            type !== 'all' ? String(type) : null,
+            source !== 'all' ? String(source) : null
+        ]));
         res.json(result.rows);
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, 'Admin logs fetched successfully', req.user.user_id);
     } catch (err) {
@@ -2371,21 +6330,39 @@ app.post('/api/esp32/command', async (req, res) => {
         return res.status(400).json({ error: 'Invalid action or portId' });
     }
 
-    mqttClient.publish(topic, message, { qos: 1 }, (err) => {
-        if (err) {
-            console.error('MQTT publish error:', err);
-            logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to publish legacy MQTT command ${message} to ${topic}: ${err.message}`);
-            return res.status(500).json({ error: 'Failed to publish MQTT message' });
-        }
+    publishMqttMessage(topic, message).then(() => {
         res.json({ success: true, message: `Published ${message} to ${topic}` });
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Published legacy command ${message} to ${topic}`);
+    }, (err) => {
+        console.error('MQTT publish error:', err);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed to publish legacy MQTT command ${message} to ${topic}: ${err.message}`);
+        res.status(isCircuitOpenError(err) ? 503 : 500).json({ error: 'Failed to publish MQTT message' });
     });
 });
 
 
 // Health check endpoint
 app.get('/api/health', (req, res) => {
-    res.json({ status: 'OK', timestamp: new Date().toISOString() });
+    res.json({
+        status: dbCircuit.state === CIRCUIT_STATES.OPEN ? 'DEGRADED' : 'OK',
+        timestamp: new Date().toISOString(),
+        process: { role: PROCESS_ROLE, pid: process.pid, live_state_version: liveStateVersion },
+        circuits: { postgres: dbCircuit.snapshot(), mqtt_publish: mqttCircuit.snapshot() },
+        event_loop_lag_ms: Math.round(admissionState.lagMs),
+        shed_requests: admissionState.shed,
+        db_pools: {
+            general: { total: pool.totalCount, idle: pool.idleCount, waiting: pool.waitingCount },
+            control: { total: controlPool.totalCount, idle: controlPool.idleCount, waiting: controlPool.waitingCount },
+            ingest: { total: ingestPool.totalCount, idle: ingestPool.idleCount, waiting: ingestPool.waitingCount },
+            reporting: { total: reportingPool.totalCount, idle: reportingPool.idleCount, waiting: reportingPool.waitingCount }
+        },
+        read_replica: getReplicaMetrics(),
+        coalesced_reads: { executions: singleFlightStats.executions, shared: singleFlightStats.shared, in_flight: singleFlights.size },
+        reference_data: getReferenceDataMetrics(),
+        conditional_gets: { not_modified: conditionalGetStats.notModified, full: conditionalGetStats.full, tracked_resources: resourceVersions.size },
+        mqtt_queue: getMqttSchedulerMetrics(),
+        ingest_worker: getIngestWorkerMetrics()
+    });
 });
 
 // Get consumption data for a specific session
@@ -2393,7 +6370,7 @@ app.get('/api/sessions/:sessionId/consumption', async (req, res) => {
     const { sessionId } = req.params;
     try {
         // Get session details including consumption data
-        const sessionResult = await pool.query(
+        const sessionResult = await reportingPool.query(
             `SELECT 
                 cs.session_id, 
                 cs.energy_consumed_kwh, 
@@ -2426,7 +6403,7 @@ app.get('/api/sessions/:sessionId/consumption', async (req, res) => {
         }
 
         // Get consumption data points
-        const consumptionResult = await pool.query(
+        const consumptionResult = await reportingPool.query(
             `SELECT 
                 consumption_watts, 
                 timestamp, 
@@ -2494,58 +6471,64 @@ app.get('/api/config/slot-limits', async (req, res) => {
     }
 });
 
-// Get all active charging sessions
-app.get('/api/sessions/active', async (req, res) => {
-    try {
-        const result = await pool.query(
-            `SELECT 
-                cs.session_id, 
-                cs.user_id,
-                u.fname || ' ' || u.lname AS user_name,
-                cs.port_id,
-                cp.port_number_in_device,
-                cs.station_id,
-                cst.station_name,
-                cs.start_time,
-                cs.energy_consumed_kwh,
-                cs.energy_consumed_mah,
-                cs.total_mah_consumed,
-                cs.is_premium,
-                cs.last_status_update,
-                EXTRACT(EPOCH FROM (NOW() - cs.start_time))/60 AS duration_minutes
-            FROM 
-                charging_session cs
-            JOIN 
-                users u ON cs.user_id = u.user_id
-            JOIN 
-                charging_port cp ON cs.port_id = cp.port_id
-            JOIN 
-                charging_station cst ON cs.station_id = cst.station_id
-            WHERE 
-                cs.session_status = $1
-            ORDER BY 
-                cs.start_time DESC`,
-            [SESSION_STATUS.ACTIVE]
-        );
-        
-        // Format the response
-        const activeSessions = result.rows.map(session => ({
-            session_id: session.session_id,
-            user_id: session.user_id,
-            user_name: session.user_name,
-            port_id: session.port_id,
-            port_number: session.port_number_in_device,
-            station_id: session.station_id,
-            station_name: session.station_name,
-            start_time: session.start_time,
-            duration_minutes: Math.round(session.duration_minutes),
-            energy_consumed_kwh: parseFloat(session.energy_consumed_kwh || 0).toFixed(3),
-            energy_consumed_mah: Math.round(session.energy_consumed_mah || 0),
-            total_mah_consumed: Math.round(session.total_mah_consumed || 0),
-            is_premium: session.is_premium,
-            last_update: session.last_status_update
-        }));
-        
+// Active charging sessions, newest first; userId narrows them to one user
+async function loadActiveSessions({ userId = null } = {}) {
+    const result = await pool.query(
+        `SELECT 
+            cs.session_id, 
+            cs.user_id,
+            u.fname || ' ' || u.lname AS user_name,
+            cs.port_id,
+            cp.port_number_in_device,
+            cs.station_id,
+            cst.station_name,
+            cs.start_time,
+            cs.energy_consumed_kwh,
+            cs.energy_consumed_mah,
+            cs.total_mah_consumed,
+            cs.is_premium,
+            cs.last_status_update,
+            EXTRACT(EPOCH FROM (NOW() - cs.start_time))/60 AS duration_minutes
+        FROM 
+            charging_session cs
+        JOIN 
+            users u ON cs.user_id = u.user_id
+        JOIN 
+            charging_port cp ON cs.port_id = cp.port_id
+        JOIN 
+            charging_station cst ON cs.station_id = cst.station_id
+        WHERE 
+            cs.session_status = $1
+            AND ($2::uuid IS NULL OR cs.user_id = $2)
+        ORDER BY 
+            cs.start_time DESC`,
+        [SESSION_STATUS.ACTIVE, userId]
+    );
+
+    // Format the response
+    return result.rows.map(session => ({
+        session_id: session.session_id,
+        user_id: session.user_id,
+        user_name: session.user_name,
+        port_id: session.port_id,
+        port_number: session.port_number_in_device,
+        station_id: session.station_id,
+        station_name: session.station_name,
+        start_time: session.start_time,
+        duration_minutes: Math.round(session.duration_minutes),
+        energy_consumed_kwh: parseFloat(session.energy_consumed_kwh || 0).toFixed(3),
+        energy_consumed_mah: Math.round(session.energy_consumed_mah || 0),
+        total_mah_consumed: Math.round(session.total_mah_consumed || 0),
+        is_premium: session.is_premium,
+        last_update: session.last_status_update
+    }));
+}
+
+// Get all active charging sessions
+app.get('/api/sessions/active', async (req, res) => {
+    try {
+        const activeSessions = await loadActiveSessions();
+
         res.json(activeSessions);
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, 'Active sessions list fetched');
     } catch (error) {
@@ -2555,13 +6538,11 @@ app.get('/api/sessions/active', async (req, res) => {
     }
 });
 
-// Get current user's subscription details and recent billing history
-app.get('/api/user/subscription', supabaseAuthMiddleware, async (req, res) => {
-    try {
-        const { user_id } = req.user; // Get user_id from the authenticated request
-
-        // Fetch current active subscription for the user (check both is_active and end_date)
-        const subscriptionResult = await pool.query(`
+// Current user's active subscription (with display fields) and last 5 payments
+async function loadUserSubscription(user_id) {
+    // Active subscription (check both is_active and end_date) and recent billing history, fetched together
+    const [subscriptionResult, billingHistoryResult] = await Promise.all([
+        pool.query(`
             SELECT
                 us.user_subscription_id,
                 us.start_date,
@@ -2590,12 +6571,8 @@ app.get('/api/user/subscription', supabaseAuthMiddleware, async (req, res) => {
                 AND us.end_date > NOW()
             ORDER BY us.start_date DESC
             LIMIT 1;
-        `, [user_id]);
-
-        const subscription = subscriptionResult.rows.length > 0 ? subscriptionResult.rows[0] : null;
-
-        // Fetch recent billing history for the user
-        const billingHistoryResult = await pool.query(`
+        `, [user_id]),
+        pool.query(`
             SELECT
                 payment_id,
                 amount,
@@ -2609,39 +6586,48 @@ app.get('/api/user/subscription', supabaseAuthMiddleware, async (req, res) => {
                 user_id = $1
             ORDER BY payment_date DESC
             LIMIT 5; -- Fetch last 5 payments
-        `, [user_id]);
-
-        const billingHistory = billingHistoryResult.rows;
-
-        // Process subscription features for frontend display (e.g., create a list of strings)
-        if (subscription) {
-            const features = [];
-            if (subscription.daily_mah_limit) features.push(`${subscription.daily_mah_limit} mAh daily limit`);
-            if (subscription.max_session_duration_hours) features.push(`${subscription.max_session_duration_hours} hour max session`);
-            if (subscription.fast_charging_access) features.push('Fast Charging Access');
-            if (subscription.priority_access) features.push('Priority Access');
-            if (subscription.cooldown_percentage && subscription.cooldown_time_hour) {
-                features.push(`${subscription.cooldown_percentage}% cooldown in ${subscription.cooldown_time_hour}h`);
-            }
-            subscription.features = features;
+        `, [user_id])
+    ]);
+
+    const subscription = subscriptionResult.rows.length > 0 ? subscriptionResult.rows[0] : null;
+    const billingHistory = billingHistoryResult.rows;
+
+    // Process subscription features for frontend display (e.g., create a list of strings)
+    if (subscription) {
+        const features = [];
+        if (subscription.daily_mah_limit) features.push(`${subscription.daily_mah_limit} mAh daily limit`);
+        if (subscription.max_session_duration_hours) features.push(`${subscription.max_session_duration_hours} hour max session`);
+        if (subscription.fast_charging_access) features.push('Fast Charging Access');
+        if (subscription.priority_access) features.push('Priority Access');
+        if (subscription.cooldown_percentage && subscription.cooldown_time_hour) {
+            features.push(`${subscription.cooldown_percentage}% cooldown in ${subscription.cooldown_time_hour}h`);
+        }
+        subscription.features = features;
 
-            // Calculate duration display text
-            if (subscription.duration_type && subscription.duration_value) {
-                const durationText = getDurationDisplayText(subscription.duration_type, subscription.duration_value);
-                subscription.duration_display = durationText;
-            }
+        // Calculate duration display text
+        if (subscription.duration_type && subscription.duration_value) {
+            const durationText = getDurationDisplayText(subscription.duration_type, subscription.duration_value);
+            subscription.duration_display = durationText;
+        }
 
-            // Add a simulated 'next_billing_date' if not directly in DB
-            // Calculate based on actual duration type and value
-            if (subscription.duration_type && subscription.duration_value) {
-                const startDate = new Date(subscription.start_date);
-                const nextBillingDate = calculateNextBillingDate(startDate, subscription.duration_type, subscription.duration_value);
-                subscription.next_billing_date = nextBillingDate;
-            }
+        // Add a simulated 'next_billing_date' if not directly in DB
+        // Calculate based on actual duration type and value
+        if (subscription.duration_type && subscription.duration_value) {
+            const startDate = new Date(subscription.start_date);
+            const nextBillingDate = calculateNextBillingDate(startDate, subscription.duration_type, subscription.duration_value);
+            subscription.next_billing_date = nextBillingDate;
         }
+    }
+
+    return { subscription, billing_history: billingHistory };
+}
 
+// Get current user's subscription details and recent billing history
+app.get('/api/user/subscription', supabaseAuthMiddleware, async (req, res) => {
+    try {
+        const { user_id } = req.user; // Get user_id from the authenticated request
 
-        res.json({ subscription, billing_history: billingHistory });
+        res.json(await loadUserSubscription(user_id));
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `User ${user_id} fetched subscription data.`);
     } catch (err) {
         console.error('API Error fetching user subscription data:', err);
@@ -2759,52 +6745,53 @@ app.post('/api/subscription/cancel', supabaseAuthMiddleware, async (req, res) =>
     }
 });
 
+// Current user's monthly usage statistics (from the daily_energy_usage rollup: one row per day)
+async function loadUserUsage(user_id) {
+    const usageResult = await readPool(reportingPool, { userId: user_id }).query(
+        preparedStatement('getUserMonthlyUsage', [user_id, SESSION_STATUS.ACTIVE, STATION_TIME_ZONE])
+    );
+
+    const usageData = usageResult.rows[0];
+
+    return {
+        totalSessions: parseInt(usageData.total_sessions || 0),
+        totalDuration: parseFloat(usageData.total_duration_minutes || 0).toFixed(0), // Round to nearest minute
+        totalEnergyKWH: parseFloat(usageData.total_energy_kwh || 0).toFixed(2), // 2 decimal places
+        totalEnergyMAH: parseFloat(usageData.total_energy_mah || 0).toFixed(2), // 2 decimal places
+        totalCost: parseFloat(usageData.total_cost || 0).toFixed(2) // 2 decimal places
+    };
+}
+
+// Current user's usage per day for the last `days` days, oldest first
+async function loadUserDailyUsage(user_id, days) {
+    const result = await readPool(reportingPool, { userId: user_id }).query(
+        preparedStatement('listUserDailyUsage', [user_id, days, STATION_TIME_ZONE])
+    );
+    return {
+        days,
+        series: result.rows.map(row => ({
+            date: row.usage_date,
+            energyMAH: Number(row.energy_mah),
+            energyKWH: Number(row.energy_kwh),
+            sessions: Number(row.sessions),
+            durationMinutes: Number(row.duration_minutes),
+            cost: Number(row.cost)
+        }))
+    };
+}
+
+function parseUsageHistoryDays(value) {
+    return Math.min(Math.max(parseInt(value, 10) || 30, 1), 365);
+}
+
 // Get current user's monthly usage statistics
 app.get('/api/user/usage', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { user_id } = req.user; // Get user_id from the authenticated request
 
-        // Calculate start and end of current month
-        const now = new Date();
-        const startOfMonth = new Date(now.getFullYear(), now.getMonth(), 1);
-        const endOfMonth = new Date(now.getFullYear(), now.getMonth() + 1, 0, 23, 59, 59, 999);
-
-        // Fetch aggregated usage data for the current month from charging_session
-        const usageResult = await pool.query(`
-            SELECT
-                COUNT(session_id) as total_sessions,
-                COALESCE(SUM(EXTRACT(EPOCH FROM (COALESCE(end_time, NOW()) - start_time))/60), 0) as total_duration_minutes,
-                COALESCE(SUM(energy_consumed_kwh), 0) as total_energy_kwh,
-                COALESCE(SUM(energy_consumed_mah), 0) as total_energy_mah,
-                COALESCE(SUM(cost), 0) as total_cost
-            FROM
-                charging_session
-            WHERE
-                user_id = $1
-                AND start_time >= $2
-                AND start_time <= $3
-                -- REVISED LINE HERE: Use ANY() with an array parameter and explicit casting
-                AND session_status = ANY($4::session_status[]);
-        `, [
-            user_id,
-            startOfMonth,
-            endOfMonth,
-            // Pass the valid enum values as an array for the $4 parameter
-            [SESSION_STATUS.COMPLETED, SESSION_STATUS.ACTIVE]
-        ])
-
-        const usageData = usageResult.rows[0];
-
-        const responseData = {
-            totalSessions: parseInt(usageData.total_sessions || 0),
-            totalDuration: parseFloat(usageData.total_duration_minutes || 0).toFixed(0), // Round to nearest minute
-            totalEnergyKWH: parseFloat(usageData.total_energy_kwh || 0).toFixed(2), // 2 decimal places
-            totalEnergyMAH: parseFloat(usageData.total_energy_mah || 0).toFixed(2), // 2 decimal places
-            totalCost: parseFloat(usageData.total_cost || 0).toFixed(2) // 2 decimal places
-        };
+        const responseData = await loadUserUsage(user_id);
 
         console.log(`API: User ${user_id} usage data:`, responseData);
-        console.log(`API: Raw database data:`, usageData);
         res.json(responseData);
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `User ${user_id} fetched usage data.`);
     } catch (err) {
@@ -2814,6 +6801,86 @@ app.get('/api/user/usage', supabaseAuthMiddleware, async (req, res) => {
     }
 });
 
+// Get current user's usage per day for the last `days` days (default 30), oldest first
+app.get('/api/user/usage/daily', supabaseAuthMiddleware, async (req, res) => {
+    try {
+        res.json(await loadUserDailyUsage(req.user.user_id, parseUsageHistoryDays(req.query.days)));
+    } catch (err) {
+        console.error('API Error fetching daily usage:', err);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Error fetching daily usage for user ${req.user?.user_id}: ${err.message}`);
+        res.status(500).json({ error: 'Failed to fetch daily usage.' });
+    }
+});
+
+// --- Page bootstrap ---
+// Everything a page needs on load in one authenticated request, with the parts fetched in parallel.
+// Each part uses the same loader as its standalone endpoint, so the shapes match.
+const BOOTSTRAP_VIEWS = {
+    station: {
+        requires: ['stationId'],
+        parts: {
+            slotLimits: () => ({ premiumUserMaxActiveSlots: PREMIUM_USER_MAX_ACTIVE_SLOTS }),
+            station: ({ stationId }) => singleFlight(`sync:${stationId}`, () => loadStationSync(stationId)),
+            activeSessions: ({ userId }) => loadActiveSessions({ userId })
+        }
+    },
+    home: {
+        requires: [],
+        parts: {
+            usage: ({ userId }) => loadUserUsage(userId)
+        }
+    },
+    usage: {
+        requires: [],
+        parts: {
+            usage: ({ userId }) => loadUserUsage(userId),
+            daily: ({ userId, query }) => loadUserDailyUsage(userId, parseUsageHistoryDays(query.days)),
+            subscription: ({ userId }) => loadUserSubscription(userId),
+            pricing: () => loadQuotaPricing()
+        }
+    }
+};
+
+// GET /api/bootstrap?view=station&stationId=...  (view: station | home | usage; usage also takes days)
+// A part that fails comes back as null and is named in `errors`; the page can fetch it on its own.
+app.get('/api/bootstrap', supabaseAuthMiddleware, async (req, res) => {
+    const view = BOOTSTRAP_VIEWS[req.query.view];
+    if (!view) {
+        return res.status(400).json({ error: `view must be one of: ${Object.keys(BOOTSTRAP_VIEWS).join(', ')}` });
+    }
+    const missing = view.requires.filter(name => !req.query[name]);
+    if (missing.length > 0) {
+        return res.status(400).json({ error: `view=${req.query.view} requires ${missing.join(', ')}` });
+    }
+
+    const context = { userId: req.user.user_id, stationId: req.query.stationId, query: req.query };
+    const names = Object.keys(view.parts);
+    const settled = await Promise.allSettled(names.map(name => Promise.resolve().then(() => view.parts[name](context))));
+
+    const body = { view: req.query.view };
+    const errors = {};
+    settled.forEach((result, i) => {
+        if (result.status === 'fulfilled') {
+            body[names[i]] = result.value;
+        } else {
+            body[names[i]] = null;
+            errors[names[i]] = 'Failed to load';
+            console.error(`Bootstrap ${req.query.view}: error loading ${names[i]}:`, result.reason);
+        }
+    });
+
+    const failed = Object.keys(errors);
+    if (failed.length === names.length) {
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Bootstrap view=${req.query.view} failed for user ${context.userId}: ${settled[0].reason?.message}`);
+        return res.status(500).json({ error: 'Failed to load page data' });
+    }
+    if (failed.length > 0) {
+        body.errors = errors;
+        logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.API, `Bootstrap view=${req.query.view} for user ${context.userId} missing: ${failed.join(', ')}`);
+    }
+    res.json(body);
+});
+
 // Debug endpoint to check raw charging session data
 app.get('/api/user/usage/debug', supabaseAuthMiddleware, async (req, res) => {
     try {
@@ -2848,28 +6915,48 @@ app.get('/api/user/usage/debug', supabaseAuthMiddleware, async (req, res) => {
     }
 });
 
+// User's registered devices, with the in-memory latest state overlaid
+async function loadUserDevices(user_id) {
+    const result = await pool.query(`
+        SELECT 
+            device_id,
+            device_type,
+            device_name,
+            device_model,
+            battery_capacity_mah,
+            current_battery_level,
+            is_charging,
+            last_updated,
+            created_at
+        FROM user_devices 
+        WHERE user_id = $1
+        ORDER BY last_updated DESC
+    `, [user_id]);
+
+    // Overlay the in-memory latest state, which can be ahead of the last batched flush
+    const cachedDevices = new Map(userDeviceTelemetry.get(user_id) || []);
+    const devices = result.rows.map(row => {
+        const key = userDeviceKey(row.device_type, row.device_name);
+        const cached = cachedDevices.get(key);
+        cachedDevices.delete(key);
+        if (!cached || cached.last_updated <= new Date(row.last_updated)) {
+            return row;
+        }
+        return { ...row, ...formatUserDeviceRecord(cached), device_id: row.device_id, created_at: row.created_at };
+    });
+    for (const cached of cachedDevices.values()) {
+        devices.push(formatUserDeviceRecord(cached));
+    }
+    devices.sort((a, b) => new Date(b.last_updated) - new Date(a.last_updated));
+    return devices;
+}
+
 // Get user devices
 app.get('/api/user/devices', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { user_id } = req.user;
-        
-        const result = await pool.query(`
-            SELECT 
-                device_id,
-                device_type,
-                device_name,
-                device_model,
-                battery_capacity_mah,
-                current_battery_level,
-                is_charging,
-                last_updated,
-                created_at
-            FROM user_devices 
-            WHERE user_id = $1
-            ORDER BY last_updated DESC
-        `, [user_id]);
-        
-        res.json(result.rows);
+
+        res.json(await loadUserDevices(user_id));
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `User devices fetched for ${user_id}`);
     } catch (err) {
         console.error('API Error fetching user devices:', err);
@@ -2912,47 +6999,38 @@ app.post('/api/admin/fix-expired-subscriptions', supabaseAuthMiddleware, require
     }
 });
 
-// Update user device information
+// Update user device information (phone battery heartbeats).
+// Accepts a single device object, an array of samples, or { devices: [...] }. Samples update the
+// in-memory latest state immediately and reach user_devices through the batched flusher.
 app.post('/api/user/devices', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { user_id } = req.user;
-        const { device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging } = req.body;
-        
-        // Check if device already exists for this user
-        const existingDevice = await pool.query(`
-            SELECT device_id FROM user_devices 
-            WHERE user_id = $1 AND device_type = $2 AND device_name = $3
-        `, [user_id, device_type, device_name]);
-        
-        if (existingDevice.rows.length > 0) {
-            // Update existing device
-            const result = await pool.query(`
-                UPDATE user_devices 
-                SET 
-                    device_model = $1,
-                    battery_capacity_mah = $2,
-                    current_battery_level = $3,
-                    is_charging = $4,
-                    last_updated = NOW(),
-                    updated_at = NOW()
-                WHERE device_id = $5
-                RETURNING *
-            `, [device_model, battery_capacity_mah, current_battery_level, is_charging, existingDevice.rows[0].device_id]);
-            
-            res.json(result.rows[0]);
+        const isBatch = Array.isArray(req.body) || Array.isArray(req.body?.devices);
+        const rawUpdates = Array.isArray(req.body) ? req.body : (Array.isArray(req.body?.devices) ? req.body.devices : [req.body]);
+
+        if (rawUpdates.length === 0 || rawUpdates.length > USER_DEVICE_MAX_BATCH_UPDATES) {
+            return res.status(400).json({ error: `Between 1 and ${USER_DEVICE_MAX_BATCH_UPDATES} device updates are allowed per request.` });
+        }
+
+        const updates = rawUpdates.map(normalizeUserDeviceUpdate);
+        if (updates.some(update => update === null)) {
+            return res.status(400).json({ error: 'device_type is required for every device update.' });
+        }
+
+        // Apply in time order so the cache ends on the newest sample per device
+        updates.sort((a, b) => a.recorded_at - b.recorded_at);
+        const latestRecords = new Map();
+        for (const update of updates) {
+            const record = ingestUserDeviceTelemetry(user_id, update);
+            latestRecords.set(record, formatUserDeviceRecord(record));
+        }
+
+        const devices = Array.from(latestRecords.values());
+        if (isBatch) {
+            res.json({ accepted: updates.length, devices });
         } else {
-            // Create new device
-            const result = await pool.query(`
-                INSERT INTO user_devices 
-                (user_id, device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging)
-                VALUES ($1, $2, $3, $4, $5, $6, $7)
-                RETURNING *
-            `, [user_id, device_type, device_name, device_model, battery_capacity_mah, current_battery_level, is_charging]);
-            
-            res.json(result.rows[0]);
+            res.json(devices[0]);
         }
-        
-        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `User device updated for ${user_id}`);
     } catch (err) {
         console.error('API Error updating user device:', err);
         logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.API, `Error updating device for user ${req.user?.user_id}: ${err.message}`);
@@ -3077,12 +7155,9 @@ app.get('/api/user/notifications', supabaseAuthMiddleware, async (req, res) => {
 app.get('/api/user/notifications/unread-count', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { user_id } = req.user;
+        if (answeredNotModified(req, res, `notifications:${user_id}`)) return;
         
-        const result = await pool.query(`
-            SELECT COUNT(*) as unread_count
-            FROM notification 
-            WHERE user_id = $1 AND is_read = false
-        `, [user_id]);
+        const result = await pool.query(preparedStatement('countUnreadNotifications', [user_id]));
         
         res.json({ unreadCount: parseInt(result.rows[0].unread_count) });
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Unread notification count fetched for user ${user_id}`);
@@ -3105,6 +7180,7 @@ app.put('/api/user/notifications/:notificationId/read', supabaseAuthMiddleware,
             WHERE notification_id = $1 AND user_id = $2
             RETURNING *
         `, [notificationId, user_id]);
+        bumpResource(`notifications:${user_id}`);
         
         if (result.rows.length === 0) {
             return res.status(404).json({ error: 'Notification not found' });
@@ -3130,6 +7206,7 @@ app.put('/api/user/notifications/mark-all-read', supabaseAuthMiddleware, async (
             WHERE user_id = $1 AND is_read = false
             RETURNING notification_id
         `, [user_id]);
+        bumpResource(`notifications:${user_id}`);
         
         res.json({ 
             message: 'All notifications marked as read',
@@ -3154,6 +7231,7 @@ app.delete('/api/user/notifications/:notificationId', supabaseAuthMiddleware, as
             WHERE notification_id = $1 AND user_id = $2
             RETURNING notification_id
         `, [notificationId, user_id]);
+        bumpResource(`notifications:${user_id}`);
         
         if (result.rows.length === 0) {
             return res.status(404).json({ error: 'Notification not found' });
@@ -3176,22 +7254,199 @@ app.use((err, req, res, next) => {
 });
 
 // Start server
-app.listen(PORT, () => {
-    console.log(`Server running on port ${PORT}`);
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Server started on port ${PORT}`);
-});
+// --- Cluster mode: HTTP workers, live-state snapshots and forwarding ---
+let lastBroadcastLiveStateVersion = -1;
+const clusterWorkerSlots = []; // slot index -> cluster worker; sticky routing hashes onto slots
+let clusterStopping = false;
+
+// Fields HTTP workers may read from a port entry (timers and sequence windows stay in the ingest process)
+function serializeLiveState() {
+    return Array.from(portStateMachines.values(), entry => ({
+        deviceId: entry.deviceId,
+        portNumber: entry.portNumber,
+        portId: entry.portId,
+        stationId: entry.stationId,
+        isPremium: entry.isPremium,
+        state: entry.state,
+        stateSince: entry.stateSince,
+        sessionId: entry.sessionId,
+        userId: entry.userId,
+        lastActivityAt: entry.lastActivityAt,
+        lastStatusAt: entry.lastStatusAt
+    }));
+}
+
+function sendLiveState(worker, message = { type: 'live-state', version: liveStateVersion, ports: serializeLiveState() }) {
+    if (worker && worker.isConnected()) worker.send(message);
+}
+
+function broadcastLiveState() {
+    if (liveStateVersion === lastBroadcastLiveStateVersion) return;
+    const message = { type: 'live-state', version: liveStateVersion, ports: serializeLiveState() };
+    clusterWorkerSlots.forEach(worker => sendLiveState(worker, message));
+    lastBroadcastLiveStateVersion = liveStateVersion;
+}
+
+function broadcastResourceVersions() {
+    if (changedResourceKeys.size === 0) return;
+    const message = resourceVersionsMessage(changedResourceKeys);
+    clusterWorkerSlots.forEach(worker => worker && worker.isConnected() && worker.send(message));
+    changedResourceKeys.clear();
+}
+
+// Worker side: replace the replica wholesale; port counts are small and snapshots only follow changes
+function applyLiveStateSnapshot({ version, ports }) {
+    portStateMachines.clear();
+    portStateMachinesById.clear();
+    for (const port of ports) {
+        const entry = { key: portStateKey(port.deviceId, port.portNumber), ...port };
+        portStateMachines.set(entry.key, entry);
+        portStateMachinesById.set(entry.portId, entry);
+    }
+    liveStateVersion = version;
+}
+
+function forwardToIngestProcess(req, res) {
+    const upstream = http.request({
+        host: '127.0.0.1',
+        port: CLUSTER_OWNER_PORT,
+        method: req.method,
+        path: req.originalUrl,
+        headers: { ...req.headers, 'x-forwarded-for': req.headers['x-forwarded-for'] || req.socket.remoteAddress }
+    }, (upstreamRes) => {
+        res.writeHead(upstreamRes.statusCode, upstreamRes.headers);
+        upstreamRes.pipe(res);
+    });
+    upstream.on('error', (error) => {
+        console.error(`Cluster: Failed to forward ${req.method} ${req.originalUrl} to the ingest process:`, error.message);
+        if (!res.headersSent) {
+            res.set('Retry-After', String(ADMISSION_RETRY_AFTER_SECONDS));
+            res.status(503).json({ error: 'Service temporarily unavailable, please retry shortly.' });
+        }
+    });
+    req.pipe(upstream);
+}
+
+function liveStateRouter(req, res, next) {
+    if (PROCESS_ROLE !== PROCESS_ROLES.HTTP) return next();
+    const owned = LIVE_STATE_OWNER_ROUTES.some(rule => (rule.method === '*' || rule.method === req.method) && rule.pattern.test(req.path));
+    return owned ? forwardToIngestProcess(req, res) : next();
+}
+
+function forkClusterWorker(slot) {
+    const worker = cluster.fork();
+    clusterWorkerSlots[slot] = worker;
+    worker.on('online', () => {
+        sendLiveState(worker);
+        worker.send({ ...resourceVersionsMessage(resourceVersions.keys()), full: true });
+    });
+    worker.on('message', (message) => {
+        if (message?.type === 'bump-resource') {
+            bumpResource(message.key);
+        } else if (message?.type === 'reconcile-station') {
+            requestStationReconcile(message.stationId).catch(error => {
+                console.error(`Cluster: Reconcile of station ${message.stationId} failed:`, error.message);
+            });
+        }
+    });
+    worker.on('exit', (code, signal) => {
+        if (clusterWorkerSlots[slot] === worker) clusterWorkerSlots[slot] = null;
+        if (clusterStopping) return;
+        console.warn(`Cluster: HTTP worker ${worker.process.pid} exited (${signal || code}); restarting.`);
+        logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.BACKEND, `HTTP worker ${worker.process.pid} exited (${signal || code}); restarting`);
+        setTimeout(() => forkClusterWorker(slot), CLUSTER_WORKER_RESTART_DELAY_MS);
+    });
+}
+
+// Client IP -> worker slot, so long-lived push connections and their follow-up requests land together
+function stickyWorkerFor(remoteAddress) {
+    let hash = 0;
+    for (const char of String(remoteAddress)) hash = (hash * 31 + char.charCodeAt(0)) | 0;
+    const preferred = clusterWorkerSlots[Math.abs(hash) % clusterWorkerSlots.length];
+    if (preferred && preferred.isConnected()) return preferred;
+    return clusterWorkerSlots.find(worker => worker && worker.isConnected()) || null;
+}
+
+function startClusterWorkers() {
+    cluster.setupPrimary({ serialization: 'advanced' }); // keeps Dates intact in snapshots
+    for (let slot = 0; slot < CLUSTER_WORKERS; slot++) {
+        forkClusterWorker(slot);
+    }
+    setInterval(() => {
+        broadcastLiveState();
+        broadcastResourceVersions();
+    }, LIVE_STATE_BROADCAST_INTERVAL_MS);
+
+    if (CLUSTER_STICKY) {
+        net.createServer({ pauseOnConnect: true }, (socket) => {
+            const worker = stickyWorkerFor(socket.remoteAddress);
+            if (!worker) return socket.destroy();
+            worker.send({ type: 'sticky-connection' }, socket);
+        }).listen(PORT);
+    }
+}
+
+async function stopClusterWorkers() {
+    clusterStopping = true;
+    clusterWorkerSlots.forEach(worker => worker && worker.kill('SIGTERM'));
+}
+
+function startHttpServer() {
+    if (PROCESS_ROLE === PROCESS_ROLES.INGEST) {
+        app.listen(CLUSTER_OWNER_PORT, '127.0.0.1', () => {
+            console.log(`Ingest process ${process.pid} serving live-state routes on 127.0.0.1:${CLUSTER_OWNER_PORT}; forking ${CLUSTER_WORKERS} HTTP workers on port ${PORT}`);
+            logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Server started in cluster mode with ${CLUSTER_WORKERS} HTTP workers on port ${PORT}`);
+        });
+        startClusterWorkers();
+        return;
+    }
+
+    if (PROCESS_ROLE === PROCESS_ROLES.HTTP) {
+        const server = http.createServer(app);
+        process.on('message', (message, socket) => {
+            if (message?.type === 'live-state') {
+                applyLiveStateSnapshot(message);
+            } else if (message?.type === 'resource-versions') {
+                applyResourceVersions(message);
+            } else if (message?.type === 'user-write') {
+                recentUserWrites.set(message.userId, message.writtenAt);
+            } else if (message?.type === 'sticky-connection' && socket) {
+                server.emit('connection', socket);
+                socket.resume();
+            }
+        });
+        if (!CLUSTER_STICKY) {
+            server.listen(PORT, () => console.log(`HTTP worker ${process.pid} listening on port ${PORT}`));
+        }
+        return;
+    }
+
+    app.listen(PORT, () => {
+        console.log(`Server running on port ${PORT}`);
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Server started on port ${PORT}`);
+    });
+}
+
+startHttpServer();
 
 // Graceful shutdown handlers
 process.on('SIGINT', () => { // Handles Ctrl+C
     console.log('Shutting down server (SIGINT)...');
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, 'Server shutting down (SIGINT)').finally(() => {
+    Promise.all([
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, 'Server shutting down (SIGINT)'),
+        flushUserDeviceTelemetry(), // Persist buffered phone telemetry before the pool closes
+        flushPortStateWrites(),
+        flushPortOccupancy(),
+        flushPortEvents()
+    ]).finally(() => {
         mqttClient.end(() => { // Close MQTT client first
             console.log('MQTT client disconnected.');
-            pool.end(() => { // Then close database pool
-                console.log('Database pool closed.');
+            Promise.all([stopClusterWorkers(), stopIngestWorker(), ...allPools.map(p => p.end()), replicaPool?.end()]).finally(() => { // Then close database pools
+                console.log('Database pools closed.');
                 // Clear all active timers on shutdown
-                for (const key in activePortTimers) {
-                    clearTimeout(activePortTimers[key].timerId);
+                for (const entry of portStateMachines.values()) {
+                    clearPortInactivityTimer(entry);
+                    clearFullChargeDisconnectTimer(entry);
                 }
                 process.exit(0);
             });
@@ -3202,14 +7457,21 @@ process.on('SIGINT', () => { // Handles Ctrl+C
 //Graceful shutdown handlers
 process.on('SIGTERM', () => { // Handles termination signals from Render
     console.log('Shutting down server (SIGTERM)...');
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, 'Server shutting down (SIGTERM)').finally(() => {
+    Promise.all([
+        logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, 'Server shutting down (SIGTERM)'),
+        flushUserDeviceTelemetry(), // Persist buffered phone telemetry before the pool closes
+        flushPortStateWrites(),
+        flushPortOccupancy(),
+        flushPortEvents()
+    ]).finally(() => {
         mqttClient.end(() => { // Close MQTT client first
             console.log('MQTT client disconnected.');
-            pool.end(() => { // Then close database pool
-                console.log('Database pool closed.');
+            Promise.all([stopClusterWorkers(), stopIngestWorker(), ...allPools.map(p => p.end()), replicaPool?.end()]).finally(() => { // Then close database pools
+                console.log('Database pools closed.');
                 // Clear all active timers on shutdown
-                for (const key in activePortTimers) {
-                    clearTimeout(activePortTimers[key].timerId);
+                for (const entry of portStateMachines.values()) {
+                    clearPortInactivityTimer(entry);
+                    clearFullChargeDisconnectTimer(entry);
                 }
                 process.exit(0);
             });
@@ -3302,7 +7564,7 @@ async function requireAdmin(req, res, next) {
     try {
         // req.user.user_id is set by auth middleware
         const { user_id } = req.user;
-        const result = await pool.query('SELECT is_admin FROM users WHERE user_id = $1', [user_id]);
+        const result = await pool.query(preparedStatement('getUserIsAdmin', [user_id]));
         if (result.rows.length === 0 || !result.rows[0].is_admin) {
             logSystemEvent(LOG_TYPES.WARN, LOG_SOURCES.AUTH, `Unauthorized admin access attempt by user ${user_id}`);
             return res.status(403).json({ error: 'Admin access required' });
@@ -3315,60 +7577,40 @@ async function requireAdmin(req, res, next) {
     }
 }
 
-// Helper function to handle MQTT status messages and update DB
-async function handleMqttStatusMessage(payload, deviceId, actualPortId, isPremiumPort) {
+// Helper function to handle MQTT status messages: drives the port state machine and logs the status
+async function handleMqttStatusMessage(payload, deviceId, portEntry) {
     const { status, charger_state, timestamp, port_number, event_type, reason } = payload;
-    const currentTimestamp = new Date(timestamp);
-
-    let mapped_current_status;
+    const actualPortId = portEntry.portId;
+    const reportedAt = Number.isFinite(Number(timestamp)) ? new Date(Number(timestamp)) : new Date();
+    portEntry.lastStatusAt = reportedAt;
+
+    // One port_events row; device_status_logs and current_device_status are projections of it
+    const eventDetails = {};
+    if (event_type) eventDetails.event_type = event_type;
+    if (reason) eventDetails.reason = reason;
+    appendPortEvent(portEntry, PORT_EVENT_TYPES.STATUS, {
+        sessionId: portEntry.sessionId,
+        occurredAt: reportedAt,
+        statusMessage: status,
+        chargerState: charger_state,
+        payload: Object.keys(eventDetails).length > 0 ? eventDetails : null
+    });
 
-    // Logic to map MQTT status/charger_state to DB enum (port_status)
+    // Map the MQTT status/charger_state onto a state machine event; charging_port follows write-behind
     if (status === 'offline') {
-        mapped_current_status = PORT_STATUS.OFFLINE;
+        transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_OFFLINE);
     } else if (charger_state === CHARGER_STATES.ON) {
-        // When the charger is ON, it's either free or premium charging
-        mapped_current_status = isPremiumPort ? PORT_STATUS.CHARGING_PREMIUM : PORT_STATUS.CHARGING_FREE;
+        transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_ON);
     } else if (charger_state === CHARGER_STATES.OFF) {
-        // When the charger is OFF and not offline, it's available
-        mapped_current_status = PORT_STATUS.AVAILABLE;
+        // With a session attached, OFF is handled below by finalizing the session
+        if (!portEntry.sessionId) {
+            transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_OFF);
+        }
     } else {
-        // Default or unknown states
-        mapped_current_status = PORT_STATUS.AVAILABLE;
+        transitionPortState(portEntry, PORT_FSM_EVENTS.DEVICE_ONLINE);
     }
-
-    // Insert into device_status_logs
-    await pool.query(
-        `INSERT INTO device_status_logs (device_id, port_id, status_message, charger_state, timestamp)
-         VALUES ($1, $2, $3, $4, TO_TIMESTAMP($5 / 1000.0))`,
-        [deviceId, actualPortId, status, charger_state, timestamp]
-    );
-
-    // UPSERT into current_device_status
-    await pool.query(
-        `INSERT INTO current_device_status (device_id, port_id, status_message, charger_state, last_update)
-         VALUES ($1, $2, $3, $4, TO_TIMESTAMP($5 / 1000.0))
-         ON CONFLICT (device_id, port_id) DO UPDATE SET
-            status_message = $3,
-            charger_state = $4,
-            last_update = TO_TIMESTAMP($5 / 1000.0)`,
-        [deviceId, actualPortId, status, charger_state, timestamp]
-    );
-
-    // This is the critical update to charging_port's current_status
-    await pool.query(
-        'UPDATE charging_port SET current_status = $1, is_occupied = $2, last_status_update = $3 WHERE port_id = $4',
-        [
-            mapped_current_status,
-            // is_occupied is true if the port is in a 'charging' or 'occupied' state
-            (mapped_current_status === PORT_STATUS.CHARGING_FREE ||
-             mapped_current_status === PORT_STATUS.CHARGING_PREMIUM ||
-             mapped_current_status === PORT_STATUS.OCCUPIED),
-            currentTimestamp,
-            actualPortId
-        ]
-    );
-    console.log(`MQTT: Updated status for ${deviceId} Port ${payload.port_number}: ${mapped_current_status}, Charger: ${charger_state}`);
-    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Status update for ${deviceId} Port ${payload.port_number}: ${mapped_current_status}, Charger: ${charger_state}`);
+    console.log(`MQTT: Updated status for ${deviceId} Port ${payload.port_number}: ${portEntry.state}, Charger: ${charger_state}`);
+    logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Status update for ${deviceId} Port ${payload.port_number}: ${portEntry.state}, Charger: ${charger_state}`);
 
     if (event_type === 'PORT_FULL_READY') {
         await handleFullChargeReadyEvent({
@@ -3385,7 +7627,8 @@ async function handleMqttStatusMessage(payload, deviceId, actualPortId, isPremiu
         });
     }
 
-    if (Number.isInteger(port_number) && charger_state === CHARGER_STATES.OFF) {
+    // A port paused by the power budget reports OFF because we switched it off; its session continues
+    if (Number.isInteger(port_number) && charger_state === CHARGER_STATES.OFF && portEntry.sessionId && !portEntry.budget.paused) {
         const endReason = reason || status || 'device_reported_off';
         const eventSource = event_type ? `${LOG_SOURCES.MQTT}:${event_type}` : LOG_SOURCES.MQTT;
         await finalizeSessionFromDeviceEvent({
@@ -3400,51 +7643,29 @@ async function handleMqttStatusMessage(payload, deviceId, actualPortId, isPremiu
 
 async function reconcileStationState(stationId) {
     if (!stationId) return;
+    await portStateReady;
 
-    const { rows: ports } = await pool.query(
-        `SELECT 
-            cp.port_id,
-            cp.device_mqtt_id,
-            cp.port_number_in_device,
-            cds.charger_state,
-            cds.last_update AS status_last_update
-        FROM charging_port cp
-        LEFT JOIN current_device_status cds ON cp.port_id = cds.port_id
-        WHERE cp.station_id = $1`,
-        [stationId]
-    );
-
-    for (const port of ports) {
-        if (!port.port_number_in_device || !port.device_mqtt_id) continue;
-
-        const activeSessionResult = await pool.query(
-            "SELECT session_id, last_status_update FROM charging_session WHERE port_id = $1 AND session_status = $2",
-            [port.port_id, SESSION_STATUS.ACTIVE]
-        );
+    const now = Date.now();
+    const secondsSince = (date) => (date ? (now - date.getTime()) / 1000 : Number.POSITIVE_INFINITY);
 
-        if (activeSessionResult.rows.length === 0) {
-            continue;
-        }
+    for (const entry of portStateMachines.values()) {
+        if (entry.stationId !== stationId || !entry.sessionId || entry.budget.paused) continue;
 
-        const lastUpdate = port.status_last_update ? new Date(port.status_last_update) : null;
-        const secondsSinceUpdate = lastUpdate ? (Date.now() - lastUpdate.getTime()) / 1000 : Number.POSITIVE_INFINITY;
-        const sessionLastUpdate = activeSessionResult.rows[0].last_status_update ? new Date(activeSessionResult.rows[0].last_status_update) : null;
-        const secondsSinceSessionUpdate = sessionLastUpdate ? (Date.now() - sessionLastUpdate.getTime()) / 1000 : Number.POSITIVE_INFINITY;
-        const isStale = secondsSinceUpdate > DEVICE_STATUS_STALE_THRESHOLD_SECONDS;
-        const sessionInactiveLongEnough = secondsSinceSessionUpdate > DEVICE_STATUS_STALE_THRESHOLD_SECONDS;
+        const isStale = secondsSince(entry.lastStatusAt) > DEVICE_STATUS_STALE_THRESHOLD_SECONDS;
+        const sessionInactiveLongEnough = secondsSince(entry.lastActivityAt) > DEVICE_STATUS_STALE_THRESHOLD_SECONDS;
 
         if (isStale && sessionInactiveLongEnough) {
             try {
                 await finalizeSessionFromDeviceEvent({
-                    deviceId: port.device_mqtt_id,
-                    portNumberInDevice: port.port_number_in_device,
-                    actualPortId: port.port_id,
+                    deviceId: entry.deviceId,
+                    portNumberInDevice: entry.portNumber,
+                    actualPortId: entry.portId,
                     endReason: 'stale_status_sync',
                     source: 'sync_reconciliation'
                 });
             } catch (error) {
-                console.error(`Sync: Failed to finalize session for ${port.device_mqtt_id}_${port.port_number_in_device}:`, error);
-                logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Sync reconcile failed for port ${port.port_id}: ${error.message}`);
+                console.error(`Sync: Failed to finalize session for ${entry.key}:`, error);
+                logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Sync reconcile failed for port ${entry.portId}: ${error.message}`);
             }
         }
     }
@@ -3596,16 +7817,19 @@ function setupStaleSessionChecker() {
         try {
             console.log('Checking for stale active sessions...');
             logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, 'Running stale session checker');
+            await flushPortEvents(); // Session totals and last_status_update must include buffered usage
             
             // Find active sessions that haven't been updated in more than the inactivity timeout
-            const staleSessions = await pool.query(
+            const staleSessions = await controlPool.query(
                 `SELECT 
                     cs.session_id, 
                     cs.port_id,
+                    cs.station_id,
                     cp.device_mqtt_id,
                     cp.port_number_in_device,
                     cs.last_status_update,
                     cs.energy_consumed_kwh, -- Need energy for cost calculation
+                    cs.accrued_cost,
                     EXTRACT(EPOCH FROM (NOW() - cs.last_status_update)) AS seconds_since_update
                 FROM 
                     charging_session cs
@@ -3623,49 +7847,46 @@ function setupStaleSessionChecker() {
                 
                 // Process each stale session
                 for (const session of staleSessions.rows) {
+                    // A port paused by the power budget draws nothing on purpose
+                    const liveEntry = session.device_mqtt_id ? getPortEntry(session.device_mqtt_id, session.port_number_in_device) : null;
+                    if (liveEntry?.sessionId === session.session_id && liveEntry.budget.paused) {
+                        continue;
+                    }
+
                     console.log(`Cleaning up stale session ${session.session_id} (${Math.round(session.seconds_since_update)}s since last update)`);
                     logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Cleaning up stale session ${session.session_id}`);
 
-                    // Send OFF command to the device
-                    if (session.device_mqtt_id && session.port_number_in_device) {
-                        const controlTopic = `${MQTT_TOPICS.CONTROL}${session.device_mqtt_id}`;
-                        const mqttPayload = JSON.stringify({ 
-                            command: CHARGER_STATES.OFF, 
-                            port_number: session.port_number_in_device 
-                        });
-                        
-                        mqttClient.publish(controlTopic, mqttPayload, { qos: 1 }, (err) => {
-                            if (err) {
-                                console.error(`Failed to publish cleanup OFF command for stale session ${session.session_id}:`, err);
-                                logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.MQTT, `Failed cleanup OFF for stale session ${session.session_id}: ${err.message}`);
-                            } else {
-                                console.log(`Sent cleanup OFF command for stale session ${session.session_id}`);
-                                logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.MQTT, `Sent cleanup OFF for stale session ${session.session_id}`);
-                            }
-                        });
-                    }
-                    
                     // Calculate final cost before marking as completed
-                    const sessionCost = await calculateSessionCost(session.session_id, session.energy_consumed_kwh || 0);
+                    const sessionCost = await finalSessionCost(session.session_id, session, session.station_id);
 
-                    // Mark the session as auto-completed in the database
-                    await pool.query(
-                        "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3",
-                        [SESSION_STATUS.COMPLETED, sessionCost, session.session_id] // Corrected variable name
-                    );
+                    // Mark the session as auto-completed and queue the OFF command to the device together
+                    await runInTransaction(async (client) => {
+                        await client.query(
+                            "UPDATE charging_session SET end_time = NOW(), session_status = $1, last_status_update = NOW(), cost = $2 WHERE session_id = $3",
+                            [SESSION_STATUS.COMPLETED, sessionCost, session.session_id] // Corrected variable name
+                        );
+                        await client.query(preparedStatement('refreshDailySessionTotals', [session.session_id, SESSION_STATUS.COMPLETED, STATION_TIME_ZONE]));
+                        if (session.device_mqtt_id && session.port_number_in_device) {
+                            await enqueueControlCommand(client, {
+                                deviceId: session.device_mqtt_id,
+                                portNumber: session.port_number_in_device,
+                                command: CHARGER_STATES.OFF,
+                                sessionId: session.session_id,
+                                source: LOG_SOURCES.BACKEND
+                            });
+                        }
+                    });
                     logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Session ${session.session_id} marked auto-completed by stale checker. Cost: $${sessionCost.toFixed(2)}`);
                     
-                    // Clean up any in-memory tracking
+                    // Release the port's state machine if it still holds this session
                     if (session.device_mqtt_id && session.port_number_in_device) {
-                        const sessionKey = `${session.device_mqtt_id}_${session.port_number_in_device}`;
-                        delete activeChargerSessions[sessionKey];
-                        
-                        if (activePortTimers[sessionKey]) {
-                            clearTimeout(activePortTimers[sessionKey].timerId);
-                            delete activePortTimers[sessionKey];
+                        const entry = getPortEntry(session.device_mqtt_id, session.port_number_in_device);
+                        if (entry && entry.sessionId === session.session_id) {
+                            transitionPortState(entry, PORT_FSM_EVENTS.SESSION_ENDED);
                         }
                     }
                 }
+                scheduleCommandOutboxDrain(); // One drain publishes all the cleanup OFFs
             } else {
                 console.log('No stale active sessions found.');
             }
@@ -3684,33 +7905,121 @@ function setupStaleSessionChecker() {
     console.log(`Stale session checker set up to run every ${STALE_SESSION_CHECK_INTERVAL_MS / 1000 / 60} minutes.`);
 }
 
+// --- Batched persistence of phone telemetry ---
+function setupUserDeviceTelemetryFlusher() {
+    setInterval(() => {
+        flushUserDeviceTelemetry();
+        evictStaleUserDeviceTelemetry();
+    }, USER_DEVICE_FLUSH_INTERVAL_MS);
+}
+
+// --- Per-port state machines: load once, then persist write-behind ---
+function setupPortStateMachines() {
+    portStateReady = loadPortStateMachines().catch(err => {
+        console.error('Error loading port state machines:', err);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Error loading port state machines: ${err.message}`);
+    });
+    setInterval(flushPortStateWrites, PORT_STATE_FLUSH_INTERVAL_MS);
+}
+
+// --- Telemetry journal: recover unapplied events, then fsync appends in batches ---
+function setupTelemetryJournal() {
+    try {
+        const unapplied = openTelemetryJournal();
+        for (const event of unapplied) {
+            if (pendingPortEvents.length >= JOURNAL_MEMORY_MAX_EVENTS) {
+                telemetryJournal.spilled = true; // The replayer pages in the rest
+                break;
+            }
+            pendingPortEvents.push(event);
+            telemetryJournal.lastQueuedLsn = event.journal_lsn;
+        }
+        console.log(`Journal: Opened ${telemetryJournal.dir} (${unapplied.length} events to replay, applied LSN ${telemetryJournal.appliedLsn}).`);
+        if (unapplied.length > 0) {
+            logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.BACKEND, `Replaying ${unapplied.length} telemetry events from the local journal`);
+        }
+    } catch (error) {
+        telemetryJournal.enabled = false;
+        telemetryJournal.lastError = error.message;
+        console.error('Journal: Failed to open telemetry journal, continuing without it:', error);
+        logSystemEvent(LOG_TYPES.ERROR, LOG_SOURCES.BACKEND, `Telemetry journal unavailable (${error.message}); telemetry is buffered in memory only`);
+    }
+
+    setInterval(() => {
+        flushTelemetryJournal().catch(error => {
+            console.error('Journal: Failed to write telemetry journal:', error);
+        });
+    }, JOURNAL_FSYNC_INTERVAL_MS);
+}
+
+// --- Port event log: batched appends, projections advance with each batch ---
+function setupPortEventLogWriter() {
+    setInterval(flushPortEvents, PORT_EVENT_FLUSH_INTERVAL_MS);
+}
+
+// --- Port occupancy rollup: add the accrued seconds to Postgres once a minute ---
+function setupPortOccupancyTracker() {
+    setInterval(flushPortOccupancy, OCCUPANCY_FLUSH_INTERVAL_MS);
+}
+
+// --- Command outbox publisher: retries and backstop for the immediate drains ---
+function setupCommandOutboxPublisher() {
+    setInterval(drainCommandOutbox, COMMAND_OUTBOX_POLL_INTERVAL_MS);
+}
+
+// --- Station telemetry: minute buckets and battery levels to Postgres, monthly partitions ahead ---
+function setupStationTelemetryPipeline() {
+    ensureStationTelemetryPartitions();
+    setInterval(ensureStationTelemetryPartitions, STATION_TELEMETRY_PARTITION_CHECK_MS);
+    setInterval(flushStationTelemetry, STATION_TELEMETRY_FLUSH_INTERVAL_MS);
+}
+
+// --- Station power budget: admit, pause and rotate ports against each station's supply ---
+function setupPowerBudgetScheduler() {
+    setInterval(runPowerBudgetScheduler, POWER_BUDGET_TICK_MS);
+}
+
+// --- Admission control: refresh the event-loop lag sample ---
+function setupAdmissionControl() {
+    setInterval(sampleEventLoopLag, ADMISSION_LAG_SAMPLE_INTERVAL_MS);
+}
+
+// --- Read replica: keep the lag sample fresh so readPool() knows when to use it ---
+function setupReplicaLagMonitor() {
+    if (!replicaPool) return;
+    checkReplicaLag();
+    setInterval(checkReplicaLag, REPLICA_LAG_CHECK_INTERVAL_MS);
+    console.log(`Replica: Routing tagged reads to the read replica while lag stays under ${REPLICA_MAX_LAG_SECONDS}s.`);
+}
+
 // Call these functions after the database connection is established
-setupStaleSessionChecker();
-setupExpiredSubscriptionChecker();
-setupBorrowedAmountProcessor();
-setupDailyQuotaReset();
+setupAdmissionControl();
+setupReplicaLagMonitor();
+setupReferenceDataCache();
+// Cluster HTTP workers only serve requests; live state and background jobs belong to the ingest process
+if (OWNS_LIVE_STATE) {
+    setupTelemetryJournal();
+    setupIngestWorker();
+    setupPortStateMachines();
+    setupPortEventLogWriter();
+    setupPortOccupancyTracker();
+    setupCommandOutboxPublisher();
+    setupStationTelemetryPipeline();
+    setupPowerBudgetScheduler();
+    setupUserDeviceTelemetryFlusher();
+    setupStaleSessionChecker();
+    setupExpiredSubscriptionChecker();
+    setupBorrowedAmountProcessor();
+    setupDailyQuotaReset();
+}
 
 // Get active sessions for a specific user
 app.get('/api/sessions/active/user', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { user_id } = req.user;
+        if (answeredNotModified(req, res, `user:${user_id}`)) return;
         
-        const result = await pool.query(`
-            SELECT 
-                cs.session_id,
-                cs.start_time,
-                cs.total_mah_consumed,
-                cs.energy_consumed_kwh,
-                cp.port_number_in_device,
-                cp.device_mqtt_id,
-                s.station_name,
-                s.station_id
-            FROM charging_session cs
-            JOIN charging_port cp ON cs.port_id = cp.port_id
-            JOIN charging_station s ON cs.station_id = s.station_id
-            WHERE cs.user_id = $1 AND cs.session_status = $2
-            ORDER BY cs.start_time DESC
-        `, [user_id, SESSION_STATUS.ACTIVE]);
+        const result = await pool.query(preparedStatement('getUserActiveSessions', [user_id, SESSION_STATUS.ACTIVE]));
         
         res.json(result.rows);
         logSystemEvent(LOG_TYPES.INFO, LOG_SOURCES.API, `Active sessions fetched for user ${user_id}`);
@@ -3725,13 +8034,15 @@ app.get('/api/sessions/active/user', supabaseAuthMiddleware, async (req, res) =>
 app.get('/api/stations/:stationId/consumption', supabaseAuthMiddleware, async (req, res) => {
     try {
         const { stationId } = req.params;
+        if (answeredNotModified(req, res, `station:${stationId}`)) return;
         
-        const result = await pool.query(`
+        const result = await readPool(reportingPool, { userId: req.user.user_id }).query(`
             SELECT 
                 cp.port_number_in_device,
                 cp.device_mqtt_id,
                 COALESCE(cs.total_mah_consumed, 0) as total_mah,
                 COALESCE(cs.energy_consumed_kwh, 0) as energy_kwh,
+                cs.accrued_cost,
                 cs.session_status,
                 cs.last_status_update as timestamp,
                 -- Get real-time current consumption from latest consumption_data
@@ -3759,6 +8070,7 @@ app.get('/api/stations/:stationId/consumption', supabaseAuthMiddleware, async (r
                 total_mah: Number(row.total_mah) || 0,
                 current_consumption: currentConsumption,
                 energy_kwh: Number(row.energy_kwh) || 0,
+                accrued_cost: row.accrued_cost === null ? null : Number(row.accrued_cost),
                 session_status: row.session_status,
                 timestamp: row.timestamp
             };
@@ -3773,30 +8085,31 @@ app.get('/api/stations/:stationId/consumption', supabaseAuthMiddleware, async (r
     }
 });
 
+// Active quota extension pricing, keyed by extension type (reference data cache)
+async function loadQuotaPricing() {
+    if (referenceData.quotaPricing.size === 0) await reloadReferenceData('quotaPricing');
+    const rows = Array.from(referenceData.quotaPricing.values())
+        .filter(row => row.is_active)
+        .sort((a, b) => a.extension_type.localeCompare(b.extension_type));
+    
+    const pricing = {};
+    rows.forEach(row => {
+        pricing[row.extension_type] = {
+            price_per_mah: parseFloat(row.price_per_mah),
+            base_fee: parseFloat(row.base_fee),
+            penalty_percentage: parseFloat(row.penalty_percentage),
+            min_purchase_mah: parseFloat(row.min_purchase_mah),
+            max_purchase_mah: parseFloat(row.max_purchase_mah),
+            is_active: row.is_active
+        };
+    });
+    return pricing;
+}
+
 // Quota Extension Pricing Management
 app.get('/api/quota/pricing', async (req, res) => {
     try {
-        const { rows } = await pool.query(`
-            SELECT extension_type, price_per_mah, base_fee, penalty_percentage, 
-                   min_purchase_mah, max_purchase_mah, is_active
-            FROM quota_extension_pricing 
-            WHERE is_active = true
-            ORDER BY extension_type
-        `);
-        
-        const pricing = {};
-        rows.forEach(row => {
-            pricing[row.extension_type] = {
-                price_per_mah: parseFloat(row.price_per_mah),
-                base_fee: parseFloat(row.base_fee),
-                penalty_percentage: parseFloat(row.penalty_percentage),
-                min_purchase_mah: parseFloat(row.min_purchase_mah),
-                max_purchase_mah: parseFloat(row.max_purchase_mah),
-                is_active: row.is_active
-            };
-        });
-        
-        res.json(pricing);
+        res.json(await loadQuotaPricing());
     } catch (error) {
         console.error('Error fetching quota pricing:', error);
         res.status(500).json({ error: 'Failed to fetch pricing configuration' });
@@ -3884,6 +8197,7 @@ app.put('/api/admin/quota/pricing', supabaseAuthMiddleware, requireAdmin, async
             'pricing_update',
             null, null, null, null, null, null, null, null, null, null
         ]);
+        await invalidateReferenceData('quotaPricing');
         
         res.json({ message: 'Pricing updated successfully' });
     } catch (error) {
@@ -3902,16 +8216,12 @@ app.post('/api/quota/purchase-extension', supabaseAuthMiddleware, async (req, re
         console.log('User object:', req.user);
         
         // Get current pricing
-        const { rows: pricingRows } = await pool.query(`
-            SELECT * FROM quota_extension_pricing WHERE extension_type = $1 AND is_active = true
-        `, [extensionType]);
+        const pricing = await getQuotaPricing(extensionType);
         
-        if (pricingRows.length === 0) {
+        if (!pricing || !pricing.is_active) {
             return res.status(400).json({ error: 'Extension type not available' });
         }
         
-        const pricing = pricingRows[0];
-        
         // Validate amount
         if (amountMah < pricing.min_purchase_mah || amountMah > pricing.max_purchase_mah) {
             return res.status(400).json({ 
@@ -3971,13 +8281,7 @@ app.post('/api/quota/purchase-extension', supabaseAuthMiddleware, async (req, re
             // For direct purchase, create pending extension that requires PayPal payment
             
             // Get the PayPal link from pricing configuration
-            const { rows: pricingRows } = await pool.query(`
-                SELECT paypal_link FROM quota_extension_pricing 
-                WHERE extension_type = 'direct_purchase' AND is_active = true
-                ORDER BY created_at DESC LIMIT 1
-            `);
-            
-            const paypalLink = pricingRows.length > 0 ? pricingRows[0].paypal_link : null;
+            const paypalLink = pricing.paypal_link || null;
             
             if (!paypalLink) {
                 return res.status(400).json({ error: 'PayPal link not configured for direct purchase' });
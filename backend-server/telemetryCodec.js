@@ -0,0 +1,153 @@
+// Columnar decoding and energy integration for batched usage readings (charger/backfill).
+// A batch becomes a "usage frame": one typed array per field instead of one object per reading.
+// The native addon (native/, built with `npm run build:native`) does both steps without leaving
+// C++; when it is not built, or TELEMETRY_NATIVE=off, the pure-JS versions below give the same results.
+
+const path = require('path');
+
+const CHARGER_STATE_CODES = { NONE: 0, ON: 1, OFF: 2, OTHER: 3 };
+
+function loadNativeCodec() {
+    if (process.env.TELEMETRY_NATIVE === 'off') return null;
+    try {
+        return require(path.join(__dirname, 'native', 'build', 'Release', 'telemetry_codec.node'));
+    } catch (error) {
+        return null; // not built on this machine
+    }
+}
+
+const nativeCodec = loadNativeCodec();
+
+function chargerStateCode(value) {
+    if (!value) return CHARGER_STATE_CODES.NONE;
+    if (value === 'ON') return CHARGER_STATE_CODES.ON;
+    if (value === 'OFF') return CHARGER_STATE_CODES.OFF;
+    return CHARGER_STATE_CODES.OTHER;
+}
+
+// null and absent fields are NaN (never Number(null) === 0), the same as the native decoder
+function numberOrNaN(value) {
+    return value === null || value === undefined ? NaN : Number(value);
+}
+
+// Builds a frame from an already-parsed body ({ port_number?, boot?, readings: [...] }).
+// Values the typed columns cannot hold (per-reading boot ids, unusual charger states) go in sparse maps.
+function usageFrameFromBody(body) {
+    const readings = Array.isArray(body?.readings) ? body.readings : [];
+    const count = readings.length;
+    const frame = {
+        count,
+        portNumber: new Float64Array(count),
+        timestamp: new Float64Array(count),
+        consumption: new Float64Array(count),
+        seq: new Float64Array(count),
+        chargerState: new Uint8Array(count),
+        boot: body?.boot ?? null
+    };
+
+    for (let i = 0; i < count; i++) {
+        const reading = readings[i];
+        frame.portNumber[i] = numberOrNaN(reading?.port_number ?? body.port_number);
+        frame.timestamp[i] = numberOrNaN(reading?.timestamp);
+        frame.consumption[i] = numberOrNaN(reading?.consumption);
+        frame.seq[i] = numberOrNaN(reading?.seq);
+        const code = chargerStateCode(reading?.charger_state);
+        frame.chargerState[i] = code;
+        if (code === CHARGER_STATE_CODES.OTHER) {
+            if (!frame.otherChargerStates) frame.otherChargerStates = new Map();
+            frame.otherChargerStates.set(i, reading.charger_state);
+        }
+        if (reading?.boot !== undefined && reading?.boot !== null) {
+            if (!frame.boots) frame.boots = new Map();
+            frame.boots.set(i, reading.boot);
+        }
+    }
+    return frame;
+}
+
+function decodeUsageFrameJs(buffer) {
+    return usageFrameFromBody(JSON.parse(buffer.toString()));
+}
+
+// Decodes a raw backfill message. Throws on malformed JSON, like decodeMqttMessage.
+function decodeUsageFrame(message) {
+    const buffer = Buffer.isBuffer(message) ? message : Buffer.from(message);
+    if (nativeCodec) {
+        const frame = nativeCodec.decodeUsageFrame(buffer);
+        if (frame) return frame; // undefined: a shape only JSON.parse handles
+    }
+    return decodeUsageFrameJs(buffer);
+}
+
+function isUsageFrame(value) {
+    return value?.timestamp instanceof Float64Array;
+}
+
+function chargerStateAt(frame, i) {
+    switch (frame.chargerState[i]) {
+        case CHARGER_STATE_CODES.ON: return 'ON';
+        case CHARGER_STATE_CODES.OFF: return 'OFF';
+        case CHARGER_STATE_CODES.OTHER: return frame.otherChargerStates.get(i);
+        default: return null;
+    }
+}
+
+function bootAt(frame, i) {
+    return frame.boots?.get(i) ?? frame.boot ?? null;
+}
+
+function integrateUsageJs(portNumber, timestamp, consumption, limits) {
+    const count = timestamp.length;
+    const accepted = new Uint8Array(count);
+    const watts = new Float64Array(count);
+    const kwh = new Float64Array(count);
+    const mah = new Float64Array(count);
+    let acceptedCount = 0;
+    let totalKwh = 0;
+    let totalMah = 0;
+
+    for (let i = 0; i < count; i++) {
+        let w = consumption[i] * limits.voltage;
+        if (Number.isNaN(w) || w < 0) w = 0;
+        if (w > limits.maxWatts) w = limits.maxWatts;
+        watts[i] = w;
+        const ts = timestamp[i];
+        if (!Number.isInteger(portNumber[i]) || portNumber[i] < 1 ||
+            !Number.isFinite(ts) || ts < limits.oldestMs || ts > limits.newestMs || w <= 0) {
+            continue;
+        }
+        accepted[i] = 1;
+        kwh[i] = (w * limits.intervalSeconds) / (1000 * 3600);
+        mah[i] = ((w / limits.voltage) * 1000) * (limits.intervalSeconds / 3600);
+        totalKwh += kwh[i];
+        totalMah += mah[i];
+        acceptedCount++;
+    }
+    return { accepted, watts, kwh, mah, acceptedCount, totalKwh, totalMah };
+}
+
+// Validates the first maxReadings readings of a frame and integrates their energy.
+// limits: { oldestMs, newestMs, maxWatts, voltage, intervalSeconds, maxReadings? }. Per reading:
+// accepted flag, clamped watts, kWh and mAh (as usageEnergyIncrement); plus totals of the accepted ones.
+function integrateUsage(frame, limits, implementation = nativeCodec || implementations.js) {
+    const count = Math.min(frame.count, limits.maxReadings ?? frame.count);
+    const columns = [frame.portNumber.subarray(0, count), frame.timestamp.subarray(0, count), frame.consumption.subarray(0, count)];
+    return implementation.integrateUsage(...columns, limits);
+}
+
+// Both code paths, for the benchmark (bench/telemetryCodec.js)
+const implementations = {
+    js: { decodeUsageFrame: decodeUsageFrameJs, integrateUsage: integrateUsageJs },
+    native: nativeCodec
+};
+
+module.exports = {
+    nativeAvailable: nativeCodec !== null,
+    implementations,
+    decodeUsageFrame,
+    usageFrameFromBody,
+    integrateUsage,
+    isUsageFrame,
+    chargerStateAt,
+    bootAt
+};
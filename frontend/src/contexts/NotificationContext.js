@@ -1,5 +1,6 @@
 import React, { createContext, useContext, useState, useEffect, useCallback } from 'react';
 import { useAuth } from './AuthContext';
+import { apiFetch } from '../utils/apiErrorHandler';
 
 const NotificationContext = createContext();
 
@@ -47,16 +48,15 @@ export const NotificationProvider = ({ children }) => {
     if (!session?.access_token) return;
     
     try {
-      const response = await fetch(`${BACKEND_URL}/api/user/notifications/unread-count`, {
+      // apiFetch revalidates with the last ETag, so unchanged polls come back as 304
+      const response = await apiFetch(`${BACKEND_URL}/api/user/notifications/unread-count`, {
         headers: {
           'Authorization': `Bearer ${session.access_token}`,
         },
       });
       
-      if (response.ok) {
-        const data = await response.json();
-        setUnreadCount(data.unreadCount);
-      }
+      const data = await response.json();
+      setUnreadCount(data.unreadCount);
     } catch (error) {
       console.error('Error fetching unread count:', error);
     }
@@ -13,6 +13,8 @@ function AdminStations({ navigateTo, handleSignOut }) {
   const [isEditing, setIsEditing] = useState(false);
   const [isAdding, setIsAdding] = useState(false);
   const [batteryLevels, setBatteryLevels] = useState([]);
+  const [occupancy, setOccupancy] = useState([]);
+  const [occupancyDays, setOccupancyDays] = useState(7);
   
      // Form state for editing or adding a station
    const [formData, setFormData] = useState({
@@ -41,6 +43,12 @@ function AdminStations({ navigateTo, handleSignOut }) {
     // eslint-disable-next-line react-hooks/exhaustive-deps
   }, [initialLoad]);
   
+  //Fetch port occupancy whenever the window changes
+  useEffect(() => {
+    fetchOccupancy(occupancyDays);
+    // eslint-disable-next-line react-hooks/exhaustive-deps
+  }, [occupancyDays]);
+  
   //Fetch stations
   async function fetchStations() {
     try {
@@ -142,6 +150,42 @@ function AdminStations({ navigateTo, handleSignOut }) {
     }
   }
   
+  //Fetch port occupancy by hour of day, in the browser's time zone
+  async function fetchOccupancy(days) {
+    try {
+      const { data: { session } } = await supabase.auth.getSession();
+      
+      if (!session) {
+        return;
+      }
+      
+      const tz = encodeURIComponent(Intl.DateTimeFormat().resolvedOptions().timeZone);
+      const res = await fetch(`${BACKEND_URL}/api/admin/occupancy?days=${days}&tz=${tz}`, {
+        headers: {
+          'Authorization': `Bearer ${session.access_token}`,
+          'Content-Type': 'application/json'
+        }
+      });
+      
+      if (!res.ok) {
+        throw new Error(`Error fetching occupancy: ${res.statusText}`);
+      }
+      
+      const data = await res.json();
+      setOccupancy(data.ports || []);
+    } catch (error) {
+      console.error("Occupancy error:", error);
+    }
+  }
+  
+  //Heatmap cell color: transparent when idle, blue as the port is occupied more of the hour
+  const occupancyCellStyle = (utilization) => {
+    if (utilization === null) {
+      return { background: 'rgba(0, 11, 61, 0.06)' };
+    }
+    return { background: `rgba(56, 182, 255, ${0.1 + utilization * 0.8})` };
+  };
+  
   //Select a station
   const handleSelectStation = (station) => {
     setSelectedStation(station);
@@ -912,6 +956,70 @@ function AdminStations({ navigateTo, handleSignOut }) {
             </div>
           </div>
         )}
+        
+        {/* Port occupancy heatmap */}
+        {!isEditing && !isAdding && (
+          <div className="relative backdrop-blur-xl rounded-2xl shadow-2xl border border-white/30 overflow-hidden p-8 mt-8" style={{ 
+            background: 'linear-gradient(135deg, rgba(255, 255, 255, 0.4) 0%, rgba(255, 255, 255, 0.2) 100%)',
+            boxShadow: '0 8px 32px 0 rgba(0, 11, 61, 0.15), inset 0 1px 0 0 rgba(255, 255, 255, 0.5)'
+          }}>
+            <div className="flex justify-between items-center mb-6">
+              <div>
+                <h2 className="text-2xl font-bold" style={{ color: '#000b3d' }}>Port Occupancy</h2>
+                <p className="text-sm" style={{ color: '#000b3d', opacity: 0.7 }}>Share of online time each port was in use, by hour of day</p>
+              </div>
+              <select
+                value={occupancyDays}
+                onChange={(e) => setOccupancyDays(parseInt(e.target.value, 10))}
+                className="rounded-xl px-3 py-2 backdrop-blur-md border border-white/30"
+                style={{ background: 'rgba(255, 255, 255, 0.5)', color: '#000b3d' }}
+              >
+                <option value={7}>Last 7 days</option>
+                <option value={30}>Last 30 days</option>
+              </select>
+            </div>
+            
+            {occupancy.length === 0 ? (
+              <p style={{ color: '#000b3d', opacity: 0.7 }}>No occupancy recorded yet.</p>
+            ) : (
+              <div className="overflow-x-auto">
+                <table className="text-xs" style={{ color: '#000b3d', borderCollapse: 'separate', borderSpacing: '2px' }}>
+                  <thead>
+                    <tr>
+                      <th className="text-left pr-4">Port</th>
+                      {Array.from({ length: 24 }, (_, hour) => (
+                        <th key={hour} className="w-6 font-normal" style={{ opacity: 0.7 }}>{hour}</th>
+                      ))}
+                      <th className="pl-4 text-right">Use</th>
+                    </tr>
+                  </thead>
+                  <tbody>
+                    {occupancy.map(port => (
+                      <tr key={port.port_id}>
+                        <td className="pr-4 whitespace-nowrap font-semibold">
+                          {port.station_name} #{port.port_number}{port.is_premium ? ' ★' : ''}
+                        </td>
+                        {port.hours.map(slot => (
+                          <td
+                            key={slot.hour}
+                            className="w-6 h-6 rounded"
+                            style={occupancyCellStyle(slot.utilization)}
+                            title={slot.utilization === null
+                              ? `${slot.hour}:00 - offline`
+                              : `${slot.hour}:00 - ${Math.round(slot.utilization * 100)}% occupied (${Math.round(slot.occupied_seconds / 60)} min)`}
+                          />
+                        ))}
+                        <td className="pl-4 text-right font-bold">
+                          {port.utilization === null ? '-' : `${Math.round(port.utilization * 100)}%`}
+                        </td>
+                      </tr>
+                    ))}
+                  </tbody>
+                </table>
+              </div>
+            )}
+          </div>
+        )}
       </div>
     </div>
   );
@@ -1,4 +1,4 @@
-import React, { useState, useEffect } from 'react';
+import React, { useState, useEffect, useRef } from 'react';
 import { useLocation, useNavigate } from 'react-router-dom'; // Add React Router hooks
 import { useAuth } from '../contexts/AuthContext';
 import { openGoogleMaps } from '../utils/mapUtils';
@@ -56,28 +56,6 @@ function HomePage({ navigateTo, message, stations: propStations, loadingStations
     }
   }, [session, location.pathname, stations.length, loadingStations]);
 
-  // Refresh usage data when navigating back to home page
-  useEffect(() => {
-    if (session?.access_token && location.pathname === '/home') {
-      // Fetch fresh usage data when returning to home page
-      const fetchUsageAnalytics = async () => {
-        try {
-          const BACKEND_URL = process.env.REACT_APP_BACKEND_URL || 'https://solar-charger-backend.onrender.com';
-          const res = await fetch(`${BACKEND_URL}/api/user/usage`, {
-            headers: { Authorization: `Bearer ${session.access_token}` },
-          });
-          if (!res.ok) throw new Error('Failed to fetch usage data.');
-          const data = await res.json();
-          setUsage(data);
-        } catch (err) {
-          console.error('HomePage: Error fetching usage analytics on navigation:', err.message);
-        }
-      };
-      
-      fetchUsageAnalytics();
-    }
-  }, [session?.access_token, location.pathname]);
-
   // Enhanced station navigation with state passing
   const handleStationClick = (station) => {
     if (subscription) {
@@ -134,17 +112,21 @@ function HomePage({ navigateTo, message, stations: propStations, loadingStations
 
   const [usage, setUsage] = useState({ totalSessions: 0, totalDuration: 0, totalCost: 0, totalEnergyMAH: 0 });
   const [userDevices, setUserDevices] = useState([]);
+  // Telemetry samples not yet accepted by the backend; sent together as one batch
+  const pendingDeviceTelemetryRef = useRef([]);
 
+  // Fetch usage on load and when navigating back to the home page (one /api/bootstrap request)
   useEffect(() => {
     async function fetchUsageAnalytics() {
       if (!session?.access_token) return;
       try {
         const BACKEND_URL = process.env.REACT_APP_BACKEND_URL || 'https://solar-charger-backend.onrender.com';
-        const res = await fetch(`${BACKEND_URL}/api/user/usage`, {
+        const res = await fetch(`${BACKEND_URL}/api/bootstrap?view=home`, {
           headers: { Authorization: `Bearer ${session.access_token}` },
         });
         if (!res.ok) throw new Error('Failed to fetch usage data.');
-        const data = await res.json();
+        const { usage: data } = await res.json();
+        if (!data) throw new Error('Failed to fetch usage data.');
         console.log('HomePage: Received usage data:', data);
         setUsage(data);
       } catch (err) {
@@ -161,7 +143,7 @@ function HomePage({ navigateTo, message, stations: propStations, loadingStations
     
     // Cleanup interval on unmount or session change
     return () => clearInterval(usageInterval);
-  }, [session]);
+  }, [session, location.pathname]);
 
   // Function to detect device information
   const detectDeviceInfo = () => {
@@ -404,8 +386,23 @@ function HomePage({ navigateTo, message, stations: propStations, loadingStations
     }
   }, [subscription, session, userDevices.length]);
 
-  // Function to save device information to database
+  // Function to save device information to database.
+  // Samples are queued and sent as a batch so a failed heartbeat is retried with the next one.
   const saveDeviceToDatabase = async (device) => {
+    const MAX_PENDING_DEVICE_SAMPLES = 20;
+    pendingDeviceTelemetryRef.current = [
+      ...pendingDeviceTelemetryRef.current,
+      {
+        device_type: device.deviceType,
+        device_name: device.deviceName,
+        device_model: device.deviceModel,
+        is_charging: device.isCharging,
+        current_battery_level: device.batteryLevel,
+        recorded_at: Date.now()
+      }
+    ].slice(-MAX_PENDING_DEVICE_SAMPLES);
+
+    const batch = pendingDeviceTelemetryRef.current;
     try {
       const BACKEND_URL = process.env.REACT_APP_BACKEND_URL;
       const response = await fetch(`${BACKEND_URL}/api/user/devices`, {
@@ -414,20 +411,16 @@ function HomePage({ navigateTo, message, stations: propStations, loadingStations
           'Content-Type': 'application/json',
           'Authorization': `Bearer ${session.access_token}`,
         },
-        body: JSON.stringify({
-          device_type: device.deviceType,
-          device_name: device.deviceName,
-          device_model: device.deviceModel,
-          is_charging: device.isCharging,
-          current_battery_level: device.batteryLevel
-        }),
+        body: JSON.stringify({ devices: batch }),
       });
       
       if (!response.ok) {
         console.warn('Device API not available yet, continuing without saving to database');
-        return; // Don't throw error, just continue
+        return; // Don't throw error, keep the samples queued for the next heartbeat
       }
       
+      // Drop only the samples that were part of this batch
+      pendingDeviceTelemetryRef.current = pendingDeviceTelemetryRef.current.filter(sample => !batch.includes(sample));
       console.log('Device information saved successfully');
     } catch (error) {
       console.warn('Error saving device information (API may not be deployed yet):', error);
@@ -88,29 +88,44 @@ function StationPage({ station, navigateTo }) {
     fetchStationData();
   }, [fetchStationData]);
 
-  // Effect to fetch slot limits on mount
-  useEffect(() => {
-    fetchSlotLimits();
-  }, [fetchSlotLimits]);
+  const applyChargerDeviceStatus = useCallback((data) => {
+    const statusMap = {};
+    data.forEach(deviceStatus => {
+      const key = `${deviceStatus.device_id}_${deviceStatus.port_number_in_device}`;
+      statusMap[key] = deviceStatus;
+    });
+
+    setChargerPortStatus(statusMap);
+  }, []);
 
   const fetchChargerDeviceStatus = useCallback(async () => {
     try {
       const response = await apiFetch(`${BACKEND_URL}/api/devices/status`, {}, { handleSessionTimeout });
       
       const data = await response.json();
-      
-      const statusMap = {};
-      data.forEach(deviceStatus => {
-        const key = `${deviceStatus.device_id}_${deviceStatus.port_number_in_device}`;
-        statusMap[key] = deviceStatus;
-      });
-      
-      setChargerPortStatus(statusMap);
+      applyChargerDeviceStatus(data);
     } catch (error) {
       console.error('Error fetching charger device statuses:', error);
       setFeedback('Error loading port statuses.');
     }
-  }, []);
+  }, [applyChargerDeviceStatus]);
+
+  const applyActiveUserSessions = useCallback((userActiveSessions) => {
+    setUserActiveSessions(userActiveSessions.length);
+
+    const newActiveSessions = {};
+    userActiveSessions.forEach(s => {
+      // Find the port in the current station's device mapping
+      const mappedPort = Object.values(devicePortMapping).find(
+        map => map.internalPortNumber === s.port_number
+      );
+      if (mappedPort) {
+        newActiveSessions[`${mappedPort.deviceId}_${s.port_number}`] = s.session_id;
+      }
+    });
+
+    setActiveSessions(newActiveSessions);
+  }, [devicePortMapping]);
 
   // Fetch active user sessions using existing endpoint
   const fetchActiveUserSessions = useCallback(async () => {
@@ -122,26 +137,12 @@ function StationPage({ station, navigateTo }) {
       }, { handleSessionTimeout });
       if (!res.ok) throw new Error('Failed to fetch active sessions.');
       const allActiveSessions = await res.json();
-      const userActiveSessions = allActiveSessions.filter(s => s.user_id === user.id);
-      setUserActiveSessions(userActiveSessions.length);
-
-      const newActiveSessions = {};
-      userActiveSessions.forEach(s => {
-        // Find the port in the current station's device mapping
-        const mappedPort = Object.values(devicePortMapping).find(
-          map => map.internalPortNumber === s.port_number
-        );
-        if (mappedPort) {
-          newActiveSessions[`${mappedPort.deviceId}_${s.port_number}`] = s.session_id;
-        }
-      });
-
-      setActiveSessions(newActiveSessions);
+      applyActiveUserSessions(allActiveSessions.filter(s => s.user_id === user.id));
     } catch (err) {
       console.error('Error fetching active user sessions:', err);
       setActiveSessions({});
     }
-  }, [user?.id, session?.access_token, devicePortMapping]);
+  }, [user?.id, session?.access_token, applyActiveUserSessions]);
 
   // Get daily usage from subscription data
   const getDailyUsage = useCallback(() => {
@@ -150,6 +151,46 @@ function StationPage({ station, navigateTo }) {
     return parseFloat(subscription.current_daily_mah_consumed || 0);
   }, [subscription]);
 
+  const applyPortConsumption = useCallback((data) => {
+    const consumptionMap = {};
+    const deviceId = stationData?.device_mqtt_id || 'ESP32_CHARGER_STATION_001';
+    
+    // Initialize all ports for this station with zero consumption
+    // This ensures ports without active sessions show 0 instead of stale data
+    if (stationData?.num_premium_ports) {
+      for (let i = 1; i <= stationData.num_premium_ports; i++) {
+        const key = `${deviceId}_${i}`;
+        consumptionMap[key] = {
+          total_mah: 0,
+          current_consumption: 0,
+          timestamp: null
+        };
+      }
+    }
+    
+    // Update with actual consumption data from the API
+    // Only ports with active sessions will have data in the response
+    data.forEach(portData => {
+      const key = `${portData.device_id}_${portData.port_number}`;
+      // Only update if this port belongs to the current station
+      if (key.startsWith(deviceId + '_')) {
+        // Always update current_consumption if it exists (even if 0, to show real-time updates)
+        // Only set total_mah if there's an active session
+        const hasActiveSession = (portData.current_consumption || 0) > 0 || (portData.total_mah || 0) > 0;
+        if (hasActiveSession || portData.current_consumption !== undefined) {
+          consumptionMap[key] = {
+            total_mah: portData.total_mah || 0,
+            current_consumption: portData.current_consumption || 0,
+            timestamp: portData.timestamp
+          };
+        }
+        // If no active session, the initialized 0 values above will remain
+      }
+    });
+    
+    setPortConsumption(consumptionMap);
+  }, [stationData]);
+
   // Fetch consumption data using existing endpoint
   const fetchPortConsumption = useCallback(async () => {
     try {
@@ -171,66 +212,44 @@ function StationPage({ station, navigateTo }) {
         return;
       }
       
-      const consumptionMap = {};
-      const deviceId = stationData?.device_mqtt_id || 'ESP32_CHARGER_STATION_001';
-      
-      // Initialize all ports for this station with zero consumption
-      // This ensures ports without active sessions show 0 instead of stale data
-      if (stationData?.num_premium_ports) {
-        for (let i = 1; i <= stationData.num_premium_ports; i++) {
-          const key = `${deviceId}_${i}`;
-          consumptionMap[key] = {
-            total_mah: 0,
-            current_consumption: 0,
-            timestamp: null
-          };
-        }
-      }
-      
-      // Update with actual consumption data from the API
-      // Only ports with active sessions will have data in the response
-      data.forEach(portData => {
-        const key = `${portData.device_id}_${portData.port_number}`;
-        // Only update if this port belongs to the current station
-        if (key.startsWith(deviceId + '_')) {
-          // Always update current_consumption if it exists (even if 0, to show real-time updates)
-          // Only set total_mah if there's an active session
-          const hasActiveSession = (portData.current_consumption || 0) > 0 || (portData.total_mah || 0) > 0;
-          if (hasActiveSession || portData.current_consumption !== undefined) {
-            consumptionMap[key] = {
-              total_mah: portData.total_mah || 0,
-              current_consumption: portData.current_consumption || 0,
-              timestamp: portData.timestamp
-            };
-          }
-          // If no active session, the initialized 0 values above will remain
-        }
-      });
-      
-      setPortConsumption(consumptionMap);
+      applyPortConsumption(data);
     } catch (error) {
       console.error('Error fetching port consumption:', error);
     }
-  }, [stationData]);
+  }, [applyPortConsumption]);
 
+  // Reconcile the station and load slot limits, port status, consumption and the user's sessions
+  // in one request (/api/bootstrap); parts it could not load are fetched on their own
   const syncStationState = useCallback(async () => {
     if (!stationData?.station_id) return;
 
+    let data = null;
     try {
-      const response = await apiFetch(`${BACKEND_URL}/api/stations/${stationData.station_id}/sync`, {}, { handleSessionTimeout });
-      if (!response.ok) {
-        console.error('Station sync returned non-200 status:', response.status);
-      }
+      const response = await apiFetch(
+        `${BACKEND_URL}/api/bootstrap?view=station&stationId=${encodeURIComponent(stationData.station_id)}`,
+        { headers: session?.access_token ? { Authorization: `Bearer ${session.access_token}` } : {} },
+        { handleSessionTimeout }
+      );
+      data = await response.json();
     } catch (error) {
       console.error('Error syncing station state:', error);
-    } finally {
-      await Promise.all([
-        fetchChargerDeviceStatus(),
-        fetchPortConsumption(),
-        fetchActiveUserSessions()
-      ]);
     }
-  }, [stationData?.station_id, fetchChargerDeviceStatus, fetchPortConsumption, fetchActiveUserSessions, handleSessionTimeout]);
+
+    if (data?.slotLimits) setMaxActiveSlots(data.slotLimits.premiumUserMaxActiveSlots);
+    if (data?.station) {
+      applyChargerDeviceStatus(data.station.status);
+      applyPortConsumption(data.station.consumption);
+    }
+    if (data?.activeSessions) applyActiveUserSessions(data.activeSessions);
+
+    await Promise.all([
+      data?.slotLimits ? null : fetchSlotLimits(),
+      data?.station ? null : fetchChargerDeviceStatus(),
+      data?.station ? null : fetchPortConsumption(),
+      data?.activeSessions ? null : fetchActiveUserSessions()
+    ]);
+  }, [stationData?.station_id, session?.access_token, applyChargerDeviceStatus, applyPortConsumption, applyActiveUserSessions,
+      fetchSlotLimits, fetchChargerDeviceStatus, fetchPortConsumption, fetchActiveUserSessions, handleSessionTimeout]);
 
   // Function to start intervals
   const startIntervals = useCallback(() => {
@@ -401,6 +420,9 @@ function StationPage({ station, navigateTo }) {
       if (response.ok) {
         const result = await response.json();
         console.log(`Control command ${command} sent successfully for port ${portNumber}:`, result);
+        if (result.powerBudget?.queued) {
+          alert(`The station is low on stored power, so Port ${portNumber} will start charging automatically as soon as power is available.`);
+        }
         await syncStationState();
       } else {
         const errorData = await response.json();
@@ -472,9 +494,14 @@ function StationPage({ station, navigateTo }) {
     // Get current consumption (real-time, updates every 10 seconds)
     // Show current consumption if there's an active session on this port
     let currentConsumption = 0;
+    let runningCost = null;
     if (userActiveSession) {
       // Show real-time current consumption from the API
       currentConsumption = consumptionInfo.current_consumption || 0;
+      // Cost accrued so far at the station's tariffs (null for sessions priced only when they end)
+      if (statusData.accrued_cost !== null && statusData.accrued_cost !== undefined) {
+        runningCost = parseFloat(statusData.accrued_cost) || 0;
+      }
     }
     
     return {
@@ -483,6 +510,7 @@ function StationPage({ station, navigateTo }) {
       buttonDisabled,
       isUserSession,
       consumption: currentConsumption, // Real-time current consumption in mA
+      runningCost,
       energyKwh: 0 // Not available in old endpoint
     };
   }, [chargerPortStatus, portConsumption, activeSessions, stationData?.device_mqtt_id]);
@@ -725,6 +753,11 @@ function StationPage({ station, navigateTo }) {
                             <div className="text-xs mt-1" style={{ color: '#000b3d', opacity: 0.7 }}>
                               Daily Total: {getDailyUsage().toFixed(2)} mAh
                             </div>
+                            {currentStatus.isUserSession && currentStatus.runningCost !== null && (
+                              <div className="text-xs mt-1 font-semibold" style={{ color: '#000b3d' }}>
+                                Running Cost: ₱{currentStatus.runningCost.toFixed(2)}
+                              </div>
+                            )}
                           </div>
 
                           {currentStatus.displayStatus === 'Offline' ? (
@@ -1,6 +1,6 @@
 // frontend/src/pages/UsagePage.js
 
-import React, { useEffect, useState, useCallback } from 'react';
+import React, { useEffect, useState, useCallback, useRef } from 'react';
 import { useLocation, useNavigate } from 'react-router-dom';
 import { useAuth } from '../contexts/AuthContext';
 
@@ -30,6 +30,12 @@ function UsagePage() {
     const [feedback, setFeedback] = useState('');
     const [usage, setUsage] = useState(null);
     const [billing, setBilling] = useState([]);
+    const [dailyUsage, setDailyUsage] = useState([]);
+    const [historyDays, setHistoryDays] = useState(14);
+    // Window the history was last requested for, so the page load and the window effect don't both fetch it
+    const historyDaysRef = useRef(historyDays);
+    const loadedHistoryDaysRef = useRef(null);
+    historyDaysRef.current = historyDays;
     
     // Quota extension modal state
     const [showQuotaModal, setShowQuotaModal] = useState(false);
@@ -82,6 +88,29 @@ function UsagePage() {
         }
     }, [session]);
 
+    // Memoized function for fetching the per-day usage history
+    const fetchDailyUsage = useCallback(async (days) => {
+        if (!session?.access_token) return;
+
+        loadedHistoryDaysRef.current = days;
+        try {
+            const res = await fetch(`${BACKEND_URL}/api/user/usage/daily?days=${days}`, {
+                headers: { Authorization: `Bearer ${session.access_token}` },
+            });
+
+            if (!res.ok) {
+                const errorData = await res.json();
+                throw new Error(errorData.error || `Failed to load daily usage (Status: ${res.status}).`);
+            }
+
+            const data = await res.json();
+            setDailyUsage(data.series || []);
+        } catch (err) {
+            console.error('Failed to load daily usage:', err);
+            setDailyUsage([]);
+        }
+    }, [session]);
+
     // Memoized function for fetching billing data
     const fetchBillingData = useCallback(async () => {
         if (!session?.access_token) return;
@@ -118,6 +147,39 @@ function UsagePage() {
         }
     }, []);
 
+    // Load usage, history, billing and pricing in one request (/api/bootstrap);
+    // parts it could not load are fetched on their own
+    const fetchPageData = useCallback(async () => {
+        if (!session?.access_token) return;
+
+        const days = historyDaysRef.current;
+        loadedHistoryDaysRef.current = days;
+        let data = null;
+        try {
+            const res = await fetch(`${BACKEND_URL}/api/bootstrap?view=usage&days=${days}`, {
+                headers: { Authorization: `Bearer ${session.access_token}` },
+            });
+            if (!res.ok) {
+                throw new Error(`Failed to load usage page data (Status: ${res.status}).`);
+            }
+            data = await res.json();
+        } catch (err) {
+            console.error('Failed to load usage page data:', err);
+        }
+
+        if (data?.usage) setUsage(data.usage);
+        if (data?.daily) setDailyUsage(data.daily.series || []);
+        if (data?.subscription) setBilling(data.subscription.billing_history || []);
+        if (data?.pricing) setQuotaPricing(data.pricing);
+
+        await Promise.all([
+            data?.usage ? null : fetchUsageData(),
+            data?.daily ? null : fetchDailyUsage(days),
+            data?.subscription ? null : fetchBillingData(),
+            data?.pricing ? null : fetchQuotaPricing()
+        ]);
+    }, [session, fetchUsageData, fetchDailyUsage, fetchBillingData, fetchQuotaPricing]);
+
     // Check if quota is reached and show modal
     const checkQuotaStatus = useCallback(() => {
         const usageData = calculateSubscriptionUsage();
@@ -171,15 +233,20 @@ function UsagePage() {
         }
     };
 
-    // Fetch all data concurrently on component mount/session change
+    // Fetch all data in one request on component mount/session change
     useEffect(() => {
         if (subscription) { // Only fetch if user has premium subscription
-            fetchUsageData();
-            fetchBillingData();
-            fetchQuotaPricing();
+            fetchPageData();
         }
         setLoading(false);
-    }, [fetchUsageData, fetchBillingData, fetchQuotaPricing, subscription]);
+    }, [fetchPageData, subscription]);
+
+    // Refetch the history when its window changes
+    useEffect(() => {
+        if (subscription && loadedHistoryDaysRef.current !== historyDays) {
+            fetchDailyUsage(historyDays);
+        }
+    }, [fetchDailyUsage, subscription, historyDays]);
 
     // Check quota status when usage data changes
     useEffect(() => {
@@ -188,6 +255,9 @@ function UsagePage() {
         }
     }, [usage, subscription, checkQuotaStatus]);
 
+    // Tallest bar of the daily energy chart
+    const maxDailyMah = Math.max(1, ...dailyUsage.map(day => day.energyMAH));
+
     // Helper function to format currency
     const formatCurrency = (amount) => {
         return new Intl.NumberFormat('en-PH', {
@@ -807,6 +877,49 @@ function UsagePage() {
                                     </div>
                                 </div>
 
+                                {/* Daily Energy History */}
+                                <div className="border-t pt-4" style={{ borderColor: 'rgba(255, 255, 255, 0.3)' }}>
+                                    <div className="flex justify-between items-center mb-3">
+                                        <h3 className="text-lg font-semibold" style={{ color: '#000b3d' }}>DAILY ENERGY</h3>
+                                        <div className="flex gap-2">
+                                            {[14, 30].map((days) => (
+                                                <button
+                                                    key={days}
+                                                    onClick={() => setHistoryDays(days)}
+                                                    className="text-xs font-semibold px-3 py-1 rounded-lg transition-all duration-200"
+                                                    style={{
+                                                        background: historyDays === days ? '#38b6ff' : 'rgba(255, 255, 255, 0.3)',
+                                                        color: historyDays === days ? '#ffffff' : '#000b3d'
+                                                    }}
+                                                >
+                                                    {days}D
+                                                </button>
+                                            ))}
+                                        </div>
+                                    </div>
+                                    {dailyUsage.some(day => day.energyMAH > 0) ? (
+                                        <div className="flex items-end gap-1 h-32">
+                                            {dailyUsage.map((day) => (
+                                                <div
+                                                    key={day.date}
+                                                    className="flex-1 rounded-t"
+                                                    title={`${formatDate(`${day.date}T00:00:00`)}: ${day.energyMAH.toFixed(0)} mAh, ${day.sessions} session(s), ${formatCurrency(day.cost)}`}
+                                                    style={{
+                                                        height: `${Math.max((day.energyMAH / maxDailyMah) * 100, day.energyMAH > 0 ? 4 : 1)}%`,
+                                                        background: day.energyMAH > 0
+                                                            ? 'linear-gradient(180deg, #38b6ff 0%, #8b5cf6 100%)'
+                                                            : 'rgba(0, 11, 61, 0.1)'
+                                                    }}
+                                                />
+                                            ))}
+                                        </div>
+                                    ) : (
+                                        <div className="text-center py-4 text-sm" style={{ color: '#000b3d', opacity: 0.7 }}>
+                                            NO CHARGING IN THE LAST {historyDays} DAYS
+                                        </div>
+                                    )}
+                                </div>
+
                                 {/* Billing History */}
                                 <div className="border-t pt-4" style={{ borderColor: 'rgba(255, 255, 255, 0.3)' }}>
                                     <h3 className="text-lg font-semibold mb-3" style={{ color: '#000b3d' }}>RECENT BILLING</h3>
@@ -16,10 +16,52 @@ export const handleApiError = (error, authContext) => {
   return { isAuthError: false, message: error.message || 'An error occurred' };
 };
 
+// Last ETag-validated body per GET URL, so polls can revalidate with If-None-Match and the
+// backend can answer 304 instead of re-running its queries. An entry only serves the credentials
+// it was fetched with; the least recently used URLs are evicted past the cap.
+const MAX_VALIDATED_RESPONSES = 50;
+const validatedResponses = new Map();
+
+const conditionalFetch = async (url, options) => {
+  const method = (options.method || 'GET').toUpperCase();
+  if (method !== 'GET') {
+    return fetch(url, options);
+  }
+
+  const headers = new Headers(options.headers);
+  const credentials = headers.get('Authorization') || '';
+  let cached = validatedResponses.get(url);
+  if (cached && cached.credentials !== credentials) {
+    cached = undefined; // Another user or a refreshed token; never serve its body
+  }
+  if (cached) {
+    headers.set('If-None-Match', cached.etag);
+  }
+
+  const response = await fetch(url, { ...options, headers });
+  if (response.status === 304 && cached) {
+    validatedResponses.delete(url); // Re-insert as most recently used
+    validatedResponses.set(url, cached);
+    // Callers only ever see complete responses
+    return new Response(cached.body, { status: 200, headers: cached.headers });
+  }
+
+  validatedResponses.delete(url);
+  const etag = response.headers.get('ETag');
+  if (response.ok && etag) {
+    const body = await response.clone().text();
+    validatedResponses.set(url, { credentials, etag, body, headers: new Headers(response.headers) });
+    if (validatedResponses.size > MAX_VALIDATED_RESPONSES) {
+      validatedResponses.delete(validatedResponses.keys().next().value);
+    }
+  }
+  return response;
+};
+
 // Wrapper for fetch calls to handle auth errors
 export const apiFetch = async (url, options = {}, authContext) => {
   try {
-    const response = await fetch(url, options);
+    const response = await conditionalFetch(url, options);
     
     if (response.status === 401) {
       console.log('Unauthorized response detected');